@@ -7,6 +7,7 @@
 #include <rendergnomoncomponent.h>
 #include <perspcameracomponent.h>
 #include <imgui/misc/cpp/imgui_stdlib.h>
+#include <algorithm>
 
 #include "imgui_internal.h"
 
@@ -61,15 +62,20 @@ namespace nap
 	}
 
 
+	void ollamademoApp::onReasoning(const std::string& reasoning)
+	{
+		mTaskQueue.enqueue([this, reasoning]()
+		{
+			mReasoning.append(reasoning);
+		});
+	}
+
+
 	void ollamademoApp::onResponse(const std::string& response)
 	{
 		mTaskQueue.enqueue([this, response]()
 		{
-			std::string answer = mAnswer + response;
-			if (ImGui::CalcTextSize(answer.c_str()).x > 880)
-				mAnswer += "\n" + response;
-			else
-				mAnswer = answer;
+			mAnswer.append(response);
 		});
 	}
 
@@ -90,6 +96,10 @@ namespace nap
 	// Update app
 	void ollamademoApp::update(double deltaTime)
 	{
+		// Record the frame time
+		mFrameTimes[mFrameIndex] = static_cast<float>(deltaTime * 1000.0);
+		mFrameIndex = (mFrameIndex + 1) % static_cast<int>(mFrameTimes.size());
+
 		std::function<void()> task;
 		while (mTaskQueue.try_dequeue(task))
 		{
@@ -113,11 +123,13 @@ namespace nap
 			if (ImGui::Button("Ask"))
 			{
 				mResponseComplete = false;
-				mAnswer = "";
-				mOllamaChat->chat(mQuestion,
-								  [this](const std::string& response){ onResponse(response); },
-								  [this](){ onComplete(); },
-								  [this](const std::string& error){ onError(error); });
+				mReasoning.clear();
+				mAnswer.clear();
+				mOllamaChat->chatWithReasoning(mQuestion,
+											   [this](const std::string& reasoning){ onReasoning(reasoning); },
+											   [this](const std::string& response){ onResponse(response); },
+											   [this](){ onComplete(); },
+											   [this](const std::string& error){ onError(error); });
 			}
 
 			if (disabled)
@@ -146,11 +158,36 @@ namespace nap
 				ImGui::PopStyleVar();
 			}
 
-			ImGui::PushItemFlag(ImGuiItemFlags_Disabled, true);
+			ImGui::SameLine();
+			if (ImGui::Button("Copy"))
+				ImGui::SetClipboardText(mAnswer.getText().c_str());
+
+			// Questions asked before the chat is ready are answered once it is
+			switch (mOllamaChat->getState())
+			{
+			case OllamaChat::EState::Connecting:
+				ImGui::Text("Connecting to Ollama...");
+				break;
+			case OllamaChat::EState::Pulling:
+				ImGui::Text("Pulling %s: %.0f%%", mOllamaChat->mModelSetting.c_str(), mOllamaChat->getPullProgress().getFraction() * 100.0f);
+				break;
+			case OllamaChat::EState::Failed:
+				ImGui::Text("%s model not available", mOllamaChat->mModelSetting.c_str());
+				break;
+			default:
+				break;
+			}
 
-			ImGui::InputTextMultiline("AI Response", &mAnswer, ImVec2(900, 1200), ImGuiInputTextFlags_ReadOnly);
+			// Frame time while the answer streams in
+			float max_frame_time = *std::max_element(mFrameTimes.begin(), mFrameTimes.end());
+			ImGui::Text("Frame time: %.2f ms, max %.2f ms | %d lines", mFrameTimes[(mFrameIndex + mFrameTimes.size() - 1) % mFrameTimes.size()],
+				max_frame_time, static_cast<int>(mAnswer.getLineCount()));
+			ImGui::PlotLines("##FrameTimes", mFrameTimes.data(), static_cast<int>(mFrameTimes.size()), mFrameIndex, nullptr, 0.0f, std::max(max_frame_time, 33.3f), ImVec2(900, 40));
 
-			ImGui::PopItemFlag();
+			// The reasoning of the model is kept apart from its answer, only the visible lines are drawn
+			if (ImGui::CollapsingHeader("Reasoning"))
+				mReasoning.draw("AI Reasoning", ImVec2(900, 300));
+			mAnswer.draw("AI Response", ImVec2(900, 1200));
 		}
 
 		ImGui::End();
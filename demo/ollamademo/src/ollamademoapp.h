@@ -16,6 +16,10 @@
 
 #include <ollamachat.h>
 #include <concurrentqueue.h>
+#include <array>
+
+// Local includes
+#include "transcriptview.h"
 
 namespace nap
 {
@@ -84,10 +88,15 @@ namespace nap
 		ObjectPtr<OllamaChat>		mOllamaChat = nullptr;			///< Pointer to the OllamaChat device
 
 		std::string mQuestion = "What is the meaning of life?";		///< The question to ask the Ollama
-		std::string mAnswer;										///< The answer from the Ollama
+		TranscriptView mReasoning;									///< The reasoning of the model before its answer, wrapped while it streams in
+		TranscriptView mAnswer;										///< The answer from the Ollama, wrapped while it streams in
+		std::array<float, 240> mFrameTimes = {};					///< Frame times in milliseconds of the last 240 frames
+		int mFrameIndex = 0;										///< Index of the next frame time to write
 		moodycamel::ConcurrentQueue<std::function<void()>> mTaskQueue;	///< Queue of tasks to execute
 
 		std::atomic_bool mResponseComplete = true;				///< Flag to indicate if the response is complete
+		void onReasoning(const std::string& reasoning);
+
 		void onResponse(const std::string& response);
 
 		void onComplete();
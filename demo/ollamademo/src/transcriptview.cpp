@@ -0,0 +1,122 @@
+#include "transcriptview.h"
+
+// External Includes
+#include <algorithm>
+
+namespace nap
+{
+	/**
+	 * Returns the width of a range of text in the current font
+	 */
+	static float measure(const std::string& text, std::size_t begin, std::size_t end)
+	{
+		return ImGui::CalcTextSize(text.data() + begin, text.data() + end).x;
+	}
+
+
+	void WrappedTextBuffer::append(const std::string& text)
+	{
+		auto position = mText.size();
+		mText += text;
+		wrap(position);
+	}
+
+
+	void WrappedTextBuffer::clear()
+	{
+		mText.clear();
+		mLines.clear();
+		mLineWidth = 0.0f;
+		mWordBegin = 0;
+	}
+
+
+	void WrappedTextBuffer::setWrapWidth(float width)
+	{
+		if (width == mWrapWidth)
+			return;
+
+		mWrapWidth = width;
+		mLines.clear();
+		wrap(0);
+	}
+
+
+	void WrappedTextBuffer::newLine(std::size_t position)
+	{
+		mLines.push_back({ position, position });
+		mLineWidth = 0.0f;
+		mWordBegin = position;
+	}
+
+
+	void WrappedTextBuffer::wrap(std::size_t position)
+	{
+		if (mLines.empty())
+			newLine(position);
+
+		while (position < mText.size())
+		{
+			// Hard line break
+			if (mText[position] == '\n')
+			{
+				mLines.back().mEnd = position;
+				newLine(position + 1);
+				position++;
+				continue;
+			}
+
+			// Take the text up to and including the next space, or up to the next line break
+			auto end = mText.find_first_of(" \n", position);
+			end = end == std::string::npos ? mText.size() : (mText[end] == ' ' ? end + 1 : end);
+
+			// Move the word that crosses the wrap width to a new line, the word may have started in previously appended text.
+			// A word wider than the wrap width overflows its line, as does a trailing space.
+			bool trailing_space = mText[end - 1] == ' ';
+			float width = measure(mText, position, end);
+			float visible_width = trailing_space ? width - measure(mText, end - 1, end) : width;
+			if (visible_width > 0.0f && mLineWidth + visible_width > mWrapWidth && mWordBegin > mLines.back().mBegin)
+			{
+				auto word_begin = mWordBegin;
+				mLines.back().mEnd = word_begin;
+				newLine(word_begin);
+				width = measure(mText, word_begin, end);
+			}
+
+			mLineWidth += width;
+			mLines.back().mEnd = end;
+			if (trailing_space)
+				mWordBegin = end;
+			position = end;
+		}
+	}
+
+
+	void TranscriptView::draw(const char* id, const ImVec2& size)
+	{
+		if (ImGui::BeginChild(id, size, true, ImGuiWindowFlags_HorizontalScrollbar))
+		{
+			// Follow appended text unless the user scrolled up
+			bool follow = ImGui::GetScrollY() >= ImGui::GetScrollMaxY() - ImGui::GetTextLineHeight();
+
+			// Rewrap when the view is resized
+			mBuffer.setWrapWidth(std::max(ImGui::GetContentRegionAvail().x, 1.0f));
+
+			// Only submit the visible lines
+			const auto& text = mBuffer.getText();
+			const auto& lines = mBuffer.getLines();
+			ImGuiListClipper clipper;
+			clipper.Begin(static_cast<int>(lines.size()));
+			while (clipper.Step())
+			{
+				for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
+					ImGui::TextUnformatted(text.data() + lines[i].mBegin, text.data() + lines[i].mEnd);
+			}
+			clipper.End();
+
+			if (follow)
+				ImGui::SetScrollHereY(1.0f);
+		}
+		ImGui::EndChild();
+	}
+}
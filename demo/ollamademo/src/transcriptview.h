@@ -0,0 +1,120 @@
+#pragma once
+
+// External Includes
+#include <imgui/imgui.h>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+	/**
+	 * Text buffer that word wraps incrementally while text is appended.
+	 * Only the text appended since the last call is measured: the width of the current line is accumulated
+	 * and a word that crosses the wrap width is moved to a new line, so the cost of an append does not grow with the length of the text.
+	 * Lines are stored as ranges in the text, the text is only rewrapped when the wrap width changes.
+	 * Text is measured with the current ImGui font, call append() in between ImGui::NewFrame() and ImGui::Render().
+	 */
+	class WrappedTextBuffer final
+	{
+	public:
+		/**
+		 * A wrapped line, range in the text
+		 */
+		struct Line
+		{
+			std::size_t mBegin = 0;
+			std::size_t mEnd = 0;
+		};
+
+		/**
+		 * Appends text and wraps it
+		 * @param text the text to append
+		 */
+		void append(const std::string& text);
+
+		/**
+		 * Removes all text
+		 */
+		void clear();
+
+		/**
+		 * Sets the width lines are wrapped at, rewraps all text when the width changed
+		 * @param width the wrap width in pixels
+		 */
+		void setWrapWidth(float width);
+
+		/**
+		 * @return the width lines are wrapped at
+		 */
+		float getWrapWidth() const									{ return mWrapWidth; }
+
+		/**
+		 * @return the wrapped lines
+		 */
+		const std::vector<Line>& getLines() const					{ return mLines; }
+
+		/**
+		 * @return the text
+		 */
+		const std::string& getText() const							{ return mText; }
+
+	private:
+		/**
+		 * Wraps the text from the given position onward, continuing the last line
+		 * @param position start of the text that has not been wrapped yet
+		 */
+		void wrap(std::size_t position);
+
+		/**
+		 * Starts a new line
+		 * @param position start of the line in the text
+		 */
+		void newLine(std::size_t position);
+
+		std::string mText;
+		std::vector<Line> mLines;
+		float mWrapWidth = 880.0f;
+		float mLineWidth = 0.0f;									///< Width of the last line
+		std::size_t mWordBegin = 0;									///< Start of the last word on the last line
+	};
+
+
+	/**
+	 * Scrollable view of a WrappedTextBuffer that only lays out and draws the visible lines.
+	 * Keeps the view scrolled to the end while text is appended, unless the user scrolled up.
+	 */
+	class TranscriptView final
+	{
+	public:
+		/**
+		 * Appends text to the transcript
+		 * @param text the text to append
+		 */
+		void append(const std::string& text)						{ mBuffer.append(text); }
+
+		/**
+		 * Removes all text from the transcript
+		 */
+		void clear()												{ mBuffer.clear(); }
+
+		/**
+		 * @return the text of the transcript
+		 */
+		const std::string& getText() const							{ return mBuffer.getText(); }
+
+		/**
+		 * @return the number of wrapped lines
+		 */
+		std::size_t getLineCount() const							{ return mBuffer.getLines().size(); }
+
+		/**
+		 * Draws the transcript in a child window
+		 * @param id the id of the child window
+		 * @param size the size of the child window
+		 */
+		void draw(const char* id, const ImVec2& size);
+
+	private:
+		WrappedTextBuffer mBuffer;
+	};
+}
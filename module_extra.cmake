@@ -11,3 +11,9 @@ find_path(OLLAMA_DIR
 message(STATUS "ollama dir: ${OLLAMA_DIR}")
 
 target_include_directories(${PROJECT_NAME} PUBLIC ${OLLAMA_DIR})
+
+# record chrome trace events of ollama requests, see ollamatrace.h
+option(NAPOLLAMA_ENABLE_TRACE "Record Chrome trace events of Ollama requests" OFF)
+if(NAPOLLAMA_ENABLE_TRACE)
+    target_compile_definitions(${PROJECT_NAME} PUBLIC NAPOLLAMA_TRACE)
+endif()
@@ -0,0 +1,404 @@
+/*  Client-overhead benchmarks for ollama.hpp.
+
+    Measures the cost the client adds on top of the server: building and serializing requests, parsing
+    streamed frames, reassembling chunked streams, serializing chat histories, Base64 encoding images and
+    end-to-end streaming throughput against the in-process mock server.
+
+    Results are written as JSON. Passing a previous result file with --compare reports the change per
+    benchmark and returns a non-zero exit code when a benchmark regressed beyond the threshold.
+
+    Usage: build/benchmark [--out file.json] [--filter substring] [--min-time seconds]
+                           [--compare baseline.json] [--threshold percent]
+*/
+
+#include "ollama.hpp"
+#include "mock_server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+// Prevent the compiler from optimizing away a computed value.
+template <typename T>
+inline void do_not_optimize(const T& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void* sink; sink = &value;
+#endif
+}
+
+struct benchmark_result
+{
+    std::string name;
+    size_t iterations;
+    double ns_per_op;           // Median over all repetitions
+    double min_ns_per_op;
+    double items_per_second;    // Items processed per second, 0 when not applicable
+    double bytes_per_second;    // Bytes processed per second, 0 when not applicable
+};
+
+struct benchmark_settings
+{
+    double min_time = 0.2;      // Minimum time per repetition in seconds
+    int repetitions = 5;
+    std::string filter;
+};
+
+class benchmark_runner
+{
+    public:
+
+        benchmark_runner(const benchmark_settings& settings): settings(settings) {}
+
+        // Run an operation repeatedly. items and bytes describe the work done by a single operation.
+        void run(const std::string& name, const std::function<void()>& operation, double items = 0, double bytes = 0)
+        {
+            if (!settings.filter.empty() && name.find(settings.filter) == std::string::npos) return;
+
+            // Warm up and determine the number of iterations needed to fill the minimum time
+            size_t iterations = 1;
+            for (;;)
+            {
+                double elapsed = time(operation, iterations);
+                if (elapsed >= settings.min_time * 0.1 || iterations >= (size_t(1) << 30))
+                {
+                    iterations = std::max<size_t>(1, static_cast<size_t>(iterations * settings.min_time / std::max(elapsed, 1e-9)));
+                    break;
+                }
+                iterations *= 10;
+            }
+
+            std::vector<double> samples;
+            for (int i = 0; i < settings.repetitions; i++) samples.push_back(time(operation, iterations) * 1e9 / iterations);
+            std::sort(samples.begin(), samples.end());
+
+            benchmark_result result;
+            result.name = name;
+            result.iterations = iterations;
+            result.ns_per_op = samples[samples.size()/2];
+            result.min_ns_per_op = samples.front();
+            result.items_per_second = items > 0 ? items * 1e9 / result.ns_per_op : 0;
+            result.bytes_per_second = bytes > 0 ? bytes * 1e9 / result.ns_per_op : 0;
+            report(result);
+        }
+
+        // Record a benchmark that measures itself, such as an end-to-end run against a server.
+        void add(const benchmark_result& result)
+        {
+            if (!settings.filter.empty() && result.name.find(settings.filter) == std::string::npos) return;
+            report(result);
+        }
+
+        bool enabled(const std::string& name) const { return settings.filter.empty() || name.find(settings.filter) != std::string::npos; }
+
+        const std::vector<benchmark_result>& get_results() const { return results; }
+
+    private:
+
+        static double time(const std::function<void()>& operation, size_t iterations)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++) operation();
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        void report(const benchmark_result& result)
+        {
+            std::cout << result.name << std::string(result.name.size() < 44 ? 44 - result.name.size() : 1, ' ') << result.ns_per_op << " ns/op";
+            if (result.items_per_second > 0) std::cout << "  " << result.items_per_second << " items/s";
+            if (result.bytes_per_second > 0) std::cout << "  " << result.bytes_per_second / (1024*1024) << " MiB/s";
+            std::cout << std::endl;
+            results.push_back(result);
+        }
+
+        benchmark_settings settings;
+        std::vector<benchmark_result> results;
+};
+
+static json to_json(const std::vector<benchmark_result>& results)
+{
+    json output;
+    output["context"]["library"] = "ollama-hpp";
+    output["benchmarks"] = json::array();
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        json benchmark;
+        benchmark["name"] = results[i].name;
+        benchmark["iterations"] = results[i].iterations;
+        benchmark["ns_per_op"] = results[i].ns_per_op;
+        benchmark["min_ns_per_op"] = results[i].min_ns_per_op;
+        benchmark["items_per_second"] = results[i].items_per_second;
+        benchmark["bytes_per_second"] = results[i].bytes_per_second;
+        output["benchmarks"].push_back(benchmark);
+    }
+    return output;
+}
+
+// Compare the results with a baseline. Returns false when a benchmark is slower than the baseline by more than threshold percent.
+static bool compare(const std::vector<benchmark_result>& results, const json& baseline, double threshold)
+{
+    bool passed = true;
+    std::cout << std::endl << "Comparison with baseline (threshold " << threshold << "%):" << std::endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        for (auto& previous : baseline["benchmarks"])
+        {
+            if (previous["name"] != results[i].name) continue;
+
+            double before = previous["ns_per_op"].get<double>();
+            double change = (results[i].ns_per_op - before) / before * 100.0;
+            bool regressed = change > threshold;
+            passed = passed && !regressed;
+            std::cout << (regressed ? "REGRESSED " : "          ") << results[i].name << " " << (change >= 0 ? "+" : "") << change << "%" << std::endl;
+        }
+    }
+    return passed;
+}
+
+static std::string generation_frame(const std::string& token, bool done, size_t context_length)
+{
+    json frame;
+    frame["model"] = "llama3:8b";
+    frame["created_at"] = "2024-01-01T00:00:00.000000Z";
+    frame["response"] = token;
+    frame["done"] = done;
+    if (done)
+    {
+        frame["done_reason"] = "stop";
+        frame["context"] = std::vector<int>(context_length, 128000);
+        frame["total_duration"] = 4935886791; frame["load_duration"] = 534986708;
+        frame["prompt_eval_count"] = 26; frame["prompt_eval_duration"] = 107345000;
+        frame["eval_count"] = 237; frame["eval_duration"] = 4289432000;
+    }
+    return frame.dump();
+}
+
+static void benchmark_requests(benchmark_runner& runner)
+{
+    ollama::options options;
+    options["seed"] = 1;
+    options["temperature"] = 0;
+    options["num_predict"] = 18;
+
+    std::string prompt = "Why is the sky blue?";
+    std::vector<int> context(2048, 128000);
+
+    runner.run("request/construct", [&] {
+        ollama::request request("llama3:8b", prompt, options, true);
+        do_not_optimize(request);
+    });
+
+    runner.run("request/construct_with_context_2048", [&] {
+        ollama::request request("llama3:8b", prompt, options, true);
+        request["context"] = context;
+        do_not_optimize(request);
+    });
+
+    ollama::request request("llama3:8b", prompt, options, true);
+    runner.run("request/dump", [&] {
+        std::string dumped = request.dump();
+        do_not_optimize(dumped);
+    });
+
+    request["context"] = context;
+    size_t dumped_size = request.dump().size();
+    runner.run("request/dump_with_context_2048", [&] {
+        std::string dumped = request.dump();
+        do_not_optimize(dumped);
+    }, 0, dumped_size);
+}
+
+static void benchmark_responses(benchmark_runner& runner)
+{
+    std::string token_frame = generation_frame(" sky", false, 0);
+    runner.run("response/parse_token_frame", [&] {
+        ollama::response response(token_frame);
+        do_not_optimize(response);
+    }, 1, token_frame.size());
+
+    std::string final_frame = generation_frame("", true, 2048);
+    runner.run("response/parse_final_frame_context_2048", [&] {
+        ollama::response response(final_frame);
+        do_not_optimize(response);
+    }, 1, final_frame.size());
+
+    json chat_frame;
+    chat_frame["model"] = "llama3:8b";
+    chat_frame["created_at"] = "2024-01-01T00:00:00.000000Z";
+    chat_frame["message"]["role"] = "assistant";
+    chat_frame["message"]["content"] = " sky";
+    chat_frame["done"] = false;
+    std::string chat_frame_string = chat_frame.dump();
+    runner.run("response/parse_chat_frame", [&] {
+        ollama::response response(chat_frame_string, ollama::message_type::chat);
+        do_not_optimize(response);
+    }, 1, chat_frame_string.size());
+}
+
+static void benchmark_reassembly(benchmark_runner& runner)
+{
+    // A recorded stream of 256 frames, as received from the server
+    const size_t frame_count = 256;
+    std::string stream;
+    for (size_t i = 0; i < frame_count; i++) stream += generation_frame(" sky", false, 0) + "\n";
+    stream += generation_frame("", true, 2048) + "\n";
+
+    size_t chunk_sizes[] = {7, 64, 4096};
+    for (size_t chunk_size : chunk_sizes)
+    {
+        runner.run("reassembly/split_frames_chunk_" + std::to_string(chunk_size), [&] {
+            ollama::frame_buffer buffer;
+            size_t frames = 0;
+            std::function<void(const std::string&)> on_frame = [&frames](const std::string&) { frames++; };
+            for (size_t offset = 0; offset < stream.size(); offset += chunk_size)
+                buffer.append(stream.data() + offset, std::min(chunk_size, stream.size() - offset), on_frame);
+            do_not_optimize(frames);
+        }, frame_count + 1, stream.size());
+
+        runner.run("reassembly/split_and_parse_chunk_" + std::to_string(chunk_size), [&] {
+            ollama::frame_buffer buffer;
+            size_t tokens = 0;
+            std::function<void(const std::string&)> on_frame = [&tokens](const std::string& frame) {
+                ollama::response response(frame);
+                tokens += response.as_simple_string().size();
+            };
+            for (size_t offset = 0; offset < stream.size(); offset += chunk_size)
+                buffer.append(stream.data() + offset, std::min(chunk_size, stream.size() - offset), on_frame);
+            do_not_optimize(tokens);
+        }, frame_count + 1, stream.size());
+    }
+}
+
+static void benchmark_messages(benchmark_runner& runner)
+{
+    size_t history_lengths[] = {10, 100, 1000};
+    for (size_t length : history_lengths)
+    {
+        ollama::messages messages;
+        for (size_t i = 0; i < length; i++)
+            messages.push_back(ollama::message(i % 2 == 0 ? "user" : "assistant", "Nimbus clouds are dense, moisture-filled clouds that produce rain. What are some other kinds of clouds?"));
+
+        runner.run("messages/to_json_" + std::to_string(length), [&] {
+            std::vector<json> output = messages.to_json();
+            do_not_optimize(output);
+        }, static_cast<double>(length));
+
+        runner.run("messages/chat_request_dump_" + std::to_string(length), [&] {
+            ollama::request request("llama3:8b", messages, nullptr, true);
+            std::string dumped = request.dump();
+            do_not_optimize(dumped);
+        }, static_cast<double>(length));
+    }
+}
+
+static void benchmark_base64(benchmark_runner& runner)
+{
+    size_t sizes[] = {1024, 1024*1024};
+    for (size_t size : sizes)
+    {
+        std::string data(size, '\0');
+        for (size_t i = 0; i < size; i++) data[i] = static_cast<char>((i * 131) & 0xff);
+
+        runner.run("base64/encode_" + std::to_string(size), [&] {
+            std::string encoded = ollama::base64::Encode(data);
+            do_not_optimize(encoded);
+        }, 0, static_cast<double>(size));
+    }
+}
+
+// Stream tokens from the mock server as fast as it can produce them and measure client-side throughput.
+static void benchmark_end_to_end(benchmark_runner& runner)
+{
+    size_t chunk_sizes[] = {0, 7};
+    for (size_t chunk_size : chunk_sizes)
+    {
+        std::string name = "end_to_end/stream_tokens_chunk_" + std::to_string(chunk_size);
+        if (!runner.enabled(name)) continue;
+
+        ollama::mock_settings settings;
+        settings.num_tokens = 2000;
+        settings.chunk_size = chunk_size;
+        ollama::mock_server server(settings);
+        if (!server.start()) { std::cerr << "Unable to start mock server" << std::endl; return; }
+
+        Ollama client(server.url());
+        size_t tokens = 0;
+        std::function<void(const ollama::response&)> on_receive_token = [&tokens](const ollama::response& response) {
+            if (!response.as_simple_string().empty()) tokens++;
+        };
+
+        // Warm up, then keep the median of a few runs
+        client.generate("llama3:8b", "Why is the sky blue?", on_receive_token);
+        std::vector<double> samples;
+        for (int i = 0; i < 5; i++)
+        {
+            tokens = 0;
+            auto start = std::chrono::steady_clock::now();
+            client.generate("llama3:8b", "Why is the sky blue?", on_receive_token);
+            samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / tokens);
+        }
+        std::sort(samples.begin(), samples.end());
+
+        benchmark_result result;
+        result.name = name;
+        result.iterations = tokens;
+        result.ns_per_op = samples[samples.size()/2];
+        result.min_ns_per_op = samples.front();
+        result.items_per_second = 1e9 / result.ns_per_op;
+        result.bytes_per_second = 0;
+        runner.add(result);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    benchmark_settings settings;
+    std::string output_path = "benchmark_results.json", baseline_path;
+    double threshold = 10.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--out" && has_value) output_path = argv[++i];
+        else if (arg == "--filter" && has_value) settings.filter = argv[++i];
+        else if (arg == "--min-time" && has_value) settings.min_time = std::atof(argv[++i]);
+        else if (arg == "--compare" && has_value) baseline_path = argv[++i];
+        else if (arg == "--threshold" && has_value) threshold = std::atof(argv[++i]);
+        else { std::cerr << "Usage: " << argv[0] << " [--out file.json] [--filter substring] [--min-time seconds] [--compare baseline.json] [--threshold percent]" << std::endl; return 2; }
+    }
+
+    ollama::show_requests(false);
+    ollama::show_replies(false);
+    ollama::allow_exceptions(true);
+
+    benchmark_runner runner(settings);
+    benchmark_requests(runner);
+    benchmark_responses(runner);
+    benchmark_reassembly(runner);
+    benchmark_messages(runner);
+    benchmark_base64(runner);
+    benchmark_end_to_end(runner);
+
+    std::ofstream output(output_path);
+    output << to_json(runner.get_results()).dump(4) << std::endl;
+    std::cout << "Results written to " << output_path << std::endl;
+
+    if (!baseline_path.empty())
+    {
+        std::ifstream baseline_file(baseline_path);
+        if (!baseline_file) { std::cerr << "Unable to open baseline " << baseline_path << std::endl; return 2; }
+        if (!compare(runner.get_results(), json::parse(baseline_file), threshold)) return 1;
+    }
+
+    return 0;
+}
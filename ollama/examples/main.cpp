@@ -26,6 +26,7 @@ int main()
 
     ollama::show_requests(true);
     ollama::show_replies(true);
+    ollama::logger().set_sink(ollama::async_logger::console());
 
     // Exceptions can be dynamically enabled and disabled through this call.
     // If exceptions are true, ollama::exception will be thrown in the event of errors. If exceptions are false, functions will either return false or empty values.
@@ -65,10 +65,25 @@
 #include <memory>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <numeric>
 #include <functional>
 #include <exception>
 #include <initializer_list>
+#include <map>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+    #include <filesystem>
+    #define OLLAMA_HAS_FILESYSTEM
+#endif
 
 // Namespace types and classes
 namespace ollama
@@ -77,12 +92,239 @@ namespace ollama
     using base64 = macaron::Base64;    
 
     static bool use_exceptions = true;    // Change this to false to avoid throwing exceptions within the library.    
-    static bool log_requests = false;      // Log raw requests to the Ollama server. Useful when debugging.       
-    static bool log_replies = false;       // Log raw replies from the Ollama server. Useful when debugging.
+
+    // The log switches are shared by every translation unit of a program, so a switch set in one file applies to the
+    // clients of all files. They are function-local statics because C++11 has no inline variables.
+    inline std::atomic<bool>& log_requests() { static std::atomic<bool> enabled(false); return enabled; }   // Log raw requests to the Ollama server. Useful when debugging.
+    inline std::atomic<bool>& log_replies() { static std::atomic<bool> enabled(false); return enabled; }    // Log raw replies from the Ollama server. Useful when debugging.
 
     static void allow_exceptions(bool enable) {use_exceptions = enable;}
-    static void show_requests(bool enable) {log_requests = enable;}
-    static void show_replies(bool enable) {log_replies = enable;}
+    inline void show_requests(bool enable) {log_requests() = enable;}
+    inline void show_replies(bool enable) {log_replies() = enable;}
+
+    enum class log_kind : uint8_t { request, reply };
+
+    // Asynchronous logger for raw requests and replies.
+    // Records are copied into a fixed size ring buffer and written by a background thread, so logging never waits for the
+    // console or a file inside a stream callback. Enqueueing copies at most max_record_size bytes under a short lock;
+    // records that do not fit in the free space of the buffer are dropped and counted instead of blocking.
+    // Records are discarded until a sink is set: use set_sink(async_logger::console()) to write them to std::cout, set_sink() to route them
+    // elsewhere, or set_file() for size-capped rotating log files.
+    class async_logger
+    {
+        public:
+
+            using sink = std::function<void(log_kind, const std::string&)>;
+
+            async_logger(size_t capacity = 1 << 20, size_t max_record_size = 64 * 1024):
+                buffer(capacity), max_record_size(max_record_size)
+            {
+                writer = std::thread([this] { write_loop(); });
+            }
+
+            ~async_logger()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                wake.notify_one();
+                writer.join();
+            }
+
+            async_logger(const async_logger&) = delete;
+            async_logger& operator=(const async_logger&) = delete;
+
+            void log(log_kind kind, const std::string& text) { log(kind, text.data(), text.size()); }
+
+            // Enqueue a record, truncated to max_record_size bytes.
+            void log(log_kind kind, const char* data, size_t size)
+            {
+                size = std::min(size, max_record_size);
+                record_header header = { static_cast<uint32_t>(size), kind };
+
+                bool notify;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (buffer.size() - (head - tail) < sizeof(header) + size) { dropped++; return; }
+                    copy_in(reinterpret_cast<const char*>(&header), sizeof(header));
+                    copy_in(data, size);
+                    notify = writer_waiting;
+                }
+                if (notify) wake.notify_one();
+            }
+
+            // Write records to a custom sink, called from the writer thread. An empty sink discards the records.
+            void set_sink(const sink& output)
+            {
+                std::lock_guard<std::mutex> lock(sink_mutex);
+                this->output = output;
+            }
+
+            // Write records to a file, rotated to path.1 ... path.<max_files-1> when it grows beyond max_bytes.
+            bool set_file(const std::string& path, size_t max_bytes = 10 * 1024 * 1024, size_t max_files = 5)
+            {
+                std::shared_ptr<rotating_file> file = std::make_shared<rotating_file>(path, max_bytes, max_files);
+                if (!file->is_open()) return false;
+                set_sink([file](log_kind, const std::string& text) { file->write(text); });
+                return true;
+            }
+
+            // A sink that writes every record to std::cout.
+            static sink console()
+            {
+                return [](log_kind, const std::string& text) { std::cout << text << '\n' << std::flush; };
+            }
+
+            // Block until all records enqueued before this call have been written.
+            void flush()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                uint64_t target = head;
+                if (writer_waiting) wake.notify_one();
+                written.wait(lock, [this, target] { return tail >= target; });
+            }
+
+            // Number of records dropped because the buffer was full.
+            size_t dropped_count() const { std::lock_guard<std::mutex> lock(mutex); return dropped; }
+
+        private:
+
+            struct record_header { uint32_t size; log_kind kind; };
+
+            class rotating_file
+            {
+                public:
+
+                    rotating_file(const std::string& path, size_t max_bytes, size_t max_files): path(path), max_bytes(max_bytes), max_files(max_files)
+                    {
+                        file.open(path, std::ios::app | std::ios::binary);
+                        size = existing_size(path);
+                    }
+
+                    bool is_open() const { return file.is_open(); }
+
+                    void write(const std::string& text)
+                    {
+                        if (size > 0 && size + text.size() + 1 > max_bytes) rotate();
+                        file << text << '\n';
+                        file.flush();
+                        size += text.size() + 1;
+                    }
+
+                private:
+
+                    // The size of the file before it was opened, the put position of a stream in append mode is not defined until it writes.
+                    static size_t existing_size(const std::string& path)
+                    {
+#ifdef OLLAMA_HAS_FILESYSTEM
+                        std::error_code error;
+                        std::uintmax_t size = std::filesystem::file_size(path, error);
+                        return error ? 0 : static_cast<size_t>(size);
+#else
+                        std::ifstream existing(path, std::ios::binary | std::ios::ate);
+                        return existing ? static_cast<size_t>(existing.tellg()) : 0;
+#endif
+                    }
+
+                    void rotate()
+                    {
+                        file.close();
+                        if (max_files > 1)
+                        {
+                            std::remove((path + "." + std::to_string(max_files-1)).c_str());
+                            for (size_t i = max_files-1; i > 1; i--) std::rename((path + "." + std::to_string(i-1)).c_str(), (path + "." + std::to_string(i)).c_str());
+                            std::rename(path.c_str(), (path + ".1").c_str());
+                        }
+                        file.open(path, std::ios::trunc | std::ios::binary);
+                        size = 0;
+                    }
+
+                    std::string path;
+                    size_t max_bytes, max_files, size = 0;
+                    std::ofstream file;
+            };
+
+            void copy_in(const char* data, size_t size)
+            {
+                size_t offset = head % buffer.size(), first = std::min(size, buffer.size() - offset);
+                std::memcpy(&buffer[offset], data, first);
+                std::memcpy(&buffer[0], data + first, size - first);
+                head += size;
+            }
+
+            void copy_out(uint64_t position, char* data, size_t size) const
+            {
+                size_t offset = position % buffer.size(), first = std::min(size, buffer.size() - offset);
+                std::memcpy(data, &buffer[offset], first);
+                std::memcpy(data + first, &buffer[0], size - first);
+            }
+
+            // Producers only write beyond head, so the records between tail and head can be read without holding the lock.
+            void write_loop()
+            {
+                std::string text;
+                for (;;)
+                {
+                    uint64_t start, end;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        writer_waiting = true;
+                        wake.wait(lock, [this] { return head != tail || stopping; });
+                        writer_waiting = false;
+                        if (head == tail) return;
+                        start = tail; end = head;
+                    }
+
+                    sink output;
+                    {
+                        std::lock_guard<std::mutex> lock(sink_mutex);
+                        output = this->output;
+                    }
+
+                    for (uint64_t position = start; position < end; )
+                    {
+                        record_header header;
+                        copy_out(position, reinterpret_cast<char*>(&header), sizeof(header));
+                        text.resize(header.size);
+                        if (header.size > 0) copy_out(position + sizeof(header), &text[0], header.size);
+                        position += sizeof(header) + header.size;
+
+                        if (output) output(header.kind, text);
+                    }
+
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        tail = end;
+                    }
+                    written.notify_all();
+                }
+            }
+
+            std::vector<char> buffer;
+            size_t max_record_size;
+            uint64_t head = 0, tail = 0;
+            size_t dropped = 0;
+            bool writer_waiting = false, stopping = false;
+            mutable std::mutex mutex;
+            std::condition_variable wake, written;
+
+            std::mutex sink_mutex;
+            sink output;
+
+            std::thread writer;
+    };
+
+    // The logger used for requests and replies, started on first use.
+    inline async_logger& logger()
+    {
+        static async_logger instance;
+        return instance;
+    }
+
+    inline void log_request(const std::string& request) { logger().log(log_kind::request, request); }
+    inline void log_reply(const char* data, size_t size) { logger().log(log_kind::reply, data, size); }
+    inline void log_reply(const std::string& reply) { logger().log(log_kind::reply, reply); }
 
     enum class message_type { generation, chat, embedding };
 
@@ -189,6 +431,9 @@ namespace ollama
             message() : json() {}
             ~message() {}
 
+            // Create a message with the result of a tool call requested by the model.
+            static message from_tool(const std::string& tool_name, const std::string& content) { message result("tool", content); result["tool_name"] = tool_name; return result; }
+
             std::string as_json_string() const { return this->dump(); }
             
             operator std::string() const { return this->as_json_string(); }           
@@ -302,7 +547,11 @@ namespace ollama
                     else
                     if (type==message_type::embedding && json_data.contains("embeddings")) simple_string=json_data["embeddings"].get<std::string>();
                     else
-                    if (type==message_type::chat && json_data.contains("message")) simple_string=json_data["message"]["content"].get<std::string>();
+                    if (type==message_type::chat && json_data.contains("message"))
+                    {
+                        if (json_data["message"].contains("content")) simple_string=json_data["message"]["content"].get<std::string>();
+                        if (json_data["message"].contains("tool_calls")) tool_calls=json_data["message"]["tool_calls"];
+                    }
                                          
                     if ( json_data.contains("error") ) error_string =json_data["error"].get<std::string>();
                 }
@@ -335,6 +584,17 @@ namespace ollama
                 return false;                
             }
 
+            // The tools the model requested to call in a chat response, each with a "function" holding its "name" and "arguments".
+            bool has_tool_calls() const
+            {
+                return tool_calls.is_array() && !tool_calls.empty();
+            }
+
+            const json& get_tool_calls() const
+            {
+                return tool_calls;
+            }
+
             const std::string& get_error() const
             {
                 return error_string;
@@ -358,11 +618,58 @@ namespace ollama
         std::string simple_string;
         std::string error_string;
 
-        json json_data;        
+        json json_data;
+        json tool_calls;
         message_type type;
         bool valid;        
     };
 
+    // Reassembles the newline delimited JSON frames of a streamed reply. A chunk received from the server can hold part of a frame or several frames.
+    class frame_buffer {
+
+        public:
+
+            // Append a chunk and invoke on_frame for every frame completed by it.
+            void append(const char* data, size_t data_length, const std::function<void(const std::string&)>& on_frame)
+            {
+                buffer.append(data, data_length);
+
+                size_t start = 0, end;
+                while ( (end = buffer.find('\n', start)) != std::string::npos )
+                {
+                    if (end > start) on_frame( buffer.substr(start, end-start) );
+                    start = end + 1;
+                }
+                buffer.erase(0, start);
+            }
+
+            // Invoke on_frame for a trailing frame that was not terminated by a newline.
+            void flush(const std::function<void(const std::string&)>& on_frame)
+            {
+                if (buffer.find_first_not_of(" \r\n\t") != std::string::npos) on_frame(buffer);
+                buffer.clear();
+            }
+
+        private:
+
+        std::string buffer;
+    };
+
+    // Progress of a streaming model pull, parsed from the status frames of /api/pull.
+    struct pull_progress
+    {
+        std::string status;             // Status reported by the server, such as "pulling manifest", "pulling <digest>" or "success", or "retrying" when resuming.
+        std::string digest;             // Digest of the layer being downloaded, empty outside of layer downloads.
+        uint64_t total = 0;             // Size of the layer in bytes.
+        uint64_t completed = 0;         // Bytes of the layer downloaded so far.
+        uint64_t total_bytes = 0;       // Size of all layers reported so far.
+        uint64_t completed_bytes = 0;   // Bytes downloaded of all layers reported so far.
+        unsigned attempt = 0;           // Incremented every time the pull is resumed after a dropped connection.
+
+        // Fraction of the reported layers downloaded so far, between 0 and 1.
+        double fraction() const { return total_bytes == 0 ? 0.0 : static_cast<double>(completed_bytes) / static_cast<double>(total_bytes); }
+    };
+
 }
 
 class Ollama
@@ -401,11 +708,11 @@ class Ollama
 
         request["stream"] = false;
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;      
+        if (ollama::log_requests()) ollama::log_request(request_string);
 
         if (auto res = this->cli->Post("/api/generate",request_string, "application/json"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
 
             response = ollama::response(res->body);
             if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
@@ -438,32 +745,30 @@ class Ollama
     {
         request["stream"] = true;
 
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
-
-        std::shared_ptr<std::vector<std::string>> partial_responses = std::make_shared<std::vector<std::string>>();
-
-        auto stream_callback = [on_receive_token, partial_responses](const char *data, size_t data_length)->bool{
-            
-            std::string message(data, data_length);
-            if (ollama::log_replies) std::cout << message << std::endl;
+        return stream_frames("/api/generate", request.dump(), [on_receive_token](const std::string& frame)->bool{
             try 
             {   
-                partial_responses->push_back(message);
-                std::string total_response = std::accumulate(partial_responses->begin(), partial_responses->end(), std::string(""));                
-                ollama::response response(total_response);
-                partial_responses->clear();  
+                ollama::response response(frame);
                 on_receive_token(response); 
             }
-            catch (const ollama::invalid_json_exception& e) { /* Partial response was received. Will do nothing and attempt to concatenate with the next response. */ }
-            
+            catch (const ollama::invalid_json_exception& e) { /* A malformed frame was received. Will do nothing and continue with the next frame. */ }
             return true;
-        };
+        });
+    }
 
-        if (auto res = this->cli->Post("/api/generate", request_string, "application/json", stream_callback)) { return true; }
-        else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL"+this->server_url+" Error: "+httplib::to_string( res.error() ) ); } 
+    // Generate a streaming reply where a user-defined callback function is invoked with the raw JSON of each frame received.
+    // Return false from the callback to cancel the stream, in which case false is returned without throwing.
+    bool generate_frames(ollama::request& request, std::function<bool(const std::string&)> on_receive_frame)
+    {
+        request["stream"] = true;
+        return stream_frames("/api/generate", request.dump(), on_receive_frame);
+    }
 
-        return false;
+    // Generate a streaming reply from a request serialized before, such as the same prompt sent to several models.
+    // The request must ask for a stream. The callback is invoked with the raw JSON of each frame, return false from it to cancel the stream.
+    bool generate_frames(const std::string& request_body, std::function<bool(const std::string&)> on_receive_frame)
+    {
+        return stream_frames("/api/generate", request_body, on_receive_frame);
     }
 
     ollama::response chat(const std::string& model, const ollama::messages& messages, json options=nullptr, const std::string& format="json", const std::string& keep_alive_duration="5m")
@@ -480,11 +785,11 @@ class Ollama
 
         request["stream"] = false;        
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;      
+        if (ollama::log_requests()) ollama::log_request(request_string);
 
         if (auto res = this->cli->Post("/api/chat",request_string, "application/json"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
 
             response = ollama::response(res->body, ollama::message_type::chat);
             if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
@@ -507,37 +812,27 @@ class Ollama
 
     bool chat(ollama::request& request, std::function<void(const ollama::response&)> on_receive_token)
     {
-        ollama::response response;        
         request["stream"] = true;
 
-        std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;      
-
-        std::shared_ptr<std::vector<std::string>> partial_responses = std::make_shared<std::vector<std::string>>();
-
-        auto stream_callback = [on_receive_token, partial_responses](const char *data, size_t data_length)->bool{
-            
-            std::string message(data, data_length);
-            if (ollama::log_replies) std::cout << message << std::endl;
+        return stream_frames("/api/chat", request.dump(), [on_receive_token](const std::string& frame)->bool{
             try 
             {   
-                partial_responses->push_back(message);
-                std::string total_response = std::accumulate(partial_responses->begin(), partial_responses->end(), std::string(""));                
-                ollama::response response(total_response, ollama::message_type::chat);
-                partial_responses->clear();  
+                ollama::response response(frame, ollama::message_type::chat);
 
                 if ( response.has_error() ) { if (ollama::use_exceptions) throw ollama::exception("Ollama response returned error: "+response.get_error() ); }
                 on_receive_token(response);
             }
-            catch (const ollama::invalid_json_exception& e) { /* Partial response was received. Will do nothing and attempt to concatenate with the next response. */ }
-
+            catch (const ollama::invalid_json_exception& e) { /* A malformed frame was received. Will do nothing and continue with the next frame. */ }
             return true;
-        };
-
-        if (auto res = this->cli->Post("/api/chat", request_string, "application/json", stream_callback)) { return true; }
-        else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL"+this->server_url+" Error: "+httplib::to_string( res.error() ) ); }
+        });
+    }
 
-        return false;
+    // Chat with a streaming reply where a user-defined callback function is invoked with the raw JSON of each frame received.
+    // Return false from the callback to cancel the stream, in which case false is returned without throwing.
+    bool chat_frames(ollama::request& request, std::function<bool(const std::string&)> on_receive_frame)
+    {
+        request["stream"] = true;
+        return stream_frames("/api/chat", request.dump(), on_receive_frame);
     }
 
     bool create_model(const std::string& modelName, const std::string& modelFile, bool loadFromFile=true)
@@ -567,13 +862,13 @@ class Ollama
         else request["modelFile"] = modelFile;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;  
+        if (ollama::log_requests()) ollama::log_request(request_string);
 
         std::string response;
 
         if (auto res = this->cli->Post("/api/create",request_string, "application/json"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
 
             json chunk = json::parse(res->body);
             if (chunk["status"]=="success") return true;        
@@ -587,17 +882,18 @@ class Ollama
 
     }
 
-    bool load_model(const std::string& model)
+    bool load_model(const std::string& model, const std::string& keep_alive_duration="5m")
     {
         json request;
         request["model"] = model;
+        request["keep_alive"] = keep_alive_duration;
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        if (ollama::log_requests()) ollama::log_request(request_string);
 
         // Send a blank request with the model name to instruct ollama to load the model into memory.
         if (auto res = this->cli->Post("/api/generate", request_string, "application/json"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
             json response = json::parse(res->body);
             return response["done"];        
         }
@@ -622,7 +918,7 @@ class Ollama
         json models;
         if (auto res = cli->Get("/api/tags"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
             models = json::parse(res->body);
         }
         else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when querying model list: "+httplib::to_string( res.error() ) );}        
@@ -649,7 +945,7 @@ class Ollama
         json models;
         if (auto res = cli->Get("/api/ps"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
             models = json::parse(res->body);
         }
         else { if (ollama::use_exceptions) throw ollama::exception("No response returned from server when querying running models: "+httplib::to_string( res.error() ) );}        
@@ -703,11 +999,11 @@ class Ollama
         if (verbose) request["verbose"] = true;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        if (ollama::log_requests()) ollama::log_request(request_string);
 
         if (auto res = cli->Post("/api/show", request_string, "application/json"))
         {
-            if (ollama::log_replies) std::cout << "Reply was " << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
             try
             { 
                 response = json::parse(res->body); 
@@ -727,7 +1023,7 @@ class Ollama
         request["destination"] = dest_model;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        if (ollama::log_requests()) ollama::log_request(request_string);
         
         if (auto res = cli->Post("/api/copy", request_string, "application/json"))
         {
@@ -745,7 +1041,7 @@ class Ollama
         request["name"] = model;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        if (ollama::log_requests()) ollama::log_request(request_string);
         
         if (auto res = cli->Delete("/api/delete", request_string, "application/json"))
         {
@@ -765,7 +1061,7 @@ class Ollama
         request["stream"] = false;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        if (ollama::log_requests()) ollama::log_request(request_string);
         
         if (auto res = cli->Post("/api/pull", request_string, "application/json"))
         {
@@ -780,6 +1076,74 @@ class Ollama
         return false;
     }
 
+    // Pull a model while streaming its progress to a user-defined callback. Return false from the callback to cancel the pull.
+    // When the connection drops the pull is resumed up to max_retries times with exponential backoff, reported with the status "retrying".
+    // The server keeps partially downloaded layers, so a resumed pull continues where it stopped. Progress never moves backwards across attempts.
+    bool pull_model_with_progress(const std::string& model, std::function<bool(const ollama::pull_progress&)> on_progress, unsigned max_retries = 5, bool allow_insecure = false)
+    {
+        ollama::request request;
+        request["name"] = model;
+        request["insecure"] = allow_insecure;
+        request["stream"] = true;
+
+        ollama::pull_progress progress;
+        std::map<std::string, std::pair<uint64_t, uint64_t>> layers;   // Digest to total and completed bytes
+
+        for (unsigned attempt = 0; ; attempt++)
+        {
+            progress.attempt = attempt;
+            bool success = false, cancelled = false;
+            std::string error;
+
+            try
+            {
+                stream_frames("/api/pull", request.dump(), [&](const std::string& frame) -> bool {
+                    json status = json::parse(frame);
+                    if (status.contains("error")) { error = status["error"].get<std::string>(); return false; }
+
+                    progress.status = status.value("status", "");
+                    progress.digest = status.value("digest", "");
+                    if (!progress.digest.empty())
+                    {
+                        std::pair<uint64_t, uint64_t>& layer = layers[progress.digest];
+                        layer.first = std::max(layer.first, status.value("total", uint64_t(0)));
+                        layer.second = std::max(layer.second, status.value("completed", uint64_t(0)));
+                        progress.total = layer.first;
+                        progress.completed = layer.second;
+                    }
+                    else { progress.total = 0; progress.completed = 0; }
+
+                    progress.total_bytes = 0; progress.completed_bytes = 0;
+                    for (std::map<std::string, std::pair<uint64_t, uint64_t>>::const_iterator it = layers.begin(); it != layers.end(); ++it)
+                    {
+                        progress.total_bytes += it->second.first;
+                        progress.completed_bytes += it->second.second;
+                    }
+
+                    if (progress.status == "success") success = true;
+                    cancelled = !on_progress(progress);
+                    return !cancelled;
+                });
+            }
+            catch (const ollama::exception&)
+            {
+                // The connection dropped, the pull is resumed below
+            }
+
+            if (success) return true;
+            if (cancelled) return false;
+            if (!error.empty()) { if (ollama::use_exceptions) throw ollama::exception("Error returned from ollama when pulling model: "+error); return false; }
+
+            if (attempt >= max_retries) { if (ollama::use_exceptions) throw ollama::exception("Unable to pull model "+model+" after "+std::to_string(attempt+1)+" attempts."); return false; }
+
+            // Report the resume, which also allows the callback to cancel it
+            progress.status = "retrying";
+            progress.attempt = attempt + 1;
+            if (!on_progress(progress)) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(250u << std::min(attempt, 5u), 8000u)));
+        }
+    }
+
     bool push_model(const std::string& model, bool allow_insecure = false)
     {
         json request, response;
@@ -788,7 +1152,7 @@ class Ollama
         request["stream"] = false;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        if (ollama::log_requests()) ollama::log_request(request_string);
         
         if (auto res = cli->Post("/api/push", request_string, "application/json"))
         {
@@ -815,11 +1179,11 @@ class Ollama
         ollama::response response;
 
         std::string request_string = request.dump();
-        if (ollama::log_requests) std::cout << request_string << std::endl;
+        if (ollama::log_requests()) ollama::log_request(request_string);
         
         if (auto res = cli->Post("/api/embed", request_string, "application/json"))
         {
-            if (ollama::log_replies) std::cout << res->body << std::endl;
+            if (ollama::log_replies()) ollama::log_reply(res->body);
 
 
             if (res->status==httplib::StatusCode::OK_200) {response = ollama::response(res->body); return response; };
@@ -869,6 +1233,18 @@ class Ollama
         this->cli->set_write_timeout(seconds);
     }
 
+    // Time to wait for a connection to the server, short timeouts make a check like is_running() fail fast when the server is unreachable.
+    void setConnectTimeout(const int seconds)
+    {
+        this->cli->set_connection_timeout(seconds);
+    }
+
+    // Close the connection to the server, aborting a request in progress on another thread.
+    void stop()
+    {
+        this->cli->stop();
+    }
+
     private:
 
 /*
@@ -879,6 +1255,32 @@ class Ollama
     }
 */
 
+    // Post a serialized request and invoke on_receive_frame for every newline delimited JSON frame of the streamed reply.
+    bool stream_frames(const std::string& endpoint, const std::string& request_string, std::function<bool(const std::string&)> on_receive_frame)
+    {
+        if (ollama::log_requests()) ollama::log_request(request_string);
+
+        std::shared_ptr<ollama::frame_buffer> partial_responses = std::make_shared<ollama::frame_buffer>();
+        std::shared_ptr<bool> cancelled = std::make_shared<bool>(false);
+
+        std::function<void(const std::string&)> on_frame = [on_receive_frame, cancelled](const std::string& frame) {
+            if (!*cancelled && !on_receive_frame(frame)) *cancelled = true;
+        };
+
+        auto stream_callback = [on_frame, partial_responses, cancelled](const char *data, size_t data_length)->bool{
+            
+            if (ollama::log_replies()) ollama::log_reply(data, data_length);
+            partial_responses->append(data, data_length, on_frame);
+            return !*cancelled;
+        };
+
+        if (auto res = this->cli->Post(endpoint, request_string, "application/json", stream_callback)) { partial_responses->flush(on_frame); return !*cancelled; }
+        else if (*cancelled) { return false; }
+        else { if (ollama::use_exceptions) throw ollama::exception( "No response from server returned at URL"+this->server_url+" Error: "+httplib::to_string( res.error() ) ); }
+
+        return false;
+    }
+
     std::string server_url;
     httplib::Client *cli;
 
@@ -925,6 +1327,16 @@ namespace ollama
         return ollama.generate(request, on_receive_response);
     }
 
+    inline bool generate_frames(ollama::request& request, std::function<bool(const std::string&)> on_receive_frame)
+    {
+        return ollama.generate_frames(request, on_receive_frame);
+    }
+
+    inline bool generate_frames(const std::string& request_body, std::function<bool(const std::string&)> on_receive_frame)
+    {
+        return ollama.generate_frames(request_body, on_receive_frame);
+    }
+
     inline ollama::response chat(const std::string& model, const ollama::messages& messages, const json& options=nullptr, const std::string& format="json", const std::string& keep_alive_duration="5m")
     {
         return ollama.chat(model, messages, options, format, keep_alive_duration);
@@ -945,6 +1357,11 @@ namespace ollama
         return ollama.chat(request, on_receive_response);
     }
 
+    inline bool chat_frames(ollama::request& request, std::function<bool(const std::string&)> on_receive_frame)
+    {
+        return ollama.chat_frames(request, on_receive_frame);
+    }
+
     inline bool create(const std::string& modelName, const std::string& modelFile, bool loadFromFile=true)
     {
         return ollama.create_model(modelName, modelFile, loadFromFile);
@@ -955,9 +1372,9 @@ namespace ollama
         return ollama.is_running();
     }
 
-    inline bool load_model(const std::string& model)
+    inline bool load_model(const std::string& model, const std::string& keep_alive_duration="5m")
     {
-        return ollama.load_model(model);
+        return ollama.load_model(model, keep_alive_duration);
     }
 
     inline std::string get_version()
@@ -1015,6 +1432,11 @@ namespace ollama
         return ollama.pull_model(model, allow_insecure);
     }
 
+    inline bool pull_model_with_progress(const std::string& model, std::function<bool(const ollama::pull_progress&)> on_progress, unsigned max_retries = 5, bool allow_insecure = false)
+    {
+        return ollama.pull_model_with_progress(model, on_progress, max_retries, allow_insecure);
+    }
+
     inline bool push_model(const std::string& model, bool allow_insecure = false)
     {
         return ollama.push_model(model, allow_insecure);
@@ -1040,6 +1462,11 @@ namespace ollama
         ollama.setWriteTimeout(seconds);
     }
 
+    inline void setConnectTimeout(const int& seconds)
+    {
+        ollama.setConnectTimeout(seconds);
+    }
+
 }
 
 
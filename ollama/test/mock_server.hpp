@@ -0,0 +1,633 @@
+#ifndef OLLAMA_MOCK_SERVER_HPP
+#define OLLAMA_MOCK_SERVER_HPP
+
+/*  In-process mock of the Ollama REST API built on httplib::Server.
+
+    The mock implements /, /api/generate, /api/chat, /api/embed, /api/pull, /api/tags, /api/ps and /api/version.
+    Generations are deterministic: tokens are taken from a configurable response text and streamed as
+    newline delimited JSON at a configurable rate. The byte stream can be cut in chunks of a fixed size,
+    splitting frames mid-JSON or packing several frames in one chunk, and errors can be injected to exercise
+    the error paths of a client. Optionally the mock simulates model residency: models are loaded on use, which can take
+    a configurable time, and unloaded when the keep_alive of their last request expires.
+
+    This allows the tests and benchmarks to run without a GPU or real models:
+
+        ollama::mock_server server;
+        server.start();
+
+        Ollama client(server.url());
+        client.generate("llama3:8b", "Why is the sky blue?");
+*/
+
+#include "ollama.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ollama
+{
+    // Settings controlling the behaviour of the mock server. Settings are copied at the start of each request.
+    struct mock_settings
+    {
+        double tokens_per_second = 0;           // Rate at which tokens are streamed, 0 streams as fast as possible.
+        unsigned first_token_delay_ms = 0;      // Simulated prompt evaluation time before the first token.
+        size_t num_tokens = 18;                 // Tokens generated when the request does not set num_predict.
+        size_t chunk_size = 0;                  // 0 writes every frame as one chunk. Otherwise the stream is cut in chunks of this many bytes.
+        std::string response_text = "The sky appears blue because of a phenomenon called Rayleigh scattering.";
+        json tool_calls = json::array();        // Tool calls answered to chat requests with tools, unless the last message is a tool result. Empty disables.
+
+        int error_status = 0;                   // Answer generation requests with this HTTP status and an error body, 0 disables.
+        int error_after_tokens = -1;            // Send an error frame after this many tokens, -1 disables.
+        int disconnect_after_tokens = -1;       // Drop the connection after this many tokens, -1 disables.
+
+        std::vector<std::string> models = {"llama3:8b"};    // Models reported by /api/tags and accepted by generation requests.
+        std::vector<std::string> registry_models = {"tinyllama:latest"};    // Models that can be pulled, added to models once pulled.
+        std::uint64_t pull_size = 1 << 20;                  // Size in bytes of the single layer of a pulled model.
+        std::uint64_t pull_chunk = 1 << 17;                 // Bytes downloaded per progress frame.
+        unsigned pull_frame_delay_ms = 0;                   // Simulated download time per progress frame.
+        int pull_disconnect_after_frames = -1;              // Drop the connection after this many progress frames of every pull request, -1 disables.
+        bool simulate_residency = false;                    // Load models on use and unload them when their keep_alive expires. Otherwise all models are always loaded.
+        unsigned load_delay_ms = 0;                         // Simulated time to load a model that is not loaded, when simulating residency.
+        size_t max_loaded_models = 0;                       // Unload the least recently used model when more models are loaded, 0 is unlimited.
+        std::string version = "0.0.0-mock";                 // Version reported by /api/version.
+        size_t max_connections = 64;                        // Number of connections served concurrently.
+    };
+
+    class mock_server
+    {
+        public:
+
+            mock_server(const mock_settings& settings = mock_settings()): settings(settings)
+            {
+                register_handlers();
+            }
+
+            ~mock_server() { stop(); }
+
+            mock_server(const mock_server&) = delete;
+            mock_server& operator=(const mock_server&) = delete;
+
+            // Bind to the given port, or a free port when 0, on the given host and serve requests on a background thread.
+            bool start(const std::string& host = "127.0.0.1", int port = 0)
+            {
+                if (thread.joinable()) return true;
+
+                size_t max_connections = get_settings().max_connections;
+                svr.new_task_queue = [max_connections] { return new httplib::ThreadPool(max_connections); };
+
+                this->host = host;
+                if (port == 0) this->port = svr.bind_to_any_port(host);
+                else this->port = svr.bind_to_port(host, port) ? port : -1;
+                if (this->port < 0) return false;
+
+                stopping = false;
+                thread = std::thread([this] { svr.listen_after_bind(); });
+                svr.wait_until_ready();
+                return true;
+            }
+
+            void stop()
+            {
+                stopping = true;
+                svr.stop();
+                if (thread.joinable()) thread.join();
+            }
+
+            std::string url() const { return "http://"+host+":"+std::to_string(port); }
+            int get_port() const { return port; }
+
+            void set_settings(const mock_settings& settings) { std::lock_guard<std::mutex> lock(mutex); this->settings = settings; }
+            mock_settings get_settings() const { std::lock_guard<std::mutex> lock(mutex); return settings; }
+
+            // Counters, useful to verify client behaviour.
+            size_t request_count() const { return requests; }               // Requests received on any endpoint.
+            size_t generation_count() const { return generations; }         // Generation, chat and embedding requests received.
+            size_t active_stream_count() const { return active_streams; }   // Streams currently being written.
+            size_t max_active_stream_count() const { return max_active_streams; }
+            size_t cancelled_stream_count() const { return cancelled_streams; } // Streams closed by the client before completion.
+            size_t pull_request_count() const { return pull_requests; }     // Pull requests received, including resumed pulls.
+            std::uint64_t pulled_byte_count() const { return pulled_bytes; } // Layer bytes sent over all pulls. Resumed pulls don't download layer bytes twice.
+            size_t load_count() const { return loads; }                     // Models loaded that were not loaded, when simulating residency.
+            size_t eviction_count() const { return evictions; }             // Models unloaded because their keep_alive expired or to make room for another model.
+            json last_generation_request() const { std::lock_guard<std::mutex> lock(mutex); return last_generation; } // Body of the last generation or chat request.
+
+            // Returns the models that are loaded, when simulating residency.
+            std::vector<std::string> loaded_models()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                unload_expired();
+                std::vector<std::string> models;
+                for (auto it = loaded.begin(); it != loaded.end(); ++it) models.push_back(it->first);
+                return models;
+            }
+
+            // Parse a keep_alive value into a duration: a number of seconds or a duration string such as "5m", "1h30m" or "90s".
+            // A negative value keeps the model loaded forever, 0 unloads it after the request.
+            static std::chrono::steady_clock::duration parse_keep_alive(const json& keep_alive)
+            {
+                using namespace std::chrono;
+                double seconds = 300;
+                if (keep_alive.is_number()) seconds = keep_alive.get<double>();
+                else if (keep_alive.is_string())
+                {
+                    std::string text = keep_alive.get<std::string>();
+                    seconds = 0;
+                    size_t i = 0;
+                    bool negative = !text.empty() && text[0] == '-';
+                    if (negative) i++;
+                    while (i < text.size())
+                    {
+                        size_t end = i;
+                        while (end < text.size() && (isdigit(static_cast<unsigned char>(text[end])) || text[end] == '.')) end++;
+                        if (end == i) break;
+                        double value = std::stod(text.substr(i, end-i));
+                        std::string unit;
+                        while (end < text.size() && isalpha(static_cast<unsigned char>(text[end]))) unit += text[end++];
+                        if (unit == "h") value *= 3600; else if (unit == "m") value *= 60; else if (unit == "ms") value /= 1000;
+                        seconds += value;
+                        i = end;
+                    }
+                    if (negative) seconds = -seconds;
+                }
+                if (seconds < 0) return steady_clock::duration::max();
+                return duration_cast<steady_clock::duration>(duration<double>(seconds));
+            }
+
+            // Split a text in tokens, every token starts at a space.
+            static std::vector<std::string> tokenize(const std::string& text)
+            {
+                std::vector<std::string> tokens;
+                for (size_t i = 0; i < text.size(); )
+                {
+                    size_t end = text.find(' ', i+1);
+                    if (end == std::string::npos) end = text.size();
+                    tokens.push_back(text.substr(i, end-i));
+                    i = end;
+                }
+                return tokens;
+            }
+
+            // The text generated for a request producing num_tokens tokens, repeating the response text when required.
+            static std::string generated_text(const mock_settings& settings, size_t num_tokens)
+            {
+                std::vector<std::string> tokens = tokenize(settings.response_text);
+                std::string text;
+                for (size_t i = 0; i < num_tokens && !tokens.empty(); i++) text += tokens[i % tokens.size()];
+                return text;
+            }
+
+        private:
+
+            // Generation requests are served with the same logic, only the framing of tokens differs.
+            void register_handlers()
+            {
+                svr.Get("/", [this](const httplib::Request&, httplib::Response& res) {
+                    requests++;
+                    res.set_content("Ollama is running", "text/plain");
+                });
+
+                svr.Get("/api/version", [this](const httplib::Request&, httplib::Response& res) {
+                    requests++;
+                    json response; response["version"] = get_settings().version;
+                    res.set_content(response.dump(), "application/json");
+                });
+
+                svr.Get("/api/tags", [this](const httplib::Request&, httplib::Response& res) {
+                    requests++;
+                    res.set_content(model_list(false).dump(), "application/json");
+                });
+
+                svr.Get("/api/ps", [this](const httplib::Request&, httplib::Response& res) {
+                    requests++;
+                    res.set_content(model_list(true).dump(), "application/json");
+                });
+
+                svr.Post("/api/generate", [this](const httplib::Request& req, httplib::Response& res) { handle_generation(req, res, message_type::generation); });
+                svr.Post("/api/chat", [this](const httplib::Request& req, httplib::Response& res) { handle_generation(req, res, message_type::chat); });
+                svr.Post("/api/embed", [this](const httplib::Request& req, httplib::Response& res) { handle_embedding(req, res); });
+                svr.Post("/api/pull", [this](const httplib::Request& req, httplib::Response& res) { handle_pull(req, res); });
+            }
+
+            json model_list(bool running)
+            {
+                json response; response["models"] = json::array();
+                mock_settings settings = get_settings();
+                std::lock_guard<std::mutex> lock(mutex);
+                unload_expired();
+                for (size_t i = 0; i < settings.models.size(); i++)
+                {
+                    json model;
+                    model["name"] = settings.models[i];
+                    model["model"] = settings.models[i];
+                    model["size"] = 4661224676;
+                    model["digest"] = "sha256:"+std::to_string(fnv1a(settings.models[i]));
+                    model["details"]["family"] = "llama";
+                    model["details"]["format"] = "gguf";
+                    if (running)
+                    {
+                        if (settings.simulate_residency && loaded.find(settings.models[i]) == loaded.end()) continue;
+                        model["size_vram"] = 4661224676;
+                        model["expires_at"] = settings.simulate_residency ? expires_at(loaded.at(settings.models[i]).expires) : "2099-01-01T00:00:00Z";
+                    }
+                    else model["modified_at"] = "2024-01-01T00:00:00Z";
+                    response["models"].push_back(model);
+                }
+                return response;
+            }
+
+            static std::uint64_t fnv1a(const std::string& text)
+            {
+                std::uint64_t hash = 14695981039346656037ULL;
+                for (size_t i = 0; i < text.size(); i++) { hash ^= static_cast<unsigned char>(text[i]); hash *= 1099511628211ULL; }
+                return hash;
+            }
+
+            // Loads the model of a generation request when it is not loaded and sets its expiry from the keep_alive of the request.
+            // Returns the time spent loading the model in nanoseconds.
+            std::uint64_t load_model(const json& request, const mock_settings& settings)
+            {
+                if (!settings.simulate_residency) return 0;
+
+                auto start = std::chrono::steady_clock::now();
+                std::string model = request["model"];
+                std::chrono::steady_clock::duration keep_alive = parse_keep_alive(request.contains("keep_alive") ? request["keep_alive"] : json());
+                bool cold;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    unload_expired();
+                    cold = loaded.find(model) == loaded.end();
+                }
+                if (cold)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(settings.load_delay_ms));
+                    loads++;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                auto now = std::chrono::steady_clock::now();
+                residency& entry = loaded[model];
+                entry.last_used = now;
+                entry.expires = keep_alive == std::chrono::steady_clock::duration::max() ? std::chrono::steady_clock::time_point::max() : now + keep_alive;
+
+                // Make room by unloading the least recently used models
+                while (settings.max_loaded_models > 0 && loaded.size() > settings.max_loaded_models)
+                {
+                    auto lru = loaded.end();
+                    for (auto it = loaded.begin(); it != loaded.end(); ++it)
+                        if (it->first != model && (lru == loaded.end() || it->second.last_used < lru->second.last_used)) lru = it;
+                    if (lru == loaded.end()) break;
+                    loaded.erase(lru); evictions++;
+                }
+                return cold ? elapsed_ns(start) : 0;
+            }
+
+            // Unloads models whose keep_alive expired, the mutex must be locked.
+            void unload_expired()
+            {
+                auto now = std::chrono::steady_clock::now();
+                for (auto it = loaded.begin(); it != loaded.end(); )
+                {
+                    if (it->second.expires <= now) { it = loaded.erase(it); evictions++; }
+                    else ++it;
+                }
+            }
+
+            static std::string expires_at(const std::chrono::steady_clock::time_point& expires)
+            {
+                if (expires == std::chrono::steady_clock::time_point::max()) return "2318-11-22T00:00:00Z";
+                std::time_t time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now() +
+                    std::chrono::duration_cast<std::chrono::system_clock::duration>(expires - std::chrono::steady_clock::now()));
+                std::tm utc = *std::gmtime(&time);
+                char buffer[32];
+                std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &utc);
+                return buffer;
+            }
+
+            static std::uint64_t elapsed_ns(const std::chrono::steady_clock::time_point& since)
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-since).count();
+            }
+
+            // Returns false and sets an error response when the request is malformed, the model is unknown or an error is injected.
+            bool accept_request(const httplib::Request& req, httplib::Response& res, const mock_settings& settings, json& request)
+            {
+                requests++; generations++;
+                try { request = json::parse(req.body); }
+                catch (...) { res.status = 400; res.set_content("{\"error\":\"invalid request body\"}", "application/json"); return false; }
+
+                std::string model = request.value("model", "");
+                if (std::find(settings.models.begin(), settings.models.end(), model) == settings.models.end())
+                {
+                    json error; error["error"] = "model \""+model+"\" not found, try pulling it first";
+                    res.status = 404; res.set_content(error.dump(), "application/json");
+                    return false;
+                }
+
+                if (settings.error_status != 0)
+                {
+                    json error; error["error"] = "injected error";
+                    res.status = settings.error_status; res.set_content(error.dump(), "application/json");
+                    return false;
+                }
+                return true;
+            }
+
+            void handle_generation(const httplib::Request& req, httplib::Response& res, message_type type)
+            {
+                mock_settings settings = get_settings();
+                json request;
+                if (!accept_request(req, res, settings, request)) return;
+                { std::lock_guard<std::mutex> lock(mutex); last_generation = request; }
+
+                std::string model = request["model"];
+                bool stream = request.value("stream", true);
+                std::uint64_t load_ns = load_model(request, settings);
+
+                // Determine the prompt and the number of tokens to generate
+                std::string prompt;
+                if (type == message_type::chat && request.contains("messages") && !request["messages"].empty()) prompt = request["messages"].back().value("content", "");
+                else prompt = request.value("prompt", "");
+
+                size_t num_tokens = settings.num_tokens;
+                if (request.contains("options") && request["options"].contains("num_predict") && request["options"]["num_predict"].is_number_integer())
+                    num_tokens = static_cast<size_t>(std::max(0, request["options"]["num_predict"].get<int>()));
+
+                // A generation without prompt only loads the model
+                if (type == message_type::generation && !request.contains("prompt")) num_tokens = 0;
+
+                // A chat with tools calls the tools instead of answering, until the tool results are sent
+                json tool_calls = json::array();
+                if (type == message_type::chat && request.contains("tools") && !request["messages"].empty() && request["messages"].back().value("role", "") != "tool")
+                    tool_calls = settings.tool_calls;
+                if (!tool_calls.empty()) num_tokens = 0;
+
+                // Previous context is extended with the prompt and generated tokens
+                std::vector<int> context;
+                if (request.contains("context") && request["context"].is_array()) context = request["context"].get<std::vector<int>>();
+                size_t prompt_tokens = context.size() + tokenize(prompt).size();
+
+                std::vector<std::string> all_tokens = tokenize(settings.response_text);
+                std::vector<std::string> tokens;
+                for (size_t i = 0; i < num_tokens && !all_tokens.empty(); i++) tokens.push_back(all_tokens[i % all_tokens.size()]);
+
+                auto make_frame = [type, model](const std::string& token, bool done) {
+                    json frame;
+                    frame["model"] = model;
+                    frame["created_at"] = "2024-01-01T00:00:00.000000Z";
+                    if (type == message_type::chat) { frame["message"]["role"] = "assistant"; frame["message"]["content"] = token; }
+                    else frame["response"] = token;
+                    frame["done"] = done;
+                    return frame;
+                };
+
+                size_t token_count = tokens.size();
+                auto finish_frame = [type, context, prompt_tokens, token_count, load_ns](json frame, const std::chrono::steady_clock::time_point& start, std::uint64_t prompt_eval_ns) {
+                    frame["done_reason"] = "stop";
+                    frame["total_duration"] = elapsed_ns(start) + load_ns;
+                    frame["load_duration"] = load_ns;
+                    frame["prompt_eval_count"] = prompt_tokens;
+                    frame["prompt_eval_duration"] = prompt_eval_ns;
+                    frame["eval_count"] = token_count;
+                    frame["eval_duration"] = elapsed_ns(start) - prompt_eval_ns;
+                    if (type == message_type::generation)
+                    {
+                        std::vector<int> new_context = context;
+                        for (size_t i = 0; i < prompt_tokens - context.size() + token_count; i++) new_context.push_back(static_cast<int>(new_context.size()));
+                        frame["context"] = new_context;
+                    }
+                    return frame;
+                };
+
+                if (!stream)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(settings.first_token_delay_ms));
+                    std::uint64_t prompt_eval_ns = elapsed_ns(start);
+                    if (settings.tokens_per_second > 0) std::this_thread::sleep_for(std::chrono::duration<double>(tokens.size() / settings.tokens_per_second));
+
+                    std::string text;
+                    for (size_t i = 0; i < tokens.size(); i++) text += tokens[i];
+                    json frame = make_frame(text, true);
+                    if (!tool_calls.empty()) frame["message"]["tool_calls"] = tool_calls;
+                    res.set_content(finish_frame(frame, start, prompt_eval_ns).dump(), "application/json");
+                    return;
+                }
+
+                std::shared_ptr<std::vector<std::string>> token_list = std::make_shared<std::vector<std::string>>(tokens);
+                res.set_chunked_content_provider("application/x-ndjson",
+                    [this, settings, token_list, tool_calls, make_frame, finish_frame](size_t, httplib::DataSink& sink) -> bool {
+
+                        stream_guard guard(*this);
+                        std::string pending;
+
+                        // Write a frame, or when chunking is enabled append it to the pending bytes and write all complete chunks
+                        auto write_frame = [&](const json& frame) -> bool {
+                            pending += frame.dump() + "\n";
+                            size_t chunk = settings.chunk_size == 0 ? pending.size() : settings.chunk_size;
+                            size_t written = 0;
+                            while (pending.size()-written >= chunk && chunk > 0)
+                            {
+                                if (!sink.is_writable() || !sink.write(pending.data()+written, chunk)) return false;
+                                written += chunk;
+                            }
+                            pending.erase(0, written);
+                            return true;
+                        };
+
+                        auto start = std::chrono::steady_clock::now();
+                        std::this_thread::sleep_for(std::chrono::milliseconds(settings.first_token_delay_ms));
+                        std::uint64_t prompt_eval_ns = elapsed_ns(start);
+                        auto first_token = std::chrono::steady_clock::now();
+
+                        if (!tool_calls.empty())
+                        {
+                            json frame = make_frame("", false);
+                            frame["message"]["tool_calls"] = tool_calls;
+                            if (!write_frame(frame)) { cancelled_streams++; return false; }
+                        }
+
+                        for (size_t i = 0; i < token_list->size(); i++)
+                        {
+                            if (stopping) return false;
+
+                            if (static_cast<int>(i) == settings.disconnect_after_tokens) { cancelled_streams++; return false; }
+                            if (static_cast<int>(i) == settings.error_after_tokens)
+                            {
+                                json error; error["error"] = "injected error";
+                                write_frame(error);
+                                if (!pending.empty()) sink.write(pending.data(), pending.size());
+                                sink.done();
+                                return true;
+                            }
+
+                            if (settings.tokens_per_second > 0)
+                                std::this_thread::sleep_until(first_token + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(i / settings.tokens_per_second)));
+
+                            if (!write_frame(make_frame((*token_list)[i], false))) { cancelled_streams++; return false; }
+                        }
+
+                        if (!write_frame(finish_frame(make_frame("", true), start, prompt_eval_ns))) { cancelled_streams++; return false; }
+                        if (!pending.empty() && !sink.write(pending.data(), pending.size())) { cancelled_streams++; return false; }
+                        sink.done();
+                        return true;
+                    });
+            }
+
+            void handle_embedding(const httplib::Request& req, httplib::Response& res)
+            {
+                mock_settings settings = get_settings();
+                json request;
+                if (!accept_request(req, res, settings, request)) return;
+                std::uint64_t load_ns = load_model(request, settings);
+
+                std::vector<std::string> inputs;
+                if (request.contains("input") && request["input"].is_array()) inputs = request["input"].get<std::vector<std::string>>();
+                else inputs.push_back(request.value("input", ""));
+
+                // Deterministic embedding derived from a hash of the input
+                json response;
+                response["model"] = request["model"];
+                response["embeddings"] = json::array();
+                for (size_t i = 0; i < inputs.size(); i++)
+                {
+                    std::uint64_t hash = fnv1a(inputs[i]);
+                    std::vector<float> embedding;
+                    for (int j = 0; j < 8; j++) embedding.push_back(static_cast<float>((hash >> (j*8)) & 0xff) / 255.0f - 0.5f);
+                    response["embeddings"].push_back(embedding);
+                }
+                response["total_duration"] = load_ns;
+                response["load_duration"] = load_ns;
+                response["prompt_eval_count"] = inputs.size();
+                res.set_content(response.dump(), "application/json");
+            }
+
+            // Streams the progress of downloading a single layer. Like Ollama, the downloaded part of a layer is kept when the
+            // connection drops, so pulling the model again resumes the download.
+            void handle_pull(const httplib::Request& req, httplib::Response& res)
+            {
+                requests++; pull_requests++;
+                mock_settings settings = get_settings();
+                json request;
+                try { request = json::parse(req.body); }
+                catch (...) { res.status = 400; res.set_content("{\"error\":\"invalid request body\"}", "application/json"); return; }
+
+                std::string model = request.value("name", request.value("model", ""));
+                bool stream = request.value("stream", true);
+                bool local = std::find(settings.models.begin(), settings.models.end(), model) != settings.models.end();
+                bool known = local || std::find(settings.registry_models.begin(), settings.registry_models.end(), model) != settings.registry_models.end();
+                if (!known)
+                {
+                    json error; error["error"] = "pull model manifest: file does not exist";
+                    if (!stream) res.status = 500;
+                    res.set_content(error.dump() + (stream ? "\n" : ""), stream ? "application/x-ndjson" : "application/json");
+                    return;
+                }
+
+                if (local) { std::lock_guard<std::mutex> lock(mutex); pull_offsets[model] = settings.pull_size; }
+                if (!stream)
+                {
+                    while (!pull_chunk(model, settings)) {}
+                    res.set_content("{\"status\":\"success\"}", "application/json");
+                    return;
+                }
+
+                res.set_chunked_content_provider("application/x-ndjson",
+                    [this, settings, model](size_t, httplib::DataSink& sink) -> bool {
+
+                        auto write_frame = [&sink](const json& frame) { std::string line = frame.dump() + "\n"; return sink.is_writable() && sink.write(line.data(), line.size()); };
+
+                        json status; status["status"] = "pulling manifest";
+                        if (!write_frame(status)) return false;
+
+                        std::string digest = "sha256:" + std::to_string(fnv1a(model));
+                        int frames = 0;
+                        for (bool done = false; !done; )
+                        {
+                            if (settings.pull_disconnect_after_frames >= 0 && frames++ >= settings.pull_disconnect_after_frames) { cancelled_streams++; return false; }
+                            if (settings.pull_frame_delay_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(settings.pull_frame_delay_ms));
+
+                            done = pull_chunk(model, settings);
+                            json progress;
+                            progress["status"] = "pulling " + digest.substr(7, 12);
+                            progress["digest"] = digest;
+                            progress["total"] = settings.pull_size;
+                            { std::lock_guard<std::mutex> lock(mutex); progress["completed"] = pull_offsets[model]; }
+                            if (!write_frame(progress)) { cancelled_streams++; return false; }
+                        }
+
+                        const char* stages[] = { "verifying sha256 digest", "writing manifest", "success" };
+                        for (const char* stage : stages) { status["status"] = stage; if (!write_frame(status)) return false; }
+                        sink.done();
+                        return true;
+                    });
+            }
+
+            // Download the next chunk of a layer. Returns true when the layer is complete, which makes the model available.
+            bool pull_chunk(const std::string& model, const mock_settings& settings)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::uint64_t& offset = pull_offsets[model];
+                std::uint64_t chunk = std::min(settings.pull_chunk, settings.pull_size - offset);
+                offset += chunk;
+                pulled_bytes += chunk;
+                if (offset < settings.pull_size) return false;
+
+                if (std::find(this->settings.models.begin(), this->settings.models.end(), model) == this->settings.models.end()) this->settings.models.push_back(model);
+                return true;
+            }
+
+            // Tracks the number of streams written concurrently.
+            class stream_guard
+            {
+                public:
+                    stream_guard(mock_server& server): server(server)
+                    {
+                        size_t active = ++server.active_streams;
+                        size_t max = server.max_active_streams;
+                        while (active > max && !server.max_active_streams.compare_exchange_weak(max, active)) {}
+                    }
+                    ~stream_guard() { server.active_streams--; }
+                private:
+                    mock_server& server;
+            };
+
+            httplib::Server svr;
+            std::thread thread;
+            std::string host = "127.0.0.1";
+            int port = -1;
+
+            mutable std::mutex mutex;
+            mock_settings settings;
+
+            std::atomic<bool> stopping{false};
+            std::atomic<size_t> requests{0};
+            std::atomic<size_t> generations{0};
+            std::atomic<size_t> active_streams{0};
+            std::atomic<size_t> max_active_streams{0};
+            std::atomic<size_t> cancelled_streams{0};
+            std::atomic<size_t> pull_requests{0};
+            std::atomic<std::uint64_t> pulled_bytes{0};
+            std::map<std::string, std::uint64_t> pull_offsets;     // Downloaded bytes per model, guarded by mutex
+            json last_generation;                                   // Body of the last generation or chat request, guarded by mutex
+
+            struct residency
+            {
+                std::chrono::steady_clock::time_point expires;
+                std::chrono::steady_clock::time_point last_used;
+            };
+            std::map<std::string, residency> loaded;                // Loaded models when simulating residency, guarded by mutex
+            std::atomic<size_t> loads{0};
+            std::atomic<size_t> evictions{0};
+    };
+}
+
+#endif
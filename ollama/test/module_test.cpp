@@ -0,0 +1,1702 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+#include "ollama.hpp"
+#include "mock_server.hpp"
+
+#include "ollamabackendset.h"
+#include "ollamacascadecheck.h"
+#include "ollamachat.h"
+#include "ollamaconversationrun.h"
+#include "ollamacoroutine.h"
+#include "ollamajsonparser.h"
+#include "ollamametrics.h"
+#include "ollamaservice.h"
+#include "ollamasnapshot.h"
+#include "ollamastopcondition.h"
+#include "ollamathinksplitter.h"
+#include "ollamatools.h"
+#include "ollamatrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tests of the NAP module sources in ../src against the mock server, built with the NAP stand-ins in test/napstub.
+// Run with: make test-module, or make test-module-cpp20 for the coroutine tests that require C++20.
+TEST_SUITE("Module Tests") {
+
+    static std::string mock_model = "llama3:8b";
+
+    // Runs the main thread loop of the service until the condition holds or the timeout elapses
+    static bool update_until(nap::OllamaService& service, const std::function<bool()>& condition, int timeout_ms = 5000)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (!condition())
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+                return false;
+            service.update(0.01);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return true;
+    }
+
+    static nap::OllamaBackendSet::BackendState backend_state(nap::OllamaBackendSet& set, const std::string& url)
+    {
+        for (auto& state : set.getBackendStates())
+            if (state.mURL == url)
+                return state;
+        return nap::OllamaBackendSet::BackendState();
+    }
+
+    static std::string unused_url()
+    {
+        ollama::mock_server probe;
+        probe.start();
+        return probe.url();
+    }
+
+    // Collects the response of a prompt, completed on the main thread loop of the service
+    struct prompt_result
+    {
+        std::string text;
+        std::string error;
+        bool done = false;
+    };
+
+    static void send_prompt(nap::OllamaChat& chat, const std::string& message, prompt_result& result)
+    {
+        chat.chat(message,
+            [&result](const std::string& token) { result.text += token; },
+            [&result] { result.done = true; },
+            [&result](const std::string& error) { result.error = error; result.done = true; });
+    }
+
+    // Feeds the tokens to a copy of the condition, returns the delivered text and the held back text when no condition fired
+    static std::string apply_stop_condition(nap::OllamaStopCondition condition, const std::vector<std::string>& tokens, bool& stopped)
+    {
+        std::string response, output;
+        stopped = false;
+        for (const auto& token : tokens)
+        {
+            stopped = condition.feed(token, output);
+            response += output;
+            if (stopped)
+                return response;
+        }
+        return response + condition.flush();
+    }
+
+    // Feeds the tokens to a splitter, collecting the reasoning and the answer including the held back text
+    static std::pair<std::string, std::string> apply_think_splitter(const std::vector<std::string>& tokens)
+    {
+        nap::OllamaThinkSplitter splitter;
+        std::string reasoning, answer, token_reasoning, token_answer;
+        for (const auto& token : tokens)
+        {
+            splitter.feed(token, token_reasoning, token_answer);
+            reasoning += token_reasoning;
+            answer += token_answer;
+        }
+        splitter.flush(token_reasoning, token_answer);
+        return { reasoning + token_reasoning, answer + token_answer };
+    }
+
+    // Feeds the tokens to the parser, collecting the events, stops at the first failure
+    static std::vector<nap::OllamaJSONEvent> apply_json_parser(nap::OllamaJSONParser& parser, const std::vector<std::string>& tokens)
+    {
+        std::vector<nap::OllamaJSONEvent> events, token_events;
+        for (const auto& token : tokens)
+        {
+            bool parsed = parser.feed(token, token_events);
+            events.insert(events.end(), token_events.begin(), token_events.end());
+            if (!parsed)
+                break;
+        }
+        return events;
+    }
+
+    // Resets the check, feeds the tokens and finishes the response, false when a check failed
+    static bool apply_cascade_check(nap::OllamaCascadeCheck& check, const std::vector<std::string>& tokens)
+    {
+        check.reset();
+        for (const auto& token : tokens)
+        {
+            if (!check.feed(token))
+                return false;
+        }
+        return check.finish();
+    }
+
+    TEST_CASE("Backend Set Routing") {
+
+        ollama::mock_settings settings;
+        settings.simulate_residency = true;
+        ollama::mock_server cold(settings), warm(settings);
+        REQUIRE( cold.start() );
+        REQUIRE( warm.start() );
+        std::string dead = unused_url();
+
+        // Only the warm server has the model in memory
+        Ollama client(warm.url());
+        REQUIRE( client.load_model(mock_model, "1h") );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaBackendSet set(service);
+        set.mID = "Backends";
+        set.mServerURLs = { cold.url(), dead, warm.url() };
+        set.mMaxConcurrentRequests = 1;
+        set.mHealthCheckInterval = 0.05f;
+        set.mFailuresToEject = 1;
+        set.mEjectionTime = 60.0f;
+        nap::Device& device = set;
+        REQUIRE( device.start(error) );
+
+        // The health check ejects the unreachable server and reports the models loaded by the others
+        REQUIRE( update_until(service, [&] { return backend_state(set, dead).mEjected && !backend_state(set, warm.url()).mLoadedModels.empty(); }) );
+        CHECK( set.getAvailableCount() == 2 );
+
+        // Requests prefer the server that has the model loaded, then go to the server with a free slot
+        {
+            auto first = set.acquire(mock_model, std::chrono::milliseconds(0));
+            REQUIRE( first.isValid() );
+            CHECK( first.getURL() == warm.url() );
+
+            auto second = set.acquire(mock_model, std::chrono::milliseconds(0));
+            REQUIRE( second.isValid() );
+            CHECK( second.getURL() == cold.url() );
+            CHECK( backend_state(set, cold.url()).mOutstanding == 1 );
+
+            // All slots are taken, a request waits for a slot
+            auto start = std::chrono::steady_clock::now();
+            auto waiting = set.acquire(mock_model, std::chrono::milliseconds(50));
+            CHECK( !waiting.isValid() );
+            CHECK( std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50) );
+
+            // A released slot is handed to a waiting request
+            std::thread releaser([&first] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                first.release();
+            });
+            auto released = set.acquire(mock_model, std::chrono::seconds(5));
+            releaser.join();
+            REQUIRE( released.isValid() );
+            CHECK( released.getURL() == warm.url() );
+        }
+        CHECK( backend_state(set, warm.url()).mOutstanding == 0 );
+        CHECK( backend_state(set, cold.url()).mOutstanding == 0 );
+
+        // A request that failed on a server is retried on another one
+        auto retry = set.acquire(mock_model, std::chrono::milliseconds(0), warm.url());
+        REQUIRE( retry.isValid() );
+        CHECK( retry.getURL() == cold.url() );
+        retry.release();
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Backend Set Ejection") {
+
+        ollama::mock_server first, second;
+        REQUIRE( first.start() );
+        REQUIRE( second.start() );
+        int second_port = second.get_port();
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaBackendSet set(service);
+        set.mID = "Backends";
+        set.mServerURLs = { first.url(), second.url() };
+        set.mHealthCheckInterval = 0.05f;
+        set.mFailuresToEject = 2;
+        set.mEjectionTime = 0.2f;
+        nap::Device& device = set;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return !backend_state(set, first.url()).mLoadedModels.empty(); }) );
+
+        // Consecutive failed requests eject a server, a success in between resets the count
+        {
+            auto lease = set.acquire(mock_model, std::chrono::milliseconds(0), second.url());
+            REQUIRE( lease.getURL() == first.url() );
+            lease.reportFailure();
+            lease.reportSuccess();
+            lease.reportFailure();
+            CHECK( !backend_state(set, first.url()).mEjected );
+            lease.reportFailure();
+            CHECK( backend_state(set, first.url()).mEjected );
+        }
+
+        // Requests avoid the ejected server, also when it is the only one not excluded
+        auto lease = set.acquire(mock_model, std::chrono::milliseconds(0), second.url());
+        REQUIRE( lease.isValid() );
+        CHECK( lease.getURL() == second.url() );
+        lease.release();
+
+        // The server is readmitted when a health check succeeds after the ejection time
+        REQUIRE( update_until(service, [&] { return !backend_state(set, first.url()).mEjected; }) );
+
+        // A server that stops answering is ejected by the health check and readmitted once it is back
+        second.stop();
+        REQUIRE( update_until(service, [&] { return backend_state(set, second.url()).mEjected; }) );
+        CHECK( set.getAvailableCount() == 1 );
+        CHECK( set.getAvailableURL() == first.url() );
+
+        ollama::mock_server restarted;
+        REQUIRE( restarted.start("127.0.0.1", second_port) );
+        REQUIRE( update_until(service, [&] { return !backend_state(set, restarted.url()).mEjected; }) );
+        CHECK( set.getAvailableCount() == 2 );
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Every Backend Must Have the Model") {
+
+        // The second server lacks the model, it can be pulled from its registry
+        ollama::mock_settings lacking;
+        lacking.models = { "tinyllama:latest" };
+        lacking.registry_models = { mock_model };
+        ollama::mock_server first, second(lacking);
+        REQUIRE( first.start() );
+        REQUIRE( second.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaBackendSet set(service);
+        set.mID = "Backends";
+        set.mServerURLs = { first.url(), second.url() };
+        nap::Device& set_device = set;
+        REQUIRE( set_device.start(error) );
+
+        // Without pulling the chat fails, also when the first server has the model
+        {
+            nap::OllamaChat chat(service);
+            chat.mBackends = &set;
+            chat.mModelSetting = mock_model;
+            nap::Device& device = chat;
+            REQUIRE( device.start(error) );
+            REQUIRE( update_until(service, [&] { return chat.getState() != nap::OllamaChat::EState::Connecting; }) );
+            CHECK( chat.getState() == nap::OllamaChat::EState::Failed );
+            CHECK( !chat.isModelAvailable() );
+            device.stop();
+        }
+
+        // Pulling only pulls to the server that lacks the model
+        {
+            nap::OllamaChat chat(service);
+            chat.mBackends = &set;
+            chat.mModelSetting = mock_model;
+            chat.mPullModel = true;
+            nap::Device& device = chat;
+            REQUIRE( device.start(error) );
+            REQUIRE( update_until(service, [&] { return chat.getState() == nap::OllamaChat::EState::Ready; }) );
+            CHECK( chat.isModelAvailable() );
+
+            Ollama client(second.url());
+            auto models = client.list_models();
+            CHECK( std::find(models.begin(), models.end(), mock_model) != models.end() );
+
+            prompt_result result;
+            send_prompt(chat, "Why is the sky blue?", result);
+            REQUIRE( update_until(service, [&] { return result.done; }) );
+            CHECK( result.error.empty() );
+            device.stop();
+        }
+
+        set_device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Scheduler Admission") {
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        configuration.mMaxActiveRequests = 1;
+        configuration.mMaxQueueDepth = 3;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+        auto& scheduler = service.getScheduler();
+        nap::OllamaChat chat(service);
+
+        std::string admit_error;
+        std::vector<std::string> shed;
+        auto on_shed = [&shed](const std::string& error) { shed.emplace_back(error); };
+        auto admit = [&](std::uint64_t id, nap::EOllamaPriority priority)
+        {
+            return scheduler.admit(chat, id, priority, on_shed, admit_error);
+        };
+
+        // A full queue sheds the most recent request of the lowest class below the new request, or rejects the new request
+        REQUIRE( admit(1, nap::EOllamaPriority::Normal) );
+        auto slot = scheduler.acquire(1);
+        REQUIRE( slot.isValid() );
+        REQUIRE( admit(2, nap::EOllamaPriority::Background) );
+        REQUIRE( admit(3, nap::EOllamaPriority::Background) );
+        REQUIRE( admit(4, nap::EOllamaPriority::Normal) );
+        CHECK( scheduler.getQueueDepth() == 3 );
+        REQUIRE( admit(5, nap::EOllamaPriority::Interactive) );
+        REQUIRE( shed.size() == 1 );
+        CHECK( scheduler.getShedCount(nap::EOllamaPriority::Background) == 1 );
+        CHECK( !scheduler.acquire(3).isValid() );
+        CHECK( !admit(6, nap::EOllamaPriority::Background) );
+        CHECK( admit_error == "Request rejected, the request queue is full" );
+        CHECK( scheduler.getRejectedCount(nap::EOllamaPriority::Background) == 1 );
+        CHECK( scheduler.getQueueDepth() == 3 );
+
+        // A free slot goes to the waiting request of the highest class, first in first out within a class
+        std::mutex mutex;
+        std::vector<std::uint64_t> order;
+        std::vector<std::thread> waiting;
+        for (std::uint64_t id : { 2, 4, 5 })
+        {
+            waiting.emplace_back([&, id]
+            {
+                auto request_slot = scheduler.acquire(id);
+                std::lock_guard<std::mutex> lock(mutex);
+                order.emplace_back(id);
+            });
+        }
+
+        // Work of the started request only takes a free slot that no waiting request of its class needs
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        CHECK( !scheduler.tryAcquire(nap::EOllamaPriority::Normal).isValid() );
+        slot.release();
+        for (auto& thread : waiting)
+            thread.join();
+        CHECK( order == std::vector<std::uint64_t>({ 5, 4, 2 }) );
+        CHECK( scheduler.getActiveCount() == 0 );
+        {
+            auto extra = scheduler.tryAcquire(nap::EOllamaPriority::Normal);
+            CHECK( extra.isValid() );
+            CHECK( !scheduler.tryAcquire(nap::EOllamaPriority::Normal).isValid() );
+        }
+
+        // Cancel removes the queued requests of a chat, failing them with the error
+        REQUIRE( admit(7, nap::EOllamaPriority::Normal) );
+        shed.clear();
+        scheduler.cancel(chat, "Chat stopped");
+        CHECK( scheduler.getQueueDepth() == 0 );
+        CHECK( shed == std::vector<std::string>({ "Chat stopped" }) );
+        CHECK( !scheduler.acquire(7).isValid() );
+        service.shutdown();
+
+        // Background requests are rejected while the smoothed queue wait exceeds the target
+        configuration.mMaxQueueDepth = 0;
+        configuration.mTargetQueueWait = 0.05f;
+        nap::OllamaService overloaded_service(&configuration);
+        REQUIRE( overloaded_service.init(error) );
+        auto& overloaded = overloaded_service.getScheduler();
+        nap::OllamaChat overloaded_chat(overloaded_service);
+        REQUIRE( overloaded.admit(overloaded_chat, 1, nap::EOllamaPriority::Normal, on_shed, admit_error) );
+        auto held = overloaded.acquire(1);
+        REQUIRE( overloaded.admit(overloaded_chat, 2, nap::EOllamaPriority::Normal, on_shed, admit_error) );
+        std::thread late([&overloaded] { overloaded.acquire(2); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(400));
+        held.release();
+        late.join();
+        CHECK( overloaded.getQueueWait(nap::EOllamaPriority::Normal).getCount() == 2 );
+
+        REQUIRE( overloaded.admit(overloaded_chat, 3, nap::EOllamaPriority::Normal, on_shed, admit_error) );
+        CHECK( overloaded.isOverloaded() );
+        CHECK( !overloaded.admit(overloaded_chat, 4, nap::EOllamaPriority::Background, on_shed, admit_error) );
+        CHECK( admit_error == "Request rejected, the Ollama service is overloaded" );
+        CHECK( overloaded.admit(overloaded_chat, 5, nap::EOllamaPriority::Interactive, on_shed, admit_error) );
+        CHECK( overloaded.getRejectedCount(nap::EOllamaPriority::Background) == 1 );
+        overloaded.cancel(overloaded_chat, "Chat stopped");
+        overloaded_service.shutdown();
+    }
+
+    TEST_CASE("Scheduler Serves Idle Sessions") {
+
+        ollama::mock_settings slow;
+        slow.first_token_delay_ms = 1500;
+        ollama::mock_settings fast;
+        fast.num_tokens = 3;
+        ollama::mock_server server(slow);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        chat.mMaxConcurrentSessions = 2;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        auto first = chat.createSession();
+        auto second = chat.createSession();
+
+        int completed_first = 0, completed_second = 0, errors = 0;
+        auto on_token = [](const std::string&) { };
+        auto on_error = [&errors](const std::string&) { errors++; };
+
+        // The first session serves a slow request, its next request is queued behind it
+        chat.chat("slow", on_token, [&] { completed_first++; }, on_error, { first });
+        REQUIRE( update_until(service, [&] { return server.generation_count() == 1; }) );
+        server.set_settings(fast);
+        chat.chat("queued", on_token, [&] { completed_first++; }, on_error, { first });
+
+        // The requests of the second session don't wait for the queued request of the busy session
+        chat.chat("one", on_token, [&] { completed_second++; }, on_error, { second });
+        chat.chat("two", on_token, [&] { completed_second++; }, on_error, { second });
+        REQUIRE( update_until(service, [&] { return completed_second == 2; }) );
+        CHECK( completed_first == 0 );
+
+        REQUIRE( update_until(service, [&] { return completed_first == 2; }) );
+        CHECK( errors == 0 );
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Hedged Requests Overtake a Slow Backend") {
+
+        // The slow server has the model loaded, so the backend set routes the requests to it
+        ollama::mock_settings slow_settings;
+        slow_settings.simulate_residency = true;
+        slow_settings.num_tokens = 3;
+        ollama::mock_settings fast_settings = slow_settings;
+        ollama::mock_server slow(slow_settings), fast(fast_settings);
+        REQUIRE( slow.start() );
+        REQUIRE( fast.start() );
+        Ollama client(slow.url());
+        REQUIRE( client.load_model(mock_model, "1h") );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        configuration.mHedgeBudget = 0.1f;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaBackendSet set(service);
+        set.mID = "Backends";
+        set.mServerURLs = { slow.url(), fast.url() };
+        set.mHealthCheckInterval = 600.0f;
+        nap::Device& set_device = set;
+        REQUIRE( set_device.start(error) );
+        REQUIRE( update_until(service, [&] { return !backend_state(set, slow.url()).mLoadedModels.empty(); }) );
+
+        nap::OllamaChat chat(service);
+        chat.mBackends = &set;
+        chat.mModelSetting = mock_model;
+        chat.mHedgeRequests = true;
+        chat.mHedgePercentile = 50.0f;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+
+        // A first token is late after 5ms
+        for (int i = 0; i < 100; i++)
+            service.getMetrics().mTimeToFirstToken.record(5000);
+        slow_settings.first_token_delay_ms = 250;
+        slow.set_settings(slow_settings);
+
+        // Every request earns a tenth of a duplicate, so only the 11th of 15 slow requests is duplicated.
+        // The duplicate is started by the timer of the service, the main thread loop doesn't run while waiting for the responses.
+        std::uint64_t fastest = UINT64_MAX;
+        for (int i = 0; i < 15; i++)
+        {
+            auto result = chat.chatFuture("Why is the sky blue? " + std::to_string(i)).get();
+            CHECK( !result.mText.empty() );
+            fastest = std::min(fastest, result.mStats.mTimeToFirstToken);
+        }
+        CHECK( chat.getMetrics().mHedges == 1 );
+        CHECK( chat.getMetrics().mHedgeWins == 1 );
+        CHECK( fastest < 200000 );
+        CHECK( fast.generation_count() == 1 );
+
+        device.stop();
+        set_device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Stopping a Session Doesn't Stop Another") {
+
+        ollama::mock_settings settings;
+        settings.tokens_per_second = 100;
+        settings.num_tokens = 20;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        chat.mMaxConcurrentSessions = 2;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+        auto stopped = chat.createSession();
+        auto streaming = chat.createSession();
+
+        // One session is prompted and stopped over and over, its connections return to the pool and are taken by the other session
+        std::atomic_bool running = { true };
+        std::thread stopper([&]
+        {
+            while (running)
+            {
+                chat.stopResponse(stopped);
+                std::this_thread::yield();
+            }
+        });
+        std::thread prompter([&]
+        {
+            while (running)
+            {
+                try { chat.chatFuture("Stop", { stopped }).get(); }
+                catch (const std::exception&) { }
+            }
+        });
+
+        // The responses of the other session are never cut short
+        for (int i = 0; i < 8; i++)
+        {
+            auto result = chat.chatFuture("Complete", { streaming }).get();
+            CHECK( result.mStats.mEvalCount == 20 );
+        }
+        running = false;
+        stopper.join();
+        prompter.join();
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Stopping Fails the Queued Prompts") {
+
+        ollama::mock_settings settings;
+        settings.num_tokens = 6;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+        auto session = chat.createSession();
+
+        // Futures and joins complete with the responses
+        auto result = chat.chatFuture("Complete", { session }).get();
+        CHECK( result.mText == ollama::mock_server::generated_text(settings, settings.num_tokens) );
+
+        nap::OllamaJoin join;
+        chat.chatFuture("First", join, { session });
+        chat.chatFuture("Second", join, { session });
+        auto joined = join.whenAll().get();
+        REQUIRE( joined.size() == 2 );
+        for (auto& future : joined)
+            CHECK( future.get().mText == result.mText );
+
+        // The prompts queued behind a slow response fail when the chat stops, the callbacks are called without another update
+        settings.tokens_per_second = 10;
+        server.set_settings(settings);
+        auto running = chat.chatFuture("Running", { session });
+        REQUIRE( update_until(service, [&] { return server.generation_count() == 4; }) );
+        auto queued = chat.chatFuture("Queued", { session });
+        nap::OllamaJoin stopped_join;
+        chat.chatFuture("Joined", stopped_join, { session });
+        auto stopped_joined = stopped_join.whenAll();
+        prompt_result callback_result;
+        chat.chat("Callback",
+            [&callback_result](const std::string& token) { callback_result.text += token; },
+            [&callback_result] { callback_result.done = true; },
+            [&callback_result](const std::string& error) { callback_result.error = error; callback_result.done = true; },
+            { session });
+
+        device.stop();
+        CHECK( running.wait_for(std::chrono::seconds(0)) == std::future_status::ready );
+        CHECK_THROWS_WITH_AS( queued.get(), "Chat stopped", std::runtime_error );
+        REQUIRE( stopped_joined.wait_for(std::chrono::seconds(0)) == std::future_status::ready );
+        auto stopped_futures = stopped_joined.get();
+        REQUIRE( stopped_futures.size() == 1 );
+        CHECK_THROWS_WITH_AS( stopped_futures[0].get(), "Chat stopped", std::runtime_error );
+        CHECK( callback_result.done );
+        CHECK( callback_result.error == "Chat stopped" );
+        CHECK( callback_result.text.empty() );
+        CHECK( server.generation_count() == 4 );
+
+        service.shutdown();
+    }
+
+    TEST_CASE("Single Flight Replays to Late Followers") {
+
+        ollama::mock_settings settings;
+        settings.tokens_per_second = 20;
+        settings.num_tokens = 10;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat leader(service), follower(service);
+        for (auto* chat : { &leader, &follower })
+        {
+            chat->mServerURLSetting = server.url();
+            chat->mModelSetting = mock_model;
+            chat->mDeduplicateRequests = true;
+            REQUIRE( static_cast<nap::Device&>(*chat).start(error) );
+        }
+
+        // The follower joins after the leader received a few frames, it receives those first
+        prompt_result first, second;
+        send_prompt(leader, "Why is the sky blue?", first);
+        REQUIRE( update_until(service, [&] { return first.text.size() > 5; }) );
+        CHECK( service.getSingleFlight().getFlightCount() == 1 );
+        send_prompt(follower, "Why is the sky blue?", second);
+        REQUIRE( update_until(service, [&] { return first.done && second.done; }) );
+
+        CHECK( first.error.empty() );
+        CHECK( second.error.empty() );
+        CHECK( second.text == first.text );
+        CHECK( server.generation_count() == 1 );
+        CHECK( service.getSingleFlight().getFollowerCount() == 1 );
+        CHECK( service.getSingleFlight().getFlightCount() == 0 );
+
+        // The flight ended with its leader, an identical request leads a new flight
+        leader.clearContext();
+        prompt_result again;
+        send_prompt(leader, "Why is the sky blue?", again);
+        REQUIRE( update_until(service, [&] { return again.done; }) );
+        CHECK( again.text == first.text );
+        CHECK( server.generation_count() == 2 );
+
+        // Followers fail with the error of the leader
+        auto failing = settings;
+        failing.error_after_tokens = 4;
+        server.set_settings(failing);
+        leader.clearContext();
+        follower.clearContext();
+        prompt_result failed_leader, failed_follower;
+        send_prompt(leader, "Fail halfway", failed_leader);
+        REQUIRE( update_until(service, [&] { return !failed_leader.text.empty(); }) );
+        send_prompt(follower, "Fail halfway", failed_follower);
+        REQUIRE( update_until(service, [&] { return failed_leader.done && failed_follower.done; }) );
+        CHECK( !failed_leader.error.empty() );
+        CHECK( failed_follower.error == failed_leader.error );
+        CHECK( server.generation_count() == 3 );
+
+        static_cast<nap::Device&>(leader).stop();
+        static_cast<nap::Device&>(follower).stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Stop Condition Sequences") {
+
+        nap::OllamaStopCondition condition;
+        condition.addSequence("END");
+        condition.addSequence("\n\n");
+        condition.addSequence("NDX");
+        condition.addSequence("");
+        REQUIRE( condition.isEnabled() );
+
+        // Text that may start a sequence is held back until it is known not to
+        nap::OllamaStopCondition response = condition;
+        std::string output;
+        CHECK( !response.feed("Hello E", output) );
+        CHECK( output == "Hello " );
+        CHECK( !response.feed("N", output) );
+        CHECK( output == "" );
+        CHECK( !response.feed("x world EN", output) );
+        CHECK( output == "ENx world " );
+        CHECK( response.feed("D tail", output) );
+        CHECK( output == "" );
+        CHECK( response.getReason() == nap::OllamaStopCondition::EReason::Sequence );
+
+        // A sequence split over tokens, the held back text of a response that ends without a stop, the earliest of overlapping sequences
+        bool stopped;
+        CHECK( apply_stop_condition(condition, { "a\n", "\nb" }, stopped) == "a" );
+        CHECK( stopped );
+        CHECK( apply_stop_condition(condition, { "no stop E" }, stopped) == "no stop E" );
+        CHECK( !stopped );
+        CHECK( apply_stop_condition(condition, { "xNDX y" }, stopped) == "x" );
+        CHECK( stopped );
+
+        // The failure links of the automaton find sequences that start inside a partial match of another sequence
+        nap::OllamaStopCondition overlapping;
+        for (auto sequence : { "hers", "his", "she" })
+            overlapping.addSequence(sequence);
+        CHECK( apply_stop_condition(overlapping, { "us", "h", "ers" }, stopped) == "u" );
+        CHECK( stopped );
+        CHECK( apply_stop_condition(overlapping, { "ahishers" }, stopped) == "a" );
+        CHECK( apply_stop_condition(overlapping, { "shhe", "rs" }, stopped) == "sh" );
+
+        // A reset condition serves the next response, copies share the automaton but not the state
+        response.reset();
+        CHECK( response.getReason() == nap::OllamaStopCondition::EReason::None );
+        CHECK( apply_stop_condition(response, { "fine" }, stopped) == "fine" );
+        CHECK( response.getKey() == condition.getKey() );
+    }
+
+    TEST_CASE("Stop Condition Patterns") {
+
+        nap::utility::ErrorState error;
+        nap::OllamaStopCondition condition;
+        REQUIRE( condition.addPattern("(^|\\n)DONE\\n", error) );
+
+        // The response ends after the match, also when it is split over tokens
+        bool stopped;
+        CHECK( apply_stop_condition(condition, { "line1\nDO", "NE\nmore" }, stopped) == "line1\nDONE\n" );
+        CHECK( stopped );
+        CHECK( apply_stop_condition(condition, { "DONE but not on its own line" }, stopped) == "DONE but not on its own line" );
+        CHECK( !stopped );
+
+        nap::OllamaStopCondition invalid;
+        CHECK( !invalid.addPattern("(", error) );
+        CHECK( error.hasErrors() );
+        CHECK( !invalid.isEnabled() );
+    }
+
+    TEST_CASE("Stop Condition JSON") {
+
+        nap::OllamaStopCondition condition;
+        condition.setStopOnCompleteJSON(true);
+
+        // Text before the value is kept, brackets in strings and escaped quotes don't close the value
+        bool stopped;
+        CHECK( apply_stop_condition(condition, { "Sure: {\"a\": \"}\"", ", \"b\": [1,", "2]}", " trailing" }, stopped) == "Sure: {\"a\": \"}\", \"b\": [1,2]}" );
+        CHECK( stopped );
+        CHECK( apply_stop_condition(condition, { "[\"\\\"]\"", ", {}] after" }, stopped) == "[\"\\\"]\", {}]" );
+        CHECK( stopped );
+        CHECK( apply_stop_condition(condition, { "{\"open\": [" }, stopped) == "{\"open\": [" );
+        CHECK( !stopped );
+
+        // The first condition to fire ends the response
+        condition.addSequence("STOP");
+        nap::OllamaStopCondition response = condition;
+        std::string output;
+        CHECK( response.feed("{\"a\": 1} STOP", output) );
+        CHECK( response.getReason() == nap::OllamaStopCondition::EReason::JSON );
+    }
+
+    TEST_CASE("Think Splitter") {
+
+        // Tags split over tokens, whitespace before the answer is dropped
+        auto split = apply_think_splitter({ "<th", "ink>Let me", " think</th", "ink>\n\nThe answer", " is 4" });
+        CHECK( split.first == "Let me think" );
+        CHECK( split.second == "The answer is 4" );
+
+        // One character per token, a '<' that doesn't start a tag and a partial tag at the end of the response
+        std::vector<std::string> characters;
+        for (char c : std::string("<think>a<b</think>\nx </thin"))
+            characters.emplace_back(1, c);
+        split = apply_think_splitter(characters);
+        CHECK( split.first == "a<b" );
+        CHECK( split.second == "x </thin" );
+
+        // The opening tag is not recognized once the answer started, a response without reasoning is all answer
+        split = apply_think_splitter({ "Use the <th", "ink> tag" });
+        CHECK( split.first.empty() );
+        CHECK( split.second == "Use the <think> tag" );
+
+        // A possible tag is held back until the token that completes it
+        nap::OllamaThinkSplitter splitter;
+        std::string reasoning, answer;
+        splitter.feed("  <thi", reasoning, answer);
+        CHECK( reasoning.empty() );
+        CHECK( answer.empty() );
+        CHECK( !splitter.isReasoning() );
+        splitter.feed("nk>ok", reasoning, answer);
+        CHECK( reasoning == "ok" );
+        CHECK( splitter.isReasoning() );
+
+        splitter.reset();
+        CHECK( !splitter.isReasoning() );
+        splitter.feed("fine", reasoning, answer);
+        CHECK( answer == "fine" );
+    }
+
+    TEST_CASE("Reasoning Budget") {
+
+        ollama::mock_settings settings;
+        settings.response_text = "<think> a b c d e f g </think> The answer.";
+        settings.num_tokens = 11;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        chat.mSplitReasoning = true;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+        auto session = chat.createSession();
+
+        // Without budget the reasoning is split from the answer
+        auto result = chat.chatFuture("Why?", { session }).get();
+        CHECK( result.mReasoning.find("a b c d e f g") != std::string::npos );
+        CHECK( result.mText.find("The answer.") != std::string::npos );
+        CHECK( server.generation_count() == 1 );
+        device.stop();
+
+        // The reasoning is cut off after the budget of chunks and the prompt is sent again with the reasoning so far, without thinking.
+        // The mock ignores the option and reasons again, which is cut off again
+        chat.mReasoningChunkBudget = 3;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+        session = chat.createSession();
+        result = chat.chatFuture("Why?", { session }).get();
+        CHECK( result.mReasoning == " a b c d" );
+        CHECK( server.generation_count() == 3 );
+        auto reprompt = server.last_generation_request();
+        CHECK( reprompt["think"] == false );
+        CHECK( reprompt["prompt"].get<std::string>() == "Why?\n\nReasoning so far:\n" + result.mReasoning + "\n\nAnswer without reasoning further." );
+        device.stop();
+
+        // Or the response completes without answer
+        chat.mReasoningBudgetAction = nap::EOllamaReasoningBudgetAction::Cancel;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+        session = chat.createSession();
+        result = chat.chatFuture("Why?", { session }).get();
+        CHECK( result.mText.empty() );
+        CHECK( server.generation_count() == 4 );
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("JSON Parser Events") {
+
+        // Values close as soon as their last character arrives, outer values after the values they contain
+        nap::OllamaJSONParser parser;
+        auto events = apply_json_parser(parser, { "Here you go: {\"na", "me\": \"a}\\\"b\", \"items\": [1", "2, true], \"n\": null} and more" });
+        REQUIRE( parser.isComplete() );
+        CHECK( parser.getError().empty() );
+        REQUIRE( events.size() == 6 );
+        CHECK( events[0].mPath == "/name" );
+        CHECK( events[0].mKey == "name" );
+        CHECK( events[0].mValue == "\"a}\\\"b\"" );
+        CHECK( events[1].mPath == "/items/0" );
+        CHECK( events[1].mValue == "12" );
+        CHECK( events[1].mDepth == 2 );
+        CHECK( events[2].mPath == "/items/1" );
+        CHECK( events[3].mPath == "/items" );
+        CHECK( events[3].mValue == "[12, true]" );
+        CHECK( events[4].mValue == "null" );
+        CHECK( events[5].isRoot() );
+        CHECK( events[5].mValue == "{\"name\": \"a}\\\"b\", \"items\": [12, true], \"n\": null}" );
+
+        // Syntax errors fail the response, reset starts the next one
+        parser.reset();
+        apply_json_parser(parser, { "[1, 2 3]" });
+        CHECK( !parser.isComplete() );
+        CHECK( parser.getError() == "Expected ',' or ']' in the root value" );
+        parser.reset();
+        CHECK( parser.getError().empty() );
+        apply_json_parser(parser, { "{\"a\": tru", "x}" });
+        CHECK( parser.getError() == "Invalid literal at '/a'" );
+    }
+
+    TEST_CASE("JSON Parser Schema") {
+
+        nap::utility::ErrorState error;
+        nap::OllamaJSONSchema schema;
+        REQUIRE( schema.parse(R"({"type": "object", "properties": {"name": {"type": "string"}, "tags": {"type": "array", "items": {"enum": ["a", "b"]}}},
+            "required": ["name"], "additionalProperties": false})", error) );
+
+        // A valid response
+        nap::OllamaJSONParser parser(schema);
+        apply_json_parser(parser, { "{\"name\": \"x\", \"tags\": [\"a\", \"b\"]}" });
+        CHECK( parser.isComplete() );
+
+        // Violations fail the response as soon as they can be checked
+        auto violation = [&parser](const std::string& response)
+        {
+            parser.reset();
+            apply_json_parser(parser, { response });
+            return parser.isComplete() ? std::string() : parser.getError();
+        };
+        CHECK( violation("{\"name\": 1}") == "Value at '/name' is of type number, the schema expects string" );
+        CHECK( violation("{\"name\": \"x\", \"other\": 1}") == "Property 'other' of the root value is not in the schema" );
+        CHECK( violation("{\"tags\": []}") == "Required property 'name' of the root value is missing" );
+        CHECK( !violation("{\"name\": \"x\", \"tags\": [\"c\"]}").empty() );
+        CHECK( violation("[\"name\"]") == "Value at the root value is of type array, the schema expects object" );
+
+        nap::OllamaJSONSchema invalid;
+        CHECK( !invalid.parse("{\"type\": ", error) );
+    }
+
+    TEST_CASE("Tool Calls Don't Wait for the Worker Pool") {
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        configuration.mWorkerThreadCount = 1;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaToolRegistry registry;
+        nap::OllamaTool echo;
+        echo.mName = "echo";
+        echo.mFunction = [](const std::string& arguments) { return arguments; };
+        echo.mTimeout = std::chrono::milliseconds(500);
+        REQUIRE( registry.addTool(echo, error) );
+
+        nap::OllamaTool hang = echo;
+        hang.mName = "hang";
+        hang.mFunction = [](const std::string&) { std::this_thread::sleep_for(std::chrono::milliseconds(300)); return std::string("late"); };
+        hang.mTimeout = std::chrono::milliseconds(100);
+        REQUIRE( registry.addTool(hang, error) );
+
+        // A long task, such as a model pull, occupies the only thread of the worker pool
+        std::promise<void> release;
+        auto released = release.get_future().share();
+        service.enqueueTask([released] { released.wait(); });
+
+        auto results = registry.dispatch({ { "echo", "{\"a\":1}" }, { "hang", "{}" }, { "missing", "{}" } }, service);
+        release.set_value();
+        REQUIRE( results.size() == 3 );
+        CHECK( results[0].mSucceeded );
+        CHECK( results[0].mContent == "{\"a\":1}" );
+        CHECK( !results[1].mSucceeded );
+        CHECK( results[1].mContent == "Error: tool 'hang' timed out after 100 ms" );
+        CHECK( !results[2].mSucceeded );
+        CHECK( results[2].mContent == "Error: unknown tool 'missing'" );
+
+        CHECK( registry.findMetrics("echo")->mCalls == 1 );
+        CHECK( registry.findMetrics("hang")->mTimeouts == 1 );
+        service.shutdown();
+    }
+
+    TEST_CASE("Fan-Out Branches Share the Worker Pool") {
+
+        ollama::mock_settings slow;
+        slow.first_token_delay_ms = 800;
+        slow.num_tokens = 3;
+        ollama::mock_settings fast;
+        fast.num_tokens = 3;
+        ollama::mock_server slow_server(slow);
+        ollama::mock_server fast_server(fast);
+        REQUIRE( slow_server.start() );
+        REQUIRE( fast_server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        configuration.mWorkerThreadCount = 1;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = fast_server.url();
+        chat.mModelSetting = mock_model;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        auto session = chat.createSession();
+
+        std::vector<nap::OllamaFanOutBranch> branches = { { "", slow_server.url() }, { "", fast_server.url() } };
+        auto fan_out = [&](nap::OllamaFanOutResult& result)
+        {
+            bool done = false;
+            chat.fanOut("race", { branches }, [](int, const std::string&) { },
+                        [&](const nap::OllamaFanOutResult& fanOutResult) { result = fanOutResult; done = true; },
+                        [&](const std::string&) { done = true; }, { session });
+            return update_until(service, [&done] { return done; });
+        };
+
+        // With a free pool the branches race, the fast branch wins
+        nap::OllamaFanOutResult result;
+        REQUIRE( fan_out(result) );
+        REQUIRE( result.mWinner == 1 );
+        CHECK( result.getWinner().mText.size() > 0 );
+        CHECK( result.mBranches[0].mCancelled );
+        CHECK( result.mFirstToken == 1 );
+
+        // The first branch to generate a token streams, every branch completes and the best scored branch wins
+        std::vector<int> streamed;
+        bool done = false;
+        nap::OllamaFanOut best = { branches, nap::EOllamaFanOutPolicy::FirstTokenBest,
+                                   [&](const nap::OllamaFanOutBranchResult& branch) { return branch.mBranch.mServerURL == slow_server.url() ? 1.0f : 0.0f; } };
+        chat.fanOut("race", best,
+                    [&streamed](int index, const std::string&) { streamed.emplace_back(index); },
+                    [&](const nap::OllamaFanOutResult& fanOutResult) { result = fanOutResult; done = true; },
+                    [&](const std::string&) { done = true; }, { session });
+        REQUIRE( update_until(service, [&done] { return done; }) );
+        REQUIRE( result.mWinner == 0 );
+        CHECK( result.mFirstToken == 1 );
+        CHECK( result.mBranches[0].mCompleted );
+        CHECK( result.mBranches[1].mCompleted );
+        CHECK( result.mBranches[0].mScore == 1.0f );
+        CHECK( streamed == std::vector<int>(fast.num_tokens, 1) );
+
+        // Stopping the prompt stops the branches in progress right away
+        std::string stop_error;
+        done = false;
+        chat.fanOut("race", { { branches[0], branches[0] } }, [](int, const std::string&) { },
+                    [&](const nap::OllamaFanOutResult&) { done = true; },
+                    [&](const std::string& error) { stop_error = error; done = true; }, { session });
+        REQUIRE( update_until(service, [&] { return slow_server.active_stream_count() == 2; }) );
+        auto stop_time = std::chrono::steady_clock::now();
+        chat.stopResponse(session);
+        REQUIRE( update_until(service, [&done] { return done; }) );
+        CHECK( std::chrono::steady_clock::now() - stop_time < std::chrono::milliseconds(400) );
+        CHECK( stop_error == "Response stopped" );
+
+        // A long task occupies the pool: the worker of the chat sends the branches itself, the branch it didn't reach is not sent
+        std::promise<void> release;
+        auto released = release.get_future().share();
+        service.enqueueTask([released] { released.wait(); });
+        auto fast_generations = fast_server.generation_count();
+        REQUIRE( fan_out(result) );
+        release.set_value();
+        REQUIRE( result.mWinner == 0 );
+        CHECK( result.mBranches[1].mCancelled );
+        CHECK( fast_server.generation_count() == fast_generations );
+        device.stop();
+        service.shutdown();
+
+        // A branch on the pool needs a slot of its own: with one slot the worker of the chat sends the branches one after the other
+        configuration.mWorkerThreadCount = 2;
+        configuration.mMaxActiveRequests = 1;
+        nap::OllamaService limited_service(&configuration);
+        REQUIRE( limited_service.init(error) );
+        nap::OllamaChat limited_chat(limited_service);
+        limited_chat.mServerURLSetting = fast_server.url();
+        limited_chat.mModelSetting = mock_model;
+        nap::Device& limited_device = limited_chat;
+        REQUIRE( limited_device.start(error) );
+
+        done = false;
+        fast_generations = fast_server.generation_count();
+        limited_chat.fanOut("race", { branches }, [](int, const std::string&) { },
+                            [&](const nap::OllamaFanOutResult& fanOutResult) { result = fanOutResult; done = true; },
+                            [&](const std::string&) { done = true; });
+        int max_active = 0;
+        REQUIRE( update_until(limited_service, [&] { max_active = std::max(max_active, limited_service.getScheduler().getActiveCount()); return done; }) );
+        CHECK( max_active == 1 );
+        REQUIRE( result.mWinner == 0 );
+        CHECK( fast_server.generation_count() == fast_generations );
+
+        limited_device.stop();
+        limited_service.shutdown();
+    }
+
+    TEST_CASE("Cascade Check") {
+
+        nap::utility::ErrorState error;
+        nap::OllamaCascadeCheck check;
+        CHECK( !check.isEnabled() );
+        CHECK( apply_cascade_check(check, { "anything" }) );
+
+        // Length fails as soon as the response grows too long, or when it completes too short
+        check.setMinLength(5);
+        check.setMaxLength(12);
+        CHECK( apply_cascade_check(check, { "just ", "right" }) );
+        CHECK( !apply_cascade_check(check, { "far ", "too ", "long", " and more" }) );
+        CHECK( check.getReason() == nap::OllamaCascadeCheck::EReason::Length );
+        CHECK( check.getFailure() == "response longer than 12 characters" );
+        CHECK( !apply_cascade_check(check, { "shy" }) );
+        CHECK( check.getFailure() == "response shorter than 5 characters" );
+
+        // Refusal patterns match case insensitive, also when split over tokens, and fail before the response completes
+        nap::OllamaCascadeCheck refusal;
+        REQUIRE( refusal.addRefusalPattern("I can'?t help", error) );
+        refusal.reset();
+        CHECK( refusal.feed("Sorry, i CAN") );
+        CHECK( !refusal.feed("T HELP with that") );
+        CHECK( refusal.getReason() == nap::OllamaCascadeCheck::EReason::Refusal );
+        CHECK( refusal.getFailure() == "refusal pattern 'I can'?t help' matched" );
+        CHECK( !refusal.feed("more") );
+        CHECK( apply_cascade_check(refusal, { "Here is how I can help" }) );
+        CHECK( !refusal.addRefusalPattern("[", error) );
+
+        // The last confidence rating counts, percentages are read as fractions
+        nap::OllamaCascadeCheck confidence;
+        REQUIRE( confidence.setConfidenceField("confidence", 0.7f, error) );
+        CHECK( apply_cascade_check(confidence, { "Paris. **Confi", "dence:** 85%" }) );
+        CHECK( confidence.getConfidence() == doctest::Approx(0.85f) );
+        CHECK( !apply_cascade_check(confidence, { "{\"answer\": 1, \"confidence\": 0.9}, actually confidence = 0.5" }) );
+        CHECK( confidence.getReason() == nap::OllamaCascadeCheck::EReason::Confidence );
+        CHECK( confidence.getFailure() == "confidence 0.50 below 0.70" );
+        CHECK( !apply_cascade_check(confidence, { "No rating" }) );
+        CHECK( confidence.getFailure() == "response has no confidence" );
+        CHECK( !confidence.setConfidenceField("confidence", 1.5f, error) );
+
+        // The predicate sees the response so far and the complete response
+        nap::OllamaCascadeCheck predicate;
+        predicate.setPredicate([](const std::string& text, bool complete) { return complete ? text.back() == '.' : text.find("TODO") == std::string::npos; });
+        CHECK( predicate.isEnabled() );
+        CHECK( apply_cascade_check(predicate, { "Done", "." }) );
+        CHECK( !apply_cascade_check(predicate, { "Done" }) );
+        CHECK( !apply_cascade_check(predicate, { "TO", "DO." }) );
+        CHECK( predicate.getReason() == nap::OllamaCascadeCheck::EReason::Predicate );
+    }
+
+    TEST_CASE("Cascade Escalates to the Next Model") {
+
+        ollama::mock_settings settings;
+        settings.models = { "tiny:1b", mock_model };
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+
+        // The response of the small model is too long, the same request is sent to the model of the chat
+        nap::OllamaCascadeCheck check;
+        check.setMaxLength(5);
+        nap::OllamaCascadeResult result;
+        std::vector<std::string> escalations;
+        bool done = false;
+        chat.cascade("Why?", { { "tiny:1b", "" }, check }, [](const std::string&) { },
+                     [&escalations](const std::string& reason) { escalations.emplace_back(reason); },
+                     [&](const nap::OllamaCascadeResult& cascadeResult) { result = cascadeResult; done = true; },
+                     [&](const std::string&) { done = true; });
+        REQUIRE( update_until(service, [&done] { return done; }) );
+        CHECK( result.mModel == mock_model );
+        CHECK( result.mStage == 1 );
+        CHECK( result.mText == ollama::mock_server::generated_text(settings, settings.num_tokens) );
+        REQUIRE( escalations.size() == 1 );
+        CHECK( escalations[0] == "tiny:1b: response longer than 5 characters" );
+        CHECK( server.generation_count() == 2 );
+
+        // The body serialized for the first model is sent with the model of the stage
+        auto request = server.last_generation_request();
+        CHECK( request["model"] == mock_model );
+        CHECK( request["prompt"] == "Why?" );
+        CHECK( request["stream"] == true );
+        CHECK( request.contains("keep_alive") );
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Latency Histogram") {
+
+        // Values below 64us have their own bucket, above that a bucket spans 1/32 of its power of two.
+        // A percentile reports the highest value of its bucket, capped by the largest recorded value.
+        auto first_percentile = [](std::initializer_list<std::uint64_t> values)
+        {
+            nap::LatencyHistogram histogram;
+            for (auto value : values)
+                histogram.record(value);
+            return histogram.getPercentile(1.0);
+        };
+        CHECK( first_percentile({ 31, 32 }) == 31 );
+        CHECK( first_percentile({ 63, 64 }) == 63 );
+        CHECK( first_percentile({ 64, 65 }) == 65 );
+        CHECK( first_percentile({ 65, 66 }) == 65 );
+        CHECK( first_percentile({ 1024, 1050, 2000 }) == 1055 );
+        CHECK( first_percentile({ 1056, 1090, 2000 }) == 1087 );
+
+        // Percentiles are within 1/32 of the exact value
+        nap::LatencyHistogram histogram;
+        for (std::uint64_t value = 1; value <= 100000; value++)
+            histogram.record(value);
+        for (double percentile : { 10.0, 50.0, 90.0, 99.0, 99.9 })
+        {
+            auto exact = static_cast<double>(percentile * 1000.0);
+            auto reported = static_cast<double>(histogram.getPercentile(percentile));
+            CHECK( reported >= exact );
+            CHECK( reported - exact <= exact / 32.0 );
+        }
+        CHECK( histogram.getPercentile(100.0) == 100000 );
+        CHECK( histogram.getMean() == doctest::Approx(50000.5) );
+
+        // Concurrent records are all counted
+        nap::LatencyHistogram shared;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; t++)
+            threads.emplace_back([&shared, t]
+            {
+                for (std::uint64_t value = 1; value <= 10000; value++)
+                    shared.record(value * (t + 1));
+            });
+        for (auto& thread : threads)
+            thread.join();
+        auto summary = shared.getSummary();
+        CHECK( summary.mCount == 80000 );
+        CHECK( summary.mMin == 1 );
+        CHECK( summary.mMax == 80000 );
+        CHECK( summary.mMean == doctest::Approx(4.5 * 5000.5) );
+
+        // Requests without a first frame or token don't record a time to first byte or token
+        nap::OllamaMetrics metrics;
+        nap::OllamaRequestStats stats;
+        stats.mEnqueueToSend = 10;
+        metrics.recordRequest(stats);
+        CHECK( metrics.mEnqueueToSend.getCount() == 1 );
+        CHECK( metrics.mTimeToFirstByte.getCount() == 0 );
+        CHECK( metrics.mTimeToFirstToken.getCount() == 0 );
+        stats.mTimeToFirstByte = 20;
+        stats.mTimeToFirstToken = 30;
+        metrics.recordRequest(stats);
+        CHECK( metrics.mTimeToFirstByte.getPercentile(50.0) == 20 );
+        CHECK( metrics.mTimeToFirstToken.getPercentile(50.0) == 30 );
+    }
+
+    TEST_CASE("Trace Export") {
+
+        // A request that starts on one thread and continues on another, linked by a flow.
+        // The threads stay alive until the trace is exported, a new thread reuses the buffer of an exited thread.
+        nap::OllamaTrace::clear();
+        auto flow = nap::OllamaTrace::createFlowID();
+        std::promise<void> enqueued, completed, exported;
+        std::shared_future<void> exported_future = exported.get_future().share();
+        std::thread main_thread([&]
+        {
+            nap::OllamaTrace::setThreadName("trace \"main\"");
+            {
+                nap::OllamaTrace::Scope scope("enqueue", 1);
+                nap::OllamaTrace::instant("admitted", 1);
+                nap::OllamaTrace::flowStart("request", flow);
+            }
+            enqueued.set_value();
+            exported_future.wait();
+        });
+        std::thread worker_thread([&]
+        {
+            enqueued.get_future().wait();
+            nap::OllamaTrace::setThreadName("trace worker");
+            {
+                nap::OllamaTrace::Scope scope("run", 1);
+                nap::OllamaTrace::flowEnd("request", flow);
+                nap::OllamaTrace::Scope nested("generate", 1);
+            }
+            completed.set_value();
+            exported_future.wait();
+        });
+        completed.get_future().wait();
+        auto trace = nlohmann::json::parse(nap::OllamaTrace::exportChromeTrace());
+        exported.set_value();
+        main_thread.join();
+        worker_thread.join();
+        REQUIRE( trace["traceEvents"].is_array() );
+
+        // Every begin has a matching end on the same thread, the flow starts and ends with the same id on two threads
+        std::map<int, std::string> thread_names;
+        std::map<int, std::vector<std::string>> open_scopes;
+        std::map<std::string, int> flow_threads;
+        int scopes = 0;
+        for (auto& event : trace["traceEvents"])
+        {
+            auto phase = event["ph"].get<std::string>();
+            int tid = event["tid"].get<int>();
+            if (phase == "M")
+                thread_names[tid] = event["args"]["name"].get<std::string>();
+            else if (phase == "B")
+                open_scopes[tid].emplace_back(event["name"].get<std::string>());
+            else if (phase == "E")
+            {
+                REQUIRE( !open_scopes[tid].empty() );
+                CHECK( open_scopes[tid].back() == event["name"].get<std::string>() );
+                open_scopes[tid].pop_back();
+                scopes++;
+            }
+            else if (phase == "s" || phase == "f")
+            {
+                CHECK( event["id"].get<std::uint64_t>() == flow );
+                flow_threads[phase] = tid;
+            }
+        }
+        CHECK( scopes == 3 );
+        for (auto& open : open_scopes)
+            CHECK( open.second.empty() );
+        REQUIRE( flow_threads.size() == 2 );
+        CHECK( flow_threads["s"] != flow_threads["f"] );
+        CHECK( thread_names[flow_threads["s"]] == "trace \"main\"" );
+        CHECK( thread_names[flow_threads["f"]] == "trace worker" );
+
+        // A full ring overwrites the oldest events of the thread
+        const std::uint64_t capacity = 1 << 14;
+        nap::OllamaTrace::clear();
+        std::thread wrap_thread([capacity]
+        {
+            for (std::uint64_t i = 0; i < capacity + 100; i++)
+                nap::OllamaTrace::instant("wrap", i);
+        });
+        wrap_thread.join();
+
+        trace = nlohmann::json::parse(nap::OllamaTrace::exportChromeTrace());
+        std::vector<std::uint64_t> ids;
+        for (auto& event : trace["traceEvents"])
+            if (event["ph"] == "i")
+                ids.emplace_back(event["args"]["request"].get<std::uint64_t>());
+        CHECK( ids.size() <= capacity );
+        CHECK( ids.size() + 1 >= capacity );
+        REQUIRE( !ids.empty() );
+        CHECK( ids.front() >= 100 );
+        CHECK( ids.back() == capacity + 99 );
+        CHECK( std::is_sorted(ids.begin(), ids.end()) );
+    }
+
+    TEST_CASE("Conversation Runs") {
+
+        using Tokens = std::vector<std::uint32_t>;
+        using Run = std::shared_ptr<const nap::OllamaContextRun>;
+
+        // A conversation that is not forked stays one run
+        Run conversation = nap::extendRuns<std::uint32_t>(nullptr, Tokens({ 1, 2, 3 }));
+        conversation = nap::extendRuns(conversation, Tokens({ 1, 2, 3, 4 }));
+        CHECK( conversation->mParent == nullptr );
+        CHECK( conversation->mItems == Tokens({ 1, 2, 3, 4 }) );
+        CHECK( nap::extendRuns(conversation, Tokens({ 1, 2, 3, 4 })) == conversation );
+
+        // Forks continue the shared run with runs of their own, the shared run doesn't change
+        Run fork_a = conversation;
+        Run fork_b = conversation;
+        std::weak_ptr<const nap::OllamaContextRun> shared = conversation;
+        conversation.reset();
+        fork_a = nap::extendRuns(fork_a, Tokens({ 1, 2, 3, 4, 5, 6 }));
+        fork_b = nap::extendRuns(fork_b, Tokens({ 1, 2, 3, 4, 7 }));
+        REQUIRE( !shared.expired() );
+        CHECK( fork_a->mParent == shared.lock() );
+        CHECK( fork_b->mParent == shared.lock() );
+        CHECK( fork_a->mItems == Tokens({ 5, 6 }) );
+        CHECK( fork_b->mItems == Tokens({ 7 }) );
+        CHECK( shared.lock()->mItems == Tokens({ 1, 2, 3, 4 }) );
+        CHECK( nap::flattenRuns(fork_a.get()) == Tokens({ 1, 2, 3, 4, 5, 6 }) );
+        CHECK( nap::flattenRuns(fork_b.get()) == Tokens({ 1, 2, 3, 4, 7 }) );
+
+        // Runs a fork owns are merged when it grows, the shared run is kept
+        fork_a = nap::extendRuns(fork_a, Tokens({ 1, 2, 3, 4, 5, 6, 8 }));
+        CHECK( fork_a->mParent == shared.lock() );
+        CHECK( fork_a->mItems == Tokens({ 5, 6, 8 }) );
+        std::vector<const nap::OllamaContextRun*> owned;
+        CHECK( nap::findSharedRun(fork_b, owned) == shared.lock() );
+        CHECK( owned == std::vector<const nap::OllamaContextRun*>({ fork_b.get() }) );
+
+        // A context the server shortened starts a new chain
+        Run diverged = fork_b;
+        diverged = nap::extendRuns(diverged, Tokens({ 9, 9 }));
+        CHECK( diverged->mParent == nullptr );
+        CHECK( diverged->mItems == Tokens({ 9, 9 }) );
+
+        // The shared run is released with the last fork
+        fork_b.reset();
+        CHECK( !shared.expired() );
+        fork_a.reset();
+        CHECK( shared.expired() );
+
+        // Compacted contexts round trip
+        Tokens tokens = { 0, 127, 128, 300, 0xffffffff };
+        auto bytes = nap::compactContext(tokens);
+        CHECK( bytes.size() == 1 + 1 + 2 + 2 + 5 );
+        CHECK( nap::expandContext(bytes) == tokens );
+    }
+
+    TEST_CASE("Forked Sessions Share Their Context") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+
+        auto session = chat.createSession();
+        chat.chatFuture("One", { session }).get();
+        auto one_memory = chat.getSessionMemory();
+        CHECK( one_memory > 0 );
+
+        // Both forks continue from the context of the session when it forked
+        auto fork = chat.forkSession(session);
+        CHECK( chat.getSessionMemory() == one_memory );
+        chat.chatFuture("Two", { session }).get();
+        auto session_context = server.last_generation_request()["context"];
+        chat.chatFuture("Three", { fork }).get();
+        auto fork_context = server.last_generation_request()["context"];
+        CHECK( !session_context.empty() );
+        CHECK( fork_context == session_context );
+
+        // The next prompts continue the context of their own fork
+        chat.chatFuture("Four", { fork }).get();
+        CHECK( server.last_generation_request()["context"].size() > fork_context.size() );
+
+        // The shared context is counted once and released with the last fork
+        auto two_memory = chat.getSessionMemory();
+        CHECK( two_memory > one_memory );
+        chat.destroySession(session);
+        CHECK( chat.getSessionMemory() > 0 );
+        chat.destroySession(fork);
+        CHECK( chat.getSessionMemory() == 0 );
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Snapshot Files") {
+
+        auto path = (std::filesystem::temp_directory_path() / "napollama_module_test.snapshot").string();
+        nap::OllamaSnapshot snapshot;
+        snapshot.mModel = mock_model;
+        snapshot.mDigest = "sha256:1234";
+        nap::OllamaSnapshot::Session session;
+        session.mID = 7;
+        session.mContext = { 0x01, 0xac, 0x02, 0x7f };
+        session.mMessages = { 0x91, 0x81, 0xa4, 'r', 'o', 'l', 'e', 0xa4, 'u', 's', 'e', 'r' };
+        snapshot.mSessions.emplace_back(session);
+        nap::OllamaSnapshot::Session empty;
+        empty.mID = 0;
+        snapshot.mSessions.emplace_back(empty);
+
+        // Round trip
+        nap::utility::ErrorState error;
+        REQUIRE( snapshot.write(path, error) );
+        CHECK( !std::filesystem::exists(path + ".tmp") );
+        nap::OllamaSnapshot restored;
+        REQUIRE( restored.read(path, error) );
+        CHECK( restored.mModel == snapshot.mModel );
+        CHECK( restored.mDigest == snapshot.mDigest );
+        REQUIRE( restored.mSessions.size() == 2 );
+        CHECK( restored.mSessions[0].mID == 7 );
+        CHECK( restored.mSessions[0].mContext == session.mContext );
+        CHECK( restored.mSessions[0].mMessages == session.mMessages );
+        CHECK( restored.mSessions[1].mContext.empty() );
+        CHECK( restored.mSessions[1].mMessages.empty() );
+
+        // Rewrites the file with the bytes of the snapshot changed, reads it and returns the error
+        std::vector<char> bytes;
+        {
+            std::ifstream file(path, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        auto read_error = [&path](const std::vector<char>& content)
+        {
+            {
+                std::ofstream file(path, std::ios::binary | std::ios::trunc);
+                file.write(content.data(), content.size());
+            }
+            nap::utility::ErrorState error;
+            nap::OllamaSnapshot snapshot;
+            return snapshot.read(path, error) ? std::string() : error.toString();
+        };
+
+        // A truncated file, a file of another version and a file that is not a snapshot are not read
+        for (std::size_t size : { bytes.size() - 1, bytes.size() - 5, std::size_t(14), std::size_t(10) })
+            CHECK( read_error(std::vector<char>(bytes.begin(), bytes.begin() + size)).find("is truncated") != std::string::npos );
+
+        auto foreign = bytes;
+        foreign[8] = static_cast<char>(nap::OllamaSnapshot::version + 1);
+        CHECK( read_error(foreign).find("is of version 2, expected version 1") != std::string::npos );
+
+        std::string text = "plain text, not a snapshot";
+        CHECK( read_error(std::vector<char>(text.begin(), text.end())).find("is not a snapshot") != std::string::npos );
+
+        std::filesystem::remove(path);
+    }
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    TEST_CASE("Coroutines Await Chats") {
+
+        ollama::mock_settings settings;
+        settings.num_tokens = 6;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+        auto session = chat.createSession();
+
+        // The coroutine suspends on the prompt and resumes on the main thread loop with the response
+        auto main_thread = std::this_thread::get_id();
+        std::vector<std::thread::id> resumed_on;
+        auto ask = [&](std::string message) -> nap::OllamaTask<std::string>
+        {
+            auto reply = co_await nap::awaitChat(chat, session, std::move(message));
+            resumed_on.emplace_back(std::this_thread::get_id());
+            co_return reply;
+        };
+
+        auto single = ask("Why is the sky blue?");
+        CHECK( resumed_on.empty() );
+        single.start();
+        CHECK_FALSE( single.isDone() );
+        REQUIRE( update_until(service, [&] { return single.isDone(); }) );
+        CHECK( single.getResult() == ollama::mock_server::generated_text(settings, settings.num_tokens) );
+        REQUIRE( resumed_on.size() == 1 );
+        CHECK( resumed_on[0] == main_thread );
+
+        // A task awaits other tasks in order
+        resumed_on.clear();
+        auto conversation = [&]() -> nap::OllamaTask<std::vector<std::string>>
+        {
+            std::vector<std::string> replies;
+            replies.emplace_back(co_await ask("First"));
+            replies.emplace_back(co_await ask("Second"));
+            co_return replies;
+        };
+        auto both = conversation();
+        both.start();
+        REQUIRE( update_until(service, [&] { return both.isDone(); }) );
+        auto replies = both.getResult();
+        REQUIRE( replies.size() == 2 );
+        CHECK( replies[0] == replies[1] );
+        CHECK( std::count(resumed_on.begin(), resumed_on.end(), main_thread) == 2 );
+
+        // The tokens of a stream are yielded as they arrive
+        auto stream = [&]() -> nap::OllamaTask<std::vector<std::string>>
+        {
+            std::vector<std::string> tokens;
+            auto generator = nap::streamChat(chat, session, "Stream");
+            while (auto token = co_await generator.next())
+                tokens.emplace_back(std::move(*token));
+            co_return tokens;
+        };
+        auto streamed = stream();
+        streamed.start();
+        REQUIRE( update_until(service, [&] { return streamed.isDone(); }) );
+        auto tokens = streamed.getResult();
+        std::string text;
+        for (const auto& token : tokens)
+            text += token;
+        CHECK( text == ollama::mock_server::generated_text(settings, settings.num_tokens) );
+        CHECK( std::count_if(tokens.begin(), tokens.end(), [](const std::string& token) { return !token.empty(); }) == static_cast<long>(settings.num_tokens) );
+
+        device.stop();
+        service.shutdown();
+    }
+
+    TEST_CASE("Coroutines Propagate Errors and Cancellation") {
+
+        ollama::mock_settings settings;
+        settings.num_tokens = 40;
+        settings.tokens_per_second = 40;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        nap::OllamaServiceConfiguration configuration;
+        configuration.mManageResidency = false;
+        nap::OllamaService service(&configuration);
+        nap::utility::ErrorState error;
+        REQUIRE( service.init(error) );
+
+        nap::OllamaChat chat(service);
+        chat.mServerURLSetting = server.url();
+        chat.mModelSetting = mock_model;
+        nap::Device& device = chat;
+        REQUIRE( device.start(error) );
+        REQUIRE( update_until(service, [&] { return chat.isReady(); }) );
+        auto session = chat.createSession();
+
+        auto ask = [&](std::string message, nap::OllamaCancellation cancellation) -> nap::OllamaTask<std::string>
+        {
+            co_return co_await nap::awaitChat(chat, session, std::move(message), nap::EOllamaPriority::Normal, cancellation);
+        };
+
+        // Cancelling stops the response and resumes the coroutine with an OllamaCancelledError
+        nap::OllamaCancellation cancellation;
+        auto cancelled = ask("Cancel", cancellation);
+        cancelled.start();
+        REQUIRE( update_until(service, [&] { return server.generation_count() == 1; }) );
+        CHECK_FALSE( cancelled.isDone() );
+        cancellation.cancel();
+        REQUIRE( update_until(service, [&] { return cancelled.isDone(); }) );
+        CHECK_THROWS_AS( cancelled.getResult(), nap::OllamaCancelledError );
+
+        // Requests awaited after cancellation fail right away, without a request to the server
+        auto late = ask("Late", cancellation);
+        late.start();
+        CHECK( late.isDone() );
+        CHECK_THROWS_AS( late.getResult(), nap::OllamaCancelledError );
+        CHECK( server.generation_count() == 1 );
+
+        // A failed prompt throws its error to the coroutine, which can catch it or pass it on to the awaiting coroutine
+        settings.tokens_per_second = 0;
+        settings.error_after_tokens = 2;
+        server.set_settings(settings);
+        std::string caught;
+        auto failing = [&]() -> nap::OllamaTask<>
+        {
+            try
+            {
+                co_await ask("Fail", {});
+            }
+            catch (const std::runtime_error& e)
+            {
+                caught = e.what();
+            }
+            co_await ask("Fail again", {});
+        };
+        auto failed = failing();
+        failed.start();
+        REQUIRE( update_until(service, [&] { return failed.isDone(); }) );
+        CHECK( caught.find("injected error") != std::string::npos );
+        CHECK_THROWS_AS( failed.getResult(), std::runtime_error );
+
+        device.stop();
+        service.shutdown();
+    }
+#endif // __cpp_impl_coroutine
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <concurrentqueue.h>
+#include <chrono>
+#include <condition_variable>
+
+namespace moodycamel
+{
+    template<typename T>
+    class BlockingConcurrentQueue : public ConcurrentQueue<T>
+    {
+    public:
+        void wait_dequeue(T& item)
+        {
+            std::unique_lock<std::mutex> lock(this->mMutex);
+            mAvailable.wait(lock, [this] { return !this->mItems.empty(); });
+            item = std::move(this->mItems.front());
+            this->mItems.pop_front();
+        }
+
+        template<typename Rep, typename Period>
+        bool wait_dequeue_timed(T& item, std::chrono::duration<Rep, Period> timeout)
+        {
+            std::unique_lock<std::mutex> lock(this->mMutex);
+            if (!mAvailable.wait_for(lock, timeout, [this] { return !this->mItems.empty(); }))
+                return false;
+            item = std::move(this->mItems.front());
+            this->mItems.pop_front();
+            return true;
+        }
+
+    private:
+        void onEnqueue() override { mAvailable.notify_one(); }
+
+        std::condition_variable mAvailable;
+    };
+}
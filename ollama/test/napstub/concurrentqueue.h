@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+namespace moodycamel
+{
+    // Locking stand-in with the interface of the lock-free queue
+    template<typename T>
+    class ConcurrentQueue
+    {
+    public:
+        virtual ~ConcurrentQueue() = default;
+
+        bool enqueue(const T& item)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mItems.push_back(item);
+            }
+            onEnqueue();
+            return true;
+        }
+
+        bool enqueue(T&& item)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mItems.push_back(std::move(item));
+            }
+            onEnqueue();
+            return true;
+        }
+
+        bool try_dequeue(T& item)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mItems.empty())
+                return false;
+            item = std::move(mItems.front());
+            mItems.pop_front();
+            return true;
+        }
+
+        std::size_t size_approx() const
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            return mItems.size();
+        }
+
+    protected:
+        virtual void onEnqueue() { }
+
+        mutable std::mutex mMutex;
+        std::deque<T> mItems;
+    };
+}
@@ -0,0 +1,12 @@
+#include <nap/logger.h>
+#include <iostream>
+
+namespace nap
+{
+    void Logger::fine(const std::string&) { }
+    void Logger::debug(const std::string&) { }
+    void Logger::info(const std::string&) { }
+    void Logger::warn(const std::string& message) { std::cerr << "[warn] " << message << "\n"; }
+    void Logger::error(const std::string& message) { std::cerr << "[error] " << message << "\n"; }
+    void Logger::fatal(const std::string& message) { std::cerr << "[fatal] " << message << "\n"; }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <nap/service.h>
+
+namespace nap
+{
+    class ResourceManager;
+
+    class Core
+    {
+    public:
+        template<typename T>
+        T* getService();
+
+        ResourceManager* getResourceManager();
+    };
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <nap/resource.h>
+
+namespace nap
+{
+    class NAPAPI Device : public Resource
+    {
+    public:
+        virtual bool start(utility::ErrorState&) { return true; }
+        virtual void stop() { }
+    };
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <utility/stringutils.h>
+#include <utility/dllexport.h>
+#include <string>
+
+namespace nap
+{
+    class NAPAPI Logger
+    {
+    public:
+        static void fine(const std::string& message);
+        static void debug(const std::string& message);
+        static void info(const std::string& message);
+        static void warn(const std::string& message);
+        static void error(const std::string& message);
+        static void fatal(const std::string& message);
+
+        template<typename... Args>
+        static void fine(const char* format, Args&&... args) { fine(utility::stringFormat(format, args...)); }
+
+        template<typename... Args>
+        static void debug(const char* format, Args&&... args) { debug(utility::stringFormat(format, args...)); }
+
+        template<typename... Args>
+        static void info(const char* format, Args&&... args) { info(utility::stringFormat(format, args...)); }
+
+        template<typename... Args>
+        static void warn(const char* format, Args&&... args) { warn(utility::stringFormat(format, args...)); }
+
+        template<typename... Args>
+        static void error(const char* format, Args&&... args) { error(utility::stringFormat(format, args...)); }
+
+        template<typename... Args>
+        static void fatal(const char* format, Args&&... args) { fatal(utility::stringFormat(format, args...)); }
+    };
+}
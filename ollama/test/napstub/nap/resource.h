@@ -0,0 +1,13 @@
+#pragma once
+
+#include <rtti/rtti.h>
+#include <utility/errorstate.h>
+
+namespace nap
+{
+    class NAPAPI Resource : public rtti::Object
+    {
+    public:
+        virtual bool init(utility::ErrorState&) { return true; }
+    };
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <nap/resourceptr.h>
+#include <string>
+
+namespace nap
+{
+    class ResourceManager
+    {
+    public:
+        template<typename T>
+        ResourcePtr<T> findObject(const std::string& id);
+    };
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <nap/resource.h>
+#include <cstddef>
+
+namespace nap
+{
+    template<typename T>
+    class ResourcePtr
+    {
+    public:
+        ResourcePtr() = default;
+        ResourcePtr(T* object) : mObject(object) { }
+
+        T* get() const { return mObject; }
+        T* operator->() const { return mObject; }
+        T& operator*() const { return *mObject; }
+        bool operator==(std::nullptr_t) const { return mObject == nullptr; }
+        bool operator!=(std::nullptr_t) const { return mObject != nullptr; }
+        explicit operator bool() const { return mObject != nullptr; }
+
+    private:
+        T* mObject = nullptr;
+    };
+
+    template<typename T>
+    using ObjectPtr = ResourcePtr<T>;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <nap/resource.h>
+#include <vector>
+
+namespace nap
+{
+    class Core;
+
+    class NAPAPI ServiceConfiguration : public Resource
+    {
+    public:
+        virtual rtti::TypeInfo getServiceType() const { return rtti::TypeInfo(); }
+    };
+
+    class NAPAPI Service
+    {
+    public:
+        Service(ServiceConfiguration* configuration) : mConfiguration(configuration) { }
+        virtual ~Service() = default;
+
+        virtual void getDependentServices(std::vector<rtti::TypeInfo>&) { }
+        virtual bool init(utility::ErrorState&) { return true; }
+        virtual void update(double) { }
+        virtual void shutdown() { }
+        virtual void registerObjectCreators(rtti::Factory&) { }
+
+        Core& getCore();
+
+        template<typename T>
+        T* getConfiguration() { return static_cast<T*>(mConfiguration); }
+
+    private:
+        ServiceConfiguration* mConfiguration = nullptr;
+    };
+}
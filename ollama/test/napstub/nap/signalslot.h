@@ -0,0 +1,39 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+namespace nap
+{
+    template<typename... Args>
+    class Slot
+    {
+    public:
+        Slot() = default;
+        Slot(const std::function<void(Args...)>& function) : mFunction(function) { }
+
+        template<typename T, typename F>
+        Slot(T* object, F function) : mFunction([object, function](Args... args) { (object->*function)(args...); }) { }
+
+        std::function<void(Args...)> mFunction;
+    };
+
+    template<typename... Args>
+    class Signal
+    {
+    public:
+        void trigger(Args... args)
+        {
+            for (auto& function : mFunctions)
+                function(args...);
+        }
+
+        void operator()(Args... args) { trigger(args...); }
+        void connect(const std::function<void(Args...)>& function) { mFunctions.push_back(function); }
+        void connect(Slot<Args...>& slot) { mFunctions.push_back(slot.mFunction); }
+        void disconnect(Slot<Args...>&) { }
+
+    private:
+        std::vector<std::function<void(Args...)>> mFunctions;
+    };
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <nap/napapi.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+// Registration compiles to an unused function that only takes the address of every property
+#define RTTI_ENABLE(...)
+#define NAP_RTTI_CAT_IMPL(a, b) a##b
+#define NAP_RTTI_CAT(a, b) NAP_RTTI_CAT_IMPL(a, b)
+#define RTTI_BEGIN_CLASS_NO_DEFAULT_CONSTRUCTOR(Type) namespace { [[maybe_unused]] void NAP_RTTI_CAT(rttiRegister, __LINE__)() { using RegisteredType = Type; (void)sizeof(RegisteredType);
+#define RTTI_BEGIN_CLASS(Type) RTTI_BEGIN_CLASS_NO_DEFAULT_CONSTRUCTOR(Type)
+#define RTTI_CONSTRUCTOR(...)
+#define RTTI_PROPERTY(Name, Member, Flags) { (void)Name; (void)Member; (void)Flags; }
+#define RTTI_FUNCTION(Name, Function) { (void)Name; (void)Function; }
+#define RTTI_END_CLASS } }
+#define RTTI_BEGIN_ENUM(Type) namespace { [[maybe_unused]] std::pair<int, const char*> NAP_RTTI_CAT(rttiEnum, __LINE__)[] = {
+#define RTTI_ENUM_VALUE(Value, Name) { static_cast<int>(Value), Name }
+#define RTTI_END_ENUM }; }
+#define RTTI_OF(Type) nap::rtti::TypeInfo()
+
+namespace nap
+{
+    namespace rtti
+    {
+        struct TypeInfo { };
+
+        enum class EPropertyMetaData : int
+        {
+            Default = 0,
+            Required = 1,
+            FileLink = 2,
+            Embedded = 4,
+            ReadOnly = 8
+        };
+
+        inline EPropertyMetaData operator|(EPropertyMetaData a, EPropertyMetaData b)
+        {
+            return static_cast<EPropertyMetaData>(static_cast<int>(a) | static_cast<int>(b));
+        }
+
+        class Object
+        {
+        public:
+            virtual ~Object() = default;
+            std::string mID;
+        };
+
+        class IObjectCreator
+        {
+        public:
+            virtual ~IObjectCreator() = default;
+        };
+
+        template<typename T, typename Service>
+        class ObjectCreator : public IObjectCreator
+        {
+        public:
+            ObjectCreator(Service& service) : mService(service) { }
+            Service& mService;
+        };
+
+        class Factory
+        {
+        public:
+            void addObjectCreator(std::unique_ptr<IObjectCreator>) { }
+        };
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <utility/stringutils.h>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    namespace utility
+    {
+        class ErrorState
+        {
+        public:
+            bool check(bool successCondition, const std::string& errorMessage)
+            {
+                if (!successCondition)
+                    mErrors.push_back(errorMessage);
+                return successCondition;
+            }
+
+            template<typename... Args>
+            bool check(bool successCondition, const char* format, Args&&... args)
+            {
+                if (!successCondition)
+                    mErrors.push_back(stringFormat(format, args...));
+                return successCondition;
+            }
+
+            template<typename... Args>
+            void fail(const char* format, Args&&... args)
+            {
+                mErrors.push_back(stringFormat(format, args...));
+            }
+
+            void fail(const std::string& errorMessage)
+            {
+                mErrors.push_back(errorMessage);
+            }
+
+            bool hasErrors() const
+            {
+                return !mErrors.empty();
+            }
+
+            std::string toString() const
+            {
+                std::string result;
+                for (const auto& error : mErrors)
+                    result += error + "\n";
+                return result;
+            }
+
+        private:
+            std::vector<std::string> mErrors;
+        };
+    }
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+#define NAP_SERVICE_MODULE(name, version, service)
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    namespace utility
+    {
+        template<typename... Args>
+        std::string stringFormat(const std::string& format, Args&&... args)
+        {
+            int size = std::snprintf(nullptr, 0, format.c_str(), args...);
+            if (size <= 0)
+                return std::string();
+            std::vector<char> buffer(size + 1);
+            std::snprintf(buffer.data(), buffer.size(), format.c_str(), args...);
+            return std::string(buffer.data(), size);
+        }
+
+        inline std::string stringFormat(const std::string& format)
+        {
+            return format;
+        }
+    }
+}
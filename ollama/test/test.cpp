@@ -2,6 +2,7 @@
 #include "doctest.h"
 
 #include "ollama.hpp"
+#include "mock_server.hpp"
 
 #include <algorithm>
 #include <atomic>
@@ -320,4 +321,420 @@ TEST_SUITE("Ollama Tests") {
         CHECK(ollama::blob_exists("sha256:29fdb92e57cf0827ded04ae6461b5931d01fa595843f55d36f5b275a52087dd2") == true);
     }    
 */
-}
\ No newline at end of file
+}
+
+// These tests run against the in-process mock server and don't require a running Ollama instance.
+// Run only these tests with: build/test --test-suite="Mock Server Tests"
+TEST_SUITE("Mock Server Tests") {
+
+    static std::string mock_model = "llama3:8b";
+
+    static std::string stream_generation(Ollama& client, const std::string& prompt, bool& done)
+    {
+        std::string streamed;
+        done = false;
+        std::function<void(const ollama::response&)> response_callback = [&](const ollama::response& response) {
+            streamed += response.as_simple_string();
+            if (response.as_json()["done"]==true) done = true;
+        };
+        client.generate(mock_model, prompt, response_callback);
+        return streamed;
+    }
+
+    TEST_CASE("Mock Server Status and Models") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        CHECK( client.is_running() );
+        CHECK( client.get_version() == "0.0.0-mock" );
+
+        std::vector<std::string> models = client.list_models();
+        CHECK( std::find(models.begin(), models.end(), mock_model) != models.end() );
+
+        std::vector<std::string> running_models = client.list_running_models();
+        CHECK( std::find(running_models.begin(), running_models.end(), mock_model) != running_models.end() );
+
+        CHECK( client.load_model(mock_model) );
+    }
+
+    TEST_CASE("Mock Server Restart on the Same Port") {
+
+        int port;
+        {
+            ollama::mock_server server;
+            REQUIRE( server.start() );
+            port = server.get_port();
+        }
+
+        // A stopped server is reported as not running, the client connects once the server is back
+        Ollama client("http://127.0.0.1:"+std::to_string(port));
+        client.setConnectTimeout(1);
+        CHECK( !client.is_running() );
+
+        ollama::mock_server server;
+        REQUIRE( server.start("127.0.0.1", port) );
+        CHECK( client.is_running() );
+    }
+
+    TEST_CASE("Mock Server Generation") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+        ollama::mock_settings settings = server.get_settings();
+
+        ollama::response context = client.generate(mock_model, "Why is the sky blue?");
+        CHECK( context.as_simple_string() == ollama::mock_server::generated_text(settings, settings.num_tokens) );
+        CHECK( context.as_json().contains("context") );
+
+        ollama::options options;
+        options["num_predict"] = 4;
+        ollama::response response = client.generate(mock_model, "Tell me more about this.", context, options);
+        CHECK( response.as_simple_string() == ollama::mock_server::generated_text(settings, 4) );
+        CHECK( response.as_json()["prompt_eval_count"].get<size_t>() > context.as_json()["context"].size() );
+    }
+
+    TEST_CASE("Mock Server Streaming Reassembly") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+        ollama::mock_settings settings = server.get_settings();
+        std::string expected = ollama::mock_server::generated_text(settings, settings.num_tokens);
+
+        // Frames split at arbitrary positions, one byte at a time, and several frames per chunk.
+        size_t chunk_sizes[] = {0, 1, 7, 64, 4096};
+        for (size_t chunk_size : chunk_sizes)
+        {
+            settings.chunk_size = chunk_size;
+            server.set_settings(settings);
+
+            bool done = false;
+            CHECK( stream_generation(client, "Why is the sky blue?", done) == expected );
+            CHECK( done );
+        }
+    }
+
+    TEST_CASE("Mock Server Streaming Chat") {
+
+        ollama::mock_settings settings;
+        settings.chunk_size = 13;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        std::string streamed;
+        bool done = false;
+        std::function<void(const ollama::response&)> response_callback = [&](const ollama::response& response) {
+            streamed += response.as_simple_string();
+            if (response.as_json()["done"]==true) done = true;
+        };
+
+        ollama::messages messages = { ollama::message("user", "What are nimbus clouds?") };
+        client.chat(mock_model, messages, response_callback);
+
+        CHECK( streamed == ollama::mock_server::generated_text(settings, settings.num_tokens) );
+        CHECK( done );
+
+        ollama::response response = client.chat(mock_model, messages);
+        CHECK( response.as_simple_string() == streamed );
+    }
+
+    TEST_CASE("Mock Server Tool Calls") {
+
+        ollama::mock_settings settings;
+        settings.tool_calls = nlohmann::json::parse(R"([{"function":{"name":"get_weather","arguments":{"city":"Paris"}}}])");
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        // A chat with tools answers with the tool calls instead of content
+        ollama::messages messages = { ollama::message("user", "What is the weather in Paris?") };
+        ollama::request request(mock_model, messages, nullptr, true);
+        request["tools"] = nlohmann::json::parse(R"([{"type":"function","function":{"name":"get_weather","parameters":{"type":"object"}}}])");
+
+        nlohmann::json tool_calls;
+        std::string streamed;
+        CHECK( client.chat_frames(request, [&](const std::string& frame) {
+            ollama::response response(frame, ollama::message_type::chat);
+            if (response.has_tool_calls()) tool_calls = response.get_tool_calls();
+            streamed += response.as_simple_string();
+            return true;
+        }) );
+        REQUIRE( tool_calls.size() == 1 );
+        CHECK( tool_calls[0]["function"]["name"] == "get_weather" );
+        CHECK( tool_calls[0]["function"]["arguments"]["city"] == "Paris" );
+        CHECK( streamed.empty() );
+
+        // The tool result is answered with content
+        messages.push_back(ollama::message::from_tool("get_weather", "Sunny"));
+        CHECK( messages.back()["role"] == "tool" );
+        ollama::request follow_up(mock_model, messages, nullptr, false);
+        follow_up["tools"] = request["tools"];
+        ollama::response response = client.chat(follow_up);
+        CHECK( !response.has_tool_calls() );
+        CHECK( response.as_simple_string() == ollama::mock_server::generated_text(settings, settings.num_tokens) );
+    }
+
+    TEST_CASE("Mock Server Raw Frames and Cancellation") {
+
+        ollama::mock_settings settings;
+        settings.chunk_size = 5;
+        settings.num_tokens = 100;
+        settings.tokens_per_second = 1000;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        // Every frame is delivered as a complete JSON string
+        size_t frames = 0;
+        ollama::request request(mock_model, "Why is the sky blue?");
+        CHECK( client.generate_frames(request, [&frames](const std::string& frame) { frames++; return nlohmann::json::parse(frame).is_object(); }) );
+        CHECK( frames == settings.num_tokens + 1 );
+
+        // A request serialized once can be sent several times
+        std::string body = request.dump();
+        for (int i = 0; i < 2; i++)
+        {
+            frames = 0;
+            CHECK( client.generate_frames(body, [&frames](const std::string&) { frames++; return true; }) );
+            CHECK( frames == settings.num_tokens + 1 );
+        }
+
+        // Returning false cancels the stream without throwing
+        frames = 0;
+        ollama::request chat_request(mock_model, ollama::message("user", "Why is the sky blue?"));
+        CHECK( !client.chat_frames(chat_request, [&frames](const std::string&) { return ++frames < 3; }) );
+        CHECK( frames == 3 );
+    }
+
+    TEST_CASE("Mock Server Embeddings") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        ollama::response first = client.generate_embeddings(mock_model, "Why is the sky blue?");
+        ollama::response second = client.generate_embeddings(mock_model, "Why is the sky blue?");
+
+        CHECK( first.as_json().contains("embeddings") );
+        CHECK( first.as_json()["embeddings"] == second.as_json()["embeddings"] );
+    }
+
+    TEST_CASE("Mock Server Token Rate") {
+
+        ollama::mock_settings settings;
+        settings.tokens_per_second = 200;
+        settings.first_token_delay_ms = 20;
+        settings.num_tokens = 10;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        auto start = std::chrono::steady_clock::now();
+        bool done = false;
+        stream_generation(client, "Why is the sky blue?", done);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        // 20ms prompt evaluation and 9 intervals of 5ms between tokens
+        CHECK( done );
+        CHECK( elapsed >= std::chrono::milliseconds(60) );
+    }
+
+    TEST_CASE("Mock Server Error Injection") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+        ollama::mock_settings settings = server.get_settings();
+
+        CHECK_THROWS_AS( client.generate("Non-existent-model", "Requesting this model will throw an error"), ollama::exception );
+
+        // Error status on the request
+        settings.error_status = 500;
+        server.set_settings(settings);
+        CHECK_THROWS_AS( client.generate(mock_model, "Why is the sky blue?"), ollama::exception );
+
+        // Error frame in the middle of a streamed chat
+        settings.error_status = 0;
+        settings.error_after_tokens = 3;
+        server.set_settings(settings);
+
+        std::function<void(const ollama::response&)> ignore_response = [](const ollama::response&) {};
+        ollama::messages messages = { ollama::message("user", "Why is the sky blue?") };
+        CHECK_THROWS_AS( client.chat(mock_model, messages, ignore_response), ollama::exception );
+
+        // Connection dropped in the middle of a stream
+        settings.error_after_tokens = -1;
+        settings.disconnect_after_tokens = 3;
+        server.set_settings(settings);
+
+        bool done = false;
+        CHECK_THROWS_AS( stream_generation(client, "Why is the sky blue?", done), ollama::exception );
+        CHECK( !done );
+        CHECK( server.cancelled_stream_count() == 1 );
+    }
+
+    TEST_CASE("Mock Server Asynchronous Logging") {
+
+        ollama::mock_server server;
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        // Requests and every streamed reply are handed to the sink on the writer thread
+        std::mutex mutex;
+        std::vector<std::pair<ollama::log_kind, std::string>> records;
+        ollama::logger().set_sink([&](ollama::log_kind kind, const std::string& text) { std::lock_guard<std::mutex> lock(mutex); records.push_back(std::make_pair(kind, text)); });
+        ollama::show_requests(true);
+        ollama::show_replies(true);
+
+        bool done = false;
+        stream_generation(client, "Why is the sky blue?", done);
+        ollama::logger().flush();
+
+        ollama::show_requests(false);
+        ollama::show_replies(false);
+        ollama::logger().set_sink(ollama::async_logger::sink());
+
+        REQUIRE( records.size() >= 2 );
+        CHECK( records.front().first == ollama::log_kind::request );
+        CHECK( records.front().second.find("Why is the sky blue?") != std::string::npos );
+        CHECK( records.back().first == ollama::log_kind::reply );
+
+        // Records that don't fit in the buffer are dropped, oversized records are truncated
+        ollama::async_logger small_logger(64, 16);
+        std::string truncated;
+        small_logger.set_sink([&truncated](ollama::log_kind, const std::string& text) { truncated = text; });
+        small_logger.log(ollama::log_kind::reply, std::string(100, 'x'));
+        small_logger.flush();
+        CHECK( truncated == std::string(16, 'x') );
+
+        ollama::async_logger tiny_logger(16, 64);
+        tiny_logger.log(ollama::log_kind::reply, std::string(32, 'x'));
+        CHECK( tiny_logger.dropped_count() == 1 );
+
+        // Log files are rotated when they exceed their maximum size
+        std::string path = "ollama_log_test.log";
+        for (std::string file : { path, path + ".1", path + ".2" }) std::remove(file.c_str());
+
+        ollama::async_logger file_logger;
+        REQUIRE( file_logger.set_file(path, 100, 3) );
+        for (int i = 0; i < 10; i++) file_logger.log(ollama::log_kind::request, std::string(40, 'a' + i));
+        file_logger.flush();
+
+        CHECK( std::ifstream(path).good() );
+        CHECK( std::ifstream(path + ".1").good() );
+        CHECK( std::ifstream(path + ".2").good() );
+        CHECK( !std::ifstream(path + ".3").good() );
+
+        std::string last_line;
+        std::ifstream latest(path);
+        for (std::string line; std::getline(latest, line); ) last_line = line;
+        CHECK( last_line == std::string(40, 'j') );
+
+        // A log file that is reopened counts the bytes it already holds towards its maximum size
+        for (std::string file : { path, path + ".1", path + ".2" }) std::remove(file.c_str());
+        std::ofstream(path) << std::string(80, 'x') << '\n';
+        {
+            ollama::async_logger reopened_logger;
+            REQUIRE( reopened_logger.set_file(path, 100, 3) );
+            reopened_logger.log(ollama::log_kind::request, std::string(40, 'y'));
+            reopened_logger.flush();
+        }
+        std::string previous;
+        std::getline(std::ifstream(path + ".1"), previous);
+        CHECK( previous == std::string(80, 'x') );
+        std::getline(std::ifstream(path), last_line);
+        CHECK( last_line == std::string(40, 'y') );
+
+        for (std::string file : { path, path + ".1", path + ".2" }) std::remove(file.c_str());
+    }
+
+    TEST_CASE("Mock Server Streaming Pull") {
+
+        ollama::mock_settings settings;
+        settings.pull_size = 1 << 20;
+        settings.pull_chunk = 1 << 17;
+        settings.pull_disconnect_after_frames = 3;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+
+        // The pull is resumed after every dropped connection and reports monotonic progress
+        std::vector<ollama::pull_progress> updates;
+        CHECK( client.pull_model_with_progress("tinyllama:latest", [&updates](const ollama::pull_progress& progress) { updates.push_back(progress); return true; }) );
+        REQUIRE( !updates.empty() );
+        CHECK( updates.back().status == "success" );
+        CHECK( updates.back().completed_bytes == settings.pull_size );
+        CHECK( updates.back().fraction() == 1.0 );
+        CHECK( updates.back().attempt == 2 );
+        for (size_t i = 1; i < updates.size(); i++) CHECK( updates[i].completed_bytes >= updates[i-1].completed_bytes );
+
+        // Resumed pulls don't download layer bytes twice, and the pulled model is available
+        CHECK( server.pull_request_count() == 3 );
+        CHECK( server.pulled_byte_count() == settings.pull_size );
+        std::vector<std::string> models = client.list_models();
+        CHECK( std::find(models.begin(), models.end(), "tinyllama:latest") != models.end() );
+
+        // Unknown models fail without retrying
+        CHECK_THROWS_AS( client.pull_model_with_progress("unknown:latest", [](const ollama::pull_progress&) { return true; }), ollama::exception );
+        CHECK( server.pull_request_count() == 4 );
+
+        // Returning false cancels the pull
+        settings = server.get_settings();
+        settings.registry_models.push_back("phi3:mini");
+        settings.pull_disconnect_after_frames = -1;
+        server.set_settings(settings);
+        CHECK( !client.pull_model_with_progress("phi3:mini", [](const ollama::pull_progress& progress) { return progress.completed_bytes == 0; }) );
+        CHECK( client.pull_model("phi3:mini") );
+    }
+
+    TEST_CASE("Mock Server Model Residency") {
+
+        ollama::mock_settings settings;
+        settings.models = {mock_model, "phi3:mini"};
+        settings.simulate_residency = true;
+        settings.load_delay_ms = 50;
+        settings.max_loaded_models = 1;
+        ollama::mock_server server(settings);
+        REQUIRE( server.start() );
+
+        Ollama client(server.url());
+        CHECK( client.list_running_models().empty() );
+
+        // Loading a model keeps it loaded for the keep_alive duration
+        CHECK( client.load_model(mock_model, "1h") );
+        CHECK( client.list_running_models() == std::vector<std::string>{mock_model} );
+        CHECK( server.load_count() == 1 );
+
+        // A request for a loaded model doesn't load it again
+        ollama::response response = client.generate(mock_model, "Why is the sky blue?");
+        CHECK( response.as_json()["load_duration"] == 0 );
+        CHECK( server.load_count() == 1 );
+
+        // Loading another model evicts the least recently used model
+        response = client.generate("phi3:mini", "Why is the sky blue?");
+        CHECK( response.as_json()["load_duration"].get<std::uint64_t>() >= 50000000 );
+        CHECK( client.list_running_models() == std::vector<std::string>{"phi3:mini"} );
+        CHECK( server.eviction_count() == 1 );
+
+        // The model is unloaded when its keep_alive expires
+        CHECK( client.load_model("phi3:mini", "100ms") );
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+        CHECK( client.list_running_models().empty() );
+        CHECK( server.eviction_count() == 2 );
+    }
+}
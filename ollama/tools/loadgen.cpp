@@ -0,0 +1,530 @@
+/*  Load generator for capacity planning against an Ollama server.
+
+    Replays a prompt corpus against a server and reports throughput, time to first token (TTFT) and tail latencies.
+
+    Two load models are supported:
+    - open loop (--mode open): requests arrive as a Poisson process at --rate requests per second, independent of how
+      fast the server answers. Latencies are measured from the scheduled arrival, so time spent waiting for a free
+      client slot is included and a saturated server is not hidden by the generator slowing down.
+    - closed loop (--mode closed): --concurrency clients each send their next request as soon as the previous one completed.
+
+    Passing --sweep runs one step per listed rate (open) or concurrency (closed) and detects the point where the server
+    saturates: open loop steps are saturated when the completed throughput falls behind the offered rate or the backlog
+    overflows, closed loop steps when adding clients no longer adds throughput. Steps with errors above 1% are saturated too.
+
+    --self-test runs a sweep against the in-process mock server with a known capacity and verifies the reported numbers.
+
+    Corpus files contain one prompt per line, or one JSON object per line with a "prompt" and optionally a "model" field.
+
+    Usage: build/loadgen [--url url] [--model name] [--corpus file] [--mode open|closed] [--rate requests/s]
+                         [--concurrency clients] [--sweep levels] [--duration seconds] [--warmup seconds]
+                         [--num-predict tokens] [--max-in-flight clients] [--seed value] [--out file.json] [--self-test]
+*/
+
+#include "ollama.hpp"
+#include "mock_server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+using load_clock = std::chrono::steady_clock;
+
+struct load_prompt
+{
+    std::string model;      // Empty uses the model of the settings
+    std::string prompt;
+};
+
+struct load_settings
+{
+    std::string url = "http://localhost:11434";
+    std::string model = "llama3:8b";
+    std::vector<load_prompt> corpus;
+    bool open_loop = false;
+    double rate = 1.0;                  // Offered requests per second in open loop mode
+    size_t concurrency = 1;             // Clients in closed loop mode
+    std::vector<double> sweep;          // Rates or concurrencies to step through, empty runs a single step
+    double duration = 10.0;             // Measured seconds per step
+    double warmup = 0.0;                // Seconds per step excluded from the results
+    int num_predict = 0;                // Tokens to generate per request, 0 leaves it to the server
+    size_t max_in_flight = 256;         // Concurrent requests in open loop mode, arrivals beyond this wait in the backlog
+    size_t max_backlog = 1000;          // Open loop steps stop issuing requests when this many arrivals are waiting
+    double min_scaling = 0.5;           // Closed loop steps that gain less than this fraction of linear scaling are saturated
+    double max_error_rate = 0.01;
+    unsigned seed = 42;
+};
+
+// Timings of a single request in seconds since the start of the step.
+struct request_sample
+{
+    double scheduled = 0;       // Arrival in open loop, send time in closed loop
+    double sent = 0;
+    double first_token = -1;
+    double completed = 0;
+    size_t tokens = 0;
+    bool ok = false;
+};
+
+struct distribution
+{
+    double p50 = 0, p90 = 0, p99 = 0, max = 0, mean = 0;
+};
+
+struct step_result
+{
+    double level = 0;           // Offered rate or concurrency
+    size_t completed = 0;
+    size_t errors = 0;
+    size_t unserved = 0;        // Open loop arrivals dropped because the backlog overflowed
+    double window = 0;          // Measured seconds
+    double throughput = 0;      // Completed requests per second
+    double token_throughput = 0;
+    distribution ttft;          // Seconds from arrival to the first token
+    distribution latency;       // Seconds from arrival to the last token
+    distribution queue_delay;   // Seconds from arrival until the request was sent
+    double tokens_per_second_per_request = 0;
+    bool saturated = false;
+    std::string reason;
+};
+
+static distribution summarize(std::vector<double> values)
+{
+    distribution result;
+    if (values.empty()) return result;
+
+    std::sort(values.begin(), values.end());
+    auto rank = [&](double percentile) { return values[std::min(values.size()-1, static_cast<size_t>(percentile / 100.0 * values.size()))]; };
+    result.p50 = rank(50); result.p90 = rank(90); result.p99 = rank(99);
+    result.max = values.back();
+    for (double value : values) result.mean += value;
+    result.mean /= values.size();
+    return result;
+}
+
+// Send a single streaming generation and record its timings relative to the start of the step.
+static void send_request(Ollama& client, const load_settings& settings, const load_prompt& prompt, load_clock::time_point start, request_sample& sample)
+{
+    auto now = [start] { return std::chrono::duration<double>(load_clock::now() - start).count(); };
+
+    ollama::options options;
+    if (settings.num_predict > 0) options["num_predict"] = settings.num_predict;
+    ollama::request request(prompt.model.empty() ? settings.model : prompt.model, prompt.prompt, settings.num_predict > 0 ? json(options) : json(nullptr), true);
+
+    sample.sent = now();
+    try
+    {
+        size_t frames = 0, eval_count = 0;
+        bool done = false;
+        client.generate_frames(request, [&](const std::string& frame) {
+            json response = json::parse(frame);
+            if (response.contains("error")) throw ollama::exception(response["error"].get<std::string>());
+            if (!response.value("response", std::string()).empty())
+            {
+                if (sample.first_token < 0) sample.first_token = now();
+                frames++;
+            }
+            if (response.value("done", false))
+            {
+                done = true;
+                eval_count = response.value("eval_count", size_t(0));
+            }
+            return true;
+        });
+        sample.tokens = eval_count > 0 ? eval_count : frames;
+        sample.ok = done;
+    }
+    catch (const std::exception&)
+    {
+        sample.ok = false;
+    }
+    sample.completed = now();
+}
+
+static step_result evaluate(const load_settings& settings, double level, const std::vector<request_sample>& samples, double end, size_t unserved)
+{
+    step_result result;
+    result.level = level;
+    result.unserved = unserved;
+    result.window = std::max(1e-9, end - settings.warmup);
+
+    std::vector<double> ttft, latency, queue_delay, rates;
+    size_t tokens = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        const request_sample& sample = samples[i];
+        if (sample.scheduled < settings.warmup) continue;
+        if (!sample.ok) { result.errors++; continue; }
+
+        result.completed++;
+        tokens += sample.tokens;
+        latency.push_back(sample.completed - sample.scheduled);
+        queue_delay.push_back(sample.sent - sample.scheduled);
+        if (sample.first_token >= 0)
+        {
+            ttft.push_back(sample.first_token - sample.scheduled);
+            if (sample.tokens > 1 && sample.completed > sample.first_token) rates.push_back((sample.tokens - 1) / (sample.completed - sample.first_token));
+        }
+    }
+
+    result.throughput = result.completed / result.window;
+    result.token_throughput = tokens / result.window;
+    result.ttft = summarize(ttft);
+    result.latency = summarize(latency);
+    result.queue_delay = summarize(queue_delay);
+    result.tokens_per_second_per_request = summarize(rates).mean;
+    return result;
+}
+
+// Closed loop: every client sends its next request as soon as the previous one completed.
+static step_result run_closed_loop(const load_settings& settings, size_t concurrency)
+{
+    auto start = load_clock::now();
+    auto stop = start + std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(settings.warmup + settings.duration));
+    std::atomic<size_t> next_prompt(0);
+
+    std::vector<std::vector<request_sample>> client_samples(concurrency);
+    std::vector<std::thread> clients;
+    for (size_t c = 0; c < concurrency; c++)
+    {
+        clients.emplace_back([&, c] {
+            Ollama client(settings.url);
+            while (load_clock::now() < stop)
+            {
+                request_sample sample;
+                sample.scheduled = std::chrono::duration<double>(load_clock::now() - start).count();
+                send_request(client, settings, settings.corpus[next_prompt++ % settings.corpus.size()], start, sample);
+                client_samples[c].push_back(sample);
+            }
+        });
+    }
+    for (auto& client : clients) client.join();
+
+    // Requests still running at the end of the window complete after it, measure until the last one finished
+    std::vector<request_sample> samples;
+    double end = settings.warmup + settings.duration;
+    for (auto& list : client_samples)
+        for (auto& sample : list) { samples.push_back(sample); end = std::max(end, sample.completed); }
+
+    return evaluate(settings, static_cast<double>(concurrency), samples, end, 0);
+}
+
+// Open loop: requests arrive as a Poisson process and are served by up to max_in_flight clients.
+static step_result run_open_loop(const load_settings& settings, double rate)
+{
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<double> backlog;
+    bool arrivals_done = false;
+    size_t unserved = 0;
+
+    std::vector<request_sample> samples;
+    std::mutex samples_mutex;
+
+    auto start = load_clock::now();
+    double end_time = settings.warmup + settings.duration;
+    size_t client_count = std::max<size_t>(1, std::min(settings.max_in_flight, static_cast<size_t>(std::ceil(rate * end_time))));
+
+    std::vector<std::thread> clients;
+    for (size_t c = 0; c < client_count; c++)
+    {
+        clients.emplace_back([&, c] {
+            Ollama client(settings.url);
+            std::mt19937 random(settings.seed + static_cast<unsigned>(c) + 1);
+            for (;;)
+            {
+                request_sample sample;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&] { return !backlog.empty() || arrivals_done; });
+                    if (backlog.empty()) return;
+                    sample.scheduled = backlog.front();
+                    backlog.pop_front();
+                }
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(sample.scheduled)));
+                send_request(client, settings, settings.corpus[random() % settings.corpus.size()], start, sample);
+
+                std::lock_guard<std::mutex> lock(samples_mutex);
+                samples.push_back(sample);
+            }
+        });
+    }
+
+    // Schedule arrivals with exponentially distributed gaps
+    std::mt19937 random(settings.seed);
+    std::exponential_distribution<double> gap(rate);
+    for (double arrival = gap(random); arrival < end_time; arrival += gap(random))
+    {
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(arrival)));
+        std::lock_guard<std::mutex> lock(mutex);
+        if (backlog.size() >= settings.max_backlog) { unserved++; continue; }
+        backlog.push_back(arrival);
+        condition.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        arrivals_done = true;
+    }
+    condition.notify_all();
+    for (auto& client : clients) client.join();
+
+    double end = end_time;
+    for (auto& sample : samples) end = std::max(end, sample.completed);
+
+    return evaluate(settings, rate, samples, end, unserved);
+}
+
+// Mark the steps where the server stopped keeping up with the offered load.
+static void detect_saturation(const load_settings& settings, std::vector<step_result>& steps)
+{
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        step_result& step = steps[i];
+        std::ostringstream reason;
+        size_t total = step.completed + step.errors;
+        if (total > 0 && static_cast<double>(step.errors) / total > settings.max_error_rate)
+            reason << "error rate " << std::setprecision(3) << 100.0 * step.errors / total << "%";
+        else if (settings.open_loop && step.unserved > 0)
+            reason << "backlog overflowed, " << step.unserved << " arrivals dropped";
+        else if (settings.open_loop && step.throughput < 0.9 * step.level)
+            reason << "completed " << std::setprecision(3) << step.throughput << " of " << step.level << " requests/s offered";
+        else if (!settings.open_loop && i > 0 && step.level > steps[i-1].level && steps[i-1].throughput > 0)
+        {
+            double ideal = step.level / steps[i-1].level - 1.0;
+            double gained = step.throughput / steps[i-1].throughput - 1.0;
+            if (gained < settings.min_scaling * ideal)
+                reason << "throughput gained " << std::setprecision(3) << 100.0 * gained << "% for " << 100.0 * ideal << "% more clients";
+        }
+
+        step.reason = reason.str();
+        step.saturated = !step.reason.empty();
+    }
+}
+
+static void print_step(const load_settings& settings, const step_result& step)
+{
+    std::cout << std::fixed << std::setprecision(settings.open_loop ? 2 : 0)
+              << (settings.open_loop ? "rate " : "concurrency ") << step.level
+              << std::setprecision(2)
+              << "  completed " << step.completed << "  errors " << step.errors
+              << "  " << step.throughput << " req/s  " << step.token_throughput << " tok/s" << std::endl
+              << std::setprecision(1)
+              << "    ttft     p50 " << step.ttft.p50 * 1e3 << " ms  p90 " << step.ttft.p90 * 1e3 << " ms  p99 " << step.ttft.p99 * 1e3 << " ms  max " << step.ttft.max * 1e3 << " ms" << std::endl
+              << "    latency  p50 " << step.latency.p50 * 1e3 << " ms  p90 " << step.latency.p90 * 1e3 << " ms  p99 " << step.latency.p99 * 1e3 << " ms  max " << step.latency.max * 1e3 << " ms" << std::endl;
+    if (settings.open_loop)
+        std::cout << "    queue    p50 " << step.queue_delay.p50 * 1e3 << " ms  p99 " << step.queue_delay.p99 * 1e3 << " ms" << std::endl;
+    if (step.saturated)
+        std::cout << "    SATURATED: " << step.reason << std::endl;
+    std::cout.unsetf(std::ios::fixed);
+}
+
+static json to_json(const distribution& values)
+{
+    json output;
+    output["p50"] = values.p50; output["p90"] = values.p90; output["p99"] = values.p99;
+    output["max"] = values.max; output["mean"] = values.mean;
+    return output;
+}
+
+static json to_json(const load_settings& settings, const std::vector<step_result>& steps)
+{
+    json output;
+    output["url"] = settings.url;
+    output["model"] = settings.model;
+    output["mode"] = settings.open_loop ? "open" : "closed";
+    output["duration"] = settings.duration;
+    output["warmup"] = settings.warmup;
+    output["steps"] = json::array();
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        json step;
+        step[settings.open_loop ? "rate" : "concurrency"] = steps[i].level;
+        step["completed"] = steps[i].completed;
+        step["errors"] = steps[i].errors;
+        step["unserved"] = steps[i].unserved;
+        step["requests_per_second"] = steps[i].throughput;
+        step["tokens_per_second"] = steps[i].token_throughput;
+        step["tokens_per_second_per_request"] = steps[i].tokens_per_second_per_request;
+        step["ttft_seconds"] = to_json(steps[i].ttft);
+        step["latency_seconds"] = to_json(steps[i].latency);
+        step["queue_delay_seconds"] = to_json(steps[i].queue_delay);
+        step["saturated"] = steps[i].saturated;
+        if (steps[i].saturated) step["saturation_reason"] = steps[i].reason;
+        output["steps"].push_back(step);
+    }
+    return output;
+}
+
+static std::vector<step_result> run(const load_settings& settings)
+{
+    std::vector<double> levels = settings.sweep;
+    if (levels.empty()) levels.push_back(settings.open_loop ? settings.rate : static_cast<double>(settings.concurrency));
+
+    std::vector<step_result> steps;
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        steps.push_back(settings.open_loop ? run_open_loop(settings, levels[i]) : run_closed_loop(settings, static_cast<size_t>(levels[i])));
+        detect_saturation(settings, steps);
+        print_step(settings, steps.back());
+    }
+
+    // Capacity is the best throughput reached up to the step where the server saturated
+    double capacity = 0;
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        capacity = std::max(capacity, steps[i].throughput);
+        if (!steps[i].saturated) continue;
+        std::cout << std::endl << std::fixed << std::setprecision(2) << "Saturated at " << (settings.open_loop ? "rate " : "concurrency ") << steps[i].level
+                  << ", capacity about " << capacity << " requests/s" << std::endl;
+        std::cout.unsetf(std::ios::fixed);
+        break;
+    }
+    return steps;
+}
+
+static std::vector<load_prompt> read_corpus(const std::string& path)
+{
+    std::vector<load_prompt> corpus;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty()) continue;
+        load_prompt prompt;
+        if (line[0] == '{')
+        {
+            json entry = json::parse(line);
+            prompt.prompt = entry.value("prompt", std::string());
+            prompt.model = entry.value("model", std::string());
+        }
+        else prompt.prompt = line;
+        corpus.push_back(prompt);
+    }
+    return corpus;
+}
+
+static std::vector<double> parse_levels(const std::string& text)
+{
+    std::vector<double> levels;
+    std::istringstream stream(text);
+    std::string level;
+    while (std::getline(stream, level, ',')) if (!level.empty()) levels.push_back(std::atof(level.c_str()));
+    return levels;
+}
+
+// Run sweeps against a mock server serving at most 4 streams at a time and verify the generator finds that limit.
+static int self_test()
+{
+    ollama::mock_settings mock;
+    mock.max_connections = 4;
+    mock.first_token_delay_ms = 20;
+    mock.tokens_per_second = 200;
+    mock.num_tokens = 10;
+
+    ollama::mock_server server(mock);
+    if (!server.start()) { std::cerr << "Unable to start the mock server" << std::endl; return 1; }
+
+    load_settings settings;
+    settings.url = server.url();
+    settings.corpus.push_back({ "", "Why is the sky blue?" });
+    settings.duration = 1.5;
+    settings.warmup = 0.25;
+
+    bool passed = true;
+    auto check = [&passed](bool condition, const std::string& message) { if (!condition) { std::cerr << "FAILED: " << message << std::endl; passed = false; } };
+
+    // Closed loop: 4 streams are served in parallel, 8 clients only queue
+    std::cout << "Closed loop sweep against a mock serving 4 streams" << std::endl;
+    settings.sweep = { 1, 2, 4, 8 };
+    std::vector<step_result> closed = run(settings);
+    for (size_t i = 0; i < closed.size(); i++) check(closed[i].errors == 0 && closed[i].completed > 0, "closed loop step completed without errors");
+    check(closed[0].ttft.p50 >= 0.020, "ttft includes the prompt evaluation delay");
+    check(!closed[0].saturated && !closed[1].saturated && !closed[2].saturated, "no saturation up to 4 clients");
+    check(closed[3].saturated, "saturation detected at 8 clients");
+    check(closed[3].ttft.p50 > 1.5 * closed[2].ttft.p50, "ttft grows when clients queue");
+
+    // Open loop: a low rate is served, a rate far above capacity is not
+    std::cout << std::endl << "Open loop sweep against a mock serving 4 streams" << std::endl;
+    settings.open_loop = true;
+    settings.sweep = { 10, 200 };
+    std::vector<step_result> open = run(settings);
+    check(!open[0].saturated, "no saturation at 10 requests/s");
+    check(open[1].saturated, "saturation detected at 200 requests/s");
+    check(open[1].ttft.p50 > 10 * open[0].ttft.p50, "ttft grows beyond capacity");
+    check(open[1].throughput > 40 && open[1].throughput < 70, "throughput beyond capacity matches the 4 streams of the mock");
+
+    server.stop();
+    std::cout << std::endl << (passed ? "Self-test passed" : "Self-test failed") << std::endl;
+    return passed ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    load_settings settings;
+    std::string output_path, corpus_path;
+    bool run_self_test = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--url" && has_value) settings.url = argv[++i];
+        else if (arg == "--model" && has_value) settings.model = argv[++i];
+        else if (arg == "--corpus" && has_value) corpus_path = argv[++i];
+        else if (arg == "--mode" && has_value) settings.open_loop = std::string(argv[++i]) == "open";
+        else if (arg == "--rate" && has_value) settings.rate = std::atof(argv[++i]);
+        else if (arg == "--concurrency" && has_value) settings.concurrency = static_cast<size_t>(std::atoi(argv[++i]));
+        else if (arg == "--sweep" && has_value) settings.sweep = parse_levels(argv[++i]);
+        else if (arg == "--duration" && has_value) settings.duration = std::atof(argv[++i]);
+        else if (arg == "--warmup" && has_value) settings.warmup = std::atof(argv[++i]);
+        else if (arg == "--num-predict" && has_value) settings.num_predict = std::atoi(argv[++i]);
+        else if (arg == "--max-in-flight" && has_value) settings.max_in_flight = static_cast<size_t>(std::atoi(argv[++i]));
+        else if (arg == "--seed" && has_value) settings.seed = static_cast<unsigned>(std::atoi(argv[++i]));
+        else if (arg == "--out" && has_value) output_path = argv[++i];
+        else if (arg == "--self-test") run_self_test = true;
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--url url] [--model name] [--corpus file] [--mode open|closed] [--rate requests/s]" << std::endl
+                      << "       [--concurrency clients] [--sweep levels] [--duration seconds] [--warmup seconds]" << std::endl
+                      << "       [--num-predict tokens] [--max-in-flight clients] [--seed value] [--out file.json] [--self-test]" << std::endl;
+            return 2;
+        }
+    }
+
+    ollama::show_requests(false);
+    ollama::show_replies(false);
+    ollama::allow_exceptions(true);
+
+    if (run_self_test) return self_test();
+
+    if (!corpus_path.empty())
+    {
+        settings.corpus = read_corpus(corpus_path);
+        if (settings.corpus.empty()) { std::cerr << "No prompts found in " << corpus_path << std::endl; return 2; }
+    }
+    else settings.corpus.push_back({ "", "Why is the sky blue?" });
+
+    std::vector<step_result> steps = run(settings);
+
+    if (!output_path.empty())
+    {
+        std::ofstream output(output_path);
+        output << to_json(settings, steps).dump(4) << std::endl;
+        std::cout << "Results written to " << output_path << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,351 @@
+#include "ollamabackendset.h"
+#include "ollamaresidency.h"
+#include "ollamaservice.h"
+
+#include "ollama.hpp"
+#include "nap/logger.h"
+
+#include <algorithm>
+
+RTTI_BEGIN_CLASS_NO_DEFAULT_CONSTRUCTOR(nap::OllamaBackendSet)
+    RTTI_CONSTRUCTOR(nap::OllamaService&)
+    RTTI_PROPERTY("ServerURLs", &nap::OllamaBackendSet::mServerURLs, nap::rtti::EPropertyMetaData::Required)
+    RTTI_PROPERTY("MaxConcurrentRequests", &nap::OllamaBackendSet::mMaxConcurrentRequests, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("HealthCheckInterval", &nap::OllamaBackendSet::mHealthCheckInterval, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("FailuresToEject", &nap::OllamaBackendSet::mFailuresToEject, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("EjectionTime", &nap::OllamaBackendSet::mEjectionTime, nap::rtti::EPropertyMetaData::Default)
+RTTI_END_CLASS
+
+namespace nap
+{
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaBackendSet::Lease
+    //////////////////////////////////////////////////////////////////////////
+
+    OllamaBackendSet::Lease::~Lease()
+    {
+        release();
+    }
+
+
+    OllamaBackendSet::Lease::Lease(Lease&& other) noexcept :
+        mSet(other.mSet), mIndex(other.mIndex), mURL(std::move(other.mURL))
+    {
+        other.mSet = nullptr;
+    }
+
+
+    OllamaBackendSet::Lease& OllamaBackendSet::Lease::operator=(Lease&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            mSet = other.mSet;
+            mIndex = other.mIndex;
+            mURL = std::move(other.mURL);
+            other.mSet = nullptr;
+        }
+        return *this;
+    }
+
+
+    void OllamaBackendSet::Lease::reportFailure()
+    {
+        if (mSet == nullptr)
+            return;
+
+        std::lock_guard lk(mSet->mMutex);
+        mSet->recordFailure(mSet->mBackends[mIndex]);
+    }
+
+
+    void OllamaBackendSet::Lease::reportSuccess()
+    {
+        if (mSet == nullptr)
+            return;
+
+        std::lock_guard lk(mSet->mMutex);
+        mSet->recordSuccess(mSet->mBackends[mIndex]);
+    }
+
+
+    void OllamaBackendSet::Lease::release()
+    {
+        if (mSet == nullptr)
+            return;
+
+        mSet->release(mIndex);
+        mSet = nullptr;
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaBackendSet
+    //////////////////////////////////////////////////////////////////////////
+
+    OllamaBackendSet::OllamaBackendSet(OllamaService& service) : Device(), mService(service)
+    { }
+
+
+    bool OllamaBackendSet::start(utility::ErrorState& errorState)
+    {
+        if (!errorState.check(!mServerURLs.empty(), "%s: no server URLs", mID.c_str()))
+            return false;
+        if (!errorState.check(mMaxConcurrentRequests > 0, "%s: MaxConcurrentRequests must be at least 1", mID.c_str()))
+            return false;
+        if (!errorState.check(mFailuresToEject > 0, "%s: FailuresToEject must be at least 1", mID.c_str()))
+            return false;
+
+        // Backends are available until a health check or request fails
+        mBackends.clear();
+        for (const auto& url : mServerURLs)
+        {
+            Backend backend;
+            backend.mURL = url;
+            mBackends.emplace_back(std::move(backend));
+        }
+
+        // The first health check runs on the first update
+        mTimeSinceCheck = mHealthCheckInterval;
+        mRunning = true;
+        mService.registerBackendSet(*this);
+        return true;
+    }
+
+
+    void OllamaBackendSet::stop()
+    {
+        // Wait for the health check running on the worker pool
+        mRunning = false;
+        if (mCheckFinished.valid())
+            mCheckFinished.wait();
+
+        mService.removeBackendSet(*this);
+    }
+
+
+    OllamaBackendSet::Lease OllamaBackendSet::acquire(const std::string& model, std::chrono::milliseconds timeout, const std::string& exclude)
+    {
+        auto tagged_model = OllamaResidency::getTaggedName(model);
+        auto deadline = Clock::now() + timeout;
+        auto exclude_url = exclude;
+
+        std::unique_lock lock(mMutex);
+        while (true)
+        {
+            // Pick the backend with the least outstanding requests, preferring backends that have the model loaded
+            std::size_t best = mBackends.size();
+            bool available = false;
+            bool excluded_available = false;
+            for (std::size_t i = 0; i < mBackends.size(); i++)
+            {
+                auto index = (mNextBackend + i) % mBackends.size();
+                const auto& backend = mBackends[index];
+                if (!isAvailable(backend))
+                    continue;
+
+                if (backend.mURL == exclude_url)
+                {
+                    excluded_available = true;
+                    continue;
+                }
+
+                available = true;
+                if (backend.mOutstanding >= mMaxConcurrentRequests)
+                    continue;
+
+                if (best == mBackends.size())
+                {
+                    best = index;
+                    continue;
+                }
+
+                const auto& current = mBackends[best];
+                bool loaded = backend.mLoadedModels.count(tagged_model) > 0;
+                bool current_loaded = current.mLoadedModels.count(tagged_model) > 0;
+                if (loaded != current_loaded ? loaded : backend.mOutstanding < current.mOutstanding)
+                    best = index;
+            }
+
+            if (best != mBackends.size())
+            {
+                auto& backend = mBackends[best];
+                backend.mOutstanding++;
+                mNextBackend = (best + 1) % mBackends.size();
+
+                Lease lease;
+                lease.mSet = this;
+                lease.mIndex = best;
+                lease.mURL = backend.mURL;
+                return lease;
+            }
+
+            // Fall back to the excluded backend when no other backend is available
+            if (!available && excluded_available)
+            {
+                exclude_url.clear();
+                continue;
+            }
+
+            // Wait for a slot when the available backends are busy
+            if (!available || mSlotReleased.wait_until(lock, deadline) == std::cv_status::timeout)
+                return Lease();
+        }
+    }
+
+
+    std::string OllamaBackendSet::getAvailableURL()
+    {
+        std::lock_guard lk(mMutex);
+        for (std::size_t i = 0; i < mBackends.size(); i++)
+        {
+            const auto& backend = mBackends[(mNextBackend + i) % mBackends.size()];
+            if (isAvailable(backend))
+                return backend.mURL;
+        }
+        return {};
+    }
+
+
+    int OllamaBackendSet::getAvailableCount()
+    {
+        std::lock_guard lk(mMutex);
+        return static_cast<int>(std::count_if(mBackends.begin(), mBackends.end(), [](const Backend& backend) { return isAvailable(backend); }));
+    }
+
+
+    std::vector<OllamaBackendSet::BackendState> OllamaBackendSet::getBackendStates()
+    {
+        std::lock_guard lk(mMutex);
+        std::vector<BackendState> states;
+        for (const auto& backend : mBackends)
+        {
+            BackendState state;
+            state.mURL = backend.mURL;
+            state.mOutstanding = backend.mOutstanding;
+            state.mEjected = backend.mEjected;
+            state.mLoadedModels.assign(backend.mLoadedModels.begin(), backend.mLoadedModels.end());
+            states.emplace_back(std::move(state));
+        }
+        return states;
+    }
+
+
+    void OllamaBackendSet::update(double deltaTime)
+    {
+        // Start a health check when the interval elapsed, one check runs at a time
+        mTimeSinceCheck += deltaTime;
+        if (mTimeSinceCheck < mHealthCheckInterval)
+            return;
+        if (mCheckFinished.valid() && mCheckFinished.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+
+        mTimeSinceCheck = 0.0;
+        auto finished = std::make_shared<std::promise<void>>();
+        mCheckFinished = finished->get_future();
+        mService.enqueueTask([this, finished]()
+        {
+            checkHealth();
+            finished->set_value();
+        });
+    }
+
+
+    void OllamaBackendSet::checkHealth()
+    {
+        std::vector<std::string> urls;
+        {
+            std::lock_guard lk(mMutex);
+            auto now = Clock::now();
+            for (const auto& backend : mBackends)
+            {
+                // Ejected backends are checked again when their ejection time elapsed
+                if (!backend.mEjected || now >= backend.mEjectedUntil)
+                    urls.emplace_back(backend.mURL);
+            }
+        }
+
+        for (const auto& url : urls)
+        {
+            if (!mRunning)
+                return;
+
+            // The loaded models are used to route requests to a backend that has the model in memory
+            std::set<std::string> loaded;
+            bool healthy = false;
+            try
+            {
+                Ollama client(url);
+                client.setConnectTimeout(1);
+                client.setReadTimeout(2);
+                auto running = client.running_model_json();
+                if (running.contains("models"))
+                {
+                    for (const auto& model : running["models"])
+                        loaded.insert(model.value("name", ""));
+                    healthy = true;
+                }
+            }
+            catch (const std::exception&)
+            { }
+
+            std::lock_guard lk(mMutex);
+            auto it = std::find_if(mBackends.begin(), mBackends.end(), [&url](const Backend& backend) { return backend.mURL == url; });
+            if (healthy)
+            {
+                it->mLoadedModels = std::move(loaded);
+                recordSuccess(*it);
+            }
+            else
+            {
+                // An ejected backend that fails its check stays ejected for longer
+                if (it->mEjected)
+                    it->mFailures = mFailuresToEject - 1;
+                recordFailure(*it);
+            }
+        }
+    }
+
+
+    void OllamaBackendSet::recordFailure(Backend& backend)
+    {
+        if (++backend.mFailures < mFailuresToEject)
+            return;
+
+        // Eject the backend, the ejection time doubles with every consecutive ejection
+        auto ejection_time = mEjectionTime * static_cast<float>(1 << std::min(backend.mEjections, 6));
+        if (!backend.mEjected)
+            nap::Logger::warn("%s: ejecting Ollama server %s for %.1f seconds", mID.c_str(), backend.mURL.c_str(), ejection_time);
+
+        backend.mEjected = true;
+        backend.mEjections++;
+        backend.mFailures = 0;
+        backend.mEjectedUntil = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(ejection_time));
+        backend.mLoadedModels.clear();
+    }
+
+
+    void OllamaBackendSet::recordSuccess(Backend& backend)
+    {
+        backend.mFailures = 0;
+        if (!backend.mEjected)
+            return;
+
+        nap::Logger::info("%s: Ollama server %s is back", mID.c_str(), backend.mURL.c_str());
+        backend.mEjected = false;
+        backend.mEjections = 0;
+
+        // Requests waiting for a slot can be routed to the backend
+        mSlotReleased.notify_all();
+    }
+
+
+    void OllamaBackendSet::release(std::size_t index)
+    {
+        {
+            std::lock_guard lk(mMutex);
+            mBackends[index].mOutstanding--;
+        }
+        mSlotReleased.notify_all();
+    }
+}
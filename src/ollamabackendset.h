@@ -0,0 +1,214 @@
+#pragma once
+
+#include <nap/device.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    // Forward declarations
+    class OllamaService;
+
+    /**
+     * Set of Ollama servers that serve the same models, referenced by an OllamaChat instead of a single server URL.
+     *
+     * Requests are routed to the backend with the least outstanding requests, preferring backends that have the model loaded,
+     * so a request does not wait for a cold model load when another backend has the model in memory.
+     * Every backend serves at most 'MaxConcurrentRequests' requests at a time, a request waits for a free slot when all backends are busy.
+     *
+     * The backends are health checked on the worker pool of the OllamaService through /api/ps, which also reports the loaded models.
+     * A backend that fails 'FailuresToEject' consecutive health checks or requests is ejected: no requests are routed to it until a health check succeeds,
+     * which is attempted after 'EjectionTime' seconds, doubling every time the backend is ejected again.
+     */
+    class NAPAPI OllamaBackendSet final : public Device
+    {
+        RTTI_ENABLE(Device)
+    public:
+        // Clock used for ejections
+        using Clock = std::chrono::steady_clock;
+
+        /**
+         * A slot on a backend, acquired to send one request.
+         * The slot is released when the lease is destroyed.
+         */
+        class NAPAPI Lease final
+        {
+            friend class OllamaBackendSet;
+        public:
+            Lease() = default;
+            ~Lease();
+
+            // A lease owns its slot and can only be moved
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+            Lease(Lease&& other) noexcept;
+            Lease& operator=(Lease&& other) noexcept;
+
+            /**
+             * @return if a slot was acquired
+             */
+            bool isValid() const                                    { return mSet != nullptr; }
+
+            /**
+             * @return URL of the backend, empty when no slot was acquired
+             */
+            const std::string& getURL() const                       { return mURL; }
+
+            /**
+             * Reports that the backend could not serve the request, counting towards its ejection
+             */
+            void reportFailure();
+
+            /**
+             * Reports that the backend served the request, resetting its consecutive failures
+             */
+            void reportSuccess();
+
+            /**
+             * Releases the slot
+             */
+            void release();
+
+        private:
+            OllamaBackendSet* mSet = nullptr;
+            std::size_t mIndex = 0;
+            std::string mURL;
+        };
+
+        /**
+         * State of a backend
+         */
+        struct BackendState
+        {
+            std::string mURL;                                       ///< URL of the server
+            int mOutstanding = 0;                                   ///< Requests being served
+            bool mEjected = false;                                  ///< If no requests are routed to the backend
+            std::vector<std::string> mLoadedModels;                 ///< Models loaded at the last health check
+        };
+
+        /**
+         * Constructor
+         * @param service the service that runs the health checks on its worker pool
+         */
+        OllamaBackendSet(OllamaService& service);
+
+        /**
+         * Acquires a slot on the backend best suited to serve a request for the given model.
+         * Blocks while all available backends are serving their maximum number of requests, until a slot is released or the timeout elapsed.
+         * This call is thread safe
+         * @param model the model of the request
+         * @param timeout maximum time to wait for a free slot
+         * @param exclude URL of a backend to skip, such as a backend that just failed to serve the request. Used when no other backend is available.
+         * @return the lease, invalid when no backend is available or the timeout elapsed
+         */
+        Lease acquire(const std::string& model, std::chrono::milliseconds timeout, const std::string& exclude = "");
+
+        /**
+         * Returns the URL of an available backend, to query the server outside of a request.
+         * This call is thread safe
+         * @return URL of an available backend, empty when all backends are ejected
+         */
+        std::string getAvailableURL();
+
+        /**
+         * @return the number of backends that are not ejected, thread safe
+         */
+        int getAvailableCount();
+
+        /**
+         * @return the URLs of all backends
+         */
+        const std::vector<std::string>& getURLs() const             { return mServerURLs; }
+
+        /**
+         * @return the state of all backends, thread safe
+         */
+        std::vector<BackendState> getBackendStates();
+
+        std::vector<std::string> mServerURLs;                       ///< Property: 'ServerURLs' The URLs of the Ollama servers
+        int mMaxConcurrentRequests = 4;                             ///< Property: 'MaxConcurrentRequests' Maximum number of requests served by one backend at a time
+        float mHealthCheckInterval = 2.0f;                          ///< Property: 'HealthCheckInterval' Seconds between health checks
+        int mFailuresToEject = 3;                                   ///< Property: 'FailuresToEject' Consecutive failures after which a backend is ejected
+        float mEjectionTime = 5.0f;                                 ///< Property: 'EjectionTime' Seconds before an ejected backend is checked again, doubles with every ejection
+
+    protected:
+        /**
+         * Starts health checking the backends
+         * @param errorState contains the error message on failure
+         * @return true on success
+         */
+        bool start(utility::ErrorState& errorState) final;
+
+        /**
+         * Stops health checking the backends
+         */
+        void stop() final;
+
+    private:
+        friend class OllamaService;
+
+        // A server of the set, guarded by mMutex
+        struct Backend
+        {
+            std::string mURL;
+            int mOutstanding = 0;                                   ///< Requests being served
+            int mFailures = 0;                                      ///< Consecutive failed health checks and requests
+            int mEjections = 0;                                     ///< Consecutive ejections, each ejection doubles the ejection time
+            bool mEjected = false;
+            Clock::time_point mEjectedUntil;
+            std::set<std::string> mLoadedModels;
+        };
+
+        /**
+         * Starts a health check on the worker pool of the service when the interval elapsed, called on the main thread by the service
+         * @param deltaTime seconds since the last update
+         */
+        void update(double deltaTime);
+
+        /**
+         * Checks the health and loaded models of all backends, runs on the worker pool
+         */
+        void checkHealth();
+
+        /**
+         * Counts a failure of a backend and ejects it after too many consecutive failures, the mutex must be locked
+         * @param backend the backend that failed
+         */
+        void recordFailure(Backend& backend);
+
+        /**
+         * Counts a success of a backend, reinstating it when it was ejected, the mutex must be locked
+         * @param backend the backend that succeeded
+         */
+        void recordSuccess(Backend& backend);
+
+        /**
+         * Releases a slot acquired by a lease
+         * @param index index of the backend
+         */
+        void release(std::size_t index);
+
+        /**
+         * Returns if requests can be routed to a backend, the mutex must be locked
+         */
+        static bool isAvailable(const Backend& backend)             { return !backend.mEjected; }
+
+        OllamaService& mService;
+        std::mutex mMutex;
+        std::condition_variable mSlotReleased;
+        std::vector<Backend> mBackends;
+        std::size_t mNextBackend = 0;                               ///< Rotates ties between equally suited backends
+        double mTimeSinceCheck = 0.0;
+        std::future<void> mCheckFinished;                           ///< Becomes ready when the health check running on the worker pool finished
+        std::atomic_bool mRunning = false;
+    };
+
+    using OllamaBackendSetObjectCreator = rtti::ObjectCreator<OllamaBackendSet, OllamaService>;
+}
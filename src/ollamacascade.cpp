@@ -0,0 +1,74 @@
+#include "ollamacascade.h"
+
+#include "ollama.hpp"
+
+namespace nap
+{
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaCascade
+    //////////////////////////////////////////////////////////////////////////
+
+    bool OllamaCascade::validate(utility::ErrorState& errorState) const
+    {
+        return errorState.check(!mModels.empty(), "Cascade has no models");
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaCascadeRun
+    //////////////////////////////////////////////////////////////////////////
+
+    OllamaCascadeRun::OllamaCascadeRun(const OllamaCascade& cascade, const ollama::request& request) :
+        mCascade(cascade), mCheck(cascade.mCheck)
+    {
+        auto body = request;
+        mDefaultModel = body["model"].get<std::string>();
+        body.erase("model");
+        mBody = body.dump();
+        startStage();
+    }
+
+
+    std::string OllamaCascadeRun::getRequestBody() const
+    {
+        return "{\"model\":" + nlohmann::json(mModel).dump() + "," + mBody.substr(1);
+    }
+
+
+    bool OllamaCascadeRun::feed(const std::string& token)
+    {
+        return isLast() || mCheck.feed(token);
+    }
+
+
+    bool OllamaCascadeRun::finish()
+    {
+        return isLast() || mCheck.finish();
+    }
+
+
+    std::string OllamaCascadeRun::escalate()
+    {
+        auto reason = mModel + ": " + mCheck.getFailure();
+        mResult.mEscalations.emplace_back(reason);
+        mStage++;
+        startStage();
+        return reason;
+    }
+
+
+    void OllamaCascadeRun::complete(std::string text, const OllamaRequestStats& stats)
+    {
+        mResult.mText = std::move(text);
+        mResult.mModel = mModel;
+        mResult.mStage = static_cast<int>(mStage);
+        mResult.mStats = stats;
+    }
+
+
+    void OllamaCascadeRun::startStage()
+    {
+        mModel = mCascade.mModels[mStage].empty() ? mDefaultModel : mCascade.mModels[mStage];
+        mCheck.reset();
+    }
+}
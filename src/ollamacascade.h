@@ -0,0 +1,123 @@
+#pragma once
+
+#include "ollamacascadecheck.h"
+#include "ollamametrics.h"
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <string>
+#include <vector>
+
+// Forward declarations
+namespace ollama
+{
+    class request;
+}
+
+namespace nap
+{
+    /**
+     * The models a cascade prompt is sent to one after the other, from small to large, and the check the response of a smaller model has to pass
+     */
+    struct NAPAPI OllamaCascade
+    {
+        std::vector<std::string> mModels;           ///< The models of the cascade, from small to large, an empty name is the model of the chat
+        OllamaCascadeCheck mCheck;                  ///< The check a response of a smaller model has to pass, the response of the last model is accepted without check
+
+        /**
+         * @param errorState contains the error when the cascade has no models
+         * @return if the cascade can be sent
+         */
+        bool validate(utility::ErrorState& errorState) const;
+    };
+
+
+    /**
+     * The answer to a cascade prompt and the models that were asked before
+     */
+    struct NAPAPI OllamaCascadeResult
+    {
+        std::string mText;                          ///< Text of the answer
+        std::string mModel;                         ///< Model that answered
+        int mStage = 0;                             ///< Index of the model that answered in the cascade
+        std::vector<std::string> mEscalations;      ///< Why the response of each smaller model failed the check, in the order of the cascade
+        OllamaRequestStats mStats;                  ///< Token usage and timings of the request that answered
+        std::uint64_t mTotalTime = 0;               ///< Microseconds between enqueueing the prompt and completing the answer
+    };
+
+
+    /**
+     * The stages of one cascade prompt: the model the request is sent to, the check of its response and the escalations so far.
+     * The request is serialized once without the model, every stage only prefixes the body with its model.
+     */
+    class NAPAPI OllamaCascadeRun final
+    {
+    public:
+        /**
+         * @param cascade the cascade, must have at least one model
+         * @param request the request of the prompt, its model replaces the empty names of the cascade
+         */
+        OllamaCascadeRun(const OllamaCascade& cascade, const ollama::request& request);
+
+        /**
+         * @return the model of the current stage
+         */
+        const std::string& getModel() const                 { return mModel; }
+
+        /**
+         * @return if the current stage is the last model, its response is accepted without check
+         */
+        bool isLast() const                                 { return mStage + 1 == mCascade.mModels.size(); }
+
+        /**
+         * @return the serialized request of the current stage
+         */
+        std::string getRequestBody() const;
+
+        /**
+         * Checks a token of the response of the current stage
+         * @param token the token
+         * @return false when the response failed the check, the request is cancelled and escalated
+         */
+        bool feed(const std::string& token);
+
+        /**
+         * Checks the complete response of the current stage
+         * @return false when the response failed the check and is escalated
+         */
+        bool finish();
+
+        /**
+         * Records why the response of the current stage failed the check and continues with the next model
+         * @return the reason, prefixed with the model that failed
+         */
+        std::string escalate();
+
+        /**
+         * Completes the prompt with the answer of the current stage
+         * @param text text of the answer
+         * @param stats token usage and timings of the request that answered
+         */
+        void complete(std::string text, const OllamaRequestStats& stats);
+
+        /**
+         * @return the answer and the escalations before it, complete once complete() was called
+         */
+        OllamaCascadeResult& getResult()                    { return mResult; }
+
+    private:
+        /**
+         * Selects the model and resets the check of the current stage
+         */
+        void startStage();
+
+        const OllamaCascade& mCascade;
+        std::string mDefaultModel;
+        std::string mBody;                                  ///< The request without model
+        std::size_t mStage = 0;
+        std::string mModel;
+        OllamaCascadeCheck mCheck;
+        OllamaCascadeResult mResult;
+    };
+}
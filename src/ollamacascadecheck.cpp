@@ -0,0 +1,135 @@
+#include "ollamacascadecheck.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace nap
+{
+    bool OllamaCascadeCheck::addRefusalPattern(const std::string& pattern, utility::ErrorState& errorState)
+    {
+        Pattern compiled;
+        compiled.mSource = pattern;
+        try
+        {
+            compiled.mExpression = std::regex(pattern, std::regex::ECMAScript | std::regex::icase);
+        }
+        catch (const std::regex_error& error)
+        {
+            errorState.fail("Invalid refusal pattern '%s': %s", pattern.c_str(), error.what());
+            return false;
+        }
+
+        auto patterns = mPatterns != nullptr ? std::make_shared<std::vector<Pattern>>(*mPatterns) : std::make_shared<std::vector<Pattern>>();
+        patterns->emplace_back(std::move(compiled));
+        mPatterns = std::move(patterns);
+        reset();
+        return true;
+    }
+
+
+    bool OllamaCascadeCheck::setConfidenceField(const std::string& field, float minimum, utility::ErrorState& errorState)
+    {
+        if (!errorState.check(!field.empty(), "Confidence field has no name"))
+            return false;
+        if (!errorState.check(minimum >= 0.0f && minimum <= 1.0f, "Minimum confidence must be between 0 and 1"))
+            return false;
+
+        // The field may be quoted or emphasized, as in "confidence": 0.8 or **Confidence:** 80%
+        std::string escaped;
+        for (auto character : field)
+        {
+            if (std::string("\\^$.|?*+()[]{}").find(character) != std::string::npos)
+                escaped.push_back('\\');
+            escaped.push_back(character);
+        }
+        mConfidenceExpression = std::make_shared<std::regex>(escaped + "[\"'*_ ]*[:=][\"'*_ ]*([0-9]*\\.?[0-9]+)(%?)", std::regex::ECMAScript | std::regex::icase);
+        mConfidenceField = field;
+        mMinConfidence = minimum;
+        reset();
+        return true;
+    }
+
+
+    bool OllamaCascadeCheck::isEnabled() const
+    {
+        return mMinLength > 0 || mMaxLength > 0 || mPatterns != nullptr || mConfidenceExpression != nullptr || mPredicate != nullptr;
+    }
+
+
+    bool OllamaCascadeCheck::feed(const std::string& token)
+    {
+        if (mReason != EReason::None)
+            return false;
+        mText += token;
+
+        if (mMaxLength > 0 && mText.size() > mMaxLength)
+            return fail(EReason::Length, "response longer than " + std::to_string(mMaxLength) + " characters");
+
+        // Search the patterns at the end of the response
+        if (mPatterns != nullptr)
+        {
+            auto window = mText.size() > patternWindow ? mText.size() - patternWindow : 0;
+            auto flags = window > 0 ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+            for (const auto& pattern : *mPatterns)
+            {
+                if (std::regex_search(mText.cbegin() + window, mText.cend(), pattern.mExpression, flags))
+                    return fail(EReason::Refusal, "refusal pattern '" + pattern.mSource + "' matched");
+            }
+        }
+
+        if (mPredicate != nullptr && !mPredicate(mText, false))
+            return fail(EReason::Predicate, "predicate rejected the response");
+        return true;
+    }
+
+
+    bool OllamaCascadeCheck::finish()
+    {
+        if (mReason != EReason::None)
+            return false;
+
+        if (mText.size() < mMinLength)
+            return fail(EReason::Length, "response shorter than " + std::to_string(mMinLength) + " characters");
+
+        // The last rating in the response counts
+        if (mConfidenceExpression != nullptr)
+        {
+            for (auto it = std::sregex_iterator(mText.begin(), mText.end(), *mConfidenceExpression); it != std::sregex_iterator(); ++it)
+            {
+                mConfidence = std::strtof((*it)[1].str().c_str(), nullptr);
+                if ((*it)[2].length() > 0)
+                    mConfidence /= 100.0f;
+            }
+
+            if (mConfidence < 0.0f)
+                return fail(EReason::Confidence, "response has no " + mConfidenceField);
+            if (mConfidence < mMinConfidence)
+            {
+                char confidence[64];
+                std::snprintf(confidence, sizeof(confidence), " %.2f below %.2f", mConfidence, mMinConfidence);
+                return fail(EReason::Confidence, mConfidenceField + confidence);
+            }
+        }
+
+        if (mPredicate != nullptr && !mPredicate(mText, true))
+            return fail(EReason::Predicate, "predicate rejected the response");
+        return true;
+    }
+
+
+    void OllamaCascadeCheck::reset()
+    {
+        mText.clear();
+        mConfidence = -1.0f;
+        mReason = EReason::None;
+        mFailure.clear();
+    }
+
+
+    bool OllamaCascadeCheck::fail(EReason reason, const std::string& failure)
+    {
+        mReason = reason;
+        mFailure = failure;
+        return false;
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <functional>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    /**
+     * Cheap checks of the response of a small model, evaluated incrementally over the tokens as they arrive.
+     * When a check fails, the prompt of OllamaChat::cascade() escalates to the next, larger model.
+     *
+     * Four kinds of checks are supported:
+     * - Length: the response fails when it grows longer than the maximum length, or completes shorter than the minimum length.
+     * - Refusal patterns: regular expressions, matched case insensitive. The response fails as soon as a pattern matches
+     *   in the last 'patternWindow' characters of the response.
+     * - Confidence: the model rates its own confidence in a field of the response, such as "Confidence: 0.8".
+     *   The response fails when it completes without the field or with a confidence below the minimum. A percentage is read as a fraction.
+     * - Predicate: a function called with the response so far on every token and with the complete response, returns false to fail.
+     *
+     * A check holds the state of one response: copy a configured check for every request, copies share the compiled patterns.
+     */
+    class NAPAPI OllamaCascadeCheck final
+    {
+    public:
+        /**
+         * The check that failed a response
+         */
+        enum class EReason : int
+        {
+            None,               ///< No check failed
+            Length,             ///< The response is too long or too short
+            Refusal,            ///< A refusal pattern matched
+            Confidence,         ///< The confidence is missing or too low
+            Predicate           ///< The predicate rejected the response
+        };
+
+        /**
+         * Rejects a response by returning false, called with the text so far and if the response is complete
+         */
+        using Predicate = std::function<bool(const std::string& text, bool complete)>;
+
+        // Number of characters at the end of the response a refusal pattern is searched in
+        static constexpr std::size_t patternWindow = 256;
+
+        OllamaCascadeCheck() = default;
+
+        /**
+         * Sets the minimum length of a complete response
+         * @param characters minimum number of characters, 0 to accept any length
+         */
+        void setMinLength(std::size_t characters)                   { mMinLength = characters; }
+
+        /**
+         * Sets the maximum length of a response, a response fails as soon as it grows longer
+         * @param characters maximum number of characters, 0 to accept any length
+         */
+        void setMaxLength(std::size_t characters)                   { mMaxLength = characters; }
+
+        /**
+         * Adds a refusal pattern in ECMAScript regular expression syntax, matched case insensitive
+         * @param pattern the expression that fails the response, such as "I can'?t help"
+         * @param errorState contains the error when the pattern is invalid
+         * @return if the pattern was added
+         */
+        bool addRefusalPattern(const std::string& pattern, utility::ErrorState& errorState);
+
+        /**
+         * Requires the model to rate its confidence in a field of the response, followed by ':' or '=' and a number
+         * @param field name of the field, such as "confidence", matched case insensitive
+         * @param minimum the minimum confidence of a response that passes, between 0 and 1
+         * @param errorState contains the error when the field is empty or the minimum is out of range
+         * @return if the field was set
+         */
+        bool setConfidenceField(const std::string& field, float minimum, utility::ErrorState& errorState);
+
+        /**
+         * Sets a predicate evaluated over the response, replacing the previous predicate
+         * @param predicate the predicate, nullptr to remove it
+         */
+        void setPredicate(const Predicate& predicate)               { mPredicate = predicate; }
+
+        /**
+         * @return if any check is set
+         */
+        bool isEnabled() const;
+
+        /**
+         * Evaluates the checks over the next token of the response
+         * @param token the next token
+         * @return false when a check failed, getFailure() describes why
+         */
+        bool feed(const std::string& token);
+
+        /**
+         * Evaluates the checks of the complete response
+         * @return false when a check failed, getFailure() describes why
+         */
+        bool finish();
+
+        /**
+         * Clears the state of the response, keeping the checks
+         */
+        void reset();
+
+        /**
+         * @return the check that failed the response
+         */
+        EReason getReason() const                                   { return mReason; }
+
+        /**
+         * @return a description of the check that failed the response, empty when no check failed
+         */
+        const std::string& getFailure() const                       { return mFailure; }
+
+        /**
+         * @return the confidence the model rated the complete response with, negative when not known
+         */
+        float getConfidence() const                                 { return mConfidence; }
+
+    private:
+        // Compiled refusal patterns
+        struct Pattern
+        {
+            std::string mSource;
+            std::regex mExpression;
+        };
+
+        /**
+         * Fails the response
+         */
+        bool fail(EReason reason, const std::string& failure);
+
+        // Checks, shared by copies
+        std::size_t mMinLength = 0;
+        std::size_t mMaxLength = 0;
+        std::shared_ptr<const std::vector<Pattern>> mPatterns;
+        std::shared_ptr<const std::regex> mConfidenceExpression;
+        std::string mConfidenceField;
+        float mMinConfidence = 0.0f;
+        Predicate mPredicate;
+
+        // State of the response
+        std::string mText;
+        float mConfidence = -1.0f;
+        EReason mReason = EReason::None;
+        std::string mFailure;
+    };
+}
@@ -1,13 +1,44 @@
 #include "ollamachat.h"
+#include "ollamahedge.h"
 #include "ollamaservice.h"
+#include "ollamatrace.h"
+#include "ollamasnapshot.h"
 
 #include "ollama.hpp"
 #include "nap/logger.h"
 
+#include <algorithm>
+#include <filesystem>
+
+RTTI_BEGIN_ENUM(nap::EOllamaReasoningBudgetAction)
+    RTTI_ENUM_VALUE(nap::EOllamaReasoningBudgetAction::Answer, "Answer"),
+    RTTI_ENUM_VALUE(nap::EOllamaReasoningBudgetAction::Cancel, "Cancel")
+RTTI_END_ENUM
+
 RTTI_BEGIN_CLASS_NO_DEFAULT_CONSTRUCTOR(nap::OllamaChat)
     RTTI_CONSTRUCTOR(nap::OllamaService&)
     RTTI_PROPERTY("ServerURL", &nap::OllamaChat::mServerURLSetting, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("Backends", &nap::OllamaChat::mBackends, nap::rtti::EPropertyMetaData::Default)
     RTTI_PROPERTY("Model", &nap::OllamaChat::mModelSetting, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("PullModel", &nap::OllamaChat::mPullModel, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("ConnectTimeout", &nap::OllamaChat::mConnectTimeout, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("MaxRetryInterval", &nap::OllamaChat::mMaxRetryInterval, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("HedgeRequests", &nap::OllamaChat::mHedgeRequests, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("HedgePercentile", &nap::OllamaChat::mHedgePercentile, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("DeduplicateRequests", &nap::OllamaChat::mDeduplicateRequests, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("StopSequences", &nap::OllamaChat::mStopSequences, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("StopPatterns", &nap::OllamaChat::mStopPatterns, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("StopOnCompleteJSON", &nap::OllamaChat::mStopOnCompleteJSON, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("SplitReasoning", &nap::OllamaChat::mSplitReasoning, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("ReasoningChunkBudget", &nap::OllamaChat::mReasoningChunkBudget, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("ReasoningTimeBudget", &nap::OllamaChat::mReasoningTimeBudget, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("ReasoningBudgetAction", &nap::OllamaChat::mReasoningBudgetAction, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("MaxToolRounds", &nap::OllamaChat::mMaxToolRounds, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("Priority", &nap::OllamaChat::mPriority, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("MaxConcurrentSessions", &nap::OllamaChat::mMaxConcurrentSessions, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("SessionMemoryLimit", &nap::OllamaChat::mSessionMemoryLimit, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("SnapshotPath", &nap::OllamaChat::mSnapshotPath, nap::rtti::EPropertyMetaData::Default)
+    RTTI_PROPERTY("SnapshotInterval", &nap::OllamaChat::mSnapshotInterval, nap::rtti::EPropertyMetaData::Default)
 RTTI_END_CLASS
 
 namespace nap
@@ -18,17 +49,85 @@ namespace nap
     class OllamaChat::Impl
     {
     public:
-        Impl()
+        Impl(const std::vector<std::string>& serverURLs, int connectTimeout) : mConnections(serverURLs, connectTimeout)
+        { }
+
+        // Connections to the Ollama servers, every request in progress uses its own connection
+        OllamaConnectionPool mConnections;
+
+        // Connections used to pull the model to the servers that lack it, separate from the connections used to chat
+        std::vector<std::unique_ptr<Ollama>> mPullServers;
+
+        // The sessions of the chat and their conversations
+        OllamaSessionTable mSessions;
+    };
+
+
+    /**
+     * A prompt and its callbacks
+     */
+    struct OllamaChat::Prompt
+    {
+        std::string mMessage;
+        SessionID mSession = defaultSession;
+        EOllamaPriority mPriority = EOllamaPriority::Normal;
+        OllamaStopCondition mStopCondition;                                 ///< Ends the response when it fires, the request is cancelled
+        std::uint64_t mRequestID = 0;                                       ///< Identifies the request in a trace
+        Clock::time_point mEnqueueTime;                                     ///< Used to measure the time spent waiting in the queue
+
+        std::function<void(const std::string&)> mOnToken;                   ///< Called for each token in the response, the answer only when the reasoning is split
+        std::function<void(const std::string&)> mOnReasoning;               ///< Called for each token of the reasoning, splits the reasoning when set
+        std::function<void(const OllamaJSONEvent&)> mOnValue;               ///< Called for every value of a JSON response that closed, requests a JSON response when set
+        OllamaJSONSchema mSchema;                                           ///< The schema of a JSON response
+        std::function<void(const OllamaRequestStats&)> mOnComplete;         ///< Called with the timings of the request when the response is complete
+        std::function<void(const std::string&)> mOnError;
+
+        /**
+         * Requests a JSON response, the response completes with the text of the root value, the last value
+         */
+        void setJSONCallbacks(const OllamaJSONSchema& schema, const std::function<void(const OllamaJSONEvent&)>& onValue, const std::function<void(const std::string&)>& onComplete)
         {
-            mServer = std::make_unique<Ollama>();
+            auto root = std::make_shared<std::string>();
+            mSchema = schema;
+            mOnValue = [root, onValue](const OllamaJSONEvent& event)
+            {
+                if (event.isRoot())
+                    *root = event.mValue;
+                onValue(event);
+            };
+            mOnComplete = [root, onComplete](const OllamaRequestStats&) { onComplete(*root); };
         }
+    };
 
-        // Ollama server
-        std::unique_ptr<Ollama> mServer;
 
-        // Context for the next chat message
-        ollama::response mContext;
-    };
+    OllamaJoin::OllamaJoin() : mState(std::make_shared<State>())
+    { }
+
+
+    std::future<std::vector<std::future<OllamaResult>>> OllamaJoin::whenAll()
+    {
+        auto future = mState->mPromise.get_future();
+        std::lock_guard lk(mState->mMutex);
+        mState->mJoined = true;
+        if (mState->mPending == 0)
+            mState->mPromise.set_value(std::move(mState->mFutures));
+        return future;
+    }
+
+
+    void OllamaJoin::add(std::future<OllamaResult> future)
+    {
+        std::lock_guard lk(mState->mMutex);
+        mState->mFutures.emplace_back(std::move(future));
+    }
+
+
+    void OllamaJoin::complete(State& state)
+    {
+        std::lock_guard lk(state.mMutex);
+        if (--state.mPending == 0 && state.mJoined)
+            state.mPromise.set_value(std::move(state.mFutures));
+    }
 
 
     OllamaChat::OllamaChat(OllamaService& service) : Device(), mService(service)
@@ -45,30 +144,41 @@ namespace nap
         mServerURL = mServerURLSetting;
         mModel = mModelSetting;
 
-        // Create the ollama server
-        mImpl = std::make_unique<Impl>();
-
-        // check if server is running
-        if (!errorState.check(mImpl->mServer->is_running(), "Ollama server is not running!"))
+        // Connect to the ollama server, or to every server of the backend set
+        if (!errorState.check(mConnectTimeout > 0, "ConnectTimeout must be at least 1 second"))
+            return false;
+        if (!errorState.check(mMaxConcurrentSessions > 0, "MaxConcurrentSessions must be at least 1"))
+            return false;
+        if (!errorState.check(mReasoningChunkBudget >= 0 && mReasoningTimeBudget >= 0.0f, "Reasoning budget can't be negative"))
+            return false;
+        if (!errorState.check(mMaxToolRounds > 0, "MaxToolRounds must be at least 1"))
+            return false;
+        if (!errorState.check(mSnapshotInterval >= 0.0f, "SnapshotInterval can't be negative"))
             return false;
 
-        // check if model is available
-        auto models = mImpl->mServer->list_models();
-        auto it = std::find_if(models.begin(), models.end(), [this](const std::string& model) { return model == mModel; });
-        if (!errorState.check(it != models.end(), utility::stringFormat("%s model not found!", mModel.c_str())))
+        // Compile the stop conditions of prompts that don't specify their own
+        mStopCondition = OllamaStopCondition();
+        for (const auto& sequence : mStopSequences)
+            mStopCondition.addSequence(sequence);
+        for (const auto& pattern : mStopPatterns)
         {
-            nap::Logger::info("Models found : ");
-            for (const auto& model : models)
-            {
-                nap::Logger::info(" ---- %s", model.c_str());
-            }
-
-            return false;
+            if (!mStopCondition.addPattern(pattern, errorState))
+                return false;
         }
+        mStopCondition.setStopOnCompleteJSON(mStopOnCompleteJSON);
+        mImpl = std::make_unique<Impl>(mBackends != nullptr ? mBackends->getURLs() : std::vector<std::string>{ mServerURL }, mConnectTimeout);
+        mImpl->mSessions.setMemoryLimit(static_cast<std::size_t>(std::max(mSessionMemoryLimit, 0.0f) * 1024.0f * 1024.0f));
+
+        // Restore the sessions saved before the app restarted
+        restoreSnapshot();
+        mLastSnapshot = Clock::now();
 
-        // Start the worker thread
+        // Start the worker threads, the first connects to the server in the background
+        mState = EState::Connecting;
+        mModelAvailable = false;
         mRunning = true;
-        mWorkerThread = std::thread([this] { onWork(); });
+        for (int i = 0; i < mMaxConcurrentSessions; i++)
+            mWorkerThreads.emplace_back([this, i] { onWork(i == 0); });
 
         // Register the chat with the ollama service
         mService.registerChat(*this);
@@ -79,11 +189,47 @@ namespace nap
 
     void OllamaChat::stop()
     {
-        // Stop the worker thread & join
+        // Stop the worker thread & join, closing the connection of a probe in progress.
+        // The workers stop taking prompts before the responses in progress are stopped
+        {
+            std::unique_lock lock(mTaskQueueMutex);
+            mRunning = false;
+        }
         stopResponse();
-        mRunning = false;
-        mSignalWorkerThreadContinue.notify_one();
-        mWorkerThread.join();
+        mService.mScheduler.cancel(*this, "Chat stopped");
+        if (mState == EState::Connecting)
+            mImpl->mConnections.stop();
+        mSignalWorkerThreadContinue.notify_all();
+        for (auto& thread : mWorkerThreads)
+            thread.join();
+        mWorkerThreads.clear();
+
+        // Drop the prompts that did not start, their requests were removed from the scheduler and failed with 'Chat stopped'
+        {
+            std::unique_lock lock(mTaskQueueMutex);
+            mWorkerThreadTaskQueue.clear();
+        }
+
+        // Deliver the callbacks that are still queued, including the errors of the dropped prompts, no update follows
+        runMainThreadTasks();
+
+        // Cancel the pull & wait for it to finish
+        if (mPullFinished.valid())
+        {
+            for (auto& server : mImpl->mPullServers)
+                server->stop();
+            mPullFinished.wait();
+        }
+
+        // Save the sessions once the snapshot in progress is written, no response changes them anymore
+        if (mSnapshotFinished.valid())
+            mSnapshotFinished.wait();
+        if (!mSnapshotPath.empty())
+        {
+            utility::ErrorState error_state;
+            if (!writeSnapshot(error_state))
+                nap::Logger::error("Unable to save sessions: %s", error_state.toString().c_str());
+        }
 
         // Unregister the chat with the ollama service
         mService.removeChat(*this);
@@ -93,186 +239,1505 @@ namespace nap
     void OllamaChat::update()
     {
         // Execute tasks on the main thread queued
-        if(mMainThreadTaskQueue.size_approx() > 0)
+        runMainThreadTasks();
+
+        // Save the sessions periodically
+        if (!mSnapshotPath.empty() && mSnapshotInterval > 0.0f && Clock::now() - mLastSnapshot >= std::chrono::duration<float>(mSnapshotInterval))
         {
-            Task task;
-            while (mMainThreadTaskQueue.try_dequeue(task))
-                task();
+            mLastSnapshot = Clock::now();
+            saveSnapshot();
+        }
+    }
+
+
+    void OllamaChat::runMainThreadTasks()
+    {
+        if(mMainThreadTaskQueue.size_approx() == 0)
+            return;
+
+        MainThreadTask task;
+        while (mMainThreadTaskQueue.try_dequeue(task))
+        {
+            // Record the time the task spent waiting for the main thread
+            auto lag = Clock::now() - task.mEnqueueTime;
+            mMetrics.mDeliveryLag.record(lag);
+            mService.mMetrics.mDeliveryLag.record(lag);
+
+            OLLAMA_TRACE_SCOPE("Callback", task.mRequestID);
+            OLLAMA_TRACE_FLOW_END("Deliver", task.mFlowID);
+            task.mTask();
         }
     }
 
 
     void OllamaChat::stopResponse()
     {
-        // Only stop if we are streaming
-        if (mStreaming)
+        for (const auto& session : mImpl->mSessions.getAll())
+            stopResponse(*session);
+    }
+
+
+    void OllamaChat::stopResponse(SessionID session)
+    {
+        auto chat_session = mImpl->mSessions.find(session);
+        if (chat_session != nullptr)
+            stopResponse(*chat_session);
+    }
+
+
+    void OllamaChat::stopResponse(OllamaSession& session)
+    {
+        // Only stop if we are streaming, the flag is cleared first so a request that starts a connection after the stop sees it
+        if (session.mStreaming.exchange(false))
         {
             // Stop is effectively closing the http connection
-            mImpl->mServer->stop();
-            mStreaming = false;
+            session.mActiveServer.stop();
         }
     }
 
 
+    OllamaChat::SessionID OllamaChat::createSession()
+    {
+        return mImpl->mSessions.create();
+    }
+
+
+    OllamaChat::SessionID OllamaChat::forkSession(SessionID session)
+    {
+        return mImpl->mSessions.fork(session);
+    }
+
+
+    void OllamaChat::destroySession(SessionID session)
+    {
+        auto destroyed = mImpl->mSessions.destroy(session);
+        if (destroyed == nullptr)
+            return;
+
+        destroyed->mDestroyed = true;
+        stopResponse(*destroyed);
+    }
+
+
+    std::size_t OllamaChat::getSessionCount()
+    {
+        return mImpl->mSessions.getCount();
+    }
+
+
+    std::vector<OllamaChat::SessionID> OllamaChat::getSessions()
+    {
+        return mImpl->mSessions.getIDs();
+    }
+
+
+    void OllamaChat::saveSnapshot()
+    {
+        if (mSnapshotPath.empty())
+            return;
+        if (mSnapshotFinished.valid() && mSnapshotFinished.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+
+        auto finished = std::make_shared<std::promise<void>>();
+        mSnapshotFinished = finished->get_future();
+        mService.enqueueTask([this, finished]()
+        {
+            utility::ErrorState error_state;
+            if (!writeSnapshot(error_state))
+                nap::Logger::error("Unable to save sessions: %s", error_state.toString().c_str());
+            finished->set_value();
+        });
+    }
+
+
+    std::string OllamaChat::getModelDigest()
+    {
+        return mImpl->mSessions.getModelDigest();
+    }
+
+
+    std::size_t OllamaChat::getSessionMemory()
+    {
+        return mImpl->mSessions.getMemory();
+    }
+
+
+    void OllamaChat::chat(const std::string& message,
+                          const std::function<void(const std::string&)>& callback,
+                          const std::function<void()>& onComplete,
+                          const std::function<void(const std::string&)>& onError,
+                          const OllamaPromptOptions& options)
+    {
+        auto prompt = createPrompt(message, onError, options);
+        prompt.mOnToken = callback;
+        prompt.mOnComplete = [onComplete](const OllamaRequestStats&) { onComplete(); };
+        enqueueChat(std::move(prompt), true);
+    }
+
+
     void OllamaChat::chatAsync(const std::string& message,
                                const std::function<void(const std::string&)>& callback,
                                const std::function<void()>& onComplete,
-                               const std::function<void(const std::string&)>& onError)
+                               const std::function<void(const std::string&)>& onError,
+                               const OllamaPromptOptions& options)
     {
-        // Enqueue the chat blocking task to be executed by the worker thread
-        enqueueWorkerTask([this, message, callback, onComplete, onError]()
-                          {
-                              chatBlocking(message, callback, onComplete, onError);
-                          });
+        auto prompt = createPrompt(message, onError, options);
+        prompt.mOnToken = callback;
+        prompt.mOnComplete = [onComplete](const OllamaRequestStats&) { onComplete(); };
+        enqueueChat(std::move(prompt), false);
     }
 
 
-    void OllamaChat::chat(const std::string &message, const std::function<void(const std::string &)> &callback,
-                          const std::function<void()> &onComplete,
-                          const std::function<void(const std::string &)> &onError)
+    void OllamaChat::chatWithReasoning(const std::string& message,
+                                       const std::function<void(const std::string&)>& onReasoning,
+                                       const std::function<void(const std::string&)>& onAnswer,
+                                       const std::function<void()>& onComplete,
+                                       const std::function<void(const std::string&)>& onError,
+                                       const OllamaPromptOptions& options)
     {
-        enqueueWorkerTask([this, message, callback, onComplete, onError]()
+        auto prompt = createPrompt(message, onError, options);
+        prompt.mOnToken = onAnswer;
+        prompt.mOnReasoning = onReasoning;
+        prompt.mOnComplete = [onComplete](const OllamaRequestStats&) { onComplete(); };
+        enqueueChat(std::move(prompt), true);
+    }
+
+
+    void OllamaChat::chatJSON(const std::string& message,
+                              const OllamaJSONSchema& schema,
+                              const std::function<void(const OllamaJSONEvent&)>& onValue,
+                              const std::function<void(const std::string&)>& onComplete,
+                              const std::function<void(const std::string&)>& onError,
+                              const OllamaPromptOptions& options)
+    {
+        auto prompt = createPrompt(message, onError, options);
+        prompt.setJSONCallbacks(schema, onValue, onComplete);
+        enqueueChat(std::move(prompt), true);
+    }
+
+
+    void OllamaChat::chatJSONAsync(const std::string& message,
+                                   const OllamaJSONSchema& schema,
+                                   const std::function<void(const OllamaJSONEvent&)>& onValue,
+                                   const std::function<void(const std::string&)>& onComplete,
+                                   const std::function<void(const std::string&)>& onError,
+                                   const OllamaPromptOptions& options)
+    {
+        auto prompt = createPrompt(message, onError, options);
+        prompt.setJSONCallbacks(schema, onValue, onComplete);
+        enqueueChat(std::move(prompt), false);
+    }
+
+
+    void OllamaChat::chatWithTools(const std::string& message,
+                                   const std::function<void(const std::string&)>& callback,
+                                   const std::function<void()>& onComplete,
+                                   const std::function<void(const std::string&)>& onError,
+                                   const OllamaPromptOptions& options)
+    {
+        auto prompt = createPrompt(message, onError, options);
+        prompt.mOnToken = callback;
+        prompt.mOnComplete = [onComplete](const OllamaRequestStats&) { onComplete(); };
+        enqueueToolChat(std::move(prompt), true);
+    }
+
+
+    void OllamaChat::chatWithToolsAsync(const std::string& message,
+                                        const std::function<void(const std::string&)>& callback,
+                                        const std::function<void()>& onComplete,
+                                        const std::function<void(const std::string&)>& onError,
+                                        const OllamaPromptOptions& options)
+    {
+        auto prompt = createPrompt(message, onError, options);
+        prompt.mOnToken = callback;
+        prompt.mOnComplete = [onComplete](const OllamaRequestStats&) { onComplete(); };
+        enqueueToolChat(std::move(prompt), false);
+    }
+
+
+    void OllamaChat::fanOut(const std::string& message,
+                            const OllamaFanOut& fanOut,
+                            const std::function<void(int, const std::string&)>& callback,
+                            const std::function<void(const OllamaFanOutResult&)>& onComplete,
+                            const std::function<void(const std::string&)>& onError,
+                            const OllamaPromptOptions& options)
+    {
+        enqueueFanOut(createPrompt(message, onError, options), fanOut, callback, onComplete, true);
+    }
+
+
+    void OllamaChat::fanOutAsync(const std::string& message,
+                                 const OllamaFanOut& fanOut,
+                                 const std::function<void(int, const std::string&)>& callback,
+                                 const std::function<void(const OllamaFanOutResult&)>& onComplete,
+                                 const std::function<void(const std::string&)>& onError,
+                                 const OllamaPromptOptions& options)
+    {
+        enqueueFanOut(createPrompt(message, onError, options), fanOut, callback, onComplete, false);
+    }
+
+
+    void OllamaChat::cascade(const std::string& message,
+                             const OllamaCascade& cascade,
+                             const std::function<void(const std::string&)>& callback,
+                             const std::function<void(const std::string&)>& onEscalate,
+                             const std::function<void(const OllamaCascadeResult&)>& onComplete,
+                             const std::function<void(const std::string&)>& onError,
+                             const OllamaPromptOptions& options)
+    {
+        auto prompt = createPrompt(message, onError, options);
+        prompt.mOnToken = callback;
+        enqueueCascade(std::move(prompt), cascade, onEscalate, onComplete, true);
+    }
+
+
+    void OllamaChat::cascadeAsync(const std::string& message,
+                                  const OllamaCascade& cascade,
+                                  const std::function<void(const std::string&)>& callback,
+                                  const std::function<void(const std::string&)>& onEscalate,
+                                  const std::function<void(const OllamaCascadeResult&)>& onComplete,
+                                  const std::function<void(const std::string&)>& onError,
+                                  const OllamaPromptOptions& options)
+    {
+        auto prompt = createPrompt(message, onError, options);
+        prompt.mOnToken = callback;
+        enqueueCascade(std::move(prompt), cascade, onEscalate, onComplete, false);
+    }
+
+
+    std::future<OllamaResult> OllamaChat::chatFuture(const std::string& message, const OllamaPromptOptions& options)
+    {
+        return enqueueFuture(message, options, nullptr);
+    }
+
+
+    void OllamaChat::chatFuture(const std::string& message, OllamaJoin& join, const OllamaPromptOptions& options)
+    {
+        // The prompt is counted before it is enqueued, a prompt that fails right away counts down the join before its future is added
+        {
+            std::lock_guard lk(join.mState->mMutex);
+            join.mState->mPending++;
+        }
+        join.add(enqueueFuture(message, options, join.mState));
+    }
+
+
+    template<typename... Args>
+    std::function<void(Args...)> OllamaChat::onMainThread(const std::function<void(Args...)>& callback, std::uint64_t requestID)
+    {
+        if (callback == nullptr)
+            return nullptr;
+        return [this, callback, requestID](Args... args)
+        {
+            enqueueMainThreadTask([callback, args...]() { callback(args...); }, requestID);
+        };
+    }
+
+
+    OllamaChat::Prompt OllamaChat::createPrompt(const std::string& message, const std::function<void(const std::string&)>& onError, const OllamaPromptOptions& options)
+    {
+        Prompt prompt;
+        prompt.mMessage = message;
+        prompt.mSession = options.mSession;
+        prompt.mPriority = options.mPriority.value_or(mPriority);
+        prompt.mStopCondition = options.mStopCondition.value_or(mStopCondition);
+        prompt.mRequestID = createRequestID();
+        prompt.mEnqueueTime = Clock::now();
+        prompt.mOnError = onError;
+        return prompt;
+    }
+
+
+    void OllamaChat::deliverOnMainThread(Prompt& prompt)
+    {
+        prompt.mOnToken = onMainThread(prompt.mOnToken, prompt.mRequestID);
+        prompt.mOnReasoning = onMainThread(prompt.mOnReasoning, prompt.mRequestID);
+        prompt.mOnValue = onMainThread(prompt.mOnValue, prompt.mRequestID);
+        prompt.mOnComplete = onMainThread(prompt.mOnComplete, prompt.mRequestID);
+        prompt.mOnError = onMainThread(prompt.mOnError, prompt.mRequestID);
+    }
+
+
+    void OllamaChat::enqueueChat(Prompt prompt, bool mainThread)
+    {
+        if (mainThread)
+            deliverOnMainThread(prompt);
+        enqueueRequest(prompt, [this, prompt](OllamaSession& session, OllamaScheduler::Slot& slot)
+        {
+            chatBlocking(session, slot, prompt);
+        });
+    }
+
+
+    void OllamaChat::enqueueToolChat(Prompt prompt, bool mainThread)
+    {
+        if (mainThread)
+            deliverOnMainThread(prompt);
+        enqueueRequest(prompt, [this, prompt](OllamaSession& session, OllamaScheduler::Slot&)
+        {
+            chatToolsBlocking(session, prompt);
+        });
+    }
+
+
+    void OllamaChat::enqueueFanOut(Prompt prompt, const OllamaFanOut& fanOut,
+                                   const std::function<void(int, const std::string&)>& callback,
+                                   const std::function<void(const OllamaFanOutResult&)>& onComplete,
+                                   bool mainThread)
+    {
+        if (mainThread)
+            deliverOnMainThread(prompt);
+        auto on_token = mainThread ? onMainThread(callback, prompt.mRequestID) : callback;
+        auto on_complete = mainThread ? onMainThread(onComplete, prompt.mRequestID) : onComplete;
+
+        utility::ErrorState error_state;
+        if (!fanOut.validate(error_state))
+        {
+            prompt.mOnError(error_state.toString());
+            return;
+        }
+
+        enqueueRequest(prompt, [this, prompt, fanOut, on_token, on_complete](OllamaSession& session, OllamaScheduler::Slot&)
+        {
+            fanOutBlocking(session, prompt, fanOut, on_token, on_complete);
+        });
+    }
+
+
+    void OllamaChat::enqueueCascade(Prompt prompt, const OllamaCascade& cascade,
+                                    const std::function<void(const std::string&)>& onEscalate,
+                                    const std::function<void(const OllamaCascadeResult&)>& onComplete,
+                                    bool mainThread)
+    {
+        if (mainThread)
+            deliverOnMainThread(prompt);
+        auto on_escalate = mainThread ? onMainThread(onEscalate, prompt.mRequestID) : onEscalate;
+        auto on_complete = mainThread ? onMainThread(onComplete, prompt.mRequestID) : onComplete;
+
+        utility::ErrorState error_state;
+        if (!cascade.validate(error_state))
+        {
+            prompt.mOnError(error_state.toString());
+            return;
+        }
+
+        enqueueRequest(prompt, [this, prompt, cascade, on_escalate, on_complete](OllamaSession& session, OllamaScheduler::Slot&)
+        {
+            cascadeBlocking(session, prompt, cascade, on_escalate, on_complete);
+        });
+    }
+
+
+    std::future<OllamaResult> OllamaChat::enqueueFuture(const std::string& message, const OllamaPromptOptions& options, const std::shared_ptr<OllamaJoin::State>& join)
+    {
+        // The response is collected on the worker thread, the future is completed once
+        struct FutureState
+        {
+            ~FutureState()
+            {
+                // A prompt that was dropped without reporting its error, such as a prompt admitted while the chat stopped, fails and still counts down its join
+                if (mCompleted)
+                    return;
+                mPromise.set_exception(std::make_exception_ptr(std::runtime_error("Prompt dropped before it completed")));
+                if (mJoin != nullptr)
+                    OllamaJoin::complete(*mJoin);
+            }
+
+            std::promise<OllamaResult> mPromise;
+            OllamaResult mResult;
+            std::atomic_bool mCompleted = false;
+            std::shared_ptr<OllamaJoin::State> mJoin;
+        };
+        auto state = std::make_shared<FutureState>();
+        state->mJoin = join;
+        auto future = state->mPromise.get_future();
+
+        auto prompt = createPrompt(message, [state](const std::string& error)
+        {
+            if (state->mCompleted.exchange(true))
+                return;
+            state->mPromise.set_exception(std::make_exception_ptr(std::runtime_error(error)));
+            if (state->mJoin != nullptr)
+                OllamaJoin::complete(*state->mJoin);
+        }, options);
+        prompt.mOnToken = [state](const std::string& token) { state->mResult.mText += token; };
+        if (mSplitReasoning)
+            prompt.mOnReasoning = [state](const std::string& token) { state->mResult.mReasoning += token; };
+        prompt.mOnComplete = [state, enqueue_time = prompt.mEnqueueTime](const OllamaRequestStats& stats)
+        {
+            if (state->mCompleted.exchange(true))
+                return;
+            state->mResult.mStats = stats;
+            state->mResult.mTotalTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - enqueue_time).count();
+            state->mPromise.set_value(std::move(state->mResult));
+            if (state->mJoin != nullptr)
+                OllamaJoin::complete(*state->mJoin);
+        };
+        enqueueChat(std::move(prompt), false);
+        return future;
+    }
+
+
+    void OllamaChat::enqueueRequest(const Prompt& prompt, const RequestTask& request)
+    {
+        auto session = mImpl->mSessions.find(prompt.mSession);
+        if (session == nullptr)
+        {
+            prompt.mOnError("Unknown session " + std::to_string(prompt.mSession));
+            return;
+        }
+
+        // Admit the request, a rejected request fails immediately or on the next update
+        std::string error;
+        if (!mService.mScheduler.admit(*this, prompt.mRequestID, prompt.mPriority, prompt.mOnError, error))
+        {
+            prompt.mOnError(error);
+            return;
+        }
+
+        OLLAMA_TRACE_INSTANT("Enqueue", prompt.mRequestID);
+        enqueueWorkerTask([this, session, request_id = prompt.mRequestID, on_error = prompt.mOnError, request]()
                           {
-                              chatBlocking(message,
-                                           [this, callback](const std::string &response)
-                                           {
-                                               // Execute the callback on the main thread
-                                               enqueueMainThreadTask([callback, response]()
-                                                                     { callback(response); });
-                                           },
-                                           [this, onComplete]()
-                                           {
-                                               // Execute the onComplete callback on the main thread
-                                               enqueueMainThreadTask(onComplete);
-                                           },
-                                           [this, onError](const std::string &error)
-                                           {
-                                               // Execute the onError callback on the main thread
-                                               enqueueMainThreadTask([onError, error]()
-                                                                     { onError(error); });
-                                           });
-                          });
-    }
-
-
-    void OllamaChat::chatBlocking(const std::string &message,
-                                  const std::function<void(const std::string &)> &callback,
-                                  const std::function<void()> &onComplete,
-                                  const std::function<void(const std::string &)> &onError)
+                              runRequest(*session, request_id, on_error, request);
+                          }, prompt.mPriority, prompt.mSession);
+    }
+
+
+    void OllamaChat::runRequest(OllamaSession& session, std::uint64_t requestID, const std::function<void(const std::string&)>& onError, const RequestTask& request)
     {
+        OLLAMA_TRACE_SCOPE("Request", requestID);
+
+        // Wait for the scheduler to start the request, a shed or cancelled request already reported its error
+        auto slot = mService.mScheduler.acquire(requestID);
+        if (!slot.isValid())
+            return;
+
+        if (session.mDestroyed)
+        {
+            onError("Session destroyed");
+            return;
+        }
+
         try
         {
             // The ollama server is responding
-            mStreaming = true;
+            session.mStreaming = true;
+            request(session, slot);
+        }
+        catch (const std::exception& exception)
+        {
+            session.mStreaming = false;
+            mMetrics.recordError();
+            mService.mMetrics.recordError();
+            onError(exception.what());
+        }
+    }
+
+
+    void OllamaChat::chatBlocking(OllamaSession& session, OllamaScheduler::Slot& slot, const Prompt& prompt)
+    {
+        // Client side timings of this request
+        OllamaRequestStats stats;
+        auto send_time = Clock::now();
+        auto last_token_time = send_time;
+        bool received_frame = false;
+        bool completed = false;
 
-            // Get the current context
-            ollama::response context = getContext();
+        // Evaluated over the tokens of this response
+        auto stop_condition = prompt.mStopCondition;
+        stop_condition.reset();
 
-            // Prompt the server to generate a response,
-            // callback handles the responses (response is one token at a time)
-            // this function will block until the response is complete
-            mImpl->mServer->generate(mModel,
-                                     message,
-                                     context,
-                                    [this, callback, onComplete](const ollama::response& response)
-                                    {
-                                        // The last response is the context for the next prompt
-                                        setContext(response);
+        // A JSON response is parsed while it streams in and ends when the root value closes
+        bool json_response = prompt.mOnValue != nullptr;
+        OllamaJSONParser json_parser(prompt.mSchema);
+        std::vector<OllamaJSONEvent> json_events;
+        if (json_response)
+            stop_condition.setStopOnCompleteJSON(true);
 
-                                        // Call the callback with the response
-                                        std::string response_str = response;
-                                        callback(response_str);
+        // Splits the reasoning from the answer, reasoning that exceeds its budget is cut off
+        bool split_reasoning = mSplitReasoning || prompt.mOnReasoning != nullptr;
+        bool reasoning_budget = split_reasoning && (mReasoningChunkBudget > 0 || mReasoningTimeBudget > 0.0f);
+        OllamaThinkSplitter splitter;
+        std::uint64_t reasoning_chunks = 0;
+        std::string reasoning_so_far;
+        bool over_budget = false;
 
-                                        // If the response is done, call the onComplete callback
-                                        if (response.as_json()["done"]==true)
-                                        {
-                                            onComplete();
-                                            mStreaming = false;
-                                        }
-                                    });
-        }catch (const std::exception& exception)
+        // Identical requests in flight share the response of the request that leads the flight
+        OllamaSingleFlight::Ticket ticket;
+
+        try
+        {
+            // Create the request, continuing from the context of the session
+            ollama::request request(mModel, prompt.mMessage, nullptr, true);
+            request["keep_alive"] = mService.getResidency().getKeepAlive();
+            auto context = mImpl->mSessions.getContext(prompt.mSession);
+            if (!context.empty())
+                request["context"] = std::move(context);
+            if (json_response)
+                request["format"] = prompt.mSchema.isEmpty() ? nlohmann::json("json") : nlohmann::json::parse(prompt.mSchema.getText());
+            // A request with a reasoning budget may be sent again, it is not shared
+            if (mDeduplicateRequests && !reasoning_budget)
+                ticket = mService.mSingleFlight.join(request.dump() + stop_condition.getKey());
+
+            // Passes text of the response to the callback, values of a JSON response are parsed first
+            auto deliver = [&](const std::string& text)
+            {
+                if (json_response)
+                {
+                    if (!json_parser.feed(text, json_events))
+                        throw ollama::exception("Invalid JSON response: " + json_parser.getError());
+                    for (const auto& event : json_events)
+                        prompt.mOnValue(event);
+                }
+                if (prompt.mOnToken != nullptr)
+                    prompt.mOnToken(text);
+            };
+
+            // Handles the frames of the response, one token at a time
+            auto on_frame = [&](const std::string& frame)
+            {
+                OLLAMA_TRACE_SCOPE("Frame", prompt.mRequestID);
+
+                // Pass the frame to the requests following this request
+                if (ticket.isLeader())
+                    ticket.publish(frame);
+
+                auto now = Clock::now();
+                if (!received_frame)
+                {
+                    OLLAMA_TRACE_INSTANT("FirstByte", prompt.mRequestID);
+                    received_frame = true;
+                }
+
+                // Parse the frame
+                OLLAMA_TRACE_BEGIN("Parse", prompt.mRequestID);
+                ollama::response response(frame);
+                OLLAMA_TRACE_END("Parse", prompt.mRequestID);
+                if (response.has_error())
+                    throw ollama::exception("Ollama response returned error: " + response.get_error());
+
+                // Record time to first byte & token and the latency between tokens
+                recordFrame(stats, send_time, last_token_time, !response.as_simple_string().empty());
+
+                // The last response is the context for the next prompt, a cancelled response keeps the context before the prompt
+                bool done = response.as_json()["done"] == true;
+                if (done)
+                    mImpl->mSessions.setContext(prompt.mSession, response);
+
+                // Split the reasoning from the answer, servers that split the reasoning themselves send it in a field of its own
+                std::string response_str = response;
+                if (split_reasoning)
+                {
+                    std::string reasoning, answer, held_reasoning, held_answer;
+                    splitter.feed(response_str, reasoning, answer);
+                    if (done)
+                    {
+                        splitter.flush(held_reasoning, held_answer);
+                        reasoning += held_reasoning;
+                        answer += held_answer;
+                    }
+
+                    const auto& json = response.as_json();
+                    if (json.contains("thinking") && json["thinking"].is_string())
+                        reasoning = json["thinking"].get<std::string>() + reasoning;
+
+                    if (!reasoning.empty())
+                    {
+                        // The server only counts the tokens of a response once it is done, the budget counts the streamed chunks
+                        reasoning_chunks++;
+                        if (reasoning_budget)
+                            reasoning_so_far += reasoning;
+                        if (prompt.mOnReasoning != nullptr)
+                            prompt.mOnReasoning(reasoning);
+                    }
+                    response_str = answer;
+
+                    // Cancel the request when the reasoning exceeds its budget
+                    if (!done && reasoning_budget && (splitter.isReasoning() || !reasoning.empty()) &&
+                        exceedsReasoningBudget(reasoning_chunks, now - send_time))
+                    {
+                        over_budget = true;
+                        return false;
+                    }
+                }
+
+                // Call the callback with the response, up to where a stop condition fired
+                if (stop_condition.isEnabled())
+                {
+                    std::string output;
+                    if (stop_condition.feed(response_str, output))
+                    {
+                        // Complete the response & cancel the request, the server does not report its timings
+                        deliver(output);
+                        if (json_response && !json_parser.isComplete())
+                            throw ollama::exception("Invalid JSON response: the response stopped before the root value closed");
+                        mMetrics.recordEarlyStop();
+                        mService.mMetrics.recordEarlyStop();
+                        completeRequest(session, stats);
+                        completed = true;
+                        prompt.mOnComplete(stats);
+                        return false;
+                    }
+                    response_str = done ? output + stop_condition.flush() : output;
+                }
+                deliver(response_str);
+                if (done && json_response && !json_parser.isComplete())
+                    throw ollama::exception("Invalid JSON response: the response ended before the root value closed");
+
+                // If the response is done, record the server timings and call the onComplete callback
+                if (done)
+                {
+                    stats.readServerTimings(response);
+                    completeRequest(session, stats);
+                    completed = true;
+                    prompt.mOnComplete(stats);
+                }
+                return true;
+            };
+
+            // Time spent waiting for a free backend counts as queue time, a request sent again is measured from the first send
+            auto mark_send = [&]()
+            {
+                if (received_frame)
+                    return;
+                send_time = Clock::now();
+                last_token_time = send_time;
+                stats.mEnqueueToSend = std::chrono::duration_cast<std::chrono::microseconds>(send_time - prompt.mEnqueueTime).count();
+            };
+
+            // Follow the identical request in flight, replaying the frames it received so far.
+            // The follower sends no request and does not need a slot
+            if (ticket.isValid() && !ticket.isLeader())
+            {
+                OLLAMA_TRACE_INSTANT("Follow", prompt.mRequestID);
+                slot.release();
+                mark_send();
+                std::vector<std::string> frames;
+                while (ticket.read(frames, session.mStreaming))
+                {
+                    for (const auto& frame : frames)
+                        on_frame(frame);
+                }
+
+                if (!completed)
+                {
+                    auto error = ticket.getError();
+                    throw ollama::exception(!error.empty() ? error : session.mStreaming ? "Shared request ended before the response was complete" : "Response stopped");
+                }
+                return;
+            }
+
+            // Sends the request, the frames of the response are passed to the frame handler
+            auto send = [&]()
+            {
+                // Duplicate the request to another backend when the first token is late
+                auto hedge_delay = Clock::duration::zero();
+                if (mHedgeRequests && mBackends != nullptr)
+                    hedge_delay = OllamaHedge::getDelay(*mBackends, mService.mMetrics, mHedgePercentile);
+                if (hedge_delay.count() > 0)
+                {
+                    auto lease = acquireBackend("");
+                    mark_send();
+                    OLLAMA_TRACE_INSTANT("Send", prompt.mRequestID);
+                    OllamaHedge(mService, mImpl->mConnections, *mBackends, mModel, mMetrics).generate(session, request, on_frame, std::move(lease), hedge_delay);
+                    return;
+                }
+
+                // Route the request to a backend of the set, a request that can't reach its backend is retried on another backend
+                std::string failed_backend;
+                std::size_t attempts = mBackends != nullptr ? mBackends->getURLs().size() : 1;
+                for (std::size_t attempt = 1; ; attempt++)
+                {
+                    OllamaBackendSet::Lease lease;
+                    if (mBackends != nullptr)
+                        lease = acquireBackend(failed_backend);
+                    OllamaConnection server(mImpl->mConnections, mBackends != nullptr ? lease.getURL() : mServerURL, &session.mActiveServer);
+                    session.mActiveServer.set(&*server);
+                    if (attempt == 1)
+                        mark_send();
+
+                    try
+                    {
+                        // Prompt the server to generate a response,
+                        // callback handles the frames of the response (one token at a time)
+                        // this function will block until the response is complete
+                        OLLAMA_TRACE_INSTANT("Send", prompt.mRequestID);
+                        server->generate_frames(request, on_frame);
+                        lease.reportSuccess();
+                        return;
+                    }
+                    catch (const std::exception&)
+                    {
+                        // Only a backend that can't be reached counts as failed, errors of the server arrive as a frame
+                        if (!lease.isValid() || received_frame || !session.mStreaming)
+                            throw;
+
+                        lease.reportFailure();
+                        if (attempt >= attempts)
+                            throw;
+                        failed_backend = lease.getURL();
+                    }
+                }
+            };
+            send();
+
+            // The reasoning exceeded its budget and was cut off
+            if (over_budget && session.mStreaming)
+            {
+                mMetrics.recordReasoningCutoff();
+                mService.mMetrics.recordReasoningCutoff();
+
+                // Prompt again with thinking disabled and the reasoning delivered so far added to the prompt, for the answer to follow from it.
+                // A server that ignores the option reasons again and is cut off again
+                if (mReasoningBudgetAction == EOllamaReasoningBudgetAction::Answer)
+                {
+                    OLLAMA_TRACE_INSTANT("Answer", prompt.mRequestID);
+                    over_budget = false;
+                    splitter.reset();
+                    request["prompt"] = prompt.mMessage + "\n\nReasoning so far:\n" + reasoning_so_far + "\n\nAnswer without reasoning further.";
+                    request["think"] = false;
+                    send();
+                }
+
+                // Complete the response without answer, the server does not report its timings
+                if (!completed && session.mStreaming)
+                {
+                    completeRequest(session, stats);
+                    completed = true;
+                    prompt.mOnComplete(stats);
+                }
+            }
+        }
+        catch (const std::exception& exception)
+        {
+            // The requests following this request fail with the same error
+            if (ticket.isLeader())
+                ticket.fail(exception.what());
+            throw;
+        }
+    }
+
+
+    void OllamaChat::chatToolsBlocking(OllamaSession& session, const Prompt& prompt)
+    {
+        // Client side timings of the last request, the request that answers
+        OllamaRequestStats stats;
+        auto send_time = Clock::now();
+        auto last_token_time = send_time;
+
+        // Create the request, continuing the conversation of the session with tools
+        ollama::request request(mModel, ollama::messages(), nullptr, true);
+        request["keep_alive"] = mService.getResidency().getKeepAlive();
+        mImpl->mSessions.writeMessages(prompt.mSession, request);
+        request["messages"].push_back(ollama::message("user", prompt.mMessage));
+        request["tools"] = nlohmann::json::parse(mTools.getDefinitions());
+
+        // Prompt the model until it answers without calling tools, the follow up requests are sent from this worker thread
+        for (int round = 1; ; round++)
+        {
+            bool done = false;
+            std::string content;
+            auto tool_calls = nlohmann::json::array();
+            ollama::response last_response;
+
+            // Handles the frames of the response, the model may answer or call tools
+            auto on_frame = [&](const std::string& frame)
+            {
+                OLLAMA_TRACE_SCOPE("Frame", prompt.mRequestID);
+                ollama::response response(frame, ollama::message_type::chat);
+                if (response.has_error())
+                    throw ollama::exception("Ollama response returned error: " + response.get_error());
+
+                const auto& token = response.as_simple_string();
+                recordFrame(stats, send_time, last_token_time, !token.empty());
+                if (!token.empty())
+                {
+                    content += token;
+                    prompt.mOnToken(token);
+                }
+
+                for (const auto& call : response.get_tool_calls())
+                    tool_calls.push_back(call);
+
+                if (response.as_json()["done"] == true)
+                {
+                    done = true;
+                    last_response = response;
+                }
+                return session.mStreaming.load();
+            };
+
+            // Send the request to a backend of the set, or to the server
+            {
+                OllamaBackendSet::Lease lease;
+                if (mBackends != nullptr)
+                    lease = acquireBackend("");
+                OllamaConnection server(mImpl->mConnections, mBackends != nullptr ? lease.getURL() : mServerURL, &session.mActiveServer);
+                session.mActiveServer.set(&*server);
+
+                // Every request of the prompt is timed from its own send, the queue time is the time before the first request
+                send_time = Clock::now();
+                last_token_time = send_time;
+                auto enqueue_to_send = round == 1 ? std::chrono::duration_cast<std::chrono::microseconds>(send_time - prompt.mEnqueueTime).count() : stats.mEnqueueToSend;
+                stats = OllamaRequestStats();
+                stats.mEnqueueToSend = enqueue_to_send;
+
+                OLLAMA_TRACE_INSTANT("Send", prompt.mRequestID);
+                server->chat_frames(request, on_frame);
+                if (lease.isValid())
+                    lease.reportSuccess();
+            }
+            if (!done)
+                throw ollama::exception("Response stopped");
+            stats.readServerTimings(last_response);
+
+            // The answer or the tool calls of the model continue the conversation
+            ollama::message reply("assistant", content);
+            if (!tool_calls.empty())
+                reply["tool_calls"] = tool_calls;
+            request["messages"].push_back(reply);
+            if (tool_calls.empty())
+                break;
+
+            if (round >= mMaxToolRounds)
+                throw ollama::exception("Model kept calling tools for " + std::to_string(mMaxToolRounds) + " rounds");
+
+            // Execute the calls of this turn concurrently and send the results back to the model
+            std::vector<OllamaToolCall> calls;
+            for (const auto& tool_call : tool_calls)
+            {
+                OllamaToolCall call;
+                const auto& function = tool_call.value("function", nlohmann::json::object());
+                call.mName = function.value("name", "");
+                if (function.contains("arguments"))
+                {
+                    const auto& arguments = function["arguments"];
+                    call.mArguments = arguments.is_string() ? arguments.get<std::string>() : arguments.dump();
+                }
+                else
+                {
+                    call.mArguments = "{}";
+                }
+                calls.emplace_back(std::move(call));
+            }
+
+            OLLAMA_TRACE_BEGIN("Tools", prompt.mRequestID);
+            auto results = mTools.dispatch(calls, mService);
+            OLLAMA_TRACE_END("Tools", prompt.mRequestID);
+            for (const auto& result : results)
+                request["messages"].push_back(ollama::message::from_tool(result.mName, result.mContent));
+
+            if (!session.mStreaming)
+                throw ollama::exception("Response stopped");
+        }
+
+        // The conversation continues from the answer in the next prompt with tools
+        mImpl->mSessions.readMessages(prompt.mSession, request);
+
+        completeRequest(session, stats);
+        prompt.mOnComplete(stats);
+    }
+
+
+    void OllamaChat::fanOutBlocking(OllamaSession& session, const Prompt& prompt, const OllamaFanOut& fanOut,
+                                    const std::function<void(int, const std::string&)>& callback,
+                                    const std::function<void(const OllamaFanOutResult&)>& onComplete)
+    {
+        OllamaFanOutRace race(fanOut, callback, session.mStreaming);
+
+        // Sends the request of a branch and reports its frames to the race
+        auto send_branch = [&](int index)
+        {
+            OllamaFanOutBranchResult branch_result;
+            branch_result.mBranch = fanOut.mBranches[index];
+            auto& model = branch_result.mBranch.mModel;
+            auto& url = branch_result.mBranch.mServerURL;
+            if (model.empty())
+                model = mModel;
+            auto send_time = Clock::now();
+            auto last_token_time = send_time;
+
+            std::unique_ptr<OllamaConnection> connection;
+            try
+            {
+                // Route a branch without server to a backend of the set or the server of the chat
+                OllamaBackendSet::Lease lease;
+                if (url.empty() && mBackends != nullptr)
+                {
+                    lease = acquireBackend("", model);
+                    url = lease.getURL();
+                }
+                else if (url.empty())
+                {
+                    url = mServerURL;
+                }
+
+                connection = std::make_unique<OllamaConnection>(mImpl->mConnections, url);
+                if (!race.connect(index, **connection))
+                    throw ollama::exception("Response stopped");
+
+                ollama::request request(model, prompt.mMessage, nullptr, true);
+                request["keep_alive"] = mService.getResidency().getKeepAlive();
+                send_time = Clock::now();
+                last_token_time = send_time;
+                branch_result.mStats.mEnqueueToSend = std::chrono::duration_cast<std::chrono::microseconds>(send_time - prompt.mEnqueueTime).count();
+
+                OLLAMA_TRACE_INSTANT("Send", prompt.mRequestID);
+                (*connection)->generate_frames(request, [&](const std::string& frame)
+                {
+                    ollama::response response(frame);
+                    if (response.has_error())
+                        throw ollama::exception("Ollama response returned error: " + response.get_error());
+
+                    const auto& token = response.as_simple_string();
+                    bool done = response.as_json()["done"] == true;
+                    if (!race.feed(index, token, done))
+                        return false;
+
+                    recordFrame(branch_result.mStats, send_time, last_token_time, !token.empty());
+                    branch_result.mText += token;
+                    if (done)
+                    {
+                        branch_result.mStats.readServerTimings(response);
+                        branch_result.mCompleted = true;
+                    }
+                    return true;
+                });
+
+                if (lease.isValid() && branch_result.mCompleted)
+                    lease.reportSuccess();
+                if (!branch_result.mCompleted)
+                    throw ollama::exception("Response stopped");
+            }
+            catch (const std::exception& exception)
+            {
+                branch_result.mError = exception.what();
+            }
+            branch_result.mTotalTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - send_time).count();
+
+            // The connection returns to the pool once it can no longer be stopped by the other branches
+            race.finish(index, std::move(branch_result));
+            connection.reset();
+        };
+
+        // Stopping the prompt stops the branches in progress
+        session.mActiveServer.setStopHandler([&race]() { race.stop(); });
+        race.run(mService, prompt.mPriority, send_branch);
+        session.mActiveServer.setStopHandler(nullptr);
+
+        if (!session.mStreaming)
+            throw ollama::exception("Response stopped");
+
+        const auto& result = race.select();
+        completeRequest(session, result.getWinner().mStats);
+        onComplete(result);
+    }
+
+
+    void OllamaChat::cascadeBlocking(OllamaSession& session, const Prompt& prompt, const OllamaCascade& cascade,
+                                     const std::function<void(const std::string&)>& onEscalate,
+                                     const std::function<void(const OllamaCascadeResult&)>& onComplete)
+    {
+        ollama::request request(mModel, prompt.mMessage, nullptr, true);
+        request["keep_alive"] = mService.getResidency().getKeepAlive();
+        OllamaCascadeRun run(cascade, request);
+
+        while (true)
+        {
+            // Client side timings of the request of this model
+            OllamaRequestStats stats;
+            auto send_time = Clock::now();
+            auto last_token_time = send_time;
+            bool done = false;
+            bool escalate = false;
+            std::string text;
+
+            // Handles the frames of the response, the check of a smaller model is evaluated on every token
+            auto on_frame = [&](const std::string& frame)
+            {
+                OLLAMA_TRACE_SCOPE("Frame", prompt.mRequestID);
+                ollama::response response(frame);
+                if (response.has_error())
+                    throw ollama::exception("Ollama response returned error: " + response.get_error());
+
+                const auto& token = response.as_simple_string();
+                recordFrame(stats, send_time, last_token_time, !token.empty());
+                if (!token.empty())
+                {
+                    // Cancel the response as soon as it fails the check
+                    if (!run.feed(token))
+                    {
+                        escalate = true;
+                        return false;
+                    }
+                    text += token;
+                    prompt.mOnToken(token);
+                }
+
+                if (response.as_json()["done"] == true)
+                {
+                    done = true;
+                    stats.readServerTimings(response);
+                    escalate = !run.finish();
+                }
+                return session.mStreaming.load();
+            };
+
+            // Send the request to a backend of the set, or to the server
+            {
+                OllamaBackendSet::Lease lease;
+                if (mBackends != nullptr)
+                    lease = acquireBackend("", run.getModel());
+                OllamaConnection server(mImpl->mConnections, mBackends != nullptr ? lease.getURL() : mServerURL, &session.mActiveServer);
+                session.mActiveServer.set(&*server);
+
+                send_time = Clock::now();
+                last_token_time = send_time;
+                stats.mEnqueueToSend = std::chrono::duration_cast<std::chrono::microseconds>(send_time - prompt.mEnqueueTime).count();
+
+                OLLAMA_TRACE_INSTANT("Send", prompt.mRequestID);
+                server->generate_frames(run.getRequestBody(), on_frame);
+                if (lease.isValid())
+                    lease.reportSuccess();
+            }
+            if (!session.mStreaming)
+                throw ollama::exception("Response stopped");
+
+            // Escalate to the next model, the tokens delivered so far are discarded
+            if (escalate)
+            {
+                OLLAMA_TRACE_INSTANT("Escalate", prompt.mRequestID);
+                onEscalate(run.escalate());
+                continue;
+            }
+            if (!done)
+                throw ollama::exception("Response stopped");
+
+            run.complete(std::move(text), stats);
+            break;
+        }
+
+        auto& result = run.getResult();
+        mMetrics.recordCascade(result.mEscalations.size());
+        mService.mMetrics.recordCascade(result.mEscalations.size());
+        result.mTotalTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - prompt.mEnqueueTime).count();
+        completeRequest(session, result.mStats);
+        onComplete(result);
+    }
+
+
+    void OllamaChat::pullModel()
+    {
+        auto finished = std::make_shared<std::promise<void>>();
+        mPullFinished = finished->get_future();
+        mService.enqueueTask([this, finished]()
+        {
+            // Pull the model to every server that lacks it, one server at a time
+            bool pulled = true;
+            for (auto& pull_server : mImpl->mPullServers)
+            {
+                try
+                {
+                    // Stream the progress to the main thread, the pull is cancelled when the chat stops
+                    pulled = mRunning && pull_server->pull_model_with_progress(mModel, [this](const ollama::pull_progress& progress)
+                    {
+                        OllamaPullProgress pull_progress;
+                        pull_progress.mStatus = progress.status;
+                        pull_progress.mDigest = progress.digest;
+                        pull_progress.mTotal = progress.total_bytes;
+                        pull_progress.mCompleted = progress.completed_bytes;
+                        pull_progress.mAttempt = progress.attempt;
+                        {
+                            std::lock_guard lk(mPullMutex);
+                            mPullProgress = pull_progress;
+                        }
+                        enqueueMainThreadTask([this, pull_progress]() { pullProgressed.trigger(pull_progress); }, 0);
+                        return mRunning.load();
+                    });
+                }
+                catch (const std::exception& exception)
+                {
+                    nap::Logger::error("Unable to pull %s model: %s", mModel.c_str(), exception.what());
+                    pulled = false;
+                }
+                if (!pulled)
+                    break;
+            }
+
+            if (pulled)
+            {
+                nap::Logger::info("Pulled %s model", mModel.c_str());
+
+                // Contexts of the snapshot are only kept when the pulled model is the same version
+                try
+                {
+                    std::string digest;
+                    auto model_list = mImpl->mPullServers.front()->list_model_json();
+                    for (const auto& model : model_list["models"])
+                    {
+                        if (model.value("name", "") == mModel)
+                            digest = model.value("digest", "");
+                    }
+                    setModelDigest(digest);
+                }
+                catch (const std::exception&)
+                { }
+                mModelAvailable = true;
+            }
+
+            // Release the held prompts, when the pull failed they fail with the error of the server
+            setState(mModelAvailable ? EState::Ready : EState::Failed);
+            finished->set_value();
+        });
+    }
+
+
+    OllamaPullProgress OllamaChat::getPullProgress()
+    {
+        std::lock_guard lk(mPullMutex);
+        return mPullProgress;
+    }
+
+
+    OllamaRequestStats OllamaChat::getLastRequestStats()
+    {
+        std::lock_guard lk(mStatsMutex);
+        return mLastRequestStats;
+    }
+
+
+    bool OllamaChat::exceedsReasoningBudget(std::uint64_t chunks, Clock::duration duration) const
+    {
+        if (mReasoningChunkBudget > 0 && chunks > static_cast<std::uint64_t>(mReasoningChunkBudget))
+            return true;
+        return mReasoningTimeBudget > 0.0f && duration > std::chrono::duration<float>(mReasoningTimeBudget);
+    }
+
+
+    void OllamaChat::recordRequestStats(const OllamaRequestStats& stats)
+    {
+        mMetrics.recordRequest(stats);
+        mService.mMetrics.recordRequest(stats);
+
+        std::lock_guard lk(mStatsMutex);
+        mLastRequestStats = stats;
+    }
+
+
+    void OllamaChat::completeRequest(OllamaSession& session, const OllamaRequestStats& stats)
+    {
+        recordRequestStats(stats);
+        session.mStreaming = false;
+    }
+
+
+    void OllamaChat::recordFrame(OllamaRequestStats& stats, Clock::time_point sendTime, Clock::time_point& lastTokenTime, bool token)
+    {
+        // The first timings are at least 1us, 0 means that nothing arrived
+        auto now = Clock::now();
+        auto elapsed = std::max<std::uint64_t>(1, std::chrono::duration_cast<std::chrono::microseconds>(now - sendTime).count());
+        if (stats.mTimeToFirstByte == 0)
+            stats.mTimeToFirstByte = elapsed;
+        if (!token)
+            return;
+
+        if (stats.mTimeToFirstToken == 0)
         {
-            // Call onError callback on error
-            std::string error = exception.what();
-            mStreaming = false;
-            onError(error);
+            stats.mTimeToFirstToken = elapsed;
         }
+        else
+        {
+            mMetrics.mInterTokenLatency.record(now - lastTokenTime);
+            mService.mMetrics.mInterTokenLatency.record(now - lastTokenTime);
+        }
+        lastTokenTime = now;
     }
 
 
     void OllamaChat::clearContext()
     {
-        setContext("");
+        clearContext(defaultSession);
     }
 
 
-    void OllamaChat::setContext(const std::string& context)
+    void OllamaChat::clearContext(SessionID session)
     {
-        std::lock_guard lk(mContextMutex);
-        mImpl->mContext = ollama::response(context);
+        mImpl->mSessions.clear(session);
     }
 
 
-    ollama::response OllamaChat::getContext()
+    void OllamaChat::restoreSnapshot()
     {
-        std::lock_guard lk(mContextMutex);
-        return mImpl->mContext;
+        if (mSnapshotPath.empty() || !std::filesystem::exists(mSnapshotPath))
+            return;
+
+        OllamaSnapshot snapshot;
+        utility::ErrorState error_state;
+        if (!snapshot.read(mSnapshotPath, error_state))
+        {
+            nap::Logger::warn("Unable to restore sessions: %s", error_state.toString().c_str());
+            return;
+        }
+
+        // Contexts of another model are discarded, the digest is checked once the server reports it
+        mImpl->mSessions.restore(snapshot, snapshot.mModel == mModel);
+        nap::Logger::info("Restored %d sessions from %s", static_cast<int>(snapshot.mSessions.size()), mSnapshotPath.c_str());
     }
 
 
-    void OllamaChat::setContext(const ollama::response& context)
+    bool OllamaChat::writeSnapshot(utility::ErrorState& errorState)
     {
-        std::lock_guard lk(mContextMutex);
-        mImpl->mContext = context;
+        std::lock_guard snapshot_lock(mSnapshotMutex);
+        auto changes = mImpl->mSessions.getChanges();
+        if (changes == mSnapshotChanges)
+            return true;
+
+        OllamaSnapshot snapshot;
+        snapshot.mModel = mModel;
+        mImpl->mSessions.save(snapshot);
+        if (!snapshot.write(mSnapshotPath, errorState))
+            return false;
+        mSnapshotChanges = changes;
+        return true;
     }
 
 
-    void OllamaChat::onWork()
+    void OllamaChat::setModelDigest(const std::string& digest)
     {
-        // Worker thread loop
+        // Contexts generated with another version of the model are stale
+        auto discarded = mImpl->mSessions.setModelDigest(digest);
+        if (discarded > 0)
+            nap::Logger::info("Discarded %d contexts of another version of %s", static_cast<int>(discarded), mModel.c_str());
+    }
+
+
+    std::uint64_t OllamaChat::createRequestID()
+    {
+        static std::atomic<std::uint64_t> counter = { 0 };
+        return ++counter;
+    }
+
+
+    void OllamaChat::connect()
+    {
+        // Probe the server, or an available server of the backend set, until it responds, backing off exponentially
+        auto retry_interval = std::chrono::milliseconds(250);
+        auto max_retry_interval = std::chrono::milliseconds(static_cast<long long>(std::max(mMaxRetryInterval, 0.25f) * 1000.0f));
+        auto server_name = mBackends != nullptr ? mBackends->mID : mServerURL;
+        std::string server_url;
+        std::vector<std::string> models;
+        std::string digest;
+        bool reported = false;
         while (mRunning)
         {
-            // Swap the task queue to avoid locking the mutex for too long
-            std::vector<Task> task_queue;
+            try
             {
-                std::unique_lock lock(mTaskQueueMutex);
-                task_queue.swap(mWorkerThreadTaskQueue);
+                server_url = mBackends != nullptr ? mBackends->getAvailableURL() : mServerURL;
+                if (!server_url.empty())
+                {
+                    OllamaConnection server(mImpl->mConnections, server_url);
+                    if (server->is_running())
+                    {
+                        auto model_list = server->list_model_json();
+                        for (const auto& model : model_list["models"])
+                        {
+                            models.emplace_back(model["name"].get<std::string>());
+                            if (models.back() == mModel)
+                                digest = model.value("digest", "");
+                        }
+                        break;
+                    }
+                }
             }
+            catch (const std::exception&)
+            { }
 
-            // Execute tasks
-            for (auto& task : task_queue)
+            if (!reported)
             {
-                task();
+                nap::Logger::warn("Ollama server %s is not running, retrying in the background", server_name.c_str());
+                reported = true;
+            }
+
+            std::unique_lock lock(mTaskQueueMutex);
+            mSignalWorkerThreadContinue.wait_for(lock, retry_interval, [this]{ return !mRunning; });
+            retry_interval = std::min(retry_interval * 2, max_retry_interval);
+        }
 
-                // Bail out if we are no longer running
+        if (!mRunning)
+            return;
+
+        if (reported)
+            nap::Logger::info("Ollama server %s is running", server_name.c_str());
+
+        // check if model is available
+        auto it = std::find_if(models.begin(), models.end(), [this](const std::string& model) { return model == mModel; });
+        std::vector<std::string> missing;
+        if (it == models.end())
+            missing.emplace_back(server_url);
+
+        // A request can be routed to any backend of the set, so every backend that responds must have the model.
+        // Backends that don't respond are ejected by the health checks of the set until they do.
+        if (mBackends != nullptr)
+        {
+            for (const auto& url : mBackends->getURLs())
+            {
+                if (url == server_url)
+                    continue;
+                try
+                {
+                    OllamaConnection server(mImpl->mConnections, url);
+                    if (!server->is_running())
+                        continue;
+                    auto model_list = server->list_model_json();
+                    const auto& backend_models = model_list["models"];
+                    if (std::none_of(backend_models.begin(), backend_models.end(), [this](const nlohmann::json& model) { return model.value("name", "") == mModel; }))
+                        missing.emplace_back(url);
+                }
+                catch (const std::exception&)
+                { }
+            }
+        }
+
+        mModelAvailable = missing.empty();
+        if (mModelAvailable)
+        {
+            setModelDigest(digest);
+            setState(EState::Ready);
+            return;
+        }
+
+        // Pull the model in the background, on the servers that lack it
+        if (mPullModel)
+        {
+            nap::Logger::info("%s model not found, pulling it in the background", mModel.c_str());
+            for (const auto& url : missing)
+            {
+                mImpl->mPullServers.emplace_back(std::make_unique<Ollama>(url));
+            }
+            setState(EState::Pulling);
+            pullModel();
+            return;
+        }
+
+        for (const auto& url : missing)
+            nap::Logger::error("%s model not found on Ollama server %s!", mModel.c_str(), url.c_str());
+        if (it == models.end())
+        {
+            nap::Logger::info("Models found : ");
+            for (const auto& model : models)
+            {
+                nap::Logger::info(" ---- %s", model.c_str());
+            }
+        }
+        setState(EState::Failed);
+    }
+
+
+    OllamaBackendSet::Lease OllamaChat::acquireBackend(const std::string& exclude, const std::string& model)
+    {
+        // Wait for a free slot, checking if the chat stopped in between
+        while (mRunning)
+        {
+            auto lease = mBackends->acquire(model.empty() ? mModel : model, std::chrono::milliseconds(100), exclude);
+            if (lease.isValid())
+                return lease;
+
+            if (mBackends->getAvailableCount() == 0)
+                throw ollama::exception("No Ollama server of " + mBackends->mID + " is available");
+        }
+        throw ollama::exception("Chat stopped");
+    }
+
+
+    void OllamaChat::setState(EState state)
+    {
+        {
+            std::unique_lock lock(mTaskQueueMutex);
+            mState = state;
+        }
+
+        // Release the held prompts
+        if (!holdPrompts())
+            mSignalWorkerThreadContinue.notify_all();
+
+        if (state == EState::Ready)
+            enqueueMainThreadTask([this]() { ready.trigger(); }, 0);
+    }
+
+
+    void OllamaChat::onWork(bool connectToServer)
+    {
+        OLLAMA_TRACE_THREAD_NAME("OllamaChat worker");
+
+        // Wait for the server
+        if (connectToServer)
+            connect();
+
+        // Worker thread loop
+        while (mRunning)
+        {
+            // Take the oldest task of the highest priority class of a session that is not being served, tasks are held until the chat is ready
+            WorkerTask task;
+            {
+                std::unique_lock lock(mTaskQueueMutex);
+                auto next = mWorkerThreadTaskQueue.end();
+                mSignalWorkerThreadContinue.wait(lock, [this, &next]
+                {
+                    next = holdPrompts() ? mWorkerThreadTaskQueue.end() : findNextTask();
+                    return next != mWorkerThreadTaskQueue.end() || !mRunning;
+                });
                 if (!mRunning)
                     return;
+
+                task = std::move(*next);
+                mWorkerThreadTaskQueue.erase(next);
+                mBusySessions.insert(task.mSession);
             }
 
-            // Wait for more tasks
-            std::unique_lock lock(mTaskQueueMutex);
-            if (mWorkerThreadTaskQueue.empty())
-                mSignalWorkerThreadContinue.wait(lock, [this]{ return !mWorkerThreadTaskQueue.empty() || !mRunning; });
+            // Execute the task
+            task.mTask();
+
+            // Serve the next request of the session, compacting idle sessions when a context grew past the memory limit
+            {
+                std::unique_lock lock(mTaskQueueMutex);
+                mBusySessions.erase(task.mSession);
+            }
+            mSignalWorkerThreadContinue.notify_all();
+            mImpl->mSessions.compact();
+        }
+    }
+
+
+    std::vector<OllamaChat::WorkerTask>::iterator OllamaChat::findNextTask()
+    {
+        auto next = mWorkerThreadTaskQueue.end();
+        for (auto it = mWorkerThreadTaskQueue.begin(); it != mWorkerThreadTaskQueue.end(); ++it)
+        {
+            if (mBusySessions.count(it->mSession) == 0 && (next == mWorkerThreadTaskQueue.end() || it->mPriority < next->mPriority))
+                next = it;
         }
+        return next;
     }
 
 
-    void OllamaChat::enqueueWorkerTask(const Task& task)
+    void OllamaChat::enqueueWorkerTask(const Task& task, EOllamaPriority priority, SessionID session)
     {
         // Enqueue the task to be executed on worker thread
         {
             std::unique_lock lk(mTaskQueueMutex);
-            mWorkerThreadTaskQueue.emplace_back(task);
+            mWorkerThreadTaskQueue.push_back({ priority, session, task });
         }
 
-        // Notify the worker thread to continue
-        mSignalWorkerThreadContinue.notify_one();
+        // Notify a worker thread to continue
+        mSignalWorkerThreadContinue.notify_all();
     }
 
 
-    void OllamaChat::enqueueMainThreadTask(const Task& task)
+    void OllamaChat::enqueueMainThreadTask(const Task& task, std::uint64_t requestID)
     {
         // Enqueue the task to be executed on the main thread
-        mMainThreadTaskQueue.enqueue(task);
+        auto flow_id = OLLAMA_TRACE_FLOW_ID();
+        OLLAMA_TRACE_FLOW_START("Deliver", flow_id);
+        mMainThreadTaskQueue.enqueue({ task, Clock::now(), requestID, flow_id });
     }
 }
\ No newline at end of file
@@ -1,24 +1,140 @@
 #pragma once
 
 #include "ollamaservice.h"
+#include "ollamametrics.h"
+#include "ollamabackendset.h"
+#include "ollamastopcondition.h"
+#include "ollamathinksplitter.h"
+#include "ollamajsonparser.h"
+#include "ollamatools.h"
+#include "ollamacascade.h"
+#include "ollamafanout.h"
+#include "ollamasessiontable.h"
 
 #include <atomic>
 #include <blockingconcurrentqueue.h>
 #include <condition_variable>
+#include <future>
+#include <optional>
+#include <set>
 #include <thread>
 #include <nap/device.h>
-
-// Forward declarations
-namespace ollama
-{
-    class response;
-}
+#include <nap/resourceptr.h>
+#include <nap/signalslot.h>
 
 namespace nap
 {
     /**
-     * OllamaChat is a device that maintains one conversation with the Ollama AI.
-     * OllamaChat will fail to start if Ollama server is not running or if the model is not found.
+     * Progress of a model pull
+     */
+    struct NAPAPI OllamaPullProgress
+    {
+        std::string mStatus;                ///< Status reported by the server, such as "pulling manifest" or "success"
+        std::string mDigest;                ///< Digest of the layer being downloaded, empty outside of layer downloads
+        std::uint64_t mTotal = 0;           ///< Size of all layers reported so far in bytes
+        std::uint64_t mCompleted = 0;       ///< Bytes downloaded of all layers reported so far
+        unsigned int mAttempt = 0;          ///< Number of times the pull was resumed after a dropped connection
+
+        /**
+         * @return fraction of the reported layers downloaded so far, between 0 and 1
+         */
+        float getFraction() const           { return mTotal == 0 ? 0.0f : static_cast<float>(static_cast<double>(mCompleted) / static_cast<double>(mTotal)); }
+    };
+
+
+    /**
+     * What a chat does when the reasoning of a response exceeds the reasoning budget
+     */
+    enum class EOllamaReasoningBudgetAction : int
+    {
+        Answer      = 0,        ///< Cancel the request and prompt again without reasoning, with the reasoning so far added to the prompt
+        Cancel      = 1         ///< Cancel the request and complete the response without answer
+    };
+
+
+    /**
+     * The complete response to a prompt
+     */
+    struct NAPAPI OllamaResult
+    {
+        std::string mText;                  ///< Text of the response, the answer only when the reasoning is split
+        std::string mReasoning;             ///< Reasoning of the response when the reasoning is split
+        OllamaRequestStats mStats;          ///< Token usage and timings of the request
+        std::uint64_t mTotalTime = 0;       ///< Microseconds between enqueueing the prompt and completing the response
+
+        /**
+         * @return number of tokens in the prompt, including the context of the session
+         */
+        std::uint64_t getPromptTokens() const       { return mStats.mPromptEvalCount; }
+
+        /**
+         * @return number of tokens generated
+         */
+        std::uint64_t getResponseTokens() const     { return mStats.mEvalCount; }
+    };
+
+
+    /**
+     * Joins prompts launched at the same time, such as the branches of a fan-out over several sessions or chats.
+     * Pass the join to OllamaChat::chatFuture() for every prompt, then call whenAll().
+     * Every prompt counts down the join when its future is completed, on the thread that completes it,
+     * and the last prompt makes the future of whenAll() ready: no thread waits for the prompts.
+     */
+    class NAPAPI OllamaJoin final
+    {
+        friend class OllamaChat;
+    public:
+        OllamaJoin();
+
+        /**
+         * Returns a future that becomes ready when all prompts launched with the join completed.
+         * Its value holds the futures of the prompts in launch order, so the result or error of every prompt can be read without blocking.
+         * Call once, after all prompts were launched.
+         * @return the future of the ready futures
+         */
+        std::future<std::vector<std::future<OllamaResult>>> whenAll();
+
+    private:
+        // Shared with the completion callbacks of the prompts, guarded by mMutex
+        struct State
+        {
+            std::mutex mMutex;
+            std::vector<std::future<OllamaResult>> mFutures;
+            std::size_t mPending = 0;                               ///< Prompts launched that did not complete
+            bool mJoined = false;                                   ///< whenAll() was called
+            std::promise<std::vector<std::future<OllamaResult>>> mPromise;
+        };
+
+        /**
+         * Adds the future of a prompt before the prompt is launched
+         * @param future the future of the prompt
+         */
+        void add(std::future<OllamaResult> future);
+
+        /**
+         * Counts down a prompt that completed, completes the join when it was the last prompt
+         * @param state the state of the join
+         */
+        static void complete(State& state);
+
+        std::shared_ptr<State> mState;
+    };
+
+
+    /**
+     * The session, priority class and stop condition of a prompt, the defaults of the chat apply to the options that are not set
+     */
+    struct NAPAPI OllamaPromptOptions
+    {
+        OllamaSessionID mSession = OllamaSessionTable::defaultSession;     ///< The session that holds the conversation of the prompt
+        std::optional<EOllamaPriority> mPriority;                           ///< Priority class of the prompt, the 'Priority' property when not set
+        std::optional<OllamaStopCondition> mStopCondition;                  ///< Replaces the stop condition of the chat, only used by prompts that stream one response
+    };
+
+
+    /**
+     * OllamaChat is a device that maintains conversations with the Ollama AI, one per session.
+     * The chat starts without waiting for the Ollama server, prompts are held until the server responds and the model is available.
      */
     class NAPAPI OllamaChat final : public Device
     {
@@ -26,6 +142,23 @@ namespace nap
 
     RTTI_ENABLE(Device)
     public:
+        /**
+         * State of the chat
+         */
+        enum class EState : int
+        {
+            Connecting,         ///< Waiting for the server to respond, prompts are held
+            Pulling,            ///< Pulling the model, prompts are held
+            Ready,              ///< The server is running and the model is available
+            Failed              ///< The model is not available, prompts fail with the error of the server
+        };
+
+        // Identifies a session of the chat
+        using SessionID = OllamaSessionID;
+
+        // The session of prompts that don't specify one, it always exists
+        static constexpr SessionID defaultSession = OllamaSessionTable::defaultSession;
+
         /**
          * Constructor
          * @param service reference to the Ollama service
@@ -39,132 +172,720 @@ namespace nap
 
         /**
          * Generate a prompt with the given message
-         * The callback will get called by each given token in the response
+         * The callback will get called by each given token in the response, up to where the stop condition fired
          * All callbacks are executed on the main thread, called from update() in OllamaService
          * @param message the message to prompt
          * @param callback the callback that gets called for each token in the response
          * @param onComplete the callback that gets called when the response is complete
-         * @param onError the callback that gets called on error
+         * @param onError the callback that gets called on error, also when the prompt is rejected or shed by the scheduler or the session does not exist
+         * @param options the session, priority class and stop condition of the prompt
          */
         void chat(const std::string& message,
                   const std::function<void(const std::string&)>& callback,
                   const std::function<void()>& onComplete,
-                  const std::function<void(const std::string&)>& onError);
+                  const std::function<void(const std::string&)>& onError,
+                  const OllamaPromptOptions& options = {});
 
         /**
          * Generate a prompt with the given message
-         * The callback will get called by each given token in the response
-         * All callbacks are executed on the worker thread
+         * All callbacks are executed on a worker thread, except the error of a rejected or shed prompt or unknown session,
+         * which is reported on the calling thread or the thread that enqueued the prompt that caused it
          * @param message the message to prompt
          * @param callback the callback that gets called for each token in the response
          * @param onComplete the callback that gets called when the response is complete
          * @param onError the callback that gets called on error
+         * @param options the session, priority class and stop condition of the prompt
          */
         void chatAsync(const std::string& message,
                        const std::function<void(const std::string&)>& callback,
                        const std::function<void()>& onComplete,
-                       const std::function<void(const std::string&)>& onError);
+                       const std::function<void(const std::string&)>& onError,
+                       const OllamaPromptOptions& options = {});
+
+        /**
+         * Generate a prompt with the given message, delivering the reasoning and the answer of the response on separate callbacks.
+         * The response is split regardless of 'SplitReasoning', the reasoning budget of the chat applies.
+         * All callbacks are executed on the main thread, called from update() in OllamaService
+         * @param message the message to prompt
+         * @param onReasoning the callback that gets called for each token of the reasoning
+         * @param onAnswer the callback that gets called for each token of the answer
+         * @param onComplete the callback that gets called when the response is complete
+         * @param onError the callback that gets called on error
+         * @param options the session, priority class and stop condition of the prompt
+         */
+        void chatWithReasoning(const std::string& message,
+                               const std::function<void(const std::string&)>& onReasoning,
+                               const std::function<void(const std::string&)>& onAnswer,
+                               const std::function<void()>& onComplete,
+                               const std::function<void(const std::string&)>& onError,
+                               const OllamaPromptOptions& options = {});
+
+        /**
+         * Generate a prompt with the given message, requesting a JSON response that is parsed while it streams in.
+         * Every value of the response is delivered as soon as it closes, objects and arrays as complete subtrees.
+         * The request is cancelled as soon as the root value closes, the response fails when it is not valid JSON or violates the schema.
+         * All callbacks are executed on the main thread, called from update() in OllamaService
+         * @param message the message to prompt
+         * @param schema the schema of the response, sent as the format of the request, empty for any JSON value
+         * @param onValue the callback that gets called for every value of the response that closed, the root value last
+         * @param onComplete the callback that gets called with the JSON text of the root value when the response is complete
+         * @param onError the callback that gets called on error, also on a syntax error or schema violation
+         * @param options the session, priority class and stop condition of the prompt
+         */
+        void chatJSON(const std::string& message,
+                      const OllamaJSONSchema& schema,
+                      const std::function<void(const OllamaJSONEvent&)>& onValue,
+                      const std::function<void(const std::string&)>& onComplete,
+                      const std::function<void(const std::string&)>& onError,
+                      const OllamaPromptOptions& options = {});
+
+        /**
+         * Generate a prompt with the given message, requesting a JSON response that is parsed while it streams in.
+         * All callbacks are executed on a worker thread, except the error of a rejected or shed prompt or unknown session
+         * @param message the message to prompt
+         * @param schema the schema of the response, sent as the format of the request, empty for any JSON value
+         * @param onValue the callback that gets called for every value of the response that closed, the root value last
+         * @param onComplete the callback that gets called with the JSON text of the root value when the response is complete
+         * @param onError the callback that gets called on error, also on a syntax error or schema violation
+         * @param options the session, priority class and stop condition of the prompt
+         */
+        void chatJSONAsync(const std::string& message,
+                           const OllamaJSONSchema& schema,
+                           const std::function<void(const OllamaJSONEvent&)>& onValue,
+                           const std::function<void(const std::string&)>& onComplete,
+                           const std::function<void(const std::string&)>& onError,
+                           const OllamaPromptOptions& options = {});
+
+        /**
+         * Generate a prompt with the given message, letting the model call the tools of the tool registry before it answers.
+         * The prompt continues the conversation of the session with tools, which is kept apart from the context of the other prompts.
+         * All callbacks are executed on the main thread, called from update() in OllamaService
+         * @param message the message to prompt
+         * @param callback the callback that gets called for each token of the answer, and of text the model generates in between tool calls
+         * @param onComplete the callback that gets called when the model answered
+         * @param onError the callback that gets called on error, also when the model keeps calling tools for more than 'MaxToolRounds' turns
+         * @param options the session and priority class of the prompt
+         */
+        void chatWithTools(const std::string& message,
+                           const std::function<void(const std::string&)>& callback,
+                           const std::function<void()>& onComplete,
+                           const std::function<void(const std::string&)>& onError,
+                           const OllamaPromptOptions& options = {});
+
+        /**
+         * Generate a prompt with the given message, letting the model call the tools of the tool registry before it answers.
+         * All callbacks are executed on a worker thread, except the error of a rejected or shed prompt or unknown session
+         * @param message the message to prompt
+         * @param callback the callback that gets called for each token of the answer, and of text the model generates in between tool calls
+         * @param onComplete the callback that gets called when the model answered
+         * @param onError the callback that gets called on error, also when the model keeps calling tools for more than 'MaxToolRounds' turns
+         * @param options the session and priority class of the prompt
+         */
+        void chatWithToolsAsync(const std::string& message,
+                                const std::function<void(const std::string&)>& callback,
+                                const std::function<void()>& onComplete,
+                                const std::function<void(const std::string&)>& onError,
+                                const OllamaPromptOptions& options = {});
+
+        /**
+         * Sends a prompt to several models or servers at the same time and selects the response of one branch by the policy.
+         * The prompt does not continue from the context of the session and does not change it, the session orders the prompt
+         * with the other prompts of the session and stopResponse() of the session stops all branches.
+         * All callbacks are executed on the main thread, called from update() in OllamaService
+         * @param message the message to prompt
+         * @param fanOut the branches, the policy and the scorer of the fan-out
+         * @param callback the callback that gets called for each token of a branch with the index of the branch, until the branch is cancelled. Only called for the first branch to generate a token with the 'FirstTokenBest' policy
+         * @param onComplete the callback that gets called with the responses of all branches when a branch won
+         * @param onError the callback that gets called on error, also when the fan-out is invalid or no branch completed
+         * @param options the session and priority class of the prompt
+         */
+        void fanOut(const std::string& message,
+                    const OllamaFanOut& fanOut,
+                    const std::function<void(int, const std::string&)>& callback,
+                    const std::function<void(const OllamaFanOutResult&)>& onComplete,
+                    const std::function<void(const std::string&)>& onError,
+                    const OllamaPromptOptions& options = {});
+
+        /**
+         * Sends a prompt to several models or servers at the same time and selects the response of one branch by the policy.
+         * All callbacks are executed on a worker thread, the token callback is not called for two branches at the same time.
+         * The error of a rejected or shed prompt, unknown session or invalid fan-out is reported on the calling thread
+         * or the thread that enqueued the prompt that caused it
+         * @param message the message to prompt
+         * @param fanOut the branches, the policy and the scorer of the fan-out
+         * @param callback the callback that gets called for each token of a branch with the index of the branch, until the branch is cancelled
+         * @param onComplete the callback that gets called with the responses of all branches when a branch won
+         * @param onError the callback that gets called on error, also when no branch completed
+         * @param options the session and priority class of the prompt
+         */
+        void fanOutAsync(const std::string& message,
+                         const OllamaFanOut& fanOut,
+                         const std::function<void(int, const std::string&)>& callback,
+                         const std::function<void(const OllamaFanOutResult&)>& onComplete,
+                         const std::function<void(const std::string&)>& onError,
+                         const OllamaPromptOptions& options = {});
+
+        /**
+         * Prompts the models of a cascade one after the other, from small to large, until a response passes the check.
+         * A response that fails the check is cancelled as soon as it fails and the same request is sent to the next model.
+         * Like fanOut(), the prompt does not continue from the context of the session and does not change it.
+         * All callbacks are executed on the main thread, called from update() in OllamaService
+         * @param message the message to prompt
+         * @param cascade the models of the cascade and the check a response of a smaller model has to pass
+         * @param callback the callback that gets called for each token of the response of the current model
+         * @param onEscalate the callback that gets called with the reason when a response failed the check, the tokens delivered so far are discarded
+         * @param onComplete the callback that gets called with the answer
+         * @param onError the callback that gets called on error, also when the cascade has no models
+         * @param options the session and priority class of the prompt
+         */
+        void cascade(const std::string& message,
+                     const OllamaCascade& cascade,
+                     const std::function<void(const std::string&)>& callback,
+                     const std::function<void(const std::string&)>& onEscalate,
+                     const std::function<void(const OllamaCascadeResult&)>& onComplete,
+                     const std::function<void(const std::string&)>& onError,
+                     const OllamaPromptOptions& options = {});
+
+        /**
+         * Prompts the models of a cascade one after the other, from small to large, until a response passes the check.
+         * All callbacks are executed on a worker thread, except the error of a rejected or shed prompt, unknown session or empty cascade,
+         * which is reported on the calling thread or the thread that enqueued the prompt that caused it
+         * @param message the message to prompt
+         * @param cascade the models of the cascade and the check a response of a smaller model has to pass
+         * @param callback the callback that gets called for each token of the response of the current model
+         * @param onEscalate the callback that gets called with the reason when a response failed the check, the tokens delivered so far are discarded
+         * @param onComplete the callback that gets called with the answer
+         * @param onError the callback that gets called on error
+         * @param options the session and priority class of the prompt
+         */
+        void cascadeAsync(const std::string& message,
+                          const OllamaCascade& cascade,
+                          const std::function<void(const std::string&)>& callback,
+                          const std::function<void(const std::string&)>& onEscalate,
+                          const std::function<void(const OllamaCascadeResult&)>& onComplete,
+                          const std::function<void(const std::string&)>& onError,
+                          const OllamaPromptOptions& options = {});
+
+        /**
+         * Generate a prompt with the given message.
+         * The future is completed with the complete response on the worker thread, without waiting for the main thread.
+         * @param message the message to prompt
+         * @param options the session, priority class and stop condition of the prompt
+         * @return the response, throws a std::runtime_error with the error when the prompt failed, was rejected, shed or dropped by a stopping chat, or the session does not exist
+         */
+        std::future<OllamaResult> chatFuture(const std::string& message, const OllamaPromptOptions& options = {});
+
+        /**
+         * Generate a prompt with the given message as one of the prompts of a join, to fan out over several sessions or chats.
+         * The join counts the prompt down when its future is completed, on the worker thread.
+         * @param message the message to prompt
+         * @param join the join the prompt is part of, its future is added to the join
+         * @param options the session, priority class and stop condition of the prompt
+         */
+        void chatFuture(const std::string& message, OllamaJoin& join, const OllamaPromptOptions& options = {});
+
+        /**
+         * Creates a session with an empty context.
+         * This call is thread safe
+         * @return the id of the session
+         */
+        SessionID createSession();
 
         /**
-         * Clear the context for the next chat message
+         * Creates a session that continues the conversation of another session, without copying its context.
+         * The sessions share the context tokens and the conversation with tools up to the fork, after which they continue independently.
+         * This call is thread safe
+         * @param session the session to fork, the fork starts with an empty context when the session does not exist
+         * @return the id of the fork
+         */
+        SessionID forkSession(SessionID session);
+
+        /**
+         * Destroys a session, stopping its response. Queued prompts of the session fail.
+         * The default session can't be destroyed.
+         * This call is thread safe
+         * @param session the session to destroy
+         */
+        void destroySession(SessionID session);
+
+        /**
+         * @return the number of sessions, including the default session, thread safe
+         */
+        std::size_t getSessionCount();
+
+        /**
+         * @return the ids of all sessions, including the default session and the sessions restored from the snapshot, thread safe
+         */
+        std::vector<SessionID> getSessions();
+
+        /**
+         * Saves the sessions to 'SnapshotPath' on the worker pool of the service, without waiting for the snapshot to be written.
+         * Nothing is saved when no session changed since the last snapshot or a snapshot is being saved.
+         * Call from the main thread
+         */
+        void saveSnapshot();
+
+        /**
+         * @return the digest of the model the contexts of the sessions belong to, empty when not known yet, thread safe
+         */
+        std::string getModelDigest();
+
+        /**
+         * @return the estimated bytes held by the contexts of all sessions, counting context shared by forked sessions once, thread safe
+         */
+        std::size_t getSessionMemory();
+
+        /**
+         * Clear the context of the default session for the next chat message
          * This call is thread safe
          */
         void clearContext();
 
         /**
-         * Stop current response
+         * Clear the context of a session for the next chat message
+         * This call is thread safe
+         * @param session the session
+         */
+        void clearContext(SessionID session);
+
+        /**
+         * Stop the current response of all sessions
          * This will close the http connection to the server effectively stopping the response
          * This call is thread safe
          */
         void stopResponse();
 
+        /**
+         * Stop the current response of a session
+         * This call is thread safe
+         * @param session the session
+         */
+        void stopResponse(SessionID session);
+
+        /**
+         * Returns the tools the model can call in prompts of chatWithTools(), together with their latency metrics.
+         * Tools can be added and removed at any time.
+         * @return the tool registry of this chat
+         */
+        OllamaToolRegistry& getTools()                                  { return mTools; }
+
+        /**
+         * Returns the latency metrics of all requests made by this chat.
+         * Metrics are recorded lock-free from the worker and main thread and can be queried at any time.
+         * @return the metrics of this chat
+         */
+        OllamaMetrics& getMetrics()                                     { return mMetrics; }
+
+        /**
+         * Returns the latency metrics of all requests made by this chat.
+         * @return the metrics of this chat
+         */
+        const OllamaMetrics& getMetrics() const                         { return mMetrics; }
+
+        /**
+         * Returns the timings of the last completed request.
+         * This call is thread safe
+         * @return the timings of the last completed request
+         */
+        OllamaRequestStats getLastRequestStats();
+
+        /**
+         * Returns the state of the chat.
+         * This call is thread safe
+         * @return the state of the chat
+         */
+        EState getState() const                                         { return mState; }
+
+        /**
+         * Returns if the server is running and the model is available, prompts are held until the chat is ready.
+         * This call is thread safe
+         * @return if the chat is ready
+         */
+        bool isReady() const                                            { return mState == EState::Ready; }
+
+        /**
+         * Returns if the model is available on the server, false while the model is being pulled.
+         * This call is thread safe
+         * @return if the model is available on the server
+         */
+        bool isModelAvailable() const                                   { return mModelAvailable; }
+
+        /**
+         * Returns the progress of the last model pull.
+         * This call is thread safe
+         * @return the progress of the last model pull
+         */
+        OllamaPullProgress getPullProgress();
+
+        /**
+         * Triggered on the main thread for every progress update of a model pull
+         */
+        Signal<const OllamaPullProgress&> pullProgressed;
+
+        /**
+         * Triggered on the main thread when the server is running and the model is available
+         */
+        Signal<> ready;
+
         // properties :
         std::string mModelSetting = "deepseek-r1:14b"; ///< Property : 'Model' The model to use for the chat
         std::string mServerURLSetting = "http://localhost:11434"; ///< Property : 'ServerURL' The URL of the Ollama server
+        ResourcePtr<OllamaBackendSet> mBackends; ///< Property : 'Backends' Optional set of Ollama servers to route requests to, replaces 'ServerURL'
+        bool mPullModel = false; ///< Property : 'PullModel' Pull the model in the background to the server, or to every backend, that lacks it
+        int mConnectTimeout = 2; ///< Property : 'ConnectTimeout' Seconds to wait for a connection to the server
+        float mMaxRetryInterval = 8.0f; ///< Property : 'MaxRetryInterval' Maximum number of seconds between attempts to reach the server
+        bool mHedgeRequests = false; ///< Property : 'HedgeRequests' Duplicate a request to another backend when its first token is late, requires 'Backends'
+        float mHedgePercentile = 95.0f; ///< Property : 'HedgePercentile' Percentile of the time to first token after which a request is duplicated
+        bool mDeduplicateRequests = false; ///< Property : 'DeduplicateRequests' Share the response of an identical request in flight, of any chat with this option, instead of sending the request again
+        std::vector<std::string> mStopSequences; ///< Property : 'StopSequences' Text the response ends before, the request is cancelled when it is generated
+        std::vector<std::string> mStopPatterns; ///< Property : 'StopPatterns' Regular expressions the response ends after, the request is cancelled when one matches
+        bool mStopOnCompleteJSON = false; ///< Property : 'StopOnCompleteJSON' End the response when the first JSON object or array in it closes
+        bool mSplitReasoning = false; ///< Property : 'SplitReasoning' Split the <think> block of reasoning models from the response, callbacks receive the answer only
+        int mReasoningChunkBudget = 0; ///< Property : 'ReasoningChunkBudget' Maximum number of streamed reasoning chunks of a split response, about one token each, 0 for no limit
+        float mReasoningTimeBudget = 0.0f; ///< Property : 'ReasoningTimeBudget' Maximum number of seconds of reasoning of a split response, 0 for no limit
+        EOllamaReasoningBudgetAction mReasoningBudgetAction = EOllamaReasoningBudgetAction::Answer; ///< Property : 'ReasoningBudgetAction' What to do when the reasoning exceeds its budget
+        int mMaxToolRounds = 8; ///< Property : 'MaxToolRounds' Maximum number of turns in which the model calls tools before a prompt of chatWithTools() fails
+        EOllamaPriority mPriority = EOllamaPriority::Normal; ///< Property : 'Priority' Priority class of prompts that don't specify one
+        int mMaxConcurrentSessions = 1; ///< Property : 'MaxConcurrentSessions' Number of sessions served at the same time, each on its own worker thread
+        float mSessionMemoryLimit = 64.0f; ///< Property : 'SessionMemoryLimit' Megabytes of session contexts above which idle sessions are compacted
+        std::string mSnapshotPath; ///< Property : 'SnapshotPath' File the sessions are saved to and restored from, empty to not save the sessions
+        float mSnapshotInterval = 60.0f; ///< Property : 'SnapshotInterval' Seconds between snapshots of the sessions, 0 to only save the sessions when the chat stops
     protected:
         /**
-         * Starts the OllamaChat device, start worker thread, checks if model is available and if server is running
+         * Starts the OllamaChat device and its worker thread, which checks if the server is running and the model is available.
+         * Does not wait for the server.
          * @param errorState contains the error message on failure
          * @return true on success
          */
         bool start(utility::ErrorState& errorState) final;
 
         /**
-         * Stops the OllamaChat device, stops worker thread
+         * Stops the OllamaChat device and its worker threads, stopping the responses in progress.
+         * Prompts that did not start fail with 'Chat stopped', the callbacks queued for the main thread are called before stop returns.
          */
         void stop() final;
     private:
         // Task type, shorthand for a function that takes no arguments and returns void
         using Task = std::function<void()>;
 
+        // Clock used to measure request timings
+        using Clock = std::chrono::steady_clock;
+
+        // A prompt and its callbacks, defined in ollamachat.cpp
+        struct Prompt;
+
+        // Task executed on a worker thread, together with its priority class and session
+        struct WorkerTask
+        {
+            EOllamaPriority mPriority = EOllamaPriority::Normal;
+            SessionID mSession = defaultSession;
+            Task mTask;
+        };
+
+        // Task executed on the main thread, together with the time it was enqueued and the request it belongs to
+        struct MainThreadTask
+        {
+            Task mTask;
+            Clock::time_point mEnqueueTime;
+            std::uint64_t mRequestID = 0;
+            std::uint64_t mFlowID = 0;      ///< Links the enqueue on the worker to the execution on the main thread in a trace
+        };
+
         /**
-         * Generate a prompt with the given message
-         * The callback will get called by each given token in the response
-         * All callbacks are executed on the calling thread
-         * This call will block until the response is complete
+         * Executes a request of a session on a worker thread, once the scheduler started it. Throws on error
+         */
+        using RequestTask = std::function<void(OllamaSession&, OllamaScheduler::Slot&)>;
+
+        /**
+         * Creates a prompt without result callbacks, the defaults of the chat apply to the options that are not set
          * @param message the message to prompt
-         * @param callback the callback that gets called for each token in the response
-         * @param onComplete the callback that gets called when the response is complete
          * @param onError the callback that gets called on error
+         * @param options the options of the prompt
+         * @return the prompt, with a new request id
          */
-        void chatBlocking(const std::string& message,
-                          const std::function<void(const std::string&)>& callback,
-                          const std::function<void()>& onComplete,
-                          const std::function<void(const std::string&)>& onError);
+        Prompt createPrompt(const std::string& message, const std::function<void(const std::string&)>& onError, const OllamaPromptOptions& options);
+
+        /**
+         * Wraps the callbacks of a prompt to be executed on the main thread
+         * @param prompt the prompt
+         */
+        void deliverOnMainThread(Prompt& prompt);
+
+        /**
+         * Admits a prompt that streams one response and enqueues it to be executed by a worker thread with chatBlocking()
+         * @param prompt the prompt
+         * @param mainThread if the callbacks are executed on the main thread instead of a worker thread
+         */
+        void enqueueChat(Prompt prompt, bool mainThread);
+
+        /**
+         * Admits a prompt with tools and enqueues it to be executed by a worker thread with chatToolsBlocking()
+         * @param prompt the prompt
+         * @param mainThread if the callbacks are executed on the main thread instead of a worker thread
+         */
+        void enqueueToolChat(Prompt prompt, bool mainThread);
+
+        /**
+         * Validates and admits a fan-out prompt and enqueues it to be executed by a worker thread with fanOutBlocking()
+         * @param prompt the prompt
+         * @param fanOut the branches, the policy and the scorer of the fan-out
+         * @param callback the callback that gets called for each token of a branch with the index of the branch
+         * @param onComplete the callback that gets called with the responses of all branches when a branch won
+         * @param mainThread if the callbacks are executed on the main thread instead of a worker thread
+         */
+        void enqueueFanOut(Prompt prompt, const OllamaFanOut& fanOut,
+                           const std::function<void(int, const std::string&)>& callback,
+                           const std::function<void(const OllamaFanOutResult&)>& onComplete,
+                           bool mainThread);
+
+        /**
+         * Validates and admits a cascade prompt and enqueues it to be executed by a worker thread with cascadeBlocking()
+         * @param prompt the prompt, its token callback gets called for each token of the response of the current model
+         * @param cascade the models of the cascade and the check
+         * @param onEscalate the callback that gets called with the reason when a response failed the check
+         * @param onComplete the callback that gets called with the answer
+         * @param mainThread if the callbacks are executed on the main thread instead of a worker thread
+         */
+        void enqueueCascade(Prompt prompt, const OllamaCascade& cascade,
+                            const std::function<void(const std::string&)>& onEscalate,
+                            const std::function<void(const OllamaCascadeResult&)>& onComplete,
+                            bool mainThread);
+
+        /**
+         * Enqueues a prompt whose complete response is returned through a future, completed on the worker thread
+         * @param message the message to prompt
+         * @param options the options of the prompt
+         * @param join the state of the join the prompt is part of, counted down when the future is completed, null when the prompt is not joined
+         * @return the future of the response
+         */
+        std::future<OllamaResult> enqueueFuture(const std::string& message, const OllamaPromptOptions& options, const std::shared_ptr<OllamaJoin::State>& join);
+
+        /**
+         * Admits the request of a prompt and enqueues it to be executed by a worker thread with runRequest().
+         * A request of an unknown session or a rejected request fails right away
+         * @param prompt the prompt, its error callback gets called on error, also when the request is shed
+         * @param request the request to execute
+         */
+        void enqueueRequest(const Prompt& prompt, const RequestTask& request);
+
+        /**
+         * Waits for the scheduler to start a request and executes it on the calling worker thread.
+         * The session streams while the request executes, a request that throws records the error and calls onError
+         * @param session the session the request is part of
+         * @param requestID unique id of the request
+         * @param onError the callback that gets called on error, also when the session was destroyed
+         * @param request the request to execute
+         */
+        void runRequest(OllamaSession& session, std::uint64_t requestID, const std::function<void(const std::string&)>& onError, const RequestTask& request);
+
+        /**
+         * Generate a response to a prompt, continuing from the context of the session.
+         * All callbacks are executed on the calling thread
+         * This call will block until the response is complete, errors are thrown
+         * @param session the session of the prompt
+         * @param slot the slot of the request, released when the request follows an identical request in flight
+         * @param prompt the prompt
+         */
+        void chatBlocking(OllamaSession& session, OllamaScheduler::Slot& slot, const Prompt& prompt);
+
+        /**
+         * Generate a response to a prompt that lets the model call tools, continuing the conversation of the session with tools
+         * All callbacks are executed on the calling thread
+         * This call will block until the model answered, errors are thrown
+         * @param session the session of the prompt
+         * @param prompt the prompt
+         */
+        void chatToolsBlocking(OllamaSession& session, const Prompt& prompt);
+
+        /**
+         * Sends a fan-out prompt to all branches and waits for the branches to end, see OllamaFanOutRace.
+         * All callbacks are executed on the calling thread or the threads of the branches, the token callback for one branch at a time.
+         * Errors are thrown
+         * @param session the session of the prompt
+         * @param prompt the prompt
+         * @param fanOut the branches, the policy and the scorer of the fan-out
+         * @param callback the callback that gets called for each token of a branch with the index of the branch
+         * @param onComplete the callback that gets called with the responses of all branches when a branch won
+         */
+        void fanOutBlocking(OllamaSession& session, const Prompt& prompt, const OllamaFanOut& fanOut,
+                            const std::function<void(int, const std::string&)>& callback,
+                            const std::function<void(const OllamaFanOutResult&)>& onComplete);
+
+        /**
+         * Prompts the models of a cascade one after the other until a response passes the check
+         * All callbacks are executed on the calling thread
+         * This call will block until a model answered, errors are thrown
+         * @param session the session of the prompt
+         * @param prompt the prompt, its token callback gets called for each token of the response of the current model
+         * @param cascade the models of the cascade and the check
+         * @param onEscalate the callback that gets called with the reason when a response failed the check
+         * @param onComplete the callback that gets called with the answer
+         */
+        void cascadeBlocking(OllamaSession& session, const Prompt& prompt, const OllamaCascade& cascade,
+                             const std::function<void(const std::string&)>& onEscalate,
+                             const std::function<void(const OllamaCascadeResult&)>& onComplete);
+
+        /**
+         * Records the timings of a completed request and ends the response of the session, called before the complete callback
+         * @param session the session of the request
+         * @param stats the timings of the completed request
+         */
+        void completeRequest(OllamaSession& session, const OllamaRequestStats& stats);
+
+        /**
+         * Records the arrival of a frame in the timings of a request: the time to the first byte and token,
+         * and the latency between tokens in the chat and service metrics
+         * @param stats the timings of the request
+         * @param sendTime the time the request was sent
+         * @param lastTokenTime the time the previous token arrived, updated when the frame holds a token
+         * @param token if the frame holds a token
+         */
+        void recordFrame(OllamaRequestStats& stats, Clock::time_point sendTime, Clock::time_point& lastTokenTime, bool token);
+
+        /**
+         * Wraps a callback to be executed on the main thread
+         * @param callback the callback to wrap, may be nullptr
+         * @param requestID the request the callback belongs to
+         * @return the wrapped callback, nullptr when the callback is nullptr
+         */
+        template<typename... Args>
+        std::function<void(Args...)> onMainThread(const std::function<void(Args...)>& callback, std::uint64_t requestID);
+
+        /**
+         * @return a new unique request id
+         */
+        static std::uint64_t createRequestID();
+
+        /**
+         * @return if reasoning of a number of streamed chunks over a duration exceeds the reasoning budget
+         */
+        bool exceedsReasoningBudget(std::uint64_t chunks, Clock::duration duration) const;
+
+        /**
+         * Records the timings of a completed request in the chat and service metrics
+         * @param stats the timings of the completed request
+         */
+        void recordRequestStats(const OllamaRequestStats& stats);
 
         /**
          * Updates the OllamaChat device, called on main thread from OllamaService
          */
         void update();
 
-        // worker thread that handles the chat
-        std::thread mWorkerThread;
-        void onWork();
+        /**
+         * Executes the tasks queued for the main thread, called on the main thread
+         */
+        void runMainThreadTasks();
+
+        /**
+         * Pulls the model on the worker pool of the service, prompts are held until the pull finished
+         */
+        void pullModel();
 
         /**
-         * Sets the context for the next chat message
-         * @param context
+         * Probes the server until it responds and checks if the model is available, called on the worker thread.
+         * Retries with exponential backoff until the chat stops.
          */
-        void setContext(const std::string& context);
+        void connect();
 
         /**
-         * Sets the context for the next chat message
-         * @param context
+         * Waits for a free slot on a backend of the backend set, throws when no backend is available or the chat stopped.
+         * @param exclude URL of a backend to skip, used when no other backend is available
+         * @param model the model of the request, empty for the model of the chat
+         * @return the lease of the slot
          */
-        void setContext(const ollama::response& context);
+        OllamaBackendSet::Lease acquireBackend(const std::string& exclude, const std::string& model = "");
 
         /**
-         * Gets the context for the next chat message
-         * @return the context
+         * Sets the state and releases the held prompts when the chat is ready or failed.
+         * The ready signal is triggered on the main thread when the chat is ready
+         * @param state the new state
          */
-        ollama::response getContext();
+        void setState(EState state);
 
         /**
-         * Enqueues a task to be executed on the worker thread
+         * @return if prompts are held until the chat is ready, the task queue mutex must be locked
+         */
+        bool holdPrompts() const                                        { return mState == EState::Connecting || mState == EState::Pulling; }
+
+        // worker threads that serve the sessions of the chat
+        std::vector<std::thread> mWorkerThreads;
+
+        /**
+         * Executes the tasks of sessions that are not being served until the chat stops
+         * @param connectToServer if this worker waits for the server before executing tasks
+         */
+        void onWork(bool connectToServer);
+
+        /**
+         * Returns the oldest task of the highest priority class of a session that is not being served, the task queue mutex must be locked
+         * @return the next task, the end of the queue when there is none
+         */
+        std::vector<WorkerTask>::iterator findNextTask();
+
+        /**
+         * Stops the response of a session
+         * @param session the session
+         */
+        void stopResponse(OllamaSession& session);
+
+        /**
+         * Restores the sessions from the snapshot, called on start. The contexts are restored compacted
+         */
+        void restoreSnapshot();
+
+        /**
+         * Writes the sessions to the snapshot when a session changed since the last snapshot
+         * @param errorState contains the error when the snapshot could not be written
+         * @return if the snapshot is up to date
+         */
+        bool writeSnapshot(utility::ErrorState& errorState);
+
+        /**
+         * Sets the digest of the model on the server, discarding the contexts of the sessions when they belong to another digest
+         * @param digest the digest of the model, empty when not known
+         */
+        void setModelDigest(const std::string& digest);
+
+        /**
+         * Enqueues a task to be executed on a worker thread, tasks of a higher priority class are executed first
          * @param task the task to execute
+         * @param priority the priority class of the task
+         * @param session the session of the task, the tasks of one session are executed one after the other
          */
-        void enqueueWorkerTask(const Task& task);
+        void enqueueWorkerTask(const Task& task, EOllamaPriority priority, SessionID session);
 
         /**
          * Enqueues a task to be executed on the main thread called from update() from OllamaService
          * @param task the task to execute
+         * @param requestID the request the task belongs to
          */
-        void enqueueMainThreadTask(const Task& task);
-
-        // mutex for the context
-        std::mutex mContextMutex;
-
-        // atomic bool indicating if the worker thread is currently streaming a response
-        std::atomic_bool mStreaming = false;
+        void enqueueMainThreadTask(const Task& task, std::uint64_t requestID);
 
         // atomic bool indicating if the worker thread is running
         std::atomic_bool mRunning = true;
 
+        // atomic bool indicating if the model is available on the server
+        std::atomic_bool mModelAvailable = false;
+
+        // state of the chat, the worker thread holds prompts while connecting or pulling
+        std::atomic<EState> mState = EState::Connecting;
+
+        // progress of the last model pull, guarded by mPullMutex
+        std::mutex mPullMutex;
+        OllamaPullProgress mPullProgress;
+
+        // becomes ready when the pull running on the worker pool of the service finished
+        std::future<void> mPullFinished;
+
         // mutex for the task queue that are executed on the worker thread
         std::mutex mTaskQueueMutex;
 
-        // task queue that are executed on the worker thread
-        std::vector<Task> mWorkerThreadTaskQueue;
+        // task queue that are executed on the worker threads
+        std::vector<WorkerTask> mWorkerThreadTaskQueue;
+
+        // sessions being served by a worker thread, guarded by mTaskQueueMutex
+        std::set<SessionID> mBusySessions;
 
         // condition variable to signal the worker thread to continue
         std::condition_variable mSignalWorkerThreadContinue;
@@ -177,11 +898,32 @@ namespace nap
         OllamaService& mService;
 
         // concurrent lockless queue of tasks to be executed from the main thread
-        moodycamel::ConcurrentQueue<Task> mMainThreadTaskQueue;
+        moodycamel::ConcurrentQueue<MainThreadTask> mMainThreadTaskQueue;
+
+        // latency metrics of all requests made by this chat
+        OllamaMetrics mMetrics;
+
+        // timings of the last completed request, guarded by mStatsMutex
+        std::mutex mStatsMutex;
+        OllamaRequestStats mLastRequestStats;
+
+        // stop condition of prompts that don't specify one, compiled from the properties on start
+        OllamaStopCondition mStopCondition;
+
+        // tools the model can call in prompts with tools
+        OllamaToolRegistry mTools;
+
+        // snapshots are written one at a time, guarded by mSnapshotMutex
+        std::mutex mSnapshotMutex;
+        std::uint64_t mSnapshotChanges = 0;
+
+        // becomes ready when the snapshot being saved on the worker pool of the service is written
+        std::future<void> mSnapshotFinished;
+        Clock::time_point mLastSnapshot;
 
         std::string mModel; ///< The model to use for the chat
         std::string mServerURL; ///< The URL of the Ollama server
     };
 
     using OllamaChatObjectCreator = rtti::ObjectCreator<OllamaChat, OllamaService>;
-}
\ No newline at end of file
+}
@@ -0,0 +1,89 @@
+#include "ollamaconnectionpool.h"
+
+#include "ollama.hpp"
+
+namespace nap
+{
+    OllamaConnectionPool::OllamaConnectionPool(const std::vector<std::string>& serverURLs, int connectTimeout) : mConnectTimeout(connectTimeout)
+    {
+        for (const auto& url : serverURLs)
+            mIdleConnections[url];
+    }
+
+
+    OllamaConnectionPool::~OllamaConnectionPool()
+    { }
+
+
+    Ollama& OllamaConnectionPool::acquire(const std::string& url)
+    {
+        std::lock_guard lk(mMutex);
+        auto& idle = mIdleConnections[url];
+        if (!idle.empty())
+        {
+            auto* server = idle.back();
+            idle.pop_back();
+            return *server;
+        }
+
+        auto server = std::make_unique<Ollama>(url);
+        server->setConnectTimeout(mConnectTimeout);
+        mConnections.emplace_back(std::move(server));
+        return *mConnections.back();
+    }
+
+
+    void OllamaConnectionPool::release(const std::string& url, Ollama& server)
+    {
+        std::lock_guard lk(mMutex);
+        mIdleConnections.at(url).emplace_back(&server);
+    }
+
+
+    void OllamaConnectionPool::stop()
+    {
+        std::lock_guard lk(mMutex);
+        for (auto& server : mConnections)
+            server->stop();
+    }
+
+
+    void OllamaActiveServer::set(Ollama* server)
+    {
+        std::lock_guard lk(mMutex);
+        mServer = server;
+    }
+
+
+    void OllamaActiveServer::clear(Ollama* server)
+    {
+        std::lock_guard lk(mMutex);
+        if (mServer == server)
+            mServer = nullptr;
+    }
+
+
+    void OllamaActiveServer::setStopHandler(std::function<void()> stop)
+    {
+        std::lock_guard lk(mMutex);
+        mStopHandler = std::move(stop);
+    }
+
+
+    void OllamaActiveServer::stop()
+    {
+        std::lock_guard lk(mMutex);
+        if (mServer != nullptr)
+            mServer->stop();
+        if (mStopHandler != nullptr)
+            mStopHandler();
+    }
+
+
+    OllamaConnection::~OllamaConnection()
+    {
+        if (mActive != nullptr)
+            mActive->clear(&mServer);
+        mPool.release(mURL, mServer);
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <utility/dllexport.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Forward declarations
+class Ollama;
+
+namespace nap
+{
+    /**
+     * Keep-alive connections to Ollama servers. Ollama streams one response per HTTP connection,
+     * so every request in progress takes a connection of its own and returns it for the next request.
+     * Servers that are not known up front, such as the servers of fan-out branches, are added on first use.
+     * All calls are thread safe
+     */
+    class NAPAPI OllamaConnectionPool final
+    {
+    public:
+        /**
+         * @param serverURLs URLs of the servers known up front
+         * @param connectTimeout seconds to wait for a connection to a server
+         */
+        OllamaConnectionPool(const std::vector<std::string>& serverURLs, int connectTimeout);
+
+        /**
+         * Closes all connections
+         */
+        ~OllamaConnectionPool();
+
+        /**
+         * Takes an idle connection to a server or opens a new one
+         * @param url URL of the server
+         * @return the connection
+         */
+        Ollama& acquire(const std::string& url);
+
+        /**
+         * Returns a connection to the pool
+         * @param url URL of the server
+         * @param server the connection
+         */
+        void release(const std::string& url, Ollama& server);
+
+        /**
+         * Closes all connections, stopping the requests and probes in progress
+         */
+        void stop();
+
+    private:
+        std::mutex mMutex;
+        std::vector<std::unique_ptr<Ollama>> mConnections;
+        std::map<std::string, std::vector<Ollama*>> mIdleConnections;       ///< Connections not in use, by URL
+        int mConnectTimeout = 2;
+    };
+
+
+    /**
+     * The connection of the request in progress of a session, stopped to stop the response.
+     * A connection is cleared under the lock before it returns to the pool, so a stop never reaches a connection that another request took from the pool.
+     * A request with several connections, such as a fan-out, stops its connections in a stop handler instead.
+     * All calls are thread safe
+     */
+    class NAPAPI OllamaActiveServer final
+    {
+    public:
+        /**
+         * @param server the connection of the request in progress
+         */
+        void set(Ollama* server);
+
+        /**
+         * Clears the connection when it is the connection of the request in progress
+         * @param server the connection that returns to the pool
+         */
+        void clear(Ollama* server);
+
+        /**
+         * @param stop called on stop, nullptr to remove the handler
+         */
+        void setStopHandler(std::function<void()> stop);
+
+        /**
+         * Closes the connection of the request in progress and calls the stop handler
+         */
+        void stop();
+
+    private:
+        std::mutex mMutex;
+        Ollama* mServer = nullptr;
+        std::function<void()> mStopHandler;
+    };
+
+
+    /**
+     * A connection taken from the pool, returned to the pool when destroyed
+     */
+    class NAPAPI OllamaConnection final
+    {
+    public:
+        /**
+         * @param pool the pool
+         * @param url URL of the server
+         * @param active cleared when it still points to this connection on destruction, so a returned connection is not stopped
+         */
+        OllamaConnection(OllamaConnectionPool& pool, const std::string& url, OllamaActiveServer* active = nullptr) :
+            mPool(pool), mURL(url), mServer(pool.acquire(url)), mActive(active) { }
+
+        ~OllamaConnection();
+
+        OllamaConnection(const OllamaConnection&) = delete;
+        OllamaConnection& operator=(const OllamaConnection&) = delete;
+
+        Ollama& operator*() const                       { return mServer; }
+        Ollama* operator->() const                      { return &mServer; }
+
+    private:
+        OllamaConnectionPool& mPool;
+        std::string mURL;
+        Ollama& mServer;
+        OllamaActiveServer* mActive = nullptr;
+    };
+}
@@ -0,0 +1,46 @@
+#include "ollamaconversationrun.h"
+
+namespace nap
+{
+    std::size_t getRunMemory(const OllamaContextRun& run)
+    {
+        return sizeof(OllamaContextRun) + run.mItems.capacity() * sizeof(std::uint32_t);
+    }
+
+
+    std::vector<std::uint8_t> compactContext(const std::vector<std::uint32_t>& tokens)
+    {
+        std::vector<std::uint8_t> bytes;
+        for (auto token : tokens)
+        {
+            std::uint64_t value = token;
+            do
+            {
+                std::uint8_t byte = value & 0x7f;
+                value >>= 7;
+                bytes.push_back(value != 0 ? byte | 0x80 : byte);
+            } while (value != 0);
+        }
+        return bytes;
+    }
+
+
+    std::vector<std::uint32_t> expandContext(const std::vector<std::uint8_t>& bytes)
+    {
+        std::vector<std::uint32_t> tokens;
+        std::uint64_t value = 0;
+        int shift = 0;
+        for (auto byte : bytes)
+        {
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            shift += 7;
+            if ((byte & 0x80) == 0)
+            {
+                tokens.push_back(static_cast<std::uint32_t>(value));
+                value = 0;
+                shift = 0;
+            }
+        }
+        return tokens;
+    }
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <utility/dllexport.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace nap
+{
+    /**
+     * A run of tokens or messages continuing the runs before it. Runs are immutable, so forked sessions share the runs
+     * up to the fork and only own the runs after it. A run is released when the last session that continues it is destroyed.
+     */
+    template<typename T>
+    struct OllamaConversationRun
+    {
+        std::shared_ptr<const OllamaConversationRun> mParent;      ///< The run before this run, null for the first run
+        std::vector<T> mItems;                                      ///< Items of this run
+        std::size_t mSize = 0;                                      ///< Number of items up to and including this run
+    };
+
+    // Context tokens of a session
+    using OllamaContextRun = OllamaConversationRun<std::uint32_t>;
+
+
+    /**
+     * Creates a run continuing another run
+     * @param parent the run to continue, null to start a chain
+     * @param items the items of the new run
+     * @return the new run
+     */
+    template<typename T>
+    std::shared_ptr<const OllamaConversationRun<T>> appendRun(const std::shared_ptr<const OllamaConversationRun<T>>& parent, std::vector<T>&& items)
+    {
+        auto run = std::make_shared<OllamaConversationRun<T>>();
+        run->mParent = parent;
+        run->mSize = (parent != nullptr ? parent->mSize : 0) + items.size();
+        run->mItems = std::move(items);
+        return run;
+    }
+
+
+    /**
+     * Copies the items of a chain of runs, from the first run to the last run
+     * @param last the last run of the chain, null for an empty chain
+     * @return all items of the chain
+     */
+    template<typename T>
+    std::vector<T> flattenRuns(const OllamaConversationRun<T>* last)
+    {
+        std::vector<T> items(last != nullptr ? last->mSize : 0);
+        for (auto* run = last; run != nullptr; run = run->mParent.get())
+            std::copy(run->mItems.begin(), run->mItems.end(), items.begin() + (run->mSize - run->mItems.size()));
+        return items;
+    }
+
+
+    /**
+     * Finds the runs at the end of a chain that no other chain references
+     * @param last the last run of the chain
+     * @param owned receives the runs only this chain references, from the last run to the first
+     * @return the last run shared with another chain, null when the chain shares no run
+     */
+    template<typename T>
+    std::shared_ptr<const OllamaConversationRun<T>> findSharedRun(const std::shared_ptr<const OllamaConversationRun<T>>& last, std::vector<const OllamaConversationRun<T>*>& owned)
+    {
+        const auto* run = &last;
+        while (*run != nullptr && run->use_count() == 1)
+        {
+            owned.emplace_back(run->get());
+            run = &(*run)->mParent;
+        }
+        return *run;
+    }
+
+
+    /**
+     * Continues a chain of runs with the items that follow the longest run of the chain the items start with.
+     * Runs only this chain references are merged into one run, so a conversation that is not forked stays one run.
+     * @param last the last run of the chain, null when the chain is empty
+     * @param items all items of the conversation
+     * @return the last run of the new chain
+     */
+    template<typename T>
+    std::shared_ptr<const OllamaConversationRun<T>> extendRuns(const std::shared_ptr<const OllamaConversationRun<T>>& last, std::vector<T>&& items)
+    {
+        std::vector<const std::shared_ptr<const OllamaConversationRun<T>>*> chain;
+        for (const auto* run = &last; *run != nullptr; run = &(*run)->mParent)
+            chain.emplace_back(run);
+
+        // The items may diverge from the chain when the server shortened the context
+        const std::shared_ptr<const OllamaConversationRun<T>>* matched = nullptr;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+        {
+            const auto& run = **it;
+            auto begin = run->mSize - run->mItems.size();
+            if (items.size() < run->mSize || !std::equal(run->mItems.begin(), run->mItems.end(), items.begin() + begin))
+                break;
+            matched = *it;
+        }
+
+        if (matched == nullptr)
+            return appendRun<T>(nullptr, std::move(items));
+        if (matched == &last && items.size() == last->mSize)
+            return last;
+
+        // The runs only this chain references are found before the chain is copied, a copy would share them
+        std::shared_ptr<const OllamaConversationRun<T>> parent;
+        if (matched == &last)
+        {
+            std::vector<const OllamaConversationRun<T>*> owned;
+            parent = findSharedRun(last, owned);
+        }
+        else
+        {
+            parent = *matched;
+        }
+        std::size_t begin = parent != nullptr ? parent->mSize : 0;
+        return appendRun(parent, std::vector<T>(std::make_move_iterator(items.begin() + begin), std::make_move_iterator(items.end())));
+    }
+
+
+    /**
+     * @param run a run of context tokens
+     * @return the bytes held by the run
+     */
+    NAPAPI std::size_t getRunMemory(const OllamaContextRun& run);
+
+    /**
+     * Encodes context tokens as LEB128 varints, most tokens take 2 or 3 bytes
+     * @param tokens the context tokens
+     * @return the encoded tokens
+     */
+    NAPAPI std::vector<std::uint8_t> compactContext(const std::vector<std::uint32_t>& tokens);
+
+    /**
+     * Decodes the context tokens encoded by compactContext()
+     * @param bytes the encoded tokens
+     * @return the context tokens
+     */
+    NAPAPI std::vector<std::uint32_t> expandContext(const std::vector<std::uint8_t>& bytes);
+}
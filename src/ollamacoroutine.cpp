@@ -0,0 +1,83 @@
+#include "ollamacoroutine.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "ollama.hpp"
+
+namespace nap
+{
+    namespace
+    {
+        /**
+         * Creates an awaitable that sends a request on the worker pool with its own connection, which is closed on cancel
+         * @param service the service that sends the request
+         * @param serverURL URL of the Ollama server
+         * @param request sends the request over the connection
+         * @param cancellation closes the connection when cancelled
+         */
+        template<typename T>
+        OllamaPoolAwaitable<T> awaitRequest(OllamaService& service, const std::string& serverURL, std::function<T(Ollama&)> request, OllamaCancellation cancellation)
+        {
+            auto client = std::make_shared<Ollama>(serverURL);
+            return OllamaPoolAwaitable<T>(service,
+                [client, request = std::move(request)]() { return request(*client); },
+                [client]() { client->stop(); },
+                std::move(cancellation));
+        }
+    }
+
+
+    OllamaPoolAwaitable<std::string> awaitGenerate(OllamaService& service, const std::string& serverURL, const std::string& model,
+                                                   const std::string& prompt, OllamaCancellation cancellation)
+    {
+        return awaitRequest<std::string>(service, serverURL, [model, prompt](Ollama& client)
+        {
+            return client.generate(model, prompt).as_simple_string();
+        }, std::move(cancellation));
+    }
+
+
+    OllamaPoolAwaitable<std::vector<float>> awaitEmbedding(OllamaService& service, const std::string& serverURL, const std::string& model,
+                                                           const std::string& input, OllamaCancellation cancellation)
+    {
+        return awaitRequest<std::vector<float>>(service, serverURL, [model, input](Ollama& client)
+        {
+            auto response = client.generate_embeddings(model, input).as_json();
+            if (!response.contains("embeddings") || response["embeddings"].empty())
+                throw std::runtime_error("No embedding returned by the server");
+            return response["embeddings"][0].get<std::vector<float>>();
+        }, std::move(cancellation));
+    }
+
+
+    OllamaPoolAwaitable<std::vector<std::string>> awaitModels(OllamaService& service, const std::string& serverURL, OllamaCancellation cancellation)
+    {
+        return awaitRequest<std::vector<std::string>>(service, serverURL, [](Ollama& client)
+        {
+            return client.list_models();
+        }, std::move(cancellation));
+    }
+
+
+    OllamaPoolAwaitable<bool> awaitLoadModel(OllamaService& service, const std::string& serverURL, const std::string& model, OllamaCancellation cancellation)
+    {
+        auto keep_alive = service.getResidency().getKeepAlive();
+        return awaitRequest<bool>(service, serverURL, [model, keep_alive](Ollama& client)
+        {
+            return client.load_model(model, keep_alive);
+        }, std::move(cancellation));
+    }
+
+
+    OllamaPoolAwaitable<bool> awaitPullModel(OllamaService& service, const std::string& serverURL, const std::string& model, OllamaCancellation cancellation)
+    {
+        return awaitRequest<bool>(service, serverURL, [model](Ollama& client)
+        {
+            // Pulls can take long, the connection is closed on cancel instead
+            client.setReadTimeout(24 * 60 * 60);
+            return client.pull_model(model);
+        }, std::move(cancellation));
+    }
+}
+
+#endif // __cpp_impl_coroutine
@@ -0,0 +1,688 @@
+#pragma once
+
+#include "ollamachat.h"
+
+// The coroutine types require C++20, the rest of the module builds without them
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nap
+{
+    /**
+     * Thrown when resuming a coroutine whose awaited request was cancelled
+     */
+    class OllamaCancelledError : public std::runtime_error
+    {
+    public:
+        OllamaCancelledError() : std::runtime_error("Request cancelled")   { }
+    };
+
+
+    /**
+     * Cancels the requests awaited by one or more coroutines.
+     * Copies share their state: pass a copy to every request of a coroutine chain, cancel() stops the request in progress
+     * and resumes its coroutine with an OllamaCancelledError. Requests awaited after cancellation fail right away.
+     */
+    class OllamaCancellation final
+    {
+    public:
+        OllamaCancellation() : mState(std::make_shared<State>())           { }
+
+        /**
+         * Cancels the requests, calling the cancel callbacks on the calling thread.
+         * This call is thread safe
+         */
+        void cancel()
+        {
+            std::map<std::uint64_t, std::function<void()>> callbacks;
+            {
+                std::lock_guard lk(mState->mMutex);
+                if (mState->mCancelled)
+                    return;
+                mState->mCancelled = true;
+                callbacks.swap(mState->mCallbacks);
+            }
+            for (auto& callback : callbacks)
+                callback.second();
+        }
+
+        /**
+         * @return if the requests were cancelled, thread safe
+         */
+        bool isCancelled() const
+        {
+            std::lock_guard lk(mState->mMutex);
+            return mState->mCancelled;
+        }
+
+        /**
+         * Registers a callback that stops a request on cancel, called right away when already cancelled.
+         * @param callback stops the request, called on the thread that cancels
+         * @return id to remove the callback with, 0 when it was called right away
+         */
+        std::uint64_t subscribe(std::function<void()> callback)
+        {
+            {
+                std::lock_guard lk(mState->mMutex);
+                if (!mState->mCancelled)
+                {
+                    mState->mCallbacks.emplace(++mState->mNextID, std::move(callback));
+                    return mState->mNextID;
+                }
+            }
+            callback();
+            return 0;
+        }
+
+        /**
+         * Removes a cancel callback, called when its request finished
+         * @param id the id returned by subscribe()
+         */
+        void unsubscribe(std::uint64_t id)
+        {
+            std::lock_guard lk(mState->mMutex);
+            mState->mCallbacks.erase(id);
+        }
+
+    private:
+        struct State
+        {
+            std::mutex mMutex;
+            bool mCancelled = false;
+            std::uint64_t mNextID = 0;
+            std::map<std::uint64_t, std::function<void()>> mCallbacks;
+        };
+        std::shared_ptr<State> mState;
+    };
+
+
+    // Forward declarations
+    template<typename T> class OllamaTask;
+
+
+    /**
+     * Promise state shared by all OllamaTask types.
+     * The task starts when it is awaited or started, and resumes the coroutine that awaits it when it finishes.
+     */
+    class OllamaTaskPromiseBase
+    {
+    public:
+        // Transfers execution to the awaiting coroutine when the task finished
+        struct FinalAwaiter
+        {
+            bool await_ready() const noexcept                               { return false; }
+            void await_resume() const noexcept                              { }
+
+            template<typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) const noexcept
+            {
+                auto continuation = handle.promise().mContinuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+        };
+
+        std::suspend_always initial_suspend() const noexcept                { return {}; }
+        FinalAwaiter final_suspend() const noexcept                         { return {}; }
+        void unhandled_exception()                                          { mException = std::current_exception(); }
+
+        std::coroutine_handle<> mContinuation;                              ///< Coroutine awaiting the task
+        std::exception_ptr mException;                                      ///< Exception that escaped the task
+    };
+
+
+    /**
+     * Promise of an OllamaTask that returns a value
+     */
+    template<typename T>
+    class OllamaTaskPromise : public OllamaTaskPromiseBase
+    {
+    public:
+        OllamaTask<T> get_return_object();
+        void return_value(T value)                                          { mValue.emplace(std::move(value)); }
+
+        T getResult()
+        {
+            if (mException)
+                std::rethrow_exception(mException);
+            return std::move(*mValue);
+        }
+
+        std::optional<T> mValue;
+    };
+
+
+    /**
+     * Promise of an OllamaTask that returns nothing
+     */
+    template<>
+    class OllamaTaskPromise<void> : public OllamaTaskPromiseBase
+    {
+    public:
+        OllamaTask<void> get_return_object();
+        void return_void()                                                  { }
+
+        void getResult()
+        {
+            if (mException)
+                std::rethrow_exception(mException);
+        }
+    };
+
+
+    /**
+     * A coroutine that awaits Ollama requests, returning a value of type T.
+     *
+     * The task is lazy: it runs when it is awaited by another coroutine or started with start().
+     * Requests awaited by the task resume it on the main thread, from update() in OllamaService,
+     * so a task started on the main thread runs on the main thread only and needs no thread of its own.
+     * An exception that escapes the task is thrown to the coroutine that awaits it, or by getResult().
+     *
+     * The task owns its coroutine: keep it alive until it is done, cancel its requests to finish it early.
+     */
+    template<typename T = void>
+    class OllamaTask final
+    {
+    public:
+        using promise_type = OllamaTaskPromise<T>;
+        using Handle = std::coroutine_handle<promise_type>;
+
+        OllamaTask() = default;
+        explicit OllamaTask(Handle handle) : mHandle(handle)               { }
+        ~OllamaTask()                                                       { if (mHandle) mHandle.destroy(); }
+
+        // A task owns its coroutine and can only be moved
+        OllamaTask(const OllamaTask&) = delete;
+        OllamaTask& operator=(const OllamaTask&) = delete;
+        OllamaTask(OllamaTask&& other) noexcept : mHandle(std::exchange(other.mHandle, nullptr)) { }
+        OllamaTask& operator=(OllamaTask&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (mHandle)
+                    mHandle.destroy();
+                mHandle = std::exchange(other.mHandle, nullptr);
+            }
+            return *this;
+        }
+
+        /**
+         * Starts a task that is not awaited by another coroutine, call on the main thread
+         */
+        void start()                                                        { if (mHandle && !mStarted) { mStarted = true; mHandle.resume(); } }
+
+        /**
+         * @return if the task finished
+         */
+        bool isDone() const                                                 { return mHandle && mHandle.done(); }
+
+        /**
+         * Returns the result of a finished task, rethrowing the exception that escaped the task
+         * @return the value returned by the task
+         */
+        T getResult()                                                       { return mHandle.promise().getResult(); }
+
+        // Awaits the task from another coroutine, running the task until it suspends
+        struct Awaiter
+        {
+            Handle mHandle;
+
+            bool await_ready() const noexcept                               { return mHandle.done(); }
+            T await_resume()                                                { return mHandle.promise().getResult(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                mHandle.promise().mContinuation = continuation;
+                return mHandle;
+            }
+        };
+
+        Awaiter operator co_await() &&                                      { mStarted = true; return Awaiter{ mHandle }; }
+        Awaiter operator co_await() &                                       { mStarted = true; return Awaiter{ mHandle }; }
+
+    private:
+        Handle mHandle = nullptr;
+        bool mStarted = false;
+    };
+
+
+    template<typename T>
+    OllamaTask<T> OllamaTaskPromise<T>::get_return_object()
+    {
+        return OllamaTask<T>(std::coroutine_handle<OllamaTaskPromise<T>>::from_promise(*this));
+    }
+
+
+    inline OllamaTask<void> OllamaTaskPromise<void>::get_return_object()
+    {
+        return OllamaTask<void>(std::coroutine_handle<OllamaTaskPromise<void>>::from_promise(*this));
+    }
+
+
+    /**
+     * A coroutine that produces a sequence of values with co_yield, and may await requests in between.
+     * The consumer awaits every value with next(), which runs the generator until it yields or returns:
+     *
+     *     auto tokens = streamChat(chat, session, "Hello");
+     *     while (auto token = co_await tokens.next())
+     *         text += *token;
+     *
+     * The generator only runs while it is awaited, on the thread of the consumer.
+     */
+    template<typename T>
+    class OllamaGenerator final
+    {
+    public:
+        class promise_type
+        {
+        public:
+            // Transfers execution back to the consumer
+            struct YieldAwaiter
+            {
+                bool await_ready() const noexcept                           { return false; }
+                void await_resume() const noexcept                          { }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) const noexcept
+                {
+                    return handle.promise().mConsumer;
+                }
+            };
+
+            OllamaGenerator get_return_object()                             { return OllamaGenerator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() const noexcept            { return {}; }
+            YieldAwaiter final_suspend() const noexcept                     { return {}; }
+            YieldAwaiter yield_value(T value)                               { mValue.emplace(std::move(value)); return {}; }
+            void return_void()                                              { }
+            void unhandled_exception()                                      { mException = std::current_exception(); }
+
+            std::optional<T> mValue;
+            std::exception_ptr mException;
+            std::coroutine_handle<> mConsumer;
+        };
+
+        using Handle = std::coroutine_handle<promise_type>;
+
+        OllamaGenerator() = default;
+        explicit OllamaGenerator(Handle handle) : mHandle(handle)          { }
+        ~OllamaGenerator()                                                  { if (mHandle) mHandle.destroy(); }
+
+        // A generator owns its coroutine and can only be moved
+        OllamaGenerator(const OllamaGenerator&) = delete;
+        OllamaGenerator& operator=(const OllamaGenerator&) = delete;
+        OllamaGenerator(OllamaGenerator&& other) noexcept : mHandle(std::exchange(other.mHandle, nullptr)) { }
+        OllamaGenerator& operator=(OllamaGenerator&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (mHandle)
+                    mHandle.destroy();
+                mHandle = std::exchange(other.mHandle, nullptr);
+            }
+            return *this;
+        }
+
+        // Awaits the next value of the generator
+        struct NextAwaiter
+        {
+            Handle mHandle;
+
+            bool await_ready() const noexcept                               { return !mHandle || mHandle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept
+            {
+                mHandle.promise().mConsumer = consumer;
+                mHandle.promise().mValue.reset();
+                return mHandle;
+            }
+            std::optional<T> await_resume()
+            {
+                if (!mHandle)
+                    return std::nullopt;
+                auto& promise = mHandle.promise();
+                if (promise.mException)
+                    std::rethrow_exception(std::exchange(promise.mException, nullptr));
+                if (mHandle.done())
+                    return std::nullopt;
+                return std::move(promise.mValue);
+            }
+        };
+
+        /**
+         * Awaits the next value, runs the generator until it yields a value or returns.
+         * An exception that escapes the generator is thrown to the consumer.
+         * @return the next value, empty when the generator returned
+         */
+        NextAwaiter next()                                                  { return NextAwaiter{ mHandle }; }
+
+    private:
+        Handle mHandle = nullptr;
+    };
+
+
+    /**
+     * Awaits the complete response to a prompt of a chat session, returning the text of the response.
+     * The prompt is enqueued when the coroutine suspends. The coroutine resumes on the main thread when the response is complete,
+     * a failed prompt throws a std::runtime_error with the error, a cancelled prompt throws an OllamaCancelledError.
+     */
+    class OllamaChatAwaitable final
+    {
+    public:
+        /**
+         * @param chat the chat that serves the prompt
+         * @param session the session that holds the context of the conversation
+         * @param message the message to prompt
+         * @param priority the priority class of the prompt
+         * @param cancellation stops the response of the session when cancelled
+         */
+        OllamaChatAwaitable(OllamaChat& chat, OllamaChat::SessionID session, std::string message, EOllamaPriority priority, OllamaCancellation cancellation) :
+            mChat(chat), mSession(session), mMessage(std::move(message)), mPriority(priority), mCancellation(std::move(cancellation)), mState(std::make_shared<State>())
+        { }
+
+        bool await_ready() const                                            { return mCancellation.isCancelled(); }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            auto state = mState;
+            state->mHandle = handle;
+
+            auto& chat = mChat;
+            auto session = mSession;
+            state->mSubscription = mCancellation.subscribe([&chat, session]() { chat.stopResponse(session); });
+            mChat.chat(mMessage,
+                       [state](const std::string& token) { state->mText += token; },
+                       [state]() { state->mHandle.resume(); },
+                       [state](const std::string& error) { state->mError = error.empty() ? "Request failed" : error; state->mHandle.resume(); },
+                       { mSession, mPriority });
+        }
+
+        std::string await_resume()
+        {
+            mCancellation.unsubscribe(mState->mSubscription);
+            if (mCancellation.isCancelled())
+                throw OllamaCancelledError();
+            if (!mState->mError.empty())
+                throw std::runtime_error(mState->mError);
+            return std::move(mState->mText);
+        }
+
+    private:
+        // Response shared with the callbacks of the chat
+        struct State
+        {
+            std::string mText;
+            std::string mError;
+            std::coroutine_handle<> mHandle;
+            std::uint64_t mSubscription = 0;
+        };
+
+        OllamaChat& mChat;
+        OllamaChat::SessionID mSession;
+        std::string mMessage;
+        EOllamaPriority mPriority;
+        OllamaCancellation mCancellation;
+        std::shared_ptr<State> mState;
+    };
+
+
+    /**
+     * The tokens of the response to a prompt of a chat session, as they arrive.
+     * The prompt is enqueued on construction. Tokens are buffered on the main thread until they are awaited with next(),
+     * the consumer is resumed on the main thread when a token arrives while it waits.
+     * Destroying the stream before the response is complete stops the response of the session.
+     */
+    class OllamaTokenStream final
+    {
+    public:
+        /**
+         * @param chat the chat that serves the prompt
+         * @param session the session that holds the context of the conversation
+         * @param message the message to prompt
+         * @param priority the priority class of the prompt
+         * @param cancellation stops the response of the session when cancelled
+         */
+        OllamaTokenStream(OllamaChat& chat, OllamaChat::SessionID session, const std::string& message, EOllamaPriority priority, OllamaCancellation cancellation) :
+            mChat(chat), mSession(session), mCancellation(std::move(cancellation)), mState(std::make_shared<State>())
+        {
+            auto& stopped_chat = mChat;
+            mSubscription = mCancellation.subscribe([&stopped_chat, session]() { stopped_chat.stopResponse(session); });
+
+            auto state = mState;
+            mChat.chat(message,
+                       [state](const std::string& token) { state->mTokens.emplace_back(token); state->resume(); },
+                       [state]() { state->mDone = true; state->resume(); },
+                       [state](const std::string& error) { state->mError = error.empty() ? "Request failed" : error; state->mDone = true; state->resume(); },
+                       { session, priority });
+        }
+
+        ~OllamaTokenStream()
+        {
+            mCancellation.unsubscribe(mSubscription);
+            if (!mState->mDone)
+                mChat.stopResponse(mSession);
+        }
+
+        // The stream is referenced by the callbacks of the chat and can't be copied or moved
+        OllamaTokenStream(const OllamaTokenStream&) = delete;
+        OllamaTokenStream& operator=(const OllamaTokenStream&) = delete;
+
+        // Awaits the next token of the stream
+        struct NextAwaiter
+        {
+            OllamaTokenStream& mStream;
+
+            bool await_ready() const                                        { return !mStream.mState->mTokens.empty() || mStream.mState->mDone; }
+            void await_suspend(std::coroutine_handle<> handle)              { mStream.mState->mWaiting = handle; }
+            std::optional<std::string> await_resume()
+            {
+                auto& state = *mStream.mState;
+                if (!state.mTokens.empty())
+                {
+                    auto token = std::move(state.mTokens.front());
+                    state.mTokens.pop_front();
+                    return token;
+                }
+                if (mStream.mCancellation.isCancelled())
+                    throw OllamaCancelledError();
+                if (!state.mError.empty())
+                    throw std::runtime_error(state.mError);
+                return std::nullopt;
+            }
+        };
+
+        /**
+         * Awaits the next token. A failed prompt throws a std::runtime_error with the error once the tokens received before the failure were returned,
+         * a cancelled prompt throws an OllamaCancelledError.
+         * @return the next token, empty when the response is complete
+         */
+        NextAwaiter next()                                                  { return NextAwaiter{ *this }; }
+
+    private:
+        // Tokens shared with the callbacks of the chat, which run on the main thread
+        struct State
+        {
+            std::deque<std::string> mTokens;
+            std::string mError;
+            bool mDone = false;
+            std::coroutine_handle<> mWaiting;                               ///< Consumer waiting for a token
+
+            void resume()                                                   { if (mWaiting) std::exchange(mWaiting, nullptr).resume(); }
+        };
+
+        OllamaChat& mChat;
+        OllamaChat::SessionID mSession;
+        OllamaCancellation mCancellation;
+        std::uint64_t mSubscription = 0;
+        std::shared_ptr<State> mState;
+    };
+
+
+    /**
+     * Awaits work executed on the worker pool of the OllamaService, such as a request that does not belong to a chat.
+     * The work is enqueued when the coroutine suspends, the coroutine resumes on the main thread with the result of the work.
+     * An exception thrown by the work is thrown to the coroutine, cancelled work throws an OllamaCancelledError.
+     */
+    template<typename T>
+    class OllamaPoolAwaitable final
+    {
+    public:
+        /**
+         * @param service the service that executes the work
+         * @param work the work to execute on the worker pool
+         * @param stop stops the work in progress, called on cancel
+         * @param cancellation cancels the work
+         */
+        OllamaPoolAwaitable(OllamaService& service, std::function<T()> work, std::function<void()> stop, OllamaCancellation cancellation) :
+            mService(service), mWork(std::move(work)), mStop(std::move(stop)), mCancellation(std::move(cancellation)), mState(std::make_shared<State>())
+        { }
+
+        bool await_ready() const                                            { return mCancellation.isCancelled(); }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            auto state = mState;
+            state->mHandle = handle;
+            if (mStop)
+                state->mSubscription = mCancellation.subscribe(mStop);
+
+            auto& service = mService;
+            service.enqueueTask([&service, state, work = std::move(mWork)]()
+            {
+                try
+                {
+                    state->mValue.emplace(work());
+                }
+                catch (...)
+                {
+                    state->mException = std::current_exception();
+                }
+                service.enqueueMainThreadTask([state]() { state->mHandle.resume(); });
+            });
+        }
+
+        T await_resume()
+        {
+            mCancellation.unsubscribe(mState->mSubscription);
+            if (mCancellation.isCancelled())
+                throw OllamaCancelledError();
+            if (mState->mException)
+                std::rethrow_exception(mState->mException);
+            return std::move(*mState->mValue);
+        }
+
+    private:
+        // Result shared with the worker pool
+        struct State
+        {
+            std::optional<T> mValue;
+            std::exception_ptr mException;
+            std::coroutine_handle<> mHandle;
+            std::uint64_t mSubscription = 0;
+        };
+
+        OllamaService& mService;
+        std::function<T()> mWork;
+        std::function<void()> mStop;
+        OllamaCancellation mCancellation;
+        std::shared_ptr<State> mState;
+    };
+
+
+    /**
+     * Prompts a chat session and awaits the complete response:
+     *
+     *     auto reply = co_await awaitChat(chat, session, "Hello");
+     *
+     * @param chat the chat that serves the prompt
+     * @param session the session that holds the context of the conversation
+     * @param message the message to prompt
+     * @param priority the priority class of the prompt
+     * @param cancellation stops the response when cancelled
+     * @return the awaitable, resumes with the text of the response
+     */
+    inline OllamaChatAwaitable awaitChat(OllamaChat& chat, OllamaChat::SessionID session, std::string message,
+                                         EOllamaPriority priority = EOllamaPriority::Normal, OllamaCancellation cancellation = {})
+    {
+        return OllamaChatAwaitable(chat, session, std::move(message), priority, std::move(cancellation));
+    }
+
+
+    /**
+     * Prompts a chat session and yields the tokens of the response as they arrive
+     * @param chat the chat that serves the prompt
+     * @param session the session that holds the context of the conversation
+     * @param message the message to prompt
+     * @param priority the priority class of the prompt
+     * @param cancellation stops the response when cancelled
+     * @return generator of the tokens
+     */
+    inline OllamaGenerator<std::string> streamChat(OllamaChat& chat, OllamaChat::SessionID session, std::string message,
+                                                   EOllamaPriority priority = EOllamaPriority::Normal, OllamaCancellation cancellation = {})
+    {
+        OllamaTokenStream stream(chat, session, message, priority, std::move(cancellation));
+        while (auto token = co_await stream.next())
+            co_yield std::move(*token);
+    }
+
+
+    /**
+     * Generates a response to a prompt without context on a server, on the worker pool of the service
+     * @param service the service that sends the request
+     * @param serverURL URL of the Ollama server
+     * @param model the model to generate with
+     * @param prompt the prompt
+     * @param cancellation stops the request when cancelled
+     * @return the awaitable, resumes with the text of the response
+     */
+    NAPAPI OllamaPoolAwaitable<std::string> awaitGenerate(OllamaService& service, const std::string& serverURL, const std::string& model,
+                                                          const std::string& prompt, OllamaCancellation cancellation = {});
+
+    /**
+     * Computes the embedding of a text on a server, on the worker pool of the service
+     * @param service the service that sends the request
+     * @param serverURL URL of the Ollama server
+     * @param model the embedding model
+     * @param input the text to embed
+     * @param cancellation stops the request when cancelled
+     * @return the awaitable, resumes with the embedding
+     */
+    NAPAPI OllamaPoolAwaitable<std::vector<float>> awaitEmbedding(OllamaService& service, const std::string& serverURL, const std::string& model,
+                                                                  const std::string& input, OllamaCancellation cancellation = {});
+
+    /**
+     * Lists the models available on a server, on the worker pool of the service
+     * @param service the service that sends the request
+     * @param serverURL URL of the Ollama server
+     * @param cancellation stops the request when cancelled
+     * @return the awaitable, resumes with the names of the models
+     */
+    NAPAPI OllamaPoolAwaitable<std::vector<std::string>> awaitModels(OllamaService& service, const std::string& serverURL, OllamaCancellation cancellation = {});
+
+    /**
+     * Loads a model into the memory of a server, on the worker pool of the service
+     * @param service the service that sends the request
+     * @param serverURL URL of the Ollama server
+     * @param model the model to load
+     * @param cancellation stops the request when cancelled
+     * @return the awaitable, resumes with true when the model was loaded
+     */
+    NAPAPI OllamaPoolAwaitable<bool> awaitLoadModel(OllamaService& service, const std::string& serverURL, const std::string& model, OllamaCancellation cancellation = {});
+
+    /**
+     * Pulls a model to a server, on the worker pool of the service
+     * @param service the service that sends the request
+     * @param serverURL URL of the Ollama server
+     * @param model the model to pull
+     * @param cancellation stops the pull when cancelled
+     * @return the awaitable, resumes with true when the model was pulled
+     */
+    NAPAPI OllamaPoolAwaitable<bool> awaitPullModel(OllamaService& service, const std::string& serverURL, const std::string& model, OllamaCancellation cancellation = {});
+}
+
+#endif // __cpp_impl_coroutine
@@ -0,0 +1,190 @@
+#include "ollamafanout.h"
+#include "ollamaservice.h"
+
+#include "ollama.hpp"
+
+#include <rtti/rtti.h>
+
+RTTI_BEGIN_ENUM(nap::EOllamaFanOutPolicy)
+    RTTI_ENUM_VALUE(nap::EOllamaFanOutPolicy::FirstComplete, "FirstComplete"),
+    RTTI_ENUM_VALUE(nap::EOllamaFanOutPolicy::FirstToken, "FirstToken"),
+    RTTI_ENUM_VALUE(nap::EOllamaFanOutPolicy::Best, "Best"),
+    RTTI_ENUM_VALUE(nap::EOllamaFanOutPolicy::FirstTokenBest, "FirstTokenBest")
+RTTI_END_ENUM
+
+namespace nap
+{
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaFanOut
+    //////////////////////////////////////////////////////////////////////////
+
+    bool OllamaFanOut::validate(utility::ErrorState& errorState) const
+    {
+        if (!errorState.check(!mBranches.empty(), "Fan-out has no branches"))
+            return false;
+        return errorState.check(!isScored() || mScorer != nullptr, "Fan-out with the 'Best' or 'FirstTokenBest' policy needs a scorer");
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaFanOutRace
+    //////////////////////////////////////////////////////////////////////////
+
+    OllamaFanOutRace::OllamaFanOutRace(const OllamaFanOut& fanOut, const std::function<void(int, const std::string&)>& callback, const std::atomic_bool& streaming) :
+        mFanOut(fanOut), mCallback(callback), mStreaming(streaming), mServers(fanOut.mBranches.size(), nullptr)
+    {
+        mResult.mBranches.resize(fanOut.mBranches.size());
+    }
+
+
+    void OllamaFanOutRace::run(OllamaService& service, EOllamaPriority priority, const std::function<void(int)>& sendBranch)
+    {
+        // Branches are claimed one at a time by the calling thread and by up to one task per other branch on the worker pool of the service.
+        // The calling thread keeps claiming until no branch is left, so the prompt never waits for a busy pool,
+        // and a task that starts after every branch was claimed returns without touching the state of the race.
+        // A task only claims a branch when it acquires a scheduler slot of its own, otherwise the branch is sent on the slot of the prompt.
+        struct Claims
+        {
+            std::atomic<std::size_t> mNext = { 0 };
+            std::size_t mCount = 0;
+            std::function<void(int)> mSend;
+        };
+        auto claims = std::make_shared<Claims>();
+        claims->mCount = mFanOut.mBranches.size();
+        claims->mSend = sendBranch;
+        auto claim = [](Claims& claims)
+        {
+            auto index = claims.mNext.fetch_add(1);
+            if (index >= claims.mCount)
+                return false;
+            claims.mSend(static_cast<int>(index));
+            return true;
+        };
+
+        auto& scheduler = service.getScheduler();
+        for (std::size_t i = 1; i < claims->mCount; i++)
+        {
+            service.enqueueTask([claims, claim, &scheduler, priority]()
+            {
+                if (claims->mNext >= claims->mCount)
+                    return;
+                auto slot = scheduler.tryAcquire(priority);
+                if (slot.isValid())
+                    claim(*claims);
+            });
+        }
+        while (claim(*claims)) {}
+
+        // Wait for the branches claimed by the pool to end, a stopped branch ends right away
+        std::unique_lock lock(mMutex);
+        mChanged.wait(lock, [this] { return mFinished == mServers.size(); });
+    }
+
+
+    bool OllamaFanOutRace::connect(int index, Ollama& server)
+    {
+        std::lock_guard lk(mMutex);
+        if (!isRacing(index))
+            return false;
+        mServers[index] = &server;
+        return true;
+    }
+
+
+    bool OllamaFanOutRace::feed(int index, const std::string& token, bool done)
+    {
+        bool stream = true;
+        {
+            // The first token or the first complete response decides the race
+            std::lock_guard lk(mMutex);
+            if (!isRacing(index))
+                return false;
+            if (!token.empty() && mResult.mFirstToken == -1)
+                mResult.mFirstToken = index;
+            if (!token.empty() && mFanOut.mPolicy == EOllamaFanOutPolicy::FirstToken && mResult.mWinner == -1)
+                win(index);
+            if (done && mFanOut.mPolicy == EOllamaFanOutPolicy::FirstComplete && mResult.mWinner == -1)
+                win(index);
+
+            // Only the branch with the first token streams, the other branches complete in the background to be scored
+            stream = mFanOut.mPolicy != EOllamaFanOutPolicy::FirstTokenBest || mResult.mFirstToken == index;
+        }
+
+        if (!token.empty() && stream)
+        {
+            std::lock_guard lk(mCallbackMutex);
+            mCallback(index, token);
+        }
+        return true;
+    }
+
+
+    void OllamaFanOutRace::finish(int index, OllamaFanOutBranchResult&& result)
+    {
+        std::lock_guard lk(mMutex);
+        mServers[index] = nullptr;
+        if (!result.mCompleted && mResult.mWinner != -1 && mResult.mWinner != index)
+        {
+            result.mCancelled = true;
+            result.mError.clear();
+        }
+        mResult.mBranches[index] = std::move(result);
+        mFinished++;
+        mChanged.notify_all();
+    }
+
+
+    void OllamaFanOutRace::stop()
+    {
+        std::lock_guard lk(mMutex);
+        for (auto* server : mServers)
+        {
+            if (server != nullptr)
+                server->stop();
+        }
+    }
+
+
+    const OllamaFanOutResult& OllamaFanOutRace::select()
+    {
+        // Every branch completed or failed, the completed branch with the highest score wins
+        if (mFanOut.isScored())
+        {
+            for (std::size_t i = 0; i < mResult.mBranches.size(); i++)
+            {
+                auto& branch = mResult.mBranches[i];
+                if (!branch.mCompleted)
+                    continue;
+                branch.mScore = mFanOut.mScorer(branch);
+                if (mResult.mWinner == -1 || branch.mScore > mResult.mBranches[mResult.mWinner].mScore)
+                    mResult.mWinner = static_cast<int>(i);
+            }
+        }
+
+        // Report the error of the winner, or of the first branch when no branch won
+        if (mResult.mWinner == -1 || !mResult.getWinner().mCompleted)
+        {
+            const auto& failed = mResult.mWinner != -1 ? mResult.getWinner() : mResult.mBranches.front();
+            throw ollama::exception("No branch of the fan-out completed: " + failed.mError);
+        }
+        return mResult;
+    }
+
+
+    bool OllamaFanOutRace::isRacing(int index) const
+    {
+        return mStreaming && (mResult.mWinner == -1 || mResult.mWinner == index);
+    }
+
+
+    void OllamaFanOutRace::win(int index)
+    {
+        mResult.mWinner = index;
+        for (std::size_t i = 0; i < mServers.size(); i++)
+        {
+            if (static_cast<int>(i) != index && mServers[i] != nullptr)
+                mServers[i]->stop();
+        }
+        mChanged.notify_all();
+    }
+}
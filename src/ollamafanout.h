@@ -0,0 +1,189 @@
+#pragma once
+
+#include "ollamaconnectionpool.h"
+#include "ollamametrics.h"
+#include "ollamascheduler.h"
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    // Forward declarations
+    class OllamaService;
+
+    /**
+     * How a fan-out prompt selects the response of one of its branches
+     */
+    enum class EOllamaFanOutPolicy : int
+    {
+        FirstComplete   = 0,    ///< The first branch to complete its response wins, the other branches are cancelled
+        FirstToken      = 1,    ///< The first branch to generate a token wins, the other branches are cancelled
+        Best            = 2,    ///< Every branch completes its response, the branch with the highest score wins
+        FirstTokenBest  = 3     ///< Only the first branch to generate a token streams its tokens, every branch completes its response and the branch with the highest score wins
+    };
+
+
+    /**
+     * A model and server a fan-out prompt is sent to
+     */
+    struct NAPAPI OllamaFanOutBranch
+    {
+        std::string mModel;                 ///< Model of the branch, empty for the model of the chat
+        std::string mServerURL;             ///< Server of the branch, empty for the server or backend set of the chat
+    };
+
+
+    /**
+     * The response and timings of a branch of a fan-out prompt
+     */
+    struct NAPAPI OllamaFanOutBranchResult
+    {
+        OllamaFanOutBranch mBranch;         ///< The branch, with the model and server the request was sent to
+        std::string mText;                  ///< Text the branch generated, the complete response when the branch completed
+        bool mCompleted = false;            ///< If the branch completed its response
+        bool mCancelled = false;            ///< If the branch was cancelled because another branch won
+        std::string mError;                 ///< Error of a branch that failed
+        float mScore = 0.0f;                ///< Score of a completed branch, only set by the 'Best' and 'FirstTokenBest' policies
+        OllamaRequestStats mStats;          ///< Token usage and timings of the request, the server timings are only known for a completed branch
+        std::uint64_t mTotalTime = 0;       ///< Microseconds between sending the request and the end of the branch
+    };
+
+
+    /**
+     * The responses of all branches of a fan-out prompt and the branch that won
+     */
+    struct NAPAPI OllamaFanOutResult
+    {
+        std::vector<OllamaFanOutBranchResult> mBranches;    ///< The branches, in the order of the prompt
+        int mWinner = -1;                                   ///< Index of the branch that won
+        int mFirstToken = -1;                               ///< Index of the branch that generated the first token
+
+        /**
+         * @return the branch that won
+         */
+        const OllamaFanOutBranchResult& getWinner() const   { return mBranches[mWinner]; }
+    };
+
+
+    /**
+     * Scores a completed branch of a fan-out prompt with the 'Best' or 'FirstTokenBest' policy, the branch with the highest score wins
+     */
+    using OllamaFanOutScorer = std::function<float(const OllamaFanOutBranchResult&)>;
+
+
+    /**
+     * The models or servers a fan-out prompt is sent to at the same time and how the response of one of them is selected
+     */
+    struct NAPAPI OllamaFanOut
+    {
+        std::vector<OllamaFanOutBranch> mBranches;                              ///< The models and servers to send the prompt to
+        EOllamaFanOutPolicy mPolicy = EOllamaFanOutPolicy::FirstComplete;       ///< How the branch that wins is selected
+        OllamaFanOutScorer mScorer;                                             ///< Scores the completed branches, required by the 'Best' and 'FirstTokenBest' policies
+
+        /**
+         * @param errorState contains the error when the fan-out has no branches or lacks the scorer of its policy
+         * @return if the fan-out can be sent
+         */
+        bool validate(utility::ErrorState& errorState) const;
+
+        /**
+         * @return if every branch completes its response to be scored
+         */
+        bool isScored() const           { return mPolicy == EOllamaFanOutPolicy::Best || mPolicy == EOllamaFanOutPolicy::FirstTokenBest; }
+    };
+
+
+    /**
+     * The race between the branches of a fan-out prompt, the branches report their frames from their own threads.
+     * The first token or complete response decides the race by the policy, the connections of the branches that lost are stopped.
+     */
+    class NAPAPI OllamaFanOutRace final
+    {
+    public:
+        /**
+         * @param fanOut the fan-out prompt
+         * @param callback called for each token of a branch with the index of the branch until the branch is cancelled, for one branch at a time
+         * @param streaming cleared when the prompt is stopped, the branches end
+         */
+        OllamaFanOutRace(const OllamaFanOut& fanOut, const std::function<void(int, const std::string&)>& callback, const std::atomic_bool& streaming);
+
+        /**
+         * Sends all branches and waits for them to end.
+         * The branches are claimed by the calling thread and by one task per other branch on the worker pool of the service,
+         * the calling thread sends the branches that no task claimed yet itself. A task only claims a branch when it acquires a scheduler slot.
+         * @param service the service of the worker pool and the scheduler
+         * @param priority the priority class of the prompt, the branches on the worker pool acquire their slots in this class
+         * @param sendBranch sends the request of the branch with the given index, reporting to this race
+         */
+        void run(OllamaService& service, EOllamaPriority priority, const std::function<void(int)>& sendBranch);
+
+        /**
+         * Registers the connection of a branch, stopped when another branch wins or the prompt is stopped
+         * @param index the branch
+         * @param server the connection of the branch
+         * @return false when the branch lost or the prompt was stopped
+         */
+        bool connect(int index, Ollama& server);
+
+        /**
+         * Reports a frame of a branch, the tokens of the branch that streams are passed to the callback
+         * @param index the branch
+         * @param token the token of the frame, empty when the frame holds none
+         * @param done if the frame completes the response
+         * @return false when the branch lost or the prompt was stopped, the branch cancels its request
+         */
+        bool feed(int index, const std::string& token, bool done);
+
+        /**
+         * Ends a branch, its connection can no longer be stopped by the other branches
+         * @param index the branch
+         * @param result the response of the branch
+         */
+        void finish(int index, OllamaFanOutBranchResult&& result);
+
+        /**
+         * Stops the connections of the branches in progress, branches that did not connect yet see the prompt stopped
+         */
+        void stop();
+
+        /**
+         * Selects the branch that wins once every branch ended, scoring the completed branches of the 'Best' and 'FirstTokenBest' policies.
+         * Throws when the branch that won did not complete
+         * @return the responses of all branches and the branch that won
+         */
+        const OllamaFanOutResult& select();
+
+    private:
+        /**
+         * @return if the branch did not lose and the prompt was not stopped, call with the mutex locked
+         */
+        bool isRacing(int index) const;
+
+        /**
+         * Cancels the branches other than the winner, call with the mutex locked
+         */
+        void win(int index);
+
+        const OllamaFanOut& mFanOut;
+        std::function<void(int, const std::string&)> mCallback;
+        const std::atomic_bool& mStreaming;
+
+        // State shared by the branches, guarded by mMutex
+        std::mutex mMutex;
+        std::condition_variable mChanged;
+        std::size_t mFinished = 0;
+        std::vector<Ollama*> mServers;                          ///< Connections of the branches in progress, stopped to cancel a branch
+        OllamaFanOutResult mResult;
+
+        // Tokens of different branches are passed to the callback one at a time
+        std::mutex mCallbackMutex;
+    };
+}
@@ -0,0 +1,159 @@
+#include "ollamahedge.h"
+#include "ollamametrics.h"
+#include "ollamaservice.h"
+
+#include "ollama.hpp"
+
+#include <array>
+#include <condition_variable>
+#include <mutex>
+
+namespace nap
+{
+    OllamaHedge::OllamaHedge(OllamaService& service, OllamaConnectionPool& connections, OllamaBackendSet& backends, const std::string& model, OllamaMetrics& metrics) :
+        mService(service), mConnections(connections), mBackends(backends), mModel(model), mMetrics(metrics)
+    { }
+
+
+    std::chrono::steady_clock::duration OllamaHedge::getDelay(OllamaBackendSet& backends, const OllamaMetrics& metrics, float percentile)
+    {
+        // Percentiles are unreliable until enough requests were measured
+        static constexpr std::uint64_t min_samples = 20;
+        if (backends.getAvailableCount() < 2)
+            return std::chrono::steady_clock::duration::zero();
+
+        const auto& time_to_first_token = metrics.mTimeToFirstToken;
+        if (time_to_first_token.getCount() < min_samples)
+            return std::chrono::steady_clock::duration::zero();
+
+        return std::chrono::microseconds(std::max<std::uint64_t>(time_to_first_token.getPercentile(percentile), 1));
+    }
+
+
+    void OllamaHedge::generate(OllamaSession& session, const ollama::request& request, const std::function<bool(const std::string&)>& onFrame,
+                               OllamaBackendSet::Lease lease, std::chrono::steady_clock::duration delay)
+    {
+        // State shared with the duplicate, which outlives the request when the duplicate is never started
+        struct Hedge
+        {
+            std::mutex mMutex;
+            std::condition_variable mFinished;
+            int mWinner = -1;                                       ///< The request whose frames are passed on, the first to receive a frame
+            bool mClosed = false;                                   ///< The first request finished, the duplicate is no longer started
+            bool mStarted = false;                                  ///< The duplicate was sent, the first request waits for it
+            bool mDone = false;                                     ///< The duplicate finished
+            std::array<Ollama*, 2> mServers = { nullptr, nullptr };
+            std::exception_ptr mError;                              ///< Error of the duplicate
+        };
+        auto hedge = std::make_shared<Hedge>();
+
+        // Sends the request over the connection, the first request to receive a frame cancels the other
+        auto send = [&session, &request, &onFrame, hedge](int index, OllamaBackendSet::Lease& backend, Ollama& server) -> std::exception_ptr
+        {
+            bool won = false;
+            std::exception_ptr error;
+            auto attempt = request;
+            try
+            {
+                server.generate_frames(attempt, [&](const std::string& frame)
+                {
+                    if (!won)
+                    {
+                        std::lock_guard lk(hedge->mMutex);
+                        if (hedge->mWinner != -1 || !session.mStreaming)
+                            return false;
+
+                        hedge->mWinner = index;
+                        won = true;
+                        session.mActiveServer.set(&server);
+                        if (hedge->mServers[1 - index] != nullptr)
+                            hedge->mServers[1 - index]->stop();
+                    }
+                    return onFrame(frame);
+                });
+                if (won)
+                    backend.reportSuccess();
+            }
+            catch (const std::exception&)
+            {
+                // Only a backend that can't be reached counts as failed, not a cancelled request
+                error = std::current_exception();
+                std::lock_guard lk(hedge->mMutex);
+                if (!won && hedge->mWinner == -1 && session.mStreaming)
+                    backend.reportFailure();
+            }
+            backend.release();
+            return error;
+        };
+
+        // Sends the duplicate to another backend, returns false when no other backend has a free slot
+        auto primary_url = lease.getURL();
+        auto send_duplicate = [this, &session, hedge, send, primary_url](std::unique_lock<std::mutex>& lock) -> bool
+        {
+            auto duplicate = mBackends.acquire(mModel, std::chrono::milliseconds(0), primary_url);
+            if (!duplicate.isValid() || duplicate.getURL() == primary_url)
+                return false;
+
+            hedge->mStarted = true;
+            {
+                // The connection returns to the pool before the duplicate is reported done, it can no longer be stopped by the first request
+                OllamaConnection connection(mConnections, duplicate.getURL(), &session.mActiveServer);
+                hedge->mServers[1] = &*connection;
+                lock.unlock();
+                auto error = send(1, duplicate, *connection);
+                lock.lock();
+                hedge->mServers[1] = nullptr;
+                hedge->mError = error;
+            }
+            hedge->mDone = true;
+            hedge->mFinished.notify_all();
+            return true;
+        };
+
+        // The duplicate is started on the worker pool of the service when no frame arrived within the delay,
+        // the references it captures are valid until the first request closes the hedge or the duplicate is done
+        mService.depositHedgeBudget();
+        mService.enqueueTask([hedge, &session, send_duplicate, this]()
+        {
+            std::unique_lock lock(hedge->mMutex);
+            if (hedge->mClosed || hedge->mWinner != -1 || !session.mStreaming || !mService.withdrawHedgeBudget())
+                return;
+            send_duplicate(lock);
+        }, delay);
+
+        // Send the first request on the calling thread
+        std::exception_ptr error;
+        {
+            OllamaConnection connection(mConnections, primary_url, &session.mActiveServer);
+            {
+                std::lock_guard lk(hedge->mMutex);
+                hedge->mServers[0] = &*connection;
+                session.mActiveServer.set(&*connection);
+            }
+            error = send(0, lease, *connection);
+            std::lock_guard lk(hedge->mMutex);
+            hedge->mServers[0] = nullptr;
+        }
+
+        // Duplicate the request right away, regardless of the budget, when the backend can't be reached.
+        // Otherwise wait for the duplicate when it was started
+        std::unique_lock lock(hedge->mMutex);
+        bool failed = error != nullptr && hedge->mWinner == -1 && !hedge->mStarted && session.mStreaming;
+        hedge->mClosed = true;
+        if (failed)
+            send_duplicate(lock);
+        hedge->mFinished.wait(lock, [&]{ return !hedge->mStarted || hedge->mDone; });
+
+        if (hedge->mStarted)
+        {
+            mMetrics.recordHedge(hedge->mWinner == 1);
+            mService.mMetrics.recordHedge(hedge->mWinner == 1);
+        }
+
+        // Throw the error of the request that answered, or of the first request when neither answered
+        if (hedge->mWinner == 1 || (error == nullptr && hedge->mWinner == -1))
+            error = hedge->mError;
+        if (error != nullptr)
+            std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ollamabackendset.h"
+#include "ollamasessiontable.h"
+
+#include <utility/dllexport.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+namespace nap
+{
+    // Forward declarations
+    class OllamaService;
+    class OllamaMetrics;
+
+    /**
+     * Sends a request to a backend and duplicates it to another backend when its first token did not arrive within the hedge delay.
+     * The duplicate is sent from the worker pool of the service when the delay elapsed and the hedge budget of the service allows it.
+     * The response of the backend that answers first is used, the other request is cancelled.
+     * A duplicate is also sent, regardless of the hedge budget, when the first backend can't be reached.
+     */
+    class NAPAPI OllamaHedge final
+    {
+    public:
+        /**
+         * @param service the service that sends the duplicate and holds the hedge budget
+         * @param connections the connections to the backends
+         * @param backends the backend set the duplicate is routed to
+         * @param model the model of the request
+         * @param metrics the metrics the hedged requests are recorded in, besides the metrics of the service
+         */
+        OllamaHedge(OllamaService& service, OllamaConnectionPool& connections, OllamaBackendSet& backends, const std::string& model, OllamaMetrics& metrics);
+
+        /**
+         * Returns the time after which a request without first token is duplicated to another backend,
+         * zero when there is only one backend available or too few requests were measured.
+         * @param backends the backend set the requests are routed to
+         * @param metrics the metrics with the time to first token of the requests
+         * @param percentile percentile of the time to first token after which a request is duplicated
+         * @return the hedge delay
+         */
+        static std::chrono::steady_clock::duration getDelay(OllamaBackendSet& backends, const OllamaMetrics& metrics, float percentile);
+
+        /**
+         * Sends a request on the calling thread and duplicates it when no frame arrived within the delay.
+         * The frames of the request that answers first are passed to the frame handler.
+         * Throws the error of the request that answered first, or of the first request when neither answered.
+         * @param session the session of the request, stopping the session stops the request that answers
+         * @param request the request to send
+         * @param onFrame the frame handler
+         * @param lease the slot on the backend the request is sent to first
+         * @param delay time to wait for the first frame before sending the duplicate
+         */
+        void generate(OllamaSession& session, const ollama::request& request, const std::function<bool(const std::string&)>& onFrame,
+                      OllamaBackendSet::Lease lease, std::chrono::steady_clock::duration delay);
+
+    private:
+        OllamaService& mService;
+        OllamaConnectionPool& mConnections;
+        OllamaBackendSet& mBackends;
+        std::string mModel;
+        OllamaMetrics& mMetrics;
+    };
+}
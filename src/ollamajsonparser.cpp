@@ -0,0 +1,606 @@
+#include "ollamajsonparser.h"
+
+#include "ollama.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <map>
+
+namespace nap
+{
+    // Types of JSON values, a schema accepts a set of them
+    static constexpr unsigned typeObject    = 1 << 0;
+    static constexpr unsigned typeArray     = 1 << 1;
+    static constexpr unsigned typeString    = 1 << 2;
+    static constexpr unsigned typeNumber    = 1 << 3;       ///< A number with a fraction or exponent
+    static constexpr unsigned typeInteger   = 1 << 4;
+    static constexpr unsigned typeBoolean   = 1 << 5;
+    static constexpr unsigned typeNull      = 1 << 6;
+    static constexpr unsigned typeAny       = (1 << 7) - 1;
+
+
+    /**
+     * @return the type of the value that starts with a character, 0 when no value starts with it
+     */
+    static unsigned getValueType(char character)
+    {
+        switch (character)
+        {
+        case '{': return typeObject;
+        case '[': return typeArray;
+        case '"': return typeString;
+        case 't':
+        case 'f': return typeBoolean;
+        case 'n': return typeNull;
+        default:
+            return character == '-' || std::isdigit(static_cast<unsigned char>(character)) ? typeNumber | typeInteger : 0;
+        }
+    }
+
+
+    /**
+     * @return the names of a set of value types, such as "string or null"
+     */
+    static std::string getTypeNames(unsigned types)
+    {
+        // A number includes the integers
+        if (types & typeNumber)
+            types &= ~typeInteger;
+
+        static const std::pair<unsigned, const char*> names[] =
+        {
+            { typeObject, "object" }, { typeArray, "array" }, { typeString, "string" }, { typeNumber, "number" },
+            { typeInteger, "integer" }, { typeBoolean, "boolean" }, { typeNull, "null" }
+        };
+        std::string result;
+        for (const auto& name : names)
+        {
+            if ((types & name.first) != 0)
+                result += (result.empty() ? "" : " or ") + std::string(name.second);
+        }
+        return result.empty() ? "no value" : result;
+    }
+
+
+    /**
+     * @return the set of value types of a type name of a schema, 0 when the name is unknown
+     */
+    static unsigned getSchemaType(const std::string& name)
+    {
+        static const std::map<std::string, unsigned> types =
+        {
+            { "object", typeObject }, { "array", typeArray }, { "string", typeString }, { "number", typeNumber | typeInteger },
+            { "integer", typeInteger }, { "boolean", typeBoolean }, { "null", typeNull }
+        };
+        auto it = types.find(name);
+        return it != types.end() ? it->second : 0;
+    }
+
+
+    /**
+     * @return if a text is a JSON number
+     */
+    static bool isNumber(const std::string& text)
+    {
+        auto digit = [&](std::size_t i) { return i < text.size() && std::isdigit(static_cast<unsigned char>(text[i])); };
+        std::size_t i = 0;
+        if (i < text.size() && text[i] == '-')
+            i++;
+        if (i < text.size() && text[i] == '0')
+            i++;
+        else if (digit(i))
+            while (digit(i)) i++;
+        else
+            return false;
+
+        if (i < text.size() && text[i] == '.')
+        {
+            if (!digit(++i))
+                return false;
+            while (digit(i)) i++;
+        }
+        if (i < text.size() && (text[i] == 'e' || text[i] == 'E'))
+        {
+            i++;
+            if (i < text.size() && (text[i] == '+' || text[i] == '-'))
+                i++;
+            if (!digit(i))
+                return false;
+            while (digit(i)) i++;
+        }
+        return i == text.size();
+    }
+
+
+    /**
+     * @return a description of the value at a path, for errors
+     */
+    static std::string describe(const std::string& path)
+    {
+        return path.empty() ? "the root value" : "'" + path + "'";
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaJSONSchema
+    //////////////////////////////////////////////////////////////////////////
+
+    struct OllamaJSONSchema::Node
+    {
+        unsigned mTypes = typeAny;                                          ///< Types the value may have
+        std::map<std::string, std::shared_ptr<const Node>> mProperties;     ///< Schemas of the properties of an object
+        std::vector<std::string> mRequired;                                 ///< Properties an object must have
+        bool mAdditionalProperties = true;                                  ///< If an object may have properties that are not in mProperties
+        std::shared_ptr<const Node> mItems;                                 ///< Schema of the elements of an array, nullptr when any value is accepted
+        std::vector<nlohmann::json> mEnum;                                  ///< Values the value must be one of, empty when any value is accepted
+
+        /**
+         * Compiles the schema of a value
+         */
+        static std::shared_ptr<const Node> compile(const nlohmann::json& schema, const std::string& path, utility::ErrorState& errorState)
+        {
+            auto node = std::make_shared<Node>();
+            if (schema.is_boolean())
+            {
+                node->mTypes = schema.get<bool>() ? typeAny : 0u;
+                return node;
+            }
+            if (!errorState.check(schema.is_object(), "Schema at '%s' is not an object", path.c_str()))
+                return nullptr;
+
+            if (schema.contains("type"))
+            {
+                const auto& type = schema["type"];
+                auto names = type.is_array() ? type : nlohmann::json::array({ type });
+                node->mTypes = 0;
+                for (const auto& name : names)
+                {
+                    auto value = name.is_string() ? getSchemaType(name.get<std::string>()) : 0;
+                    if (!errorState.check(value != 0, "Unknown type %s in schema at '%s'", name.dump().c_str(), path.c_str()))
+                        return nullptr;
+                    node->mTypes |= value;
+                }
+            }
+
+            if (schema.contains("properties") && schema["properties"].is_object())
+            {
+                for (const auto& property : schema["properties"].items())
+                {
+                    auto child = compile(property.value(), path + "/properties/" + property.key(), errorState);
+                    if (child == nullptr)
+                        return nullptr;
+                    node->mProperties.emplace(property.key(), std::move(child));
+                }
+            }
+
+            if (schema.contains("required") && schema["required"].is_array())
+            {
+                for (const auto& name : schema["required"])
+                {
+                    if (!errorState.check(name.is_string(), "Required property %s in schema at '%s' is not a string", name.dump().c_str(), path.c_str()))
+                        return nullptr;
+                    node->mRequired.emplace_back(name.get<std::string>());
+                }
+            }
+
+            if (schema.contains("additionalProperties") && schema["additionalProperties"].is_boolean())
+                node->mAdditionalProperties = schema["additionalProperties"].get<bool>();
+
+            if (schema.contains("items"))
+            {
+                node->mItems = compile(schema["items"], path + "/items", errorState);
+                if (node->mItems == nullptr)
+                    return nullptr;
+            }
+
+            if (schema.contains("enum") && schema["enum"].is_array())
+                node->mEnum.assign(schema["enum"].begin(), schema["enum"].end());
+            return node;
+        }
+    };
+
+
+    bool OllamaJSONSchema::parse(const std::string& schema, utility::ErrorState& errorState)
+    {
+        auto json = nlohmann::json::parse(schema, nullptr, false);
+        if (!errorState.check(!json.is_discarded(), "Schema is not valid JSON"))
+            return false;
+
+        auto root = Node::compile(json, "", errorState);
+        if (root == nullptr)
+            return false;
+
+        mRoot = std::move(root);
+        mText = json.dump();
+        return true;
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaJSONParser
+    //////////////////////////////////////////////////////////////////////////
+
+    OllamaJSONParser::OllamaJSONParser(const OllamaJSONSchema& schema) :
+        mSchema(schema)
+    { }
+
+
+    bool OllamaJSONParser::feed(const std::string& token, std::vector<OllamaJSONEvent>& events)
+    {
+        events.clear();
+        for (auto character : token)
+        {
+            if (mState == EState::Complete || mState == EState::Failed)
+                break;
+
+            // A character that ends a number is parsed again in the next state
+            if (mState != EState::BeforeRoot)
+                mText.push_back(character);
+            while (!step(character, events)) {}
+        }
+        return mState != EState::Failed;
+    }
+
+
+    void OllamaJSONParser::reset()
+    {
+        mState = EState::BeforeRoot;
+        mText.clear();
+        mScopes.clear();
+        mError.clear();
+        mKey = false;
+        mEscaped = false;
+        mHexDigits = 0;
+    }
+
+
+    bool OllamaJSONParser::step(char character, std::vector<OllamaJSONEvent>& events)
+    {
+        bool space = std::isspace(static_cast<unsigned char>(character)) != 0;
+        switch (mState)
+        {
+        case EState::BeforeRoot:
+            if (character == '{' || character == '[')
+            {
+                mText.push_back(character);
+                beginValue(character);
+            }
+            return true;
+
+        case EState::Value:
+            if (!space)
+                beginValue(character);
+            return true;
+
+        case EState::ValueOrEnd:
+            if (space)
+                return true;
+            if (character == ']')
+            {
+                endScope(events);
+                return true;
+            }
+            mState = EState::Value;
+            return false;
+
+        case EState::KeyOrEnd:
+            if (space)
+                return true;
+            if (character == '}')
+            {
+                endScope(events);
+                return true;
+            }
+            mState = EState::Key;
+            return false;
+
+        case EState::Key:
+            if (space)
+                return true;
+            if (character != '"')
+            {
+                fail("Expected a key in " + describe(mScopes.back().mPath));
+                return true;
+            }
+            mKey = true;
+            mEscaped = false;
+            mHexDigits = 0;
+            mValueStart = mText.size() - 1;
+            mState = EState::String;
+            return true;
+
+        case EState::Colon:
+            if (space)
+                return true;
+            if (character != ':')
+                fail("Expected ':' after key '" + mScopes.back().mMember + "' in " + describe(mScopes.back().mPath));
+            else
+                mState = EState::Value;
+            return true;
+
+        case EState::CommaOrEnd:
+        {
+            if (space)
+                return true;
+            const auto& scope = mScopes.back();
+            if (character == ',')
+                mState = scope.mObject ? EState::Key : EState::Value;
+            else if (character == (scope.mObject ? '}' : ']'))
+                endScope(events);
+            else
+                fail(std::string("Expected ',' or '") + (scope.mObject ? '}' : ']') + "' in " + describe(scope.mPath));
+            return true;
+        }
+
+        case EState::String:
+            if (mHexDigits > 0)
+            {
+                if (!std::isxdigit(static_cast<unsigned char>(character)))
+                    fail("Invalid unicode escape in a string");
+                mHexDigits--;
+                return true;
+            }
+            if (mEscaped)
+            {
+                mEscaped = false;
+                if (character == 'u')
+                    mHexDigits = 4;
+                else if (character == '\0' || std::strchr("\"\\/bfnrt", character) == nullptr)
+                    fail(std::string("Invalid escape '\\") + character + "' in a string");
+                return true;
+            }
+            if (character == '\\')
+            {
+                mEscaped = true;
+                return true;
+            }
+            if (static_cast<unsigned char>(character) < 0x20)
+            {
+                fail("Control character in a string");
+                return true;
+            }
+            if (character != '"')
+                return true;
+
+            // The key of a member, an object of the schema may not allow it
+            if (mKey)
+            {
+                mKey = false;
+                auto& scope = mScopes.back();
+                scope.mMember = nlohmann::json::parse(mText.substr(mValueStart)).get<std::string>();
+                if (scope.mSchema != nullptr && !scope.mSchema->mAdditionalProperties && scope.mSchema->mProperties.count(scope.mMember) == 0)
+                {
+                    fail("Property '" + scope.mMember + "' of " + describe(scope.mPath) + " is not in the schema");
+                    return true;
+                }
+                scope.mMembers.emplace_back(scope.mMember);
+                mState = EState::Colon;
+                return true;
+            }
+            endScalar(mText.size(), events);
+            return true;
+
+        case EState::Number:
+            if (std::isdigit(static_cast<unsigned char>(character)) || character == '-' || character == '+' || character == '.' || character == 'e' || character == 'E')
+                return true;
+            endScalar(mText.size() - 1, events);
+            return false;
+
+        case EState::Literal:
+        {
+            auto offset = mText.size() - 1 - mValueStart;
+            if (character != mLiteral[offset])
+            {
+                fail("Invalid literal at " + describe(mValuePath));
+                return true;
+            }
+            if (offset + 1 == mLiteral.size())
+                endScalar(mText.size(), events);
+            return true;
+        }
+
+        case EState::Complete:
+        case EState::Failed:
+            return true;
+        }
+        return true;
+    }
+
+
+    void OllamaJSONParser::beginValue(char character)
+    {
+        std::string key;
+        auto path = mScopes.empty() ? std::string() : getChildPath(key);
+        const auto* schema = mScopes.empty() ? mSchema.mRoot.get() : getChildSchema();
+
+        auto type = getValueType(character);
+        if (type == 0)
+        {
+            fail(std::string("Unexpected character '") + character + "' at " + describe(path));
+            return;
+        }
+        if (schema != nullptr && (schema->mTypes & type) == 0)
+        {
+            fail("Value at " + describe(path) + " is of type " + getTypeNames(type) + ", the schema expects " + getTypeNames(schema->mTypes));
+            return;
+        }
+
+        // Objects and arrays are scopes until they close
+        if (type == typeObject || type == typeArray)
+        {
+            Scope scope;
+            scope.mObject = type == typeObject;
+            scope.mPath = std::move(path);
+            scope.mKey = std::move(key);
+            scope.mStart = mText.size() - 1;
+            scope.mSchema = schema;
+            mScopes.emplace_back(std::move(scope));
+            mState = type == typeObject ? EState::KeyOrEnd : EState::ValueOrEnd;
+            return;
+        }
+
+        mValueStart = mText.size() - 1;
+        mValuePath = std::move(path);
+        mValueKey = std::move(key);
+        mValueSchema = schema;
+        if (type == typeString)
+        {
+            mKey = false;
+            mEscaped = false;
+            mHexDigits = 0;
+            mState = EState::String;
+        }
+        else if (type == typeBoolean || type == typeNull)
+        {
+            mLiteral = character == 't' ? "true" : character == 'f' ? "false" : "null";
+            mState = EState::Literal;
+        }
+        else
+        {
+            mState = EState::Number;
+        }
+    }
+
+
+    void OllamaJSONParser::endScalar(std::size_t end, std::vector<OllamaJSONEvent>& events)
+    {
+        auto value = mText.substr(mValueStart, end - mValueStart);
+        if (mState == EState::Number)
+        {
+            if (!isNumber(value))
+            {
+                fail("Invalid number '" + value + "' at " + describe(mValuePath));
+                return;
+            }
+            if (mValueSchema != nullptr && (mValueSchema->mTypes & typeNumber) == 0 && value.find_first_of(".eE") != std::string::npos)
+            {
+                fail("Value at " + describe(mValuePath) + " is of type number, the schema expects " + getTypeNames(mValueSchema->mTypes));
+                return;
+            }
+        }
+
+        auto error = checkEnum(mValueSchema, value, mValuePath);
+        if (!error.empty())
+        {
+            fail(error);
+            return;
+        }
+
+        OllamaJSONEvent event;
+        event.mPath = std::move(mValuePath);
+        event.mKey = std::move(mValueKey);
+        event.mValue = std::move(value);
+        event.mDepth = static_cast<int>(mScopes.size());
+        events.emplace_back(std::move(event));
+        endValue();
+    }
+
+
+    void OllamaJSONParser::endScope(std::vector<OllamaJSONEvent>& events)
+    {
+        auto scope = std::move(mScopes.back());
+        mScopes.pop_back();
+
+        if (scope.mSchema != nullptr)
+        {
+            for (const auto& required : scope.mSchema->mRequired)
+            {
+                if (std::find(scope.mMembers.begin(), scope.mMembers.end(), required) == scope.mMembers.end())
+                {
+                    fail("Required property '" + required + "' of " + describe(scope.mPath) + " is missing");
+                    return;
+                }
+            }
+        }
+
+        auto value = mText.substr(scope.mStart);
+        auto error = checkEnum(scope.mSchema, value, scope.mPath);
+        if (!error.empty())
+        {
+            fail(error);
+            return;
+        }
+
+        OllamaJSONEvent event;
+        event.mPath = std::move(scope.mPath);
+        event.mKey = std::move(scope.mKey);
+        event.mValue = std::move(value);
+        event.mDepth = static_cast<int>(mScopes.size());
+        events.emplace_back(std::move(event));
+        endValue();
+    }
+
+
+    void OllamaJSONParser::endValue()
+    {
+        if (mScopes.empty())
+        {
+            mState = EState::Complete;
+            return;
+        }
+
+        auto& scope = mScopes.back();
+        if (!scope.mObject)
+            scope.mIndex++;
+        mState = EState::CommaOrEnd;
+    }
+
+
+    void OllamaJSONParser::fail(const std::string& error)
+    {
+        mState = EState::Failed;
+        mError = error;
+    }
+
+
+    std::string OllamaJSONParser::getChildPath(std::string& key) const
+    {
+        const auto& scope = mScopes.back();
+        if (!scope.mObject)
+        {
+            key.clear();
+            return scope.mPath + "/" + std::to_string(scope.mIndex);
+        }
+
+        // Escape the key as a JSON pointer reference token
+        key = scope.mMember;
+        std::string token;
+        for (auto character : key)
+        {
+            if (character == '~')
+                token += "~0";
+            else if (character == '/')
+                token += "~1";
+            else
+                token += character;
+        }
+        return scope.mPath + "/" + token;
+    }
+
+
+    const OllamaJSONSchema::Node* OllamaJSONParser::getChildSchema() const
+    {
+        const auto& scope = mScopes.back();
+        if (scope.mSchema == nullptr)
+            return nullptr;
+
+        if (!scope.mObject)
+            return scope.mSchema->mItems.get();
+
+        auto it = scope.mSchema->mProperties.find(scope.mMember);
+        return it != scope.mSchema->mProperties.end() ? it->second.get() : nullptr;
+    }
+
+
+    std::string OllamaJSONParser::checkEnum(const OllamaJSONSchema::Node* schema, const std::string& value, const std::string& path)
+    {
+        if (schema == nullptr || schema->mEnum.empty())
+            return {};
+
+        auto json = nlohmann::json::parse(value, nullptr, false);
+        if (std::find(schema->mEnum.begin(), schema->mEnum.end(), json) != schema->mEnum.end())
+            return {};
+        return "Value " + value + " at " + describe(path) + " is not one of the values of the schema";
+    }
+}
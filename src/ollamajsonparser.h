@@ -0,0 +1,205 @@
+#pragma once
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    /**
+     * A value of a JSON response that closed
+     */
+    struct NAPAPI OllamaJSONEvent
+    {
+        std::string mPath;                  ///< JSON pointer of the value, such as "/items/0/name", empty for the root value
+        std::string mKey;                   ///< Key of the value in its object, empty for array elements and the root value
+        std::string mValue;                 ///< JSON text of the value, the complete subtree for objects and arrays
+        int mDepth = 0;                     ///< Nesting depth of the value, 0 for the root value
+
+        /**
+         * @return if the value is the root value, the complete response
+         */
+        bool isRoot() const                 { return mDepth == 0; }
+    };
+
+
+    /**
+     * A JSON schema that JSON responses are validated against while they stream in.
+     * The schema is sent as the format of the request, so the server constrains the response to it.
+     *
+     * The parser validates the keywords that can be checked as soon as a value starts or closes:
+     * 'type' (a type name or an array of type names), 'properties', 'required', 'additionalProperties' (false), 'items' and 'enum'.
+     * Other keywords are sent to the server but not validated.
+     * Copies share the compiled schema.
+     */
+    class NAPAPI OllamaJSONSchema final
+    {
+        friend class OllamaJSONParser;
+    public:
+        OllamaJSONSchema() = default;
+
+        /**
+         * Compiles a schema
+         * @param schema the JSON text of the schema
+         * @param errorState contains the error when the schema is not valid JSON or uses an unknown type
+         * @return if the schema compiled
+         */
+        bool parse(const std::string& schema, utility::ErrorState& errorState);
+
+        /**
+         * @return if no schema is set, any JSON value is accepted
+         */
+        bool isEmpty() const                                        { return mRoot == nullptr; }
+
+        /**
+         * @return the JSON text of the schema, empty when no schema is set
+         */
+        const std::string& getText() const                          { return mText; }
+
+    private:
+        // Compiled schema of a value, defined in ollamajsonparser.cpp
+        struct Node;
+
+        std::shared_ptr<const Node> mRoot;
+        std::string mText;
+    };
+
+
+    /**
+     * Parses a JSON response incrementally over the tokens as they arrive.
+     * An event is returned for every value as soon as it closes: scalars when their last character arrives,
+     * objects and arrays as complete subtrees. The last event is the root value.
+     * Text before the root object or array is skipped, text after it is ignored.
+     * The response fails on the first syntax error or schema violation.
+     */
+    class NAPAPI OllamaJSONParser final
+    {
+    public:
+        OllamaJSONParser() = default;
+
+        /**
+         * Constructor
+         * @param schema the schema the response is validated against, empty to accept any JSON value
+         */
+        explicit OllamaJSONParser(const OllamaJSONSchema& schema);
+
+        /**
+         * Parses the next token of the response
+         * @param token the next token
+         * @param events receives the values that closed in the token, outer values after the values they contain
+         * @return false when the response failed, getError() returns the error
+         */
+        bool feed(const std::string& token, std::vector<OllamaJSONEvent>& events);
+
+        /**
+         * @return if the root value closed
+         */
+        bool isComplete() const                                     { return mState == EState::Complete; }
+
+        /**
+         * @return the syntax error or schema violation the response failed on, empty when it did not fail
+         */
+        const std::string& getError() const                         { return mError; }
+
+        /**
+         * Clears the state of the response, keeping the schema
+         */
+        void reset();
+
+    private:
+        enum class EState : int
+        {
+            BeforeRoot,             ///< Skipping text before the root value
+            Value,                  ///< Expecting a value
+            ValueOrEnd,             ///< Expecting the first element of an array or its end
+            KeyOrEnd,               ///< Expecting the first key of an object or its end
+            Key,                    ///< Expecting a key after a comma
+            Colon,                  ///< Expecting the colon after a key
+            CommaOrEnd,             ///< Expecting a comma or the end of the current object or array
+            String,                 ///< In a string value or key
+            Number,                 ///< In a number
+            Literal,                ///< In true, false or null
+            Complete,               ///< The root value closed
+            Failed                  ///< The response failed
+        };
+
+        // An object or array that did not close yet
+        struct Scope
+        {
+            bool mObject = false;
+            std::string mPath;
+            std::string mKey;                                       ///< Key of the scope in its parent object
+            std::size_t mStart = 0;                                 ///< Offset of the scope in the text
+            int mIndex = 0;                                         ///< Number of elements of an array
+            std::string mMember;                                    ///< Key of the member being parsed in an object
+            std::vector<std::string> mMembers;                      ///< Keys of the object, to check required keys
+            const OllamaJSONSchema::Node* mSchema = nullptr;
+        };
+
+        /**
+         * Parses the next character, false when it has to be parsed again in the next state
+         */
+        bool step(char character, std::vector<OllamaJSONEvent>& events);
+
+        /**
+         * Starts a value at the last character of the text
+         */
+        void beginValue(char character);
+
+        /**
+         * Closes the scalar that started at the value start, ending before an offset in the text
+         */
+        void endScalar(std::size_t end, std::vector<OllamaJSONEvent>& events);
+
+        /**
+         * Closes the innermost object or array
+         */
+        void endScope(std::vector<OllamaJSONEvent>& events);
+
+        /**
+         * Ends a value of the innermost scope, or the response when the root value closed
+         */
+        void endValue();
+
+        /**
+         * Fails the response
+         */
+        void fail(const std::string& error);
+
+        /**
+         * @return the path and key of the value that starts in the innermost scope
+         */
+        std::string getChildPath(std::string& key) const;
+
+        /**
+         * @return the schema of the value that starts in the innermost scope, nullptr when any value is accepted
+         */
+        const OllamaJSONSchema::Node* getChildSchema() const;
+
+        /**
+         * @return an error when a closed value is not in the enum of its schema, empty when it is
+         */
+        static std::string checkEnum(const OllamaJSONSchema::Node* schema, const std::string& value, const std::string& path);
+
+        OllamaJSONSchema mSchema;
+
+        // State of the response
+        EState mState = EState::BeforeRoot;
+        std::string mText;                                          ///< Text of the response from the root value on
+        std::vector<Scope> mScopes;
+        std::string mError;
+
+        // The string, number or literal being parsed
+        bool mKey = false;                                          ///< If the string is a key
+        bool mEscaped = false;                                      ///< If the next character of the string is escaped
+        int mHexDigits = 0;                                         ///< Number of hex digits of a unicode escape still expected
+        std::string mLiteral;                                       ///< The literal being matched
+        std::size_t mValueStart = 0;                                ///< Offset of the value in the text
+        std::string mValuePath;
+        std::string mValueKey;
+        const OllamaJSONSchema::Node* mValueSchema = nullptr;
+    };
+}
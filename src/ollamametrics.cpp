@@ -0,0 +1,230 @@
+#include "ollamametrics.h"
+
+#include "ollama.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace nap
+{
+    /**
+     * Atomically lowers the value to the given value if it is smaller
+     */
+    static void atomicMin(std::atomic<std::uint64_t>& target, std::uint64_t value)
+    {
+        auto current = target.load(std::memory_order_relaxed);
+        while (value < current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+
+
+    /**
+     * Atomically raises the value to the given value if it is larger
+     */
+    static void atomicMax(std::atomic<std::uint64_t>& target, std::uint64_t value)
+    {
+        auto current = target.load(std::memory_order_relaxed);
+        while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+
+
+    /**
+     * Reads an unsigned duration in nanoseconds from a json field and converts it to microseconds
+     */
+    static std::uint64_t readNanosecondsAsMicroseconds(const nlohmann::json& json, const char* field)
+    {
+        if (!json.contains(field) || !json[field].is_number())
+            return 0;
+        return json[field].get<std::uint64_t>() / 1000;
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // LatencyHistogram
+    //////////////////////////////////////////////////////////////////////////
+
+    LatencyHistogram::LatencyHistogram()
+    {
+        for (auto& bucket : mBuckets)
+            bucket.store(0, std::memory_order_relaxed);
+    }
+
+
+    int LatencyHistogram::getIndex(std::uint64_t value)
+    {
+        // Values below the sub-bucket count map linearly
+        if (value < sSubBucketCount)
+            return static_cast<int>(value);
+
+        // Clamp to the largest trackable value
+        value = std::min<std::uint64_t>(value, (std::uint64_t(1) << sMaxValueBits) - 1);
+
+        // Find the highest set bit, every power of two above the sub-bucket range holds sSubBucketCount linear buckets
+        int magnitude = 63;
+        while ((value & (std::uint64_t(1) << magnitude)) == 0)
+            --magnitude;
+        int shift = magnitude - sSubBucketBits;
+        return (shift + 1) * sSubBucketCount + static_cast<int>((value >> shift) - sSubBucketCount);
+    }
+
+
+    std::uint64_t LatencyHistogram::getValue(int index)
+    {
+        if (index < sSubBucketCount)
+            return static_cast<std::uint64_t>(index);
+
+        // Return the highest value that maps to the bucket
+        int shift = index / sSubBucketCount - 1;
+        std::uint64_t lowest = static_cast<std::uint64_t>(sSubBucketCount + index % sSubBucketCount) << shift;
+        return lowest + (std::uint64_t(1) << shift) - 1;
+    }
+
+
+    void LatencyHistogram::record(std::uint64_t microseconds)
+    {
+        mBuckets[getIndex(microseconds)].fetch_add(1, std::memory_order_relaxed);
+        mSum.fetch_add(microseconds, std::memory_order_relaxed);
+        atomicMin(mMin, microseconds);
+        atomicMax(mMax, microseconds);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+    double LatencyHistogram::getMean() const
+    {
+        auto count = getCount();
+        return count == 0 ? 0.0 : static_cast<double>(mSum.load(std::memory_order_relaxed)) / static_cast<double>(count);
+    }
+
+
+    std::uint64_t LatencyHistogram::getPercentile(double percentile) const
+    {
+        auto count = getCount();
+        if (count == 0)
+            return 0;
+
+        // Find the bucket that holds the requested rank
+        percentile = std::clamp(percentile, 0.0, 100.0);
+        auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(count))));
+        std::uint64_t seen = 0;
+        for (int i = 0; i < sBucketCount; i++)
+        {
+            seen += mBuckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(getValue(i), mMax.load(std::memory_order_relaxed));
+        }
+        return mMax.load(std::memory_order_relaxed);
+    }
+
+
+    LatencyHistogram::Summary LatencyHistogram::getSummary() const
+    {
+        Summary summary;
+        summary.mCount = getCount();
+        if (summary.mCount == 0)
+            return summary;
+
+        summary.mMin = mMin.load(std::memory_order_relaxed);
+        summary.mMax = mMax.load(std::memory_order_relaxed);
+        summary.mMean = getMean();
+        summary.mP50 = getPercentile(50.0);
+        summary.mP90 = getPercentile(90.0);
+        summary.mP95 = getPercentile(95.0);
+        summary.mP99 = getPercentile(99.0);
+        return summary;
+    }
+
+
+    void LatencyHistogram::reset()
+    {
+        for (auto& bucket : mBuckets)
+            bucket.store(0, std::memory_order_relaxed);
+        mCount.store(0, std::memory_order_relaxed);
+        mSum.store(0, std::memory_order_relaxed);
+        mMin.store(UINT64_MAX, std::memory_order_relaxed);
+        mMax.store(0, std::memory_order_relaxed);
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaRequestStats
+    //////////////////////////////////////////////////////////////////////////
+
+    void OllamaRequestStats::readServerTimings(const ollama::response& response)
+    {
+        const auto& json = response.as_json();
+        mTotalDuration = readNanosecondsAsMicroseconds(json, "total_duration");
+        mLoadDuration = readNanosecondsAsMicroseconds(json, "load_duration");
+        mPromptEvalDuration = readNanosecondsAsMicroseconds(json, "prompt_eval_duration");
+        mEvalDuration = readNanosecondsAsMicroseconds(json, "eval_duration");
+        mPromptEvalCount = json.value("prompt_eval_count", std::uint64_t(0));
+        mEvalCount = json.value("eval_count", std::uint64_t(0));
+    }
+
+
+    double OllamaRequestStats::getTokensPerSecond() const
+    {
+        return mEvalDuration == 0 ? 0.0 : static_cast<double>(mEvalCount) * 1e6 / static_cast<double>(mEvalDuration);
+    }
+
+
+    double OllamaRequestStats::getPromptTokensPerSecond() const
+    {
+        return mPromptEvalDuration == 0 ? 0.0 : static_cast<double>(mPromptEvalCount) * 1e6 / static_cast<double>(mPromptEvalDuration);
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaMetrics
+    //////////////////////////////////////////////////////////////////////////
+
+    void OllamaMetrics::recordRequest(const OllamaRequestStats& stats)
+    {
+        mEnqueueToSend.record(stats.mEnqueueToSend);
+
+        // A request that failed or was stopped before the first frame or token has no sample to record
+        if (stats.mTimeToFirstByte > 0)
+            mTimeToFirstByte.record(stats.mTimeToFirstByte);
+        if (stats.mTimeToFirstToken > 0)
+            mTimeToFirstToken.record(stats.mTimeToFirstToken);
+
+        // Server timings are only available when the response completed
+        if (stats.mTotalDuration > 0)
+        {
+            mTotalDuration.record(stats.mTotalDuration);
+            mLoadDuration.record(stats.mLoadDuration);
+            mPromptEvalDuration.record(stats.mPromptEvalDuration);
+            mEvalDuration.record(stats.mEvalDuration);
+        }
+
+        mPromptTokens.fetch_add(stats.mPromptEvalCount, std::memory_order_relaxed);
+        mGeneratedTokens.fetch_add(stats.mEvalCount, std::memory_order_relaxed);
+        mPromptEvalMicroseconds.fetch_add(stats.mPromptEvalDuration, std::memory_order_relaxed);
+        mEvalMicroseconds.fetch_add(stats.mEvalDuration, std::memory_order_relaxed);
+        mRequests.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+    double OllamaMetrics::getTokensPerSecond() const
+    {
+        auto duration = mEvalMicroseconds.load(std::memory_order_relaxed);
+        return duration == 0 ? 0.0 : static_cast<double>(mGeneratedTokens.load(std::memory_order_relaxed)) * 1e6 / static_cast<double>(duration);
+    }
+
+
+    double OllamaMetrics::getPromptTokensPerSecond() const
+    {
+        auto duration = mPromptEvalMicroseconds.load(std::memory_order_relaxed);
+        return duration == 0 ? 0.0 : static_cast<double>(mPromptTokens.load(std::memory_order_relaxed)) * 1e6 / static_cast<double>(duration);
+    }
+
+
+    void OllamaMetrics::reset()
+    {
+        for (auto* histogram : { &mEnqueueToSend, &mTimeToFirstByte, &mTimeToFirstToken, &mInterTokenLatency, &mDeliveryLag,
+                                 &mTotalDuration, &mLoadDuration, &mPromptEvalDuration, &mEvalDuration })
+            histogram->reset();
+
+        for (auto* counter : { &mRequests, &mErrors, &mPromptTokens, &mGeneratedTokens, &mHedges, &mHedgeWins, &mEarlyStops, &mReasoningCutoffs, &mCascades, &mEscalations, &mPromptEvalMicroseconds, &mEvalMicroseconds })
+            counter->store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <utility/dllexport.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Forward declarations
+namespace ollama
+{
+    class response;
+}
+
+namespace nap
+{
+    /**
+     * Lock-free latency histogram with HDR-style log-linear buckets.
+     * Values are recorded in microseconds. Each power of two is divided into 32 linear sub-buckets,
+     * bounding the relative error of reported percentiles to ~3%.
+     * Recording is wait-free and may be called from any thread, reads are approximate while values are being recorded.
+     */
+    class NAPAPI LatencyHistogram final
+    {
+    public:
+        /**
+         * Summary of the recorded values, all values are in microseconds
+         */
+        struct Summary
+        {
+            std::uint64_t mCount = 0;   ///< Number of recorded values
+            std::uint64_t mMin = 0;     ///< Smallest recorded value
+            std::uint64_t mMax = 0;     ///< Largest recorded value
+            double mMean = 0.0;         ///< Mean of all recorded values
+            std::uint64_t mP50 = 0;     ///< 50th percentile
+            std::uint64_t mP90 = 0;     ///< 90th percentile
+            std::uint64_t mP95 = 0;     ///< 95th percentile
+            std::uint64_t mP99 = 0;     ///< 99th percentile
+        };
+
+        LatencyHistogram();
+
+        // Histograms are shared between threads and can't be copied or moved
+        LatencyHistogram(const LatencyHistogram&) = delete;
+        LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+        /**
+         * Records a value, thread safe
+         * @param microseconds the value to record in microseconds
+         */
+        void record(std::uint64_t microseconds);
+
+        /**
+         * Records a duration, thread safe
+         * @param duration the duration to record
+         */
+        template<typename Rep, typename Period>
+        void record(const std::chrono::duration<Rep, Period>& duration);
+
+        /**
+         * @return number of recorded values
+         */
+        std::uint64_t getCount() const                  { return mCount.load(std::memory_order_relaxed); }
+
+        /**
+         * @return mean of all recorded values in microseconds
+         */
+        double getMean() const;
+
+        /**
+         * Returns the value at the given percentile, 0 when no values have been recorded
+         * @param percentile the percentile to query, 0-100
+         * @return value at percentile in microseconds
+         */
+        std::uint64_t getPercentile(double percentile) const;
+
+        /**
+         * @return summary of the recorded values
+         */
+        Summary getSummary() const;
+
+        /**
+         * Clears all recorded values
+         */
+        void reset();
+
+    private:
+        static constexpr int sSubBucketBits = 5;
+        static constexpr int sSubBucketCount = 1 << sSubBucketBits;
+        static constexpr int sMaxValueBits = 36;    ///< ~19 hours in microseconds, larger values are clamped
+        static constexpr int sBucketCount = (sMaxValueBits - sSubBucketBits + 1) * sSubBucketCount;
+
+        static int getIndex(std::uint64_t value);
+        static std::uint64_t getValue(int index);
+
+        std::array<std::atomic<std::uint64_t>, sBucketCount> mBuckets;
+        std::atomic<std::uint64_t> mCount = { 0 };
+        std::atomic<std::uint64_t> mSum = { 0 };
+        std::atomic<std::uint64_t> mMin = { UINT64_MAX };
+        std::atomic<std::uint64_t> mMax = { 0 };
+    };
+
+
+    /**
+     * Timings of a single request, recorded by OllamaChat.
+     * Server side timings are taken from the final frame reported by Ollama, client side timings are measured locally.
+     * All durations are in microseconds.
+     */
+    struct NAPAPI OllamaRequestStats
+    {
+        // server side
+        std::uint64_t mTotalDuration = 0;       ///< Time spent by the server generating the response
+        std::uint64_t mLoadDuration = 0;        ///< Time spent by the server loading the model
+        std::uint64_t mPromptEvalDuration = 0;  ///< Time spent by the server evaluating the prompt
+        std::uint64_t mEvalDuration = 0;        ///< Time spent by the server generating tokens
+        std::uint64_t mPromptEvalCount = 0;     ///< Number of tokens in the prompt
+        std::uint64_t mEvalCount = 0;           ///< Number of tokens generated
+
+        // client side
+        std::uint64_t mEnqueueToSend = 0;       ///< Time between enqueueing the request and sending it to the server
+        std::uint64_t mTimeToFirstByte = 0;     ///< Time between sending the request and receiving the first frame, 0 when no frame arrived
+        std::uint64_t mTimeToFirstToken = 0;    ///< Time between sending the request and receiving the first non-empty token, 0 when no token arrived
+
+        /**
+         * Copies the server side timings from the final frame of a response
+         * @param response the final ('done') frame of a response
+         */
+        void readServerTimings(const ollama::response& response);
+
+        /**
+         * @return tokens generated per second as reported by the server, 0 if unknown
+         */
+        double getTokensPerSecond() const;
+
+        /**
+         * @return prompt tokens evaluated per second as reported by the server, 0 if unknown
+         */
+        double getPromptTokensPerSecond() const;
+    };
+
+
+    /**
+     * Aggregated request metrics.
+     * Every OllamaChat holds its own metrics, the OllamaService aggregates the metrics of all chats.
+     * Recording is lock-free and may be called from any thread.
+     */
+    class NAPAPI OllamaMetrics final
+    {
+    public:
+        OllamaMetrics() = default;
+
+        // Metrics are shared between threads and can't be copied or moved
+        OllamaMetrics(const OllamaMetrics&) = delete;
+        OllamaMetrics& operator=(const OllamaMetrics&) = delete;
+
+        /**
+         * Records the timings of a completed request
+         * @param stats the request timings
+         */
+        void recordRequest(const OllamaRequestStats& stats);
+
+        /**
+         * Records a failed request
+         */
+        void recordError()                              { mErrors.fetch_add(1, std::memory_order_relaxed); }
+
+        /**
+         * Records a duplicate request sent to another backend because the first token was late
+         * @param won if the duplicate answered first
+         */
+        void recordHedge(bool won)                      { mHedges.fetch_add(1, std::memory_order_relaxed); if (won) mHedgeWins.fetch_add(1, std::memory_order_relaxed); }
+
+        /**
+         * Records a request cancelled because a client side stop condition fired
+         */
+        void recordEarlyStop()                          { mEarlyStops.fetch_add(1, std::memory_order_relaxed); }
+
+        /**
+         * Records a request whose reasoning was cut off because it exceeded the reasoning budget
+         */
+        void recordReasoningCutoff()                    { mReasoningCutoffs.fetch_add(1, std::memory_order_relaxed); }
+
+        /**
+         * Records a cascade prompt
+         * @param escalations number of times the prompt escalated to a larger model
+         */
+        void recordCascade(std::uint64_t escalations)   { mCascades.fetch_add(1, std::memory_order_relaxed); mEscalations.fetch_add(escalations, std::memory_order_relaxed); }
+
+        /**
+         * @return generated tokens per second over all completed requests as reported by the server
+         */
+        double getTokensPerSecond() const;
+
+        /**
+         * @return prompt tokens evaluated per second over all completed requests as reported by the server
+         */
+        double getPromptTokensPerSecond() const;
+
+        /**
+         * Clears all recorded metrics
+         */
+        void reset();
+
+        // client side
+        LatencyHistogram mEnqueueToSend;            ///< Time between enqueueing a request and sending it
+        LatencyHistogram mTimeToFirstByte;          ///< Time between sending a request and receiving the first frame
+        LatencyHistogram mTimeToFirstToken;         ///< Time between sending a request and receiving the first token
+        LatencyHistogram mInterTokenLatency;        ///< Time between two consecutive tokens
+        LatencyHistogram mDeliveryLag;              ///< Time between a token arriving on the worker and its callback on the main thread
+
+        // server side
+        LatencyHistogram mTotalDuration;            ///< Server reported total duration per request
+        LatencyHistogram mLoadDuration;             ///< Server reported model load duration per request
+        LatencyHistogram mPromptEvalDuration;       ///< Server reported prompt evaluation duration per request
+        LatencyHistogram mEvalDuration;             ///< Server reported generation duration per request
+
+        std::atomic<std::uint64_t> mRequests = { 0 };           ///< Number of completed requests
+        std::atomic<std::uint64_t> mErrors = { 0 };             ///< Number of failed requests
+        std::atomic<std::uint64_t> mPromptTokens = { 0 };       ///< Total prompt tokens evaluated
+        std::atomic<std::uint64_t> mGeneratedTokens = { 0 };    ///< Total tokens generated
+        std::atomic<std::uint64_t> mHedges = { 0 };             ///< Number of hedged requests
+        std::atomic<std::uint64_t> mHedgeWins = { 0 };          ///< Number of hedged requests where the duplicate answered first
+        std::atomic<std::uint64_t> mEarlyStops = { 0 };         ///< Number of requests cancelled because a stop condition fired
+        std::atomic<std::uint64_t> mReasoningCutoffs = { 0 };   ///< Number of requests whose reasoning exceeded the reasoning budget
+        std::atomic<std::uint64_t> mCascades = { 0 };           ///< Number of completed cascade prompts
+        std::atomic<std::uint64_t> mEscalations = { 0 };        ///< Number of times a cascade prompt escalated to a larger model
+
+    private:
+        std::atomic<std::uint64_t> mPromptEvalMicroseconds = { 0 };
+        std::atomic<std::uint64_t> mEvalMicroseconds = { 0 };
+    };
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // Template definitions
+    //////////////////////////////////////////////////////////////////////////
+
+    template<typename Rep, typename Period>
+    void LatencyHistogram::record(const std::chrono::duration<Rep, Period>& duration)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        record(us > 0 ? static_cast<std::uint64_t>(us) : 0);
+    }
+}
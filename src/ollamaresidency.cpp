@@ -0,0 +1,236 @@
+#include "ollamaresidency.h"
+#include "ollamachat.h"
+#include "ollamaservice.h"
+
+#include "ollama.hpp"
+#include "nap/logger.h"
+
+namespace nap
+{
+    OllamaResidency::OllamaResidency(OllamaService& service) : mService(service)
+    { }
+
+
+    OllamaResidency::~OllamaResidency()
+    { }
+
+
+    void OllamaResidency::init(bool enabled, const std::string& keepAlive, double pollInterval, double refreshInterval)
+    {
+        mEnabled = enabled;
+        mKeepAlive = keepAlive;
+        mPollInterval = pollInterval;
+        mRefreshInterval = refreshInterval;
+        mRunning = true;
+    }
+
+
+    void OllamaResidency::preloadModel(const std::string& serverURL, const std::string& model)
+    {
+        {
+            std::lock_guard lk(mMutex);
+            mPreloadModels[serverURL].insert(getTaggedName(model));
+        }
+        poll();
+    }
+
+
+    void OllamaResidency::releaseModel(const std::string& serverURL, const std::string& model)
+    {
+        std::lock_guard lk(mMutex);
+        auto it = mPreloadModels.find(serverURL);
+        if (it != mPreloadModels.end())
+            it->second.erase(getTaggedName(model));
+    }
+
+
+    bool OllamaResidency::isModelLoaded(const std::string& serverURL, const std::string& model) const
+    {
+        std::lock_guard lk(mMutex);
+        auto it = mLoadedModels.find(serverURL);
+        return it != mLoadedModels.end() && it->second.count(getTaggedName(model)) > 0;
+    }
+
+
+    std::vector<std::string> OllamaResidency::getLoadedModels(const std::string& serverURL) const
+    {
+        std::lock_guard lk(mMutex);
+        auto it = mLoadedModels.find(serverURL);
+        if (it == mLoadedModels.end())
+            return {};
+        return { it->second.begin(), it->second.end() };
+    }
+
+
+    void OllamaResidency::update(double deltaTime, const std::vector<OllamaChat*>& chats)
+    {
+        // Trigger the events of finished polls
+        std::vector<std::pair<bool, OllamaResidencyEvent>> events;
+        {
+            std::lock_guard lk(mMutex);
+            events.swap(mEvents);
+        }
+        for (const auto& event : events)
+        {
+            if (event.first)
+                modelLoaded.trigger(event.second);
+            else
+                modelEvicted.trigger(event.second);
+        }
+
+        if (!mEnabled)
+            return;
+
+        // Start a poll when the interval elapsed, one poll runs at a time
+        mTimeSincePoll += deltaTime;
+        mTimeSinceRefresh += deltaTime;
+        if ((mTimeSincePoll < mPollInterval && !mPollRequested) || mPolling)
+            return;
+
+        // Keep the models of the running chats loaded, skipping models that are being pulled
+        ModelMap models;
+        {
+            std::lock_guard lk(mMutex);
+            models = mPreloadModels;
+            for (const auto& loaded : mLoadedModels)
+                models[loaded.first];
+        }
+        for (auto* chat : chats)
+        {
+            if (!chat->isModelAvailable())
+                continue;
+
+            // Keep the model loaded on every backend the chat routes requests to
+            if (chat->mBackends != nullptr)
+            {
+                for (const auto& url : chat->mBackends->getURLs())
+                    models[url].insert(getTaggedName(chat->mModelSetting));
+            }
+            else
+            {
+                models[chat->mServerURLSetting].insert(getTaggedName(chat->mModelSetting));
+            }
+        }
+
+        bool refresh = mTimeSinceRefresh >= mRefreshInterval;
+        if (refresh)
+            mTimeSinceRefresh = 0.0;
+        mTimeSincePoll = 0.0;
+        mPollRequested = false;
+        mPolling = true;
+        mService.enqueueTask([this, models, refresh]()
+        {
+            pollServers(models, refresh);
+            mPolling = false;
+        });
+    }
+
+
+    void OllamaResidency::shutdown()
+    {
+        // Close the connection of the running poll, the poll stops at the next server or model
+        mRunning = false;
+        std::lock_guard lk(mMutex);
+        if (mClient != nullptr)
+            mClient->stop();
+    }
+
+
+    void OllamaResidency::pollServers(const ModelMap& models, bool refresh)
+    {
+        for (const auto& server : models)
+        {
+            const auto& url = server.first;
+            if (!mRunning)
+                return;
+
+            auto client = std::make_shared<Ollama>(url);
+            {
+                std::lock_guard lk(mMutex);
+                mClient = client;
+            }
+
+            try
+            {
+                // Query the loaded models
+                std::set<std::string> loaded;
+                auto running = client->running_model_json();
+                if (running.contains("models"))
+                {
+                    for (const auto& model : running["models"])
+                        loaded.insert(model.value("name", ""));
+                }
+
+                // Report the models that were loaded or evicted since the last poll
+                {
+                    std::lock_guard lk(mMutex);
+                    if (mUnreachable.erase(url) > 0)
+                        nap::Logger::info("Ollama server %s is reachable again", url.c_str());
+
+                    auto& previous = mLoadedModels[url];
+                    for (const auto& model : loaded)
+                    {
+                        if (previous.count(model) == 0)
+                            mEvents.push_back({ true, { url, model } });
+                    }
+                    for (const auto& model : previous)
+                    {
+                        if (loaded.count(model) == 0)
+                            mEvents.push_back({ false, { url, model } });
+                    }
+                    previous = loaded;
+                }
+
+                // Load the models that are not loaded, loading a loaded model refreshes its keep_alive
+                for (const auto& model : server.second)
+                {
+                    if (!mRunning)
+                        break;
+
+                    bool is_loaded = loaded.count(model) > 0;
+                    if (is_loaded && !refresh)
+                        continue;
+
+                    std::string error;
+                    try
+                    {
+                        if (!client->load_model(model, mKeepAlive))
+                            error = "server did not load the model";
+                    }
+                    catch (const std::exception& exception)
+                    {
+                        error = exception.what();
+                    }
+
+                    std::lock_guard lk(mMutex);
+                    auto key = url + " " + model;
+                    if (!error.empty())
+                    {
+                        if (mFailedLoads.insert(key).second)
+                            nap::Logger::warn("Unable to load %s model on %s: %s", model.c_str(), url.c_str(), error.c_str());
+                        continue;
+                    }
+
+                    mFailedLoads.erase(key);
+                    if (!is_loaded && mLoadedModels[url].insert(model).second)
+                        mEvents.push_back({ true, { url, model } });
+                }
+            }
+            catch (const std::exception& exception)
+            {
+                std::lock_guard lk(mMutex);
+                if (mRunning && mUnreachable.insert(url).second)
+                    nap::Logger::warn("Unable to query the loaded models of Ollama server %s: %s", url.c_str(), exception.what());
+            }
+        }
+
+        std::lock_guard lk(mMutex);
+        mClient = nullptr;
+    }
+
+
+    std::string OllamaResidency::getTaggedName(const std::string& model)
+    {
+        return model.find(':') == std::string::npos ? model + ":latest" : model;
+    }
+}
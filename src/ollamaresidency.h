@@ -0,0 +1,177 @@
+#pragma once
+
+#include <nap/signalslot.h>
+#include <utility/dllexport.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Forward declarations
+class Ollama;
+
+namespace nap
+{
+    // Forward declarations
+    class OllamaChat;
+    class OllamaService;
+
+    /**
+     * A model that was loaded or evicted by an Ollama server
+     */
+    struct NAPAPI OllamaResidencyEvent
+    {
+        std::string mServerURL;     ///< URL of the Ollama server
+        std::string mModel;         ///< Name of the model, including its tag
+    };
+
+
+    /**
+     * Keeps the models of running OllamaChat devices loaded in the memory of the Ollama server,
+     * so the first prompt does not wait for a cold model load.
+     *
+     * The models loaded by each server are polled through /api/ps on the worker pool of the OllamaService.
+     * Models of running chats and preloaded models that are not loaded are loaded in advance,
+     * and their keep_alive is refreshed periodically so the server does not evict them while they are in use.
+     * Models loaded or evicted by a server, by any client, are reported on the main thread.
+     */
+    class NAPAPI OllamaResidency final
+    {
+        friend class OllamaService;
+    public:
+        /**
+         * Constructor
+         * @param service the service that runs the polls on its worker pool
+         */
+        OllamaResidency(OllamaService& service);
+
+        /**
+         * Destructor
+         */
+        ~OllamaResidency();
+
+        // The residency is shared with the worker pool and can't be copied or moved
+        OllamaResidency(const OllamaResidency&) = delete;
+        OllamaResidency& operator=(const OllamaResidency&) = delete;
+
+        /**
+         * Keeps a model loaded on a server, the model is loaded in the background on the next poll.
+         * Use this to load a model that is predicted to be used before the first prompt.
+         * This call is thread safe
+         * @param serverURL URL of the Ollama server
+         * @param model the model to load
+         */
+        void preloadModel(const std::string& serverURL, const std::string& model);
+
+        /**
+         * Stops keeping a preloaded model loaded, the server evicts it when its keep_alive expires.
+         * This call is thread safe
+         * @param serverURL URL of the Ollama server
+         * @param model the model to release
+         */
+        void releaseModel(const std::string& serverURL, const std::string& model);
+
+        /**
+         * Returns if a server had the model loaded at the last poll.
+         * This call is thread safe
+         * @param serverURL URL of the Ollama server
+         * @param model the model, without tag the 'latest' tag is assumed
+         * @return if the model is loaded
+         */
+        bool isModelLoaded(const std::string& serverURL, const std::string& model) const;
+
+        /**
+         * Returns the models a server had loaded at the last poll.
+         * This call is thread safe
+         * @param serverURL URL of the Ollama server
+         * @return the loaded models
+         */
+        std::vector<std::string> getLoadedModels(const std::string& serverURL) const;
+
+        /**
+         * Polls the servers on the next update, instead of waiting for the poll interval to elapse
+         */
+        void poll()                                                         { mPollRequested = true; }
+
+        /**
+         * @return the keep_alive duration used to load models, such as "10m"
+         */
+        const std::string& getKeepAlive() const                             { return mKeepAlive; }
+
+        /**
+         * Appends the 'latest' tag to a model without tag, the form reported by the server
+         * @param model the model name
+         * @return the model name including tag
+         */
+        static std::string getTaggedName(const std::string& model);
+
+        /**
+         * Triggered on the main thread when a server loaded a model
+         */
+        Signal<const OllamaResidencyEvent&> modelLoaded;
+
+        /**
+         * Triggered on the main thread when a server evicted a model
+         */
+        Signal<const OllamaResidencyEvent&> modelEvicted;
+
+    private:
+        // Models to keep loaded per server URL
+        using ModelMap = std::map<std::string, std::set<std::string>>;
+
+        /**
+         * Starts managing residency, called by the service on init
+         * @param enabled if models are loaded and kept loaded, when disabled the loaded models are not polled either
+         * @param keepAlive the keep_alive duration used to load models
+         * @param pollInterval seconds between polls
+         * @param refreshInterval seconds between keep_alive refreshes of the models that are kept loaded
+         */
+        void init(bool enabled, const std::string& keepAlive, double pollInterval, double refreshInterval);
+
+        /**
+         * Starts a poll on the worker pool when the poll interval elapsed and triggers the events of finished polls.
+         * Called on the main thread by the service
+         * @param deltaTime seconds since the last update
+         * @param chats the running chat devices, their models are kept loaded
+         */
+        void update(double deltaTime, const std::vector<OllamaChat*>& chats);
+
+        /**
+         * Cancels a running poll, called by the service before the worker pool stops
+         */
+        void shutdown();
+
+        /**
+         * Polls the loaded models of all servers and loads the models to keep loaded, runs on the worker pool
+         * @param models the models to keep loaded per server
+         * @param refresh if the keep_alive of loaded models is refreshed
+         */
+        void pollServers(const ModelMap& models, bool refresh);
+
+        OllamaService& mService;
+
+        bool mEnabled = false;
+        std::string mKeepAlive = "10m";
+        double mPollInterval = 5.0;
+        double mRefreshInterval = 60.0;
+        double mTimeSincePoll = 0.0;
+        double mTimeSinceRefresh = 0.0;
+        std::atomic_bool mPollRequested = true;
+        std::atomic_bool mPolling = false;
+        std::atomic_bool mRunning = false;
+
+        // State shared with the worker pool, guarded by mMutex
+        mutable std::mutex mMutex;
+        ModelMap mPreloadModels;                                            ///< Models preloaded through preloadModel()
+        ModelMap mLoadedModels;                                             ///< Models loaded by each server at the last poll
+        std::set<std::string> mUnreachable;                                 ///< Servers that could not be polled, to only log the first failure
+        std::set<std::string> mFailedLoads;                                 ///< Models that could not be loaded, to only log the first failure
+        std::vector<std::pair<bool, OllamaResidencyEvent>> mEvents;         ///< Events to trigger on the main thread, true when the model was loaded
+        std::shared_ptr<Ollama> mClient;                                    ///< Connection of the running poll, closed on shutdown
+    };
+}
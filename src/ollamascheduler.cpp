@@ -0,0 +1,245 @@
+#include "ollamascheduler.h"
+
+#include <rtti/rtti.h>
+
+RTTI_BEGIN_ENUM(nap::EOllamaPriority)
+    RTTI_ENUM_VALUE(nap::EOllamaPriority::Interactive, "Interactive"),
+    RTTI_ENUM_VALUE(nap::EOllamaPriority::Normal, "Normal"),
+    RTTI_ENUM_VALUE(nap::EOllamaPriority::Background, "Background")
+RTTI_END_ENUM
+
+namespace nap
+{
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaScheduler::Slot
+    //////////////////////////////////////////////////////////////////////////
+
+    OllamaScheduler::Slot::~Slot()
+    {
+        release();
+    }
+
+
+    OllamaScheduler::Slot::Slot(Slot&& other) noexcept : mScheduler(other.mScheduler)
+    {
+        other.mScheduler = nullptr;
+    }
+
+
+    OllamaScheduler::Slot& OllamaScheduler::Slot::operator=(Slot&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            mScheduler = other.mScheduler;
+            other.mScheduler = nullptr;
+        }
+        return *this;
+    }
+
+
+    void OllamaScheduler::Slot::release()
+    {
+        if (mScheduler == nullptr)
+            return;
+
+        mScheduler->release();
+        mScheduler = nullptr;
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaScheduler
+    //////////////////////////////////////////////////////////////////////////
+
+    void OllamaScheduler::init(int maxActiveRequests, int maxQueueDepth, double targetQueueWait)
+    {
+        std::lock_guard lk(mMutex);
+        mMaxActiveRequests = maxActiveRequests;
+        mMaxQueueDepth = maxQueueDepth;
+        mTargetQueueWait = targetQueueWait;
+    }
+
+
+    int OllamaScheduler::getQueueDepth() const
+    {
+        std::lock_guard lk(mMutex);
+        return static_cast<int>(mQueued.size());
+    }
+
+
+    int OllamaScheduler::getActiveCount() const
+    {
+        std::lock_guard lk(mMutex);
+        return mActive;
+    }
+
+
+    bool OllamaScheduler::isOverloaded() const
+    {
+        std::lock_guard lk(mMutex);
+        return overloaded();
+    }
+
+
+    bool OllamaScheduler::admit(OllamaChat& chat, std::uint64_t requestID, EOllamaPriority priority, const std::function<void(const std::string&)>& onShed, std::string& error)
+    {
+        std::function<void(const std::string&)> on_shed;
+        {
+            std::lock_guard lk(mMutex);
+
+            // Reject background work while the queue wait is above target, so the queue drains for requests of a higher class
+            if (priority == EOllamaPriority::Background && overloaded())
+            {
+                mRejected[static_cast<int>(priority)].fetch_add(1, std::memory_order_relaxed);
+                error = "Request rejected, the Ollama service is overloaded";
+                return false;
+            }
+
+            if (mMaxQueueDepth > 0 && static_cast<int>(mQueued.size()) >= mMaxQueueDepth)
+            {
+                // Shed the most recent request of the lowest class below the priority of the new request
+                auto victim = mQueued.end();
+                for (auto it = mQueued.begin(); it != mQueued.end(); ++it)
+                {
+                    if (it->second.mPriority > priority && (victim == mQueued.end() || it->second.mPriority >= victim->second.mPriority))
+                        victim = it;
+                }
+
+                if (victim == mQueued.end())
+                {
+                    mRejected[static_cast<int>(priority)].fetch_add(1, std::memory_order_relaxed);
+                    error = "Request rejected, the request queue is full";
+                    return false;
+                }
+
+                mShed[static_cast<int>(victim->second.mPriority)].fetch_add(1, std::memory_order_relaxed);
+                on_shed = std::move(victim->second.mOnShed);
+                mQueued.erase(victim);
+                mChanged.notify_all();
+            }
+
+            Request request;
+            request.mChat = &chat;
+            request.mPriority = priority;
+            request.mAdmitTime = Clock::now();
+            request.mOnShed = onShed;
+            mQueued.emplace(requestID, std::move(request));
+        }
+
+        if (on_shed)
+            on_shed("Request shed to admit a request of a higher priority");
+        return true;
+    }
+
+
+    OllamaScheduler::Slot OllamaScheduler::acquire(std::uint64_t requestID)
+    {
+        std::unique_lock lock(mMutex);
+        while (true)
+        {
+            // The request is no longer queued when it was shed or its chat stopped
+            auto it = mQueued.find(requestID);
+            if (it == mQueued.end())
+                return Slot();
+
+            it->second.mWaiting = true;
+            if (canStart(requestID, it->second))
+            {
+                // Measure the queue wait, the smoothed wait drives admission
+                auto wait = Clock::now() - it->second.mAdmitTime;
+                mQueueWait[static_cast<int>(it->second.mPriority)].record(wait);
+                mSmoothedQueueWait += 0.2 * (std::chrono::duration<double>(wait).count() - mSmoothedQueueWait);
+
+                Slot slot;
+                slot.mScheduler = this;
+                mQueued.erase(it);
+                mActive++;
+
+                // Requests of the same class waiting behind this request may start as well
+                mChanged.notify_all();
+                return slot;
+            }
+            mChanged.wait(lock);
+        }
+    }
+
+
+    OllamaScheduler::Slot OllamaScheduler::tryAcquire(EOllamaPriority priority)
+    {
+        std::lock_guard lk(mMutex);
+        if (mMaxActiveRequests > 0 && mActive >= mMaxActiveRequests)
+            return Slot();
+
+        // The started request was admitted before every waiting request, only a waiting request of a higher class goes first.
+        // A waiting request of the same class goes first as well, additional work never holds back the requests of its class
+        for (const auto& queued : mQueued)
+        {
+            if (queued.second.mWaiting && queued.second.mPriority <= priority)
+                return Slot();
+        }
+
+        Slot slot;
+        slot.mScheduler = this;
+        mActive++;
+        return slot;
+    }
+
+
+    void OllamaScheduler::cancel(OllamaChat& chat, const std::string& error)
+    {
+        std::vector<std::function<void(const std::string&)>> cancelled;
+        {
+            std::lock_guard lk(mMutex);
+            for (auto it = mQueued.begin(); it != mQueued.end();)
+            {
+                if (it->second.mChat != &chat)
+                {
+                    ++it;
+                    continue;
+                }
+                cancelled.emplace_back(std::move(it->second.mOnShed));
+                it = mQueued.erase(it);
+            }
+        }
+        mChanged.notify_all();
+
+        // Report the error outside of the lock, the callbacks may enqueue new requests
+        for (const auto& on_cancel : cancelled)
+            if (on_cancel)
+                on_cancel(error);
+    }
+
+
+    void OllamaScheduler::release()
+    {
+        {
+            std::lock_guard lk(mMutex);
+            mActive--;
+        }
+        mChanged.notify_all();
+    }
+
+
+    bool OllamaScheduler::canStart(std::uint64_t requestID, const Request& request) const
+    {
+        if (mMaxActiveRequests > 0 && mActive >= mMaxActiveRequests)
+            return false;
+
+        // Only requests that are waiting for a slot go first, requests of a higher class or admitted earlier in the same class
+        for (const auto& queued : mQueued)
+        {
+            if (!queued.second.mWaiting || queued.first == requestID)
+                continue;
+            if (queued.second.mPriority < request.mPriority || (queued.second.mPriority == request.mPriority && queued.first < requestID))
+                return false;
+        }
+        return true;
+    }
+
+
+    bool OllamaScheduler::overloaded() const
+    {
+        return mTargetQueueWait > 0.0 && !mQueued.empty() && mSmoothedQueueWait > mTargetQueueWait;
+    }
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "ollamametrics.h"
+
+#include <utility/dllexport.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace nap
+{
+    // Forward declarations
+    class OllamaChat;
+
+    /**
+     * Priority class of a request, requests of a higher class are sent before requests of a lower class
+     */
+    enum class EOllamaPriority : int
+    {
+        Interactive = 0,        ///< Someone is waiting for the response, such as a visitor prompt
+        Normal      = 1,        ///< Default priority
+        Background  = 2         ///< Work nobody waits for, such as batch summarization, rejected first under overload
+    };
+
+
+    /**
+     * Schedules the requests of all OllamaChat devices by priority class.
+     *
+     * A request is admitted when it is enqueued and waits until it is started. A chat runs its admitted requests in priority order,
+     * first in first out within a class. When 'MaxActiveRequests' is set, the requests of all chats share that number of slots,
+     * a free slot goes to the waiting request of the highest class.
+     * A prompt that sends several requests at a time holds a slot per request: the branches of a fan-out that run on the worker pool
+     * take a free slot each and are otherwise sent one after the other on the slot of the prompt. The stages of a cascade are sent
+     * one at a time and share the slot of the prompt.
+     *
+     * Admission is bounded by 'MaxQueueDepth': when the queue is full, a new request sheds the most recent queued request of a lower class,
+     * or is rejected when there is none. Admission also uses the measured queue wait: while the smoothed wait of recently started requests
+     * exceeds 'TargetQueueWait', new background requests are rejected. Rejected and shed requests fail with an error.
+     */
+    class NAPAPI OllamaScheduler final
+    {
+        friend class OllamaService;
+    public:
+        // Clock used to measure the queue wait
+        using Clock = std::chrono::steady_clock;
+
+        // Number of priority classes
+        static constexpr int priorityCount = 3;
+
+        /**
+         * A slot to send one request, acquired when the request starts.
+         * The slot is released when it is destroyed.
+         */
+        class NAPAPI Slot final
+        {
+            friend class OllamaScheduler;
+        public:
+            Slot() = default;
+            ~Slot();
+
+            // A slot can only be moved
+            Slot(const Slot&) = delete;
+            Slot& operator=(const Slot&) = delete;
+            Slot(Slot&& other) noexcept;
+            Slot& operator=(Slot&& other) noexcept;
+
+            /**
+             * @return if the request can start, false when it was shed or its chat stopped
+             */
+            bool isValid() const                                    { return mScheduler != nullptr; }
+
+            /**
+             * Releases the slot
+             */
+            void release();
+
+        private:
+            OllamaScheduler* mScheduler = nullptr;
+        };
+
+        OllamaScheduler() = default;
+
+        // The scheduler is shared between threads and can't be copied or moved
+        OllamaScheduler(const OllamaScheduler&) = delete;
+        OllamaScheduler& operator=(const OllamaScheduler&) = delete;
+
+        /**
+         * @return the number of admitted requests that did not start yet, thread safe
+         */
+        int getQueueDepth() const;
+
+        /**
+         * @return the number of started requests holding a slot, thread safe
+         */
+        int getActiveCount() const;
+
+        /**
+         * Returns if the smoothed queue wait of recently started requests exceeds the target, in which case background requests are rejected.
+         * This call is thread safe
+         * @return if the service is overloaded
+         */
+        bool isOverloaded() const;
+
+        /**
+         * Returns the time requests of a class waited between being enqueued and starting.
+         * @param priority the priority class
+         * @return the queue wait of the class
+         */
+        const LatencyHistogram& getQueueWait(EOllamaPriority priority) const    { return mQueueWait[static_cast<int>(priority)]; }
+
+        /**
+         * @param priority the priority class
+         * @return the number of requests of the class rejected on admission
+         */
+        std::uint64_t getRejectedCount(EOllamaPriority priority) const          { return mRejected[static_cast<int>(priority)].load(std::memory_order_relaxed); }
+
+        /**
+         * @param priority the priority class
+         * @return the number of queued requests of the class shed to admit a request of a higher class
+         */
+        std::uint64_t getShedCount(EOllamaPriority priority) const              { return mShed[static_cast<int>(priority)].load(std::memory_order_relaxed); }
+
+        /**
+         * Admits a request, shedding a queued request of a lower class when the queue is full.
+         * The shed callback of the shed request is called on the calling thread.
+         * This call is thread safe
+         * @param chat the chat that runs the request
+         * @param requestID unique id of the request, ids increase in the order requests are created
+         * @param priority the priority class of the request
+         * @param onShed called with the error when the request is shed before it started
+         * @param error contains the reason when the request is rejected
+         * @return if the request was admitted
+         */
+        bool admit(OllamaChat& chat, std::uint64_t requestID, EOllamaPriority priority, const std::function<void(const std::string&)>& onShed, std::string& error);
+
+        /**
+         * Waits until the admitted request may start, called by the chat on its worker thread.
+         * This call is thread safe
+         * @param requestID the id of the admitted request
+         * @return the slot of the request, invalid when the request was shed or its chat stopped
+         */
+        Slot acquire(std::uint64_t requestID);
+
+        /**
+         * Acquires a slot for additional work of a started request, such as a branch of a fan-out, without waiting.
+         * The slot is only acquired when it is free and no waiting request of the same or a higher class would start before it.
+         * This call is thread safe
+         * @param priority the priority class of the started request
+         * @return the slot, invalid when no slot is free
+         */
+        Slot tryAcquire(EOllamaPriority priority);
+
+        /**
+         * Removes the queued requests of a chat that stops, calling their shed callback with the error on the calling thread.
+         * Workers waiting for a slot for the requests stop waiting.
+         * This call is thread safe
+         * @param chat the chat that stops
+         * @param error the error the requests fail with
+         */
+        void cancel(OllamaChat& chat, const std::string& error);
+
+    private:
+        // An admitted request that did not start yet
+        struct Request
+        {
+            OllamaChat* mChat = nullptr;
+            EOllamaPriority mPriority = EOllamaPriority::Normal;
+            Clock::time_point mAdmitTime;
+            std::function<void(const std::string&)> mOnShed;        ///< Called when the request is shed
+            bool mWaiting = false;                                  ///< If a worker called acquire for the request and waits for a slot
+        };
+
+        /**
+         * Applies the configuration of the service, called on init
+         * @param maxActiveRequests maximum number of started requests over all chats, 0 for no limit
+         * @param maxQueueDepth maximum number of admitted requests that did not start, 0 for no limit
+         * @param targetQueueWait seconds of smoothed queue wait above which background requests are rejected, 0 to disable
+         */
+        void init(int maxActiveRequests, int maxQueueDepth, double targetQueueWait);
+
+        /**
+         * Releases a slot acquired by a request and wakes the waiting requests.
+         * Only requests that called acquire are waiting: a queued request whose session is busy does not hold back other requests.
+         */
+        void release();
+
+        /**
+         * Returns if a waiting request may start, the mutex must be locked
+         * @param requestID the id of the request
+         * @param request the request
+         */
+        bool canStart(std::uint64_t requestID, const Request& request) const;
+
+        /**
+         * Returns if background requests are rejected, the mutex must be locked
+         */
+        bool overloaded() const;
+
+        int mMaxActiveRequests = 0;
+        int mMaxQueueDepth = 0;
+        double mTargetQueueWait = 0.0;
+
+        // State shared by the chats, guarded by mMutex
+        mutable std::mutex mMutex;
+        std::condition_variable mChanged;                           ///< Notified when a request may be able to start
+        std::map<std::uint64_t, Request> mQueued;                   ///< Admitted requests that did not start, in order of admission
+        int mActive = 0;                                            ///< Started requests holding a slot
+        double mSmoothedQueueWait = 0.0;                            ///< Exponential moving average of the queue wait in seconds
+
+        std::array<LatencyHistogram, priorityCount> mQueueWait;
+        std::array<std::atomic<std::uint64_t>, priorityCount> mRejected = {};
+        std::array<std::atomic<std::uint64_t>, priorityCount> mShed = {};
+    };
+}
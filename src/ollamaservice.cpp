@@ -1,32 +1,108 @@
 // Local Includes
 #include "ollamaservice.h"
+#include "ollamabackendset.h"
 #include "ollamachat.h"
+#include "ollamatrace.h"
 
 // External Includes
 #include <nap/core.h>
 #include <nap/resourcemanager.h>
 #include <nap/logger.h>
+#include "ollama.hpp"
+#include <algorithm>
 #include <iostream>
 
+RTTI_BEGIN_CLASS(nap::OllamaServiceConfiguration)
+	RTTI_PROPERTY("WorkerThreadCount", &nap::OllamaServiceConfiguration::mWorkerThreadCount, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("ToolThreadCount", &nap::OllamaServiceConfiguration::mToolThreadCount, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("ManageResidency", &nap::OllamaServiceConfiguration::mManageResidency, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("KeepAlive", &nap::OllamaServiceConfiguration::mKeepAlive, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("ResidencyPollInterval", &nap::OllamaServiceConfiguration::mResidencyPollInterval, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("KeepAliveRefreshInterval", &nap::OllamaServiceConfiguration::mKeepAliveRefreshInterval, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("PreloadServerURL", &nap::OllamaServiceConfiguration::mPreloadServerURL, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("PreloadModels", &nap::OllamaServiceConfiguration::mPreloadModels, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("HedgeBudget", &nap::OllamaServiceConfiguration::mHedgeBudget, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("MaxActiveRequests", &nap::OllamaServiceConfiguration::mMaxActiveRequests, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("MaxQueueDepth", &nap::OllamaServiceConfiguration::mMaxQueueDepth, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("TargetQueueWait", &nap::OllamaServiceConfiguration::mTargetQueueWait, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("LogRequests", &nap::OllamaServiceConfiguration::mLogRequests, nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("LogReplies", &nap::OllamaServiceConfiguration::mLogReplies, nap::rtti::EPropertyMetaData::Default)
+RTTI_END_CLASS
+
 RTTI_BEGIN_CLASS_NO_DEFAULT_CONSTRUCTOR(nap::OllamaService)
 	RTTI_CONSTRUCTOR(nap::ServiceConfiguration*)
 RTTI_END_CLASS
 
 namespace nap
 {
+	rtti::TypeInfo OllamaServiceConfiguration::getServiceType() const
+	{
+		return RTTI_OF(OllamaService);
+	}
+
+
 	bool OllamaService::init(nap::utility::ErrorState& errorState)
 	{
-		//Logger::info("Initializing ollamaService");
+		// Validate the configuration
+		OllamaServiceConfiguration default_configuration;
+		auto* configuration = getConfiguration<OllamaServiceConfiguration>();
+		if (configuration == nullptr)
+			configuration = &default_configuration;
+		if (!errorState.check(configuration->mWorkerThreadCount > 0, "WorkerThreadCount must be at least 1"))
+			return false;
+		if (!errorState.check(configuration->mToolThreadCount > 0, "ToolThreadCount must be at least 1"))
+			return false;
+		if (!errorState.check(configuration->mResidencyPollInterval > 0.0f, "ResidencyPollInterval must be larger than 0"))
+			return false;
+		if (!errorState.check(configuration->mHedgeBudget >= 0.0f && configuration->mHedgeBudget <= 1.0f, "HedgeBudget must be between 0 and 1"))
+			return false;
+		mHedgeBudget = configuration->mHedgeBudget;
+		if (!errorState.check(configuration->mMaxActiveRequests >= 0 && configuration->mMaxQueueDepth >= 0 && configuration->mTargetQueueWait >= 0.0f,
+			"MaxActiveRequests, MaxQueueDepth and TargetQueueWait can't be negative"))
+			return false;
+		mScheduler.init(configuration->mMaxActiveRequests, configuration->mMaxQueueDepth, configuration->mTargetQueueWait);
+
+		// Log requests & replies of all clients asynchronously through the nap logger
+		ollama::show_requests(configuration->mLogRequests);
+		ollama::show_replies(configuration->mLogReplies);
+		if (configuration->mLogRequests || configuration->mLogReplies)
+			enableRequestLogging();
+
+		// Start the worker & tool pools
+		mRunning = true;
+		for (int i = 0; i < configuration->mWorkerThreadCount; i++)
+			mWorkers.emplace_back([this] { onWork(mWorkerTasks); });
+		for (int i = 0; i < configuration->mToolThreadCount; i++)
+			mToolWorkers.emplace_back([this] { onWork(mToolTasks); });
+		mTimerRunning = true;
+		mTimer = std::thread([this] { onTimer(); });
+
+		// Keep the models of the chats & the preload models loaded, the first poll runs on the first update
+		mResidency.init(configuration->mManageResidency, configuration->mKeepAlive,
+			configuration->mResidencyPollInterval, configuration->mKeepAliveRefreshInterval);
+		for (const auto& model : configuration->mPreloadModels)
+			mResidency.preloadModel(configuration->mPreloadServerURL, model);
+
 		return true;
 	}
 
 
 	void OllamaService::update(double deltaTime)
 	{
+        OLLAMA_TRACE_THREAD_NAME("Main");
+        std::function<void()> task;
+        while (mMainThreadTasks.try_dequeue(task))
+            task();
+
         for(auto chat : mChats)
         {
             chat->update();
         }
+        for(auto backend_set : mBackendSets)
+        {
+            backend_set->update(deltaTime);
+        }
+        mResidency.update(deltaTime, mChats);
 	}
 	
 
@@ -37,12 +113,143 @@ namespace nap
 
 	void OllamaService::shutdown()
 	{
+        // Write the pending log records and stop routing them to the nap logger
+        if (mRequestLoggingEnabled)
+        {
+            ollama::logger().flush();
+            ollama::logger().set_sink(ollama::async_logger::sink());
+            mRequestLoggingEnabled = false;
+        }
+
+        // Stop the worker & tool pools, tasks that are running are finished first
+        mResidency.shutdown();
+        {
+            std::lock_guard lk(mDelayedTaskMutex);
+            mDelayedTasks.clear();
+            mTimerRunning = false;
+        }
+        mDelayedTaskAdded.notify_one();
+        if (mTimer.joinable())
+            mTimer.join();
+        mRunning = false;
+        for (std::size_t i = 0; i < mWorkers.size(); i++)
+            mWorkerTasks.enqueue([]{});
+        for (std::size_t i = 0; i < mToolWorkers.size(); i++)
+            mToolTasks.enqueue([]{});
+        for (auto& worker : mWorkers)
+            worker.join();
+        for (auto& worker : mToolWorkers)
+            worker.join();
+        mWorkers.clear();
+        mToolWorkers.clear();
 	}
 
 
+    void OllamaService::enqueueTask(const std::function<void()>& task)
+    {
+        mWorkerTasks.enqueue(task);
+    }
+
+
+    void OllamaService::enqueueTask(const std::function<void()>& task, std::chrono::steady_clock::duration delay)
+    {
+        {
+            std::lock_guard lk(mDelayedTaskMutex);
+            mDelayedTasks.emplace(std::chrono::steady_clock::now() + delay, task);
+        }
+        mDelayedTaskAdded.notify_one();
+    }
+
+
+    void OllamaService::enqueueToolTask(const std::function<void()>& task)
+    {
+        mToolTasks.enqueue(task);
+    }
+
+
+    void OllamaService::enqueueMainThreadTask(const std::function<void()>& task)
+    {
+        mMainThreadTasks.enqueue(task);
+    }
+
+
+    void OllamaService::onWork(moodycamel::BlockingConcurrentQueue<std::function<void()>>& tasks)
+    {
+        OLLAMA_TRACE_THREAD_NAME(&tasks == &mToolTasks ? "OllamaService tool worker" : "OllamaService worker");
+        std::function<void()> task;
+        while (mRunning)
+        {
+            tasks.wait_dequeue(task);
+            task();
+        }
+    }
+
+
+    void OllamaService::onTimer()
+    {
+        OLLAMA_TRACE_THREAD_NAME("OllamaService timer");
+        std::unique_lock lock(mDelayedTaskMutex);
+        while (mTimerRunning)
+        {
+            // Sleep until the earliest task is due or a task is added
+            if (mDelayedTasks.empty())
+            {
+                mDelayedTaskAdded.wait(lock);
+                continue;
+            }
+            if (mDelayedTaskAdded.wait_until(lock, mDelayedTasks.begin()->first) == std::cv_status::no_timeout)
+                continue;
+
+            auto due = mDelayedTasks.upper_bound(std::chrono::steady_clock::now());
+            for (auto it = mDelayedTasks.begin(); it != due; ++it)
+                mWorkerTasks.enqueue(std::move(it->second));
+            mDelayedTasks.erase(mDelayedTasks.begin(), due);
+        }
+    }
+
+
+    void OllamaService::depositHedgeBudget()
+    {
+        // Saving up allows a short burst of hedges after a quiet period, but never more than a few
+        std::lock_guard lk(mHedgeMutex);
+        mHedgeTokens = std::min(mHedgeTokens + mHedgeBudget, 10.0);
+    }
+
+
+    bool OllamaService::withdrawHedgeBudget()
+    {
+        std::lock_guard lk(mHedgeMutex);
+        if (mHedgeTokens < 1.0)
+            return false;
+
+        mHedgeTokens -= 1.0;
+        return true;
+    }
+
+
+    void OllamaService::enableRequestLogging()
+    {
+        if (mRequestLoggingEnabled)
+            return;
+
+        // Called from the writer thread of the logger, never from a stream callback
+        ollama::logger().set_sink([](ollama::log_kind kind, const std::string& text)
+        {
+            if (kind == ollama::log_kind::request)
+                Logger::debug("Ollama request: %s", text.c_str());
+            else
+                Logger::fine("Ollama reply: %s", text.c_str());
+        });
+        mRequestLoggingEnabled = true;
+    }
+
+
     void OllamaService::registerChat(OllamaChat& chat)
     {
         mChats.push_back(&chat);
+
+        // Load the model of the chat before the first prompt
+        mResidency.poll();
     }
 
 
@@ -56,8 +263,25 @@ namespace nap
     }
 
 
+    void OllamaService::registerBackendSet(OllamaBackendSet& backendSet)
+    {
+        mBackendSets.push_back(&backendSet);
+    }
+
+
+    void OllamaService::removeBackendSet(OllamaBackendSet& backendSet)
+    {
+        auto it = std::find(mBackendSets.begin(), mBackendSets.end(), &backendSet);
+        if(it != mBackendSets.end())
+        {
+            mBackendSets.erase(it);
+        }
+    }
+
+
     void OllamaService::registerObjectCreators(rtti::Factory &factory)
     {
         factory.addObjectCreator(std::make_unique<OllamaChatObjectCreator>(*this));
+        factory.addObjectCreator(std::make_unique<OllamaBackendSetObjectCreator>(*this));
     }
 }
@@ -1,19 +1,65 @@
 #pragma once
 
+// Local Includes
+#include "ollamametrics.h"
+#include "ollamaresidency.h"
+#include "ollamascheduler.h"
+#include "ollamasingleflight.h"
+
 // External Includes
 #include <nap/service.h>
+#include <blockingconcurrentqueue.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace nap
 {
     // Forward declarations
+    class OllamaBackendSet;
     class OllamaChat;
+    class OllamaService;
 
     /**
-     * OllamaService is a service that manages OllamaChat devices
+     * OllamaService configuration
+     */
+    class NAPAPI OllamaServiceConfiguration : public ServiceConfiguration
+    {
+        RTTI_ENABLE(ServiceConfiguration)
+    public:
+        int mWorkerThreadCount = 2;     ///< Property: 'WorkerThreadCount' Number of threads that run background tasks, such as model pulls
+        int mToolThreadCount = 4;       ///< Property: 'ToolThreadCount' Number of threads that execute the tool calls of the chats, the maximum number of calls executed at a time
+        bool mManageResidency = true;   ///< Property: 'ManageResidency' Keep the models of running chats loaded in the memory of the Ollama server
+        std::string mKeepAlive = "10m"; ///< Property: 'KeepAlive' How long the server keeps a model loaded after its last use, negative keeps it loaded forever
+        float mResidencyPollInterval = 5.0f;    ///< Property: 'ResidencyPollInterval' Seconds between polls of the models loaded by the server
+        float mKeepAliveRefreshInterval = 60.0f;    ///< Property: 'KeepAliveRefreshInterval' Seconds between keep_alive refreshes of the models of running chats
+        std::string mPreloadServerURL = "http://localhost:11434";  ///< Property: 'PreloadServerURL' The URL of the Ollama server the preload models are loaded on
+        std::vector<std::string> mPreloadModels;    ///< Property: 'PreloadModels' Models to load on start, before a chat uses them
+        float mHedgeBudget = 0.1f;      ///< Property: 'HedgeBudget' Maximum fraction of requests that are hedged, shared by all chats
+        int mMaxActiveRequests = 0;     ///< Property: 'MaxActiveRequests' Maximum number of requests sent at a time over all chats, 0 for no limit
+        int mMaxQueueDepth = 0;         ///< Property: 'MaxQueueDepth' Maximum number of queued requests over all chats before requests are shed or rejected, 0 for no limit
+        float mTargetQueueWait = 0.0f;  ///< Property: 'TargetQueueWait' Seconds of measured queue wait above which background requests are rejected, 0 to disable
+        bool mLogRequests = false;      ///< Property: 'LogRequests' Log the raw requests to the Ollama servers at debug level
+        bool mLogReplies = false;       ///< Property: 'LogReplies' Log the raw replies of the Ollama servers at fine level
+
+        /**
+         * @return the service this configuration belongs to
+         */
+        rtti::TypeInfo getServiceType() const override;
+    };
+
+    /**
+     * OllamaService is a service that manages OllamaChat and OllamaBackendSet devices
      */
 	class NAPAPI OllamaService : public Service
 	{
+        friend class OllamaBackendSet;
         friend class OllamaChat;
+        friend class OllamaHedge;
 
 		RTTI_ENABLE(Service)
 	public:
@@ -51,6 +97,82 @@ namespace nap
 		virtual void shutdown() override;
 
         void registerObjectCreators(rtti::Factory &factory) override;
+
+        /**
+         * Returns the latency metrics aggregated over all OllamaChat devices.
+         * Metrics are recorded lock-free and can be queried at any time.
+         * @return the aggregated metrics
+         */
+        OllamaMetrics& getMetrics()                         { return mMetrics; }
+
+        /**
+         * Returns the latency metrics aggregated over all OllamaChat devices.
+         * @return the aggregated metrics
+         */
+        const OllamaMetrics& getMetrics() const             { return mMetrics; }
+
+        /**
+         * Returns the residency manager, which keeps the models of running chats loaded and reports models loaded or evicted by the server.
+         * @return the residency manager
+         */
+        OllamaResidency& getResidency()                     { return mResidency; }
+
+        /**
+         * Returns the residency manager.
+         * @return the residency manager
+         */
+        const OllamaResidency& getResidency() const         { return mResidency; }
+
+        /**
+         * Returns the scheduler, which orders the requests of all chats by priority class and admits or rejects new requests.
+         * @return the scheduler
+         */
+        OllamaScheduler& getScheduler()                     { return mScheduler; }
+
+        /**
+         * Returns the scheduler.
+         * @return the scheduler
+         */
+        const OllamaScheduler& getScheduler() const         { return mScheduler; }
+
+        /**
+         * Returns the identical requests in flight shared between chats that deduplicate requests.
+         * @return the requests in flight
+         */
+        const OllamaSingleFlight& getSingleFlight() const   { return mSingleFlight; }
+
+        /**
+         * Enqueues a task to be executed on the worker pool of the service.
+         * Use the pool for long running background work, such as pulling a model.
+         * This call is thread safe
+         * @param task the task to execute
+         */
+        void enqueueTask(const std::function<void()>& task);
+
+        /**
+         * Enqueues a task to be executed on the worker pool of the service once the delay elapsed.
+         * The delay is timed by a timer thread, independent of the update of the service. Tasks that are not due when the service shuts down are dropped.
+         * This call is thread safe
+         * @param task the task to execute
+         * @param delay time to wait before the task is executed
+         */
+        void enqueueTask(const std::function<void()>& task, std::chrono::steady_clock::duration delay);
+
+        /**
+         * Enqueues a tool call to be executed on the tool pool of the service.
+         * The tool pool is separate from the worker pool, so tool calls don't wait for model pulls & loads.
+         * This call is thread safe
+         * @param task the tool call to execute
+         */
+        void enqueueToolTask(const std::function<void()>& task);
+
+        /**
+         * Enqueues a task to be executed on the main thread, on the next update of the service.
+         * Use this to report the result of work done on the worker pool.
+         * This call is thread safe
+         * @param task the task to execute
+         */
+        void enqueueMainThreadTask(const std::function<void()>& task);
     private:
         /**
          * Registers a chat device
@@ -64,7 +186,89 @@ namespace nap
          */
         void removeChat(OllamaChat& chat);
 
+        /**
+         * Registers a backend set
+         * @param backendSet the backend set to register
+         */
+        void registerBackendSet(OllamaBackendSet& backendSet);
+
+        /**
+         * Removes a backend set
+         * @param backendSet the backend set to remove
+         */
+        void removeBackendSet(OllamaBackendSet& backendSet);
+
+        /**
+         * Adds the hedge budget earned by one request, called for every request that may be hedged
+         */
+        void depositHedgeBudget();
+
+        /**
+         * Spends the budget of one hedged request
+         * @return if the budget allows another hedged request
+         */
+        bool withdrawHedgeBudget();
+
+        /**
+         * Routes the asynchronous request & reply log of the ollama client to the nap logger.
+         * Requests are logged at debug level, replies at fine level.
+         */
+        void enableRequestLogging();
+
         // List of registered chat devices
         std::vector<OllamaChat*> mChats;
+
+        // List of registered backend sets
+        std::vector<OllamaBackendSet*> mBackendSets;
+
+        // If the request log is routed to the nap logger
+        bool mRequestLoggingEnabled = false;
+
+        // Metrics aggregated over all chat devices
+        OllamaMetrics mMetrics;
+
+        // Keeps the models of the chat devices loaded
+        OllamaResidency mResidency { *this };
+
+        // Orders the requests of the chat devices by priority class
+        OllamaScheduler mScheduler;
+
+        // Identical requests in flight of the chat devices
+        OllamaSingleFlight mSingleFlight;
+
+        // Hedged requests that can be sent, every request adds the hedge budget, guarded by mHedgeMutex
+        std::mutex mHedgeMutex;
+        double mHedgeTokens = 0.0;
+        double mHedgeBudget = 0.1;
+
+        /**
+         * Executes tasks of a pool until the service shuts down
+         * @param tasks the tasks of the pool
+         */
+        void onWork(moodycamel::BlockingConcurrentQueue<std::function<void()>>& tasks);
+
+        /**
+         * Moves the delayed tasks to the worker pool once their time elapsed, until the service shuts down
+         */
+        void onTimer();
+
+        // Worker pool executing background tasks
+        std::vector<std::thread> mWorkers;
+        moodycamel::BlockingConcurrentQueue<std::function<void()>> mWorkerTasks;
+
+        // Tool pool executing the tool calls of the chats
+        std::vector<std::thread> mToolWorkers;
+        moodycamel::BlockingConcurrentQueue<std::function<void()>> mToolTasks;
+
+        // Tasks moved to the worker pool by the timer thread once their time elapsed, guarded by mDelayedTaskMutex
+        std::thread mTimer;
+        std::mutex mDelayedTaskMutex;
+        std::condition_variable mDelayedTaskAdded;
+        std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> mDelayedTasks;
+        bool mTimerRunning = false;
+
+        // Tasks executed on the main thread on the next update
+        moodycamel::ConcurrentQueue<std::function<void()>> mMainThreadTasks;
+        std::atomic_bool mRunning = false;
 	};
 }
@@ -0,0 +1,391 @@
+#include "ollamasessiontable.h"
+#include "ollamaconversationrun.h"
+#include "ollamasnapshot.h"
+
+#include "ollama.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
+
+namespace nap
+{
+    // Messages of a conversation with tools
+    using MessageRun = OllamaConversationRun<nlohmann::json>;
+
+
+    /**
+     * The conversation of a session
+     */
+    struct OllamaSessionTable::Entry
+    {
+        std::shared_ptr<OllamaSession> mSession = std::make_shared<OllamaSession>();
+
+        // Context tokens for the next prompt
+        std::shared_ptr<const OllamaContextRun> mContext;           ///< The context tokens, only the runs shared with other sessions while compacted
+        std::vector<std::uint8_t> mCompactContext;                  ///< The tokens after the shared runs encoded as varints while the session is compacted
+        bool mCompacted = false;
+        std::chrono::steady_clock::time_point mLastUsed = std::chrono::steady_clock::now();
+
+        // Messages of the conversation with tools
+        std::shared_ptr<const MessageRun> mMessages;
+    };
+
+
+    namespace
+    {
+        // Id of the last session created by any chat, sessions restored from a snapshot keep their id
+        std::atomic<OllamaSessionID> sessionCounter = { OllamaSessionTable::defaultSession };
+    }
+
+
+    OllamaSessionTable::OllamaSessionTable()
+    {
+        mEntries.emplace(defaultSession, std::make_unique<Entry>());
+    }
+
+
+    OllamaSessionTable::~OllamaSessionTable()
+    { }
+
+
+    OllamaSessionID OllamaSessionTable::create()
+    {
+        auto session = ++sessionCounter;
+
+        std::lock_guard lk(mMutex);
+        mEntries.emplace(session, std::make_unique<Entry>());
+        mChanges++;
+        return session;
+    }
+
+
+    OllamaSessionID OllamaSessionTable::fork(OllamaSessionID session)
+    {
+        auto fork_id = ++sessionCounter;
+        auto fork = std::make_unique<Entry>();
+
+        // The fork references the runs of the session, a compacted session is restored first so the runs are shared
+        std::lock_guard lk(mMutex);
+        auto* source = findEntry(session);
+        if (source != nullptr)
+        {
+            expand(*source);
+            fork->mContext = source->mContext;
+            fork->mMessages = source->mMessages;
+        }
+        mEntries.emplace(fork_id, std::move(fork));
+        mChanges++;
+        return fork_id;
+    }
+
+
+    std::shared_ptr<OllamaSession> OllamaSessionTable::destroy(OllamaSessionID session)
+    {
+        std::lock_guard lk(mMutex);
+        auto it = mEntries.find(session);
+        if (it == mEntries.end() || session == defaultSession)
+            return nullptr;
+
+        auto destroyed = it->second->mSession;
+        mEntries.erase(it);
+        mChanges++;
+        return destroyed;
+    }
+
+
+    std::shared_ptr<OllamaSession> OllamaSessionTable::find(OllamaSessionID session)
+    {
+        std::lock_guard lk(mMutex);
+        auto* entry = findEntry(session);
+        return entry != nullptr ? entry->mSession : nullptr;
+    }
+
+
+    std::vector<std::shared_ptr<OllamaSession>> OllamaSessionTable::getAll()
+    {
+        std::vector<std::shared_ptr<OllamaSession>> sessions;
+        std::lock_guard lk(mMutex);
+        for (const auto& entry : mEntries)
+            sessions.emplace_back(entry.second->mSession);
+        return sessions;
+    }
+
+
+    std::vector<OllamaSessionID> OllamaSessionTable::getIDs()
+    {
+        std::vector<OllamaSessionID> sessions;
+        std::lock_guard lk(mMutex);
+        for (const auto& entry : mEntries)
+            sessions.emplace_back(entry.first);
+        return sessions;
+    }
+
+
+    std::size_t OllamaSessionTable::getCount()
+    {
+        std::lock_guard lk(mMutex);
+        return mEntries.size();
+    }
+
+
+    std::vector<std::uint32_t> OllamaSessionTable::getContext(OllamaSessionID session)
+    {
+        std::lock_guard lk(mMutex);
+        auto* entry = findEntry(session);
+        if (entry == nullptr)
+            return {};
+
+        entry->mLastUsed = std::chrono::steady_clock::now();
+        expand(*entry);
+        return flattenRuns(entry->mContext.get());
+    }
+
+
+    void OllamaSessionTable::setContext(OllamaSessionID session, const ollama::response& response)
+    {
+        const auto& json = response.as_json();
+        auto tokens = json.contains("context") ? json["context"].get<std::vector<std::uint32_t>>() : std::vector<std::uint32_t>();
+
+        // The runs shared with other sessions are kept, the tokens after them are stored once more
+        std::lock_guard lk(mMutex);
+        auto* entry = findEntry(session);
+        if (entry == nullptr)
+            return;
+
+        mChanges++;
+        auto previous_size = entry->mContext != nullptr ? entry->mContext->mSize : 0;
+        entry->mContext = !tokens.empty() ? extendRuns(entry->mContext, std::move(tokens)) : nullptr;
+        if (entry->mContext != nullptr && entry->mContext->mSize > previous_size)
+            growMemory(sizeof(OllamaContextRun) + (entry->mContext->mSize - previous_size) * sizeof(std::uint32_t));
+        entry->mCompactContext.clear();
+        entry->mCompacted = false;
+        entry->mLastUsed = std::chrono::steady_clock::now();
+    }
+
+
+    void OllamaSessionTable::writeMessages(OllamaSessionID session, ollama::request& request)
+    {
+        std::lock_guard lk(mMutex);
+        auto* entry = findEntry(session);
+        if (entry == nullptr)
+            return;
+
+        entry->mLastUsed = std::chrono::steady_clock::now();
+        request["messages"] = flattenRuns(entry->mMessages.get());
+    }
+
+
+    void OllamaSessionTable::readMessages(OllamaSessionID session, const ollama::request& request)
+    {
+        auto messages = request["messages"].get<std::vector<nlohmann::json>>();
+
+        std::lock_guard lk(mMutex);
+        auto* entry = findEntry(session);
+        if (entry == nullptr)
+            return;
+
+        entry->mMessages = extendRuns(entry->mMessages, std::move(messages));
+        entry->mLastUsed = std::chrono::steady_clock::now();
+        mChanges++;
+    }
+
+
+    void OllamaSessionTable::clear(OllamaSessionID session)
+    {
+        std::lock_guard lk(mMutex);
+        auto* entry = findEntry(session);
+        if (entry == nullptr)
+            return;
+
+        entry->mContext = nullptr;
+        entry->mCompactContext.clear();
+        entry->mCompacted = false;
+        entry->mMessages = nullptr;
+        mChanges++;
+    }
+
+
+    void OllamaSessionTable::setMemoryLimit(std::size_t bytes)
+    {
+        std::lock_guard lk(mMutex);
+        mMemoryLimit = bytes;
+    }
+
+
+    std::size_t OllamaSessionTable::getMemory()
+    {
+        std::lock_guard lk(mMutex);
+        return measureMemory();
+    }
+
+
+    void OllamaSessionTable::compact()
+    {
+        if (!mCompactionPending.exchange(false))
+            return;
+
+        std::lock_guard lk(mMutex);
+        std::size_t memory = measureMemory();
+
+        // Compact the least recently used idle sessions until the live contexts fit.
+        // Only the tokens no other session shares are compacted, the shared runs stay live for the other sessions
+        while (memory > mMemoryLimit)
+        {
+            Entry* oldest = nullptr;
+            for (const auto& entry : mEntries)
+            {
+                auto& candidate = *entry.second;
+                if (candidate.mCompacted || candidate.mSession->mStreaming || candidate.mContext == nullptr || candidate.mContext.use_count() > 1)
+                    continue;
+                if (oldest == nullptr || candidate.mLastUsed < oldest->mLastUsed)
+                    oldest = &candidate;
+            }
+            if (oldest == nullptr)
+                break;
+
+            std::vector<const OllamaContextRun*> owned;
+            auto shared = findSharedRun(oldest->mContext, owned);
+            std::vector<std::uint32_t> tokens;
+            for (auto it = owned.rbegin(); it != owned.rend(); ++it)
+            {
+                tokens.insert(tokens.end(), (*it)->mItems.begin(), (*it)->mItems.end());
+                memory -= getRunMemory(**it);
+            }
+
+            oldest->mCompactContext = compactContext(tokens);
+            oldest->mContext = shared;
+            oldest->mCompacted = true;
+            memory += oldest->mCompactContext.size();
+        }
+        mMemoryBound = memory;
+    }
+
+
+    std::string OllamaSessionTable::getModelDigest()
+    {
+        std::lock_guard lk(mMutex);
+        return mModelDigest;
+    }
+
+
+    std::size_t OllamaSessionTable::setModelDigest(const std::string& digest)
+    {
+        std::lock_guard lk(mMutex);
+        if (digest == mModelDigest)
+            return 0;
+
+        // Contexts generated with another version of the model are stale
+        std::size_t discarded = 0;
+        for (const auto& entry : mEntries)
+        {
+            auto& stale = *entry.second;
+            if (stale.mCompacted || stale.mContext != nullptr)
+                discarded++;
+            stale.mContext = nullptr;
+            stale.mCompactContext.clear();
+            stale.mCompacted = false;
+        }
+
+        mModelDigest = digest;
+        mChanges++;
+        return discarded;
+    }
+
+
+    void OllamaSessionTable::restore(const OllamaSnapshot& snapshot, bool keepContexts)
+    {
+        std::lock_guard lk(mMutex);
+        for (const auto& saved : snapshot.mSessions)
+        {
+            auto& entry = mEntries[saved.mID];
+            if (entry == nullptr)
+                entry = std::make_unique<Entry>();
+
+            if (keepContexts && !saved.mContext.empty())
+            {
+                entry->mCompactContext = saved.mContext;
+                entry->mCompacted = true;
+            }
+            if (!saved.mMessages.empty())
+            {
+                auto messages = nlohmann::json::from_msgpack(saved.mMessages, true, false);
+                if (messages.is_array() && !messages.empty())
+                    entry->mMessages = appendRun<nlohmann::json>(nullptr, messages.get<std::vector<nlohmann::json>>());
+            }
+
+            // New sessions get an id after the restored sessions
+            auto last = sessionCounter.load();
+            while (last < saved.mID && !sessionCounter.compare_exchange_weak(last, saved.mID))
+            { }
+        }
+        mModelDigest = keepContexts ? snapshot.mDigest : "";
+        growMemory(measureMemory());
+    }
+
+
+    void OllamaSessionTable::save(OllamaSnapshot& snapshot)
+    {
+        // Compacted contexts are saved as they are, the other contexts are encoded the same way
+        std::lock_guard lk(mMutex);
+        snapshot.mDigest = mModelDigest;
+        for (const auto& entry : mEntries)
+        {
+            OllamaSnapshot::Session saved;
+            saved.mID = entry.first;
+            // The tokens of a compacted session follow its shared runs
+            saved.mContext = compactContext(flattenRuns(entry.second->mContext.get()));
+            saved.mContext.insert(saved.mContext.end(), entry.second->mCompactContext.begin(), entry.second->mCompactContext.end());
+            if (entry.second->mMessages != nullptr)
+                saved.mMessages = nlohmann::json::to_msgpack(flattenRuns(entry.second->mMessages.get()));
+            snapshot.mSessions.emplace_back(std::move(saved));
+        }
+    }
+
+
+    OllamaSessionTable::Entry* OllamaSessionTable::findEntry(OllamaSessionID session)
+    {
+        auto it = mEntries.find(session);
+        return it != mEntries.end() ? it->second.get() : nullptr;
+    }
+
+
+    void OllamaSessionTable::expand(Entry& entry)
+    {
+        if (!entry.mCompacted)
+            return;
+
+        // Continue the shared runs with the tokens of the session
+        if (!entry.mCompactContext.empty())
+        {
+            entry.mContext = appendRun(entry.mContext, expandContext(entry.mCompactContext));
+            growMemory(getRunMemory(*entry.mContext));
+        }
+        entry.mCompactContext.clear();
+        entry.mCompactContext.shrink_to_fit();
+        entry.mCompacted = false;
+    }
+
+
+    std::size_t OllamaSessionTable::measureMemory()
+    {
+        // Runs shared by forked sessions are counted once
+        std::size_t memory = 0;
+        std::unordered_set<const OllamaContextRun*> counted;
+        for (const auto& entry : mEntries)
+        {
+            memory += entry.second->mCompactContext.size();
+            for (auto* run = entry.second->mContext.get(); run != nullptr && counted.insert(run).second; run = run->mParent.get())
+                memory += getRunMemory(*run);
+        }
+        return memory;
+    }
+
+
+    void OllamaSessionTable::growMemory(std::size_t bytes)
+    {
+        mMemoryBound += bytes;
+        if (mMemoryBound > mMemoryLimit)
+            mCompactionPending = true;
+    }
+}
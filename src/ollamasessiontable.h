@@ -0,0 +1,224 @@
+#pragma once
+
+#include "ollamaconnectionpool.h"
+
+#include <utility/dllexport.h>
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Forward declarations
+namespace ollama
+{
+    class request;
+    class response;
+}
+
+namespace nap
+{
+    // Forward declarations
+    struct OllamaSnapshot;
+
+    // Identifies a session of a chat
+    using OllamaSessionID = std::uint64_t;
+
+    /**
+     * The request in progress of a session
+     */
+    struct NAPAPI OllamaSession
+    {
+        std::atomic_bool mStreaming = false;                        ///< If a response is streaming, cleared to stop it
+        OllamaActiveServer mActiveServer;                           ///< Connection of the request in progress, closed to stop the response
+        std::atomic_bool mDestroyed = false;                        ///< Queued prompts of a destroyed session fail
+    };
+
+
+    /**
+     * The sessions of a chat and their conversations: the context tokens of the prompts and the messages of the conversation with tools.
+     * A forked session shares the context tokens and messages of the session it continues, only the tokens and messages after the fork are stored per session.
+     * When the contexts of all sessions exceed the memory limit, the contexts of the least recently used idle sessions are compacted,
+     * and restored when the session is prompted again.
+     * All calls are thread safe
+     */
+    class NAPAPI OllamaSessionTable final
+    {
+    public:
+        // The session of prompts that don't specify one, it always exists
+        static constexpr OllamaSessionID defaultSession = 0;
+
+        /**
+         * Creates the table with the default session
+         */
+        OllamaSessionTable();
+
+        /**
+         * Destructor
+         */
+        ~OllamaSessionTable();
+
+        /**
+         * Creates a session with an empty context
+         * @return the id of the session
+         */
+        OllamaSessionID create();
+
+        /**
+         * Creates a session that continues the conversation of another session, without copying its context
+         * @param session the session to fork, the fork starts with an empty context when the session does not exist
+         * @return the id of the fork
+         */
+        OllamaSessionID fork(OllamaSessionID session);
+
+        /**
+         * Removes a session, the default session can't be removed
+         * @param session the session to remove
+         * @return the removed session, nullptr when it was not removed
+         */
+        std::shared_ptr<OllamaSession> destroy(OllamaSessionID session);
+
+        /**
+         * @return the session with the given id, nullptr when it does not exist
+         */
+        std::shared_ptr<OllamaSession> find(OllamaSessionID session);
+
+        /**
+         * @return all sessions
+         */
+        std::vector<std::shared_ptr<OllamaSession>> getAll();
+
+        /**
+         * @return the ids of all sessions, including the default session
+         */
+        std::vector<OllamaSessionID> getIDs();
+
+        /**
+         * @return the number of sessions, including the default session
+         */
+        std::size_t getCount();
+
+        /**
+         * Gets the context tokens of a session for the next prompt, restoring them when the session was compacted
+         * @param session the session
+         * @return the context tokens, empty when the session has no context
+         */
+        std::vector<std::uint32_t> getContext(OllamaSessionID session);
+
+        /**
+         * Sets the context of a session to the context of the last response of a prompt
+         * @param session the session
+         * @param response the last response, the context is cleared when it has no context
+         */
+        void setContext(OllamaSessionID session, const ollama::response& response);
+
+        /**
+         * Sets the messages of a request to the conversation with tools of a session
+         * @param session the session
+         * @param request the request
+         */
+        void writeMessages(OllamaSessionID session, ollama::request& request);
+
+        /**
+         * Continues the conversation with tools of a session with the messages of a request
+         * @param session the session
+         * @param request the request that holds all messages of the conversation
+         */
+        void readMessages(OllamaSessionID session, const ollama::request& request);
+
+        /**
+         * Clears the context and the conversation with tools of a session
+         * @param session the session
+         */
+        void clear(OllamaSessionID session);
+
+        /**
+         * @param bytes the bytes of the contexts of all sessions above which idle sessions are compacted
+         */
+        void setMemoryLimit(std::size_t bytes);
+
+        /**
+         * @return the estimated bytes held by the contexts of all sessions, counting context shared by forked sessions once
+         */
+        std::size_t getMemory();
+
+        /**
+         * Compacts the contexts of the least recently used idle sessions until the contexts fit the memory limit,
+         * only when a context grew past the memory limit since the last compaction
+         */
+        void compact();
+
+        /**
+         * @return the digest of the model the contexts belong to, empty when not known
+         */
+        std::string getModelDigest();
+
+        /**
+         * Sets the digest of the model, discarding the contexts when they belong to another digest
+         * @param digest the digest of the model, empty when not known
+         * @return the number of contexts discarded
+         */
+        std::size_t setModelDigest(const std::string& digest);
+
+        /**
+         * @return the number of changes of the sessions, to skip snapshots without changes
+         */
+        std::uint64_t getChanges() const                            { return mChanges.load(); }
+
+        /**
+         * Restores the sessions of a snapshot, the contexts are restored compacted
+         * @param snapshot the snapshot
+         * @param keepContexts if the contexts are restored, false when they belong to another model
+         */
+        void restore(const OllamaSnapshot& snapshot, bool keepContexts);
+
+        /**
+         * Saves the sessions and the digest of the model to a snapshot
+         * @param snapshot the snapshot
+         */
+        void save(OllamaSnapshot& snapshot);
+
+    private:
+        // The conversation of a session, defined in ollamasessiontable.cpp
+        struct Entry;
+
+        /**
+         * @return the entry of a session, nullptr when it does not exist, call with the mutex locked
+         */
+        Entry* findEntry(OllamaSessionID session);
+
+        /**
+         * Restores the context of a compacted session, call with the mutex locked
+         */
+        void expand(Entry& entry);
+
+        /**
+         * @return the estimated bytes held by the contexts of all sessions, call with the mutex locked
+         */
+        std::size_t measureMemory();
+
+        /**
+         * Raises the bound of the memory by the memory a context grew, call with the mutex locked.
+         * Marks the sessions for compaction when the bound exceeds the memory limit
+         */
+        void growMemory(std::size_t bytes);
+
+        // Sessions by id and the digest of the model their contexts belong to, guarded by mMutex
+        std::mutex mMutex;
+        std::map<OllamaSessionID, std::unique_ptr<Entry>> mEntries;
+        std::string mModelDigest;
+
+        // Upper bound of the memory, measured when compacting and raised by every context that grows, guarded by mMutex.
+        // The sessions are compacted when the bound exceeds the memory limit
+        std::size_t mMemoryBound = 0;
+        std::size_t mMemoryLimit = std::numeric_limits<std::size_t>::max();
+        std::atomic_bool mCompactionPending = false;
+
+        // Number of changes of the sessions
+        std::atomic<std::uint64_t> mChanges = { 0 };
+    };
+}
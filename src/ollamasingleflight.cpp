@@ -0,0 +1,144 @@
+#include "ollamasingleflight.h"
+
+#include <chrono>
+
+namespace nap
+{
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaSingleFlight::Ticket
+    //////////////////////////////////////////////////////////////////////////
+
+    OllamaSingleFlight::Ticket::~Ticket()
+    {
+        release();
+    }
+
+
+    OllamaSingleFlight::Ticket::Ticket(Ticket&& other) noexcept :
+        mSingleFlight(other.mSingleFlight), mFlight(std::move(other.mFlight)), mKey(std::move(other.mKey)), mLeader(other.mLeader), mRead(other.mRead)
+    {
+        other.mFlight = nullptr;
+    }
+
+
+    OllamaSingleFlight::Ticket& OllamaSingleFlight::Ticket::operator=(Ticket&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            mSingleFlight = other.mSingleFlight;
+            mFlight = std::move(other.mFlight);
+            mKey = std::move(other.mKey);
+            mLeader = other.mLeader;
+            mRead = other.mRead;
+            other.mFlight = nullptr;
+        }
+        return *this;
+    }
+
+
+    void OllamaSingleFlight::Ticket::publish(const std::string& frame)
+    {
+        {
+            std::lock_guard lk(mFlight->mMutex);
+            mFlight->mFrames.emplace_back(frame);
+        }
+        mFlight->mChanged.notify_all();
+    }
+
+
+    void OllamaSingleFlight::Ticket::fail(const std::string& error)
+    {
+        std::lock_guard lk(mFlight->mMutex);
+        mFlight->mError = error;
+    }
+
+
+    bool OllamaSingleFlight::Ticket::read(std::vector<std::string>& frames, const std::atomic_bool& streaming)
+    {
+        frames.clear();
+        std::unique_lock lock(mFlight->mMutex);
+        while (streaming)
+        {
+            if (mRead < mFlight->mFrames.size())
+            {
+                frames.assign(mFlight->mFrames.begin() + mRead, mFlight->mFrames.end());
+                mRead = mFlight->mFrames.size();
+                return true;
+            }
+            if (mFlight->mDone)
+                return false;
+
+            // Stopping the response of the follower does not notify the flight, the flag is polled
+            mFlight->mChanged.wait_for(lock, std::chrono::milliseconds(50));
+        }
+        return false;
+    }
+
+
+    std::string OllamaSingleFlight::Ticket::getError()
+    {
+        std::lock_guard lk(mFlight->mMutex);
+        return mFlight->mError;
+    }
+
+
+    void OllamaSingleFlight::Ticket::release()
+    {
+        if (mFlight == nullptr)
+            return;
+
+        if (mLeader)
+            mSingleFlight->end(mKey, *mFlight);
+        mFlight = nullptr;
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaSingleFlight
+    //////////////////////////////////////////////////////////////////////////
+
+    std::size_t OllamaSingleFlight::getFlightCount() const
+    {
+        std::lock_guard lk(mMutex);
+        return mFlights.size();
+    }
+
+
+    OllamaSingleFlight::Ticket OllamaSingleFlight::join(const std::string& key)
+    {
+        Ticket ticket;
+        ticket.mSingleFlight = this;
+
+        std::lock_guard lk(mMutex);
+        auto it = mFlights.find(key);
+        if (it != mFlights.end())
+        {
+            mFollowers.fetch_add(1, std::memory_order_relaxed);
+            ticket.mFlight = it->second;
+            return ticket;
+        }
+
+        ticket.mFlight = std::make_shared<Flight>();
+        ticket.mKey = key;
+        ticket.mLeader = true;
+        mFlights.emplace(key, ticket.mFlight);
+        return ticket;
+    }
+
+
+    void OllamaSingleFlight::end(const std::string& key, Flight& flight)
+    {
+        // New identical requests lead a new flight
+        {
+            std::lock_guard lk(mMutex);
+            mFlights.erase(key);
+        }
+
+        {
+            std::lock_guard lk(flight.mMutex);
+            flight.mDone = true;
+        }
+        flight.mChanged.notify_all();
+    }
+}
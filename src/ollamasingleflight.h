@@ -0,0 +1,141 @@
+#pragma once
+
+#include <utility/dllexport.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nap
+{
+    /**
+     * Shares identical requests in flight between the OllamaChat devices of a service.
+     *
+     * Requests are identified by their body: model, options, prompt and context.
+     * The first request with a body leads the flight and is sent to the server, identical requests that arrive while it is in flight
+     * follow it instead of sending their own request: they receive the frames the leader received so far, followed by the frames that arrive after.
+     * When the leader fails, its followers fail with the same error. The flight ends with its leader,
+     * an identical request that arrives after it ended leads a new flight.
+     */
+    class NAPAPI OllamaSingleFlight final
+    {
+        friend class OllamaChat;
+        friend class OllamaService;
+
+        // Frames of a request in flight, shared by its leader and followers
+        struct Flight
+        {
+            std::mutex mMutex;
+            std::condition_variable mChanged;                       ///< Notified when a frame arrived or the flight ended
+            std::vector<std::string> mFrames;                       ///< All frames received by the leader so far
+            std::string mError;                                     ///< Error of the leader
+            bool mDone = false;
+        };
+
+    public:
+        /**
+         * The part of a request in a flight, acquired before the request is sent.
+         * The leader ends the flight when its ticket is destroyed.
+         */
+        class NAPAPI Ticket final
+        {
+            friend class OllamaSingleFlight;
+        public:
+            Ticket() = default;
+            ~Ticket();
+
+            // A ticket can only be moved
+            Ticket(const Ticket&) = delete;
+            Ticket& operator=(const Ticket&) = delete;
+            Ticket(Ticket&& other) noexcept;
+            Ticket& operator=(Ticket&& other) noexcept;
+
+            /**
+             * @return if the request joined a flight
+             */
+            bool isValid() const                                    { return mFlight != nullptr; }
+
+            /**
+             * @return if the request leads the flight and sends the request, otherwise it follows the leader
+             */
+            bool isLeader() const                                   { return mLeader; }
+
+            /**
+             * Passes a frame received by the leader to the followers
+             * @param frame the frame
+             */
+            void publish(const std::string& frame);
+
+            /**
+             * Sets the error the followers fail with, called by the leader when its request failed
+             * @param error the error
+             */
+            void fail(const std::string& error);
+
+            /**
+             * Waits for the frames of the leader that were not read yet, called by a follower.
+             * @param frames receives the frames that were not read yet
+             * @param streaming cleared when the response of the follower is stopped, polled while no frame arrives
+             * @return false when the flight ended and all frames were read, or the response of the follower was stopped
+             */
+            bool read(std::vector<std::string>& frames, const std::atomic_bool& streaming);
+
+            /**
+             * @return the error of the leader, empty when its request did not fail
+             */
+            std::string getError();
+
+            /**
+             * Ends the flight when leading it, followers read the frames that were not read yet
+             */
+            void release();
+
+        private:
+            OllamaSingleFlight* mSingleFlight = nullptr;
+            std::shared_ptr<Flight> mFlight;
+            std::string mKey;
+            bool mLeader = false;
+            std::size_t mRead = 0;                                  ///< Number of frames read by a follower
+        };
+
+        OllamaSingleFlight() = default;
+
+        // The flights are shared between threads and can't be copied or moved
+        OllamaSingleFlight(const OllamaSingleFlight&) = delete;
+        OllamaSingleFlight& operator=(const OllamaSingleFlight&) = delete;
+
+        /**
+         * @return the number of requests in flight that can be followed, thread safe
+         */
+        std::size_t getFlightCount() const;
+
+        /**
+         * @return the number of requests that followed a request in flight instead of sending their own request
+         */
+        std::uint64_t getFollowerCount() const                      { return mFollowers.load(std::memory_order_relaxed); }
+
+    private:
+        /**
+         * Joins the flight of a request, leading a new flight when no identical request is in flight
+         * @param key the body of the request
+         * @return the ticket of the request in the flight
+         */
+        Ticket join(const std::string& key);
+
+        /**
+         * Ends a flight, called when the ticket of its leader is released
+         * @param key the body of the request
+         * @param flight the flight
+         */
+        void end(const std::string& key, Flight& flight);
+
+        mutable std::mutex mMutex;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> mFlights;    ///< Flights by request body, guarded by mMutex
+        std::atomic<std::uint64_t> mFollowers = { 0 };
+    };
+}
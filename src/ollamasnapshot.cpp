@@ -0,0 +1,267 @@
+#include "ollamasnapshot.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace nap
+{
+    namespace
+    {
+        // Identifies a snapshot file
+        constexpr char magic[8] = { 'N', 'A', 'P', 'O', 'L', 'L', 'S', 'N' };
+
+
+        /**
+         * A file mapped read only into memory, unmapped when destroyed
+         */
+        class MappedFile final
+        {
+        public:
+            MappedFile() = default;
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            ~MappedFile()
+            {
+#ifdef _WIN32
+                if (mData != nullptr)
+                    UnmapViewOfFile(mData);
+                if (mMapping != nullptr)
+                    CloseHandle(mMapping);
+                if (mFile != INVALID_HANDLE_VALUE)
+                    CloseHandle(mFile);
+#else
+                if (mData != nullptr)
+                    munmap(const_cast<std::uint8_t*>(mData), mSize);
+                if (mFile != -1)
+                    close(mFile);
+#endif
+            }
+
+            /**
+             * Maps a file
+             * @return if the file was mapped, false when it can't be opened or is empty
+             */
+            bool open(const std::string& path)
+            {
+#ifdef _WIN32
+                mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                LARGE_INTEGER size;
+                if (mFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+                    return false;
+                mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (mMapping == nullptr)
+                    return false;
+                mData = static_cast<const std::uint8_t*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+                mSize = static_cast<std::size_t>(size.QuadPart);
+                return mData != nullptr;
+#else
+                mFile = ::open(path.c_str(), O_RDONLY);
+                struct stat status;
+                if (mFile == -1 || fstat(mFile, &status) != 0 || status.st_size == 0)
+                    return false;
+                auto* data = mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_PRIVATE, mFile, 0);
+                if (data == MAP_FAILED)
+                    return false;
+                mData = static_cast<const std::uint8_t*>(data);
+                mSize = static_cast<std::size_t>(status.st_size);
+                return true;
+#endif
+            }
+
+            const std::uint8_t* getData() const         { return mData; }
+            std::size_t getSize() const                 { return mSize; }
+
+        private:
+#ifdef _WIN32
+            HANDLE mFile = INVALID_HANDLE_VALUE;
+            HANDLE mMapping = nullptr;
+#else
+            int mFile = -1;
+#endif
+            const std::uint8_t* mData = nullptr;
+            std::size_t mSize = 0;
+        };
+
+
+        /**
+         * Appends little endian numbers and length prefixed bytes to a buffer
+         */
+        class Writer final
+        {
+        public:
+            void number(std::uint64_t value, int bytes)
+            {
+                for (int i = 0; i < bytes; i++)
+                    mBuffer.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+            }
+
+            void bytes(const void* data, std::size_t size)
+            {
+                number(size, 8);
+                auto* begin = static_cast<const std::uint8_t*>(data);
+                mBuffer.insert(mBuffer.end(), begin, begin + size);
+            }
+
+            std::vector<std::uint8_t> mBuffer;
+        };
+
+
+        /**
+         * Reads the numbers and bytes appended by the writer, failing when they run past the end of the data
+         */
+        class Reader final
+        {
+        public:
+            Reader(const std::uint8_t* data, std::size_t size) : mData(data), mSize(size) { }
+
+            bool skip(std::size_t size)
+            {
+                if (mSize - mPosition < size)
+                    return false;
+                mPosition += size;
+                return true;
+            }
+
+            bool number(std::uint64_t& value, int bytes)
+            {
+                if (mSize - mPosition < static_cast<std::size_t>(bytes))
+                    return false;
+                value = 0;
+                for (int i = 0; i < bytes; i++)
+                    value |= static_cast<std::uint64_t>(mData[mPosition++]) << (8 * i);
+                return true;
+            }
+
+            bool bytes(const std::uint8_t*& data, std::size_t& size)
+            {
+                std::uint64_t length = 0;
+                if (!number(length, 8) || mSize - mPosition < length)
+                    return false;
+                data = mData + mPosition;
+                size = static_cast<std::size_t>(length);
+                mPosition += size;
+                return true;
+            }
+
+            bool string(std::string& value)
+            {
+                const std::uint8_t* data = nullptr;
+                std::size_t size = 0;
+                if (!bytes(data, size))
+                    return false;
+                value.assign(reinterpret_cast<const char*>(data), size);
+                return true;
+            }
+
+            bool buffer(std::vector<std::uint8_t>& value)
+            {
+                const std::uint8_t* data = nullptr;
+                std::size_t size = 0;
+                if (!bytes(data, size))
+                    return false;
+                value.assign(data, data + size);
+                return true;
+            }
+
+        private:
+            const std::uint8_t* mData = nullptr;
+            std::size_t mSize = 0;
+            std::size_t mPosition = 0;
+        };
+    }
+
+
+    bool OllamaSnapshot::write(const std::string& path, utility::ErrorState& errorState) const
+    {
+        Writer writer;
+        writer.mBuffer.insert(writer.mBuffer.end(), std::begin(magic), std::end(magic));
+        writer.number(version, 4);
+        writer.bytes(mModel.data(), mModel.size());
+        writer.bytes(mDigest.data(), mDigest.size());
+        writer.number(mSessions.size(), 8);
+        for (const auto& session : mSessions)
+        {
+            writer.number(session.mID, 8);
+            writer.bytes(session.mContext.data(), session.mContext.size());
+            writer.bytes(session.mMessages.data(), session.mMessages.size());
+        }
+
+        // Write a temporary file and flush it to disk before it replaces the snapshot
+        auto temporary = path + ".tmp";
+        auto* file = std::fopen(temporary.c_str(), "wb");
+        if (!errorState.check(file != nullptr, "Unable to create snapshot %s", temporary.c_str()))
+            return false;
+
+        bool written = std::fwrite(writer.mBuffer.data(), 1, writer.mBuffer.size(), file) == writer.mBuffer.size() && std::fflush(file) == 0;
+#ifdef _WIN32
+        written = written && _commit(_fileno(file)) == 0;
+#else
+        written = written && fsync(fileno(file)) == 0;
+#endif
+        written = std::fclose(file) == 0 && written;
+        if (!errorState.check(written, "Unable to write snapshot %s", temporary.c_str()))
+        {
+            std::remove(temporary.c_str());
+            return false;
+        }
+
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        if (!errorState.check(!error, "Unable to replace snapshot %s: %s", path.c_str(), error.message().c_str()))
+        {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+
+    bool OllamaSnapshot::read(const std::string& path, utility::ErrorState& errorState)
+    {
+        MappedFile file;
+        if (!errorState.check(file.open(path), "Unable to map snapshot %s", path.c_str()))
+            return false;
+
+        Reader reader(file.getData(), file.getSize());
+        if (!errorState.check(reader.skip(sizeof(magic)) && std::memcmp(file.getData(), magic, sizeof(magic)) == 0, "%s is not a snapshot", path.c_str()))
+            return false;
+
+        // The version is read before it is formatted into the error, the order in which arguments are evaluated is unspecified
+        std::uint64_t file_version = 0;
+        if (!errorState.check(reader.number(file_version, 4), "Snapshot %s is truncated", path.c_str()))
+            return false;
+        if (!errorState.check(file_version == version, "Snapshot %s is of version %d, expected version %d",
+                              path.c_str(), static_cast<int>(file_version), static_cast<int>(version)))
+            return false;
+
+        OllamaSnapshot snapshot;
+        std::uint64_t count = 0;
+        bool valid = reader.string(snapshot.mModel) && reader.string(snapshot.mDigest) && reader.number(count, 8);
+        for (std::uint64_t i = 0; valid && i < count; i++)
+        {
+            Session session;
+            valid = reader.number(session.mID, 8) && reader.buffer(session.mContext) && reader.buffer(session.mMessages);
+            snapshot.mSessions.emplace_back(std::move(session));
+        }
+        if (!errorState.check(valid, "Snapshot %s is truncated", path.c_str()))
+            return false;
+
+        *this = std::move(snapshot);
+        return true;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    /**
+     * The conversations of a chat, saved to a compact binary file so they survive a restart of the app.
+     *
+     * The file holds the model and the digest of the model the contexts were generated with, followed by every session:
+     * its id, its context tokens encoded as LEB128 varints and the messages of its conversation with tools encoded as MessagePack.
+     * Numbers are stored little endian. The file is written to a temporary file that replaces the snapshot when it is complete,
+     * so a crash while writing leaves the previous snapshot intact. The file is memory mapped to read it.
+     */
+    struct NAPAPI OllamaSnapshot
+    {
+        // Version of the file format, a file of another version is not read
+        static constexpr std::uint32_t version = 1;
+
+        /**
+         * The saved state of a session
+         */
+        struct Session
+        {
+            std::uint64_t mID = 0;                      ///< Id of the session
+            std::vector<std::uint8_t> mContext;         ///< Context tokens encoded as LEB128 varints
+            std::vector<std::uint8_t> mMessages;        ///< Messages of the conversation with tools encoded as MessagePack, empty when there are none
+        };
+
+        std::string mModel;                             ///< Model the contexts were generated with
+        std::string mDigest;                            ///< Digest of the model the contexts were generated with, empty when not known
+        std::vector<Session> mSessions;
+
+        /**
+         * Writes the snapshot to a file, replacing the file once the snapshot is written and flushed to disk
+         * @param path path of the file
+         * @param errorState contains the error when the file could not be written
+         * @return if the snapshot was written
+         */
+        bool write(const std::string& path, utility::ErrorState& errorState) const;
+
+        /**
+         * Reads the snapshot from a file
+         * @param path path of the file
+         * @param errorState contains the error when the file could not be mapped, is not a snapshot or is of another version
+         * @return if the snapshot was read
+         */
+        bool read(const std::string& path, utility::ErrorState& errorState);
+    };
+}
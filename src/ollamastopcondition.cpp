@@ -0,0 +1,251 @@
+#include "ollamastopcondition.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace nap
+{
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaStopCondition::Automaton
+    //////////////////////////////////////////////////////////////////////////
+
+    int OllamaStopCondition::Automaton::edge(int node, unsigned char character) const
+    {
+        const auto& next = mNodes[node].mNext;
+        auto it = std::lower_bound(next.begin(), next.end(), character, [](const std::pair<unsigned char, int>& edge, unsigned char value) { return edge.first < value; });
+        return it != next.end() && it->first == character ? it->second : -1;
+    }
+
+
+    int OllamaStopCondition::Automaton::step(int node, unsigned char character) const
+    {
+        while (true)
+        {
+            auto next = edge(node, character);
+            if (next != -1)
+                return next;
+            if (node == 0)
+                return 0;
+            node = mNodes[node].mFail;
+        }
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////
+    // OllamaStopCondition
+    //////////////////////////////////////////////////////////////////////////
+
+    void OllamaStopCondition::addSequence(const std::string& sequence)
+    {
+        if (sequence.empty())
+            return;
+
+        // The automaton is shared by copies, a new one is built with the sequence added
+        auto sequences = mSequences != nullptr ? mSequences->mSequences : std::vector<std::string>();
+        sequences.emplace_back(sequence);
+        mSequences = build(sequences);
+        reset();
+    }
+
+
+    bool OllamaStopCondition::addPattern(const std::string& pattern, utility::ErrorState& errorState)
+    {
+        Pattern compiled;
+        compiled.mSource = pattern;
+        try
+        {
+            compiled.mExpression = std::regex(pattern, std::regex::ECMAScript);
+        }
+        catch (const std::regex_error& error)
+        {
+            errorState.fail("Invalid stop pattern '%s': %s", pattern.c_str(), error.what());
+            return false;
+        }
+
+        auto patterns = mPatterns != nullptr ? std::make_shared<std::vector<Pattern>>(*mPatterns) : std::make_shared<std::vector<Pattern>>();
+        patterns->emplace_back(std::move(compiled));
+        mPatterns = std::move(patterns);
+        reset();
+        return true;
+    }
+
+
+    bool OllamaStopCondition::feed(const std::string& token, std::string& output)
+    {
+        output.clear();
+        if (mReason != EReason::None)
+            return true;
+
+        for (auto character : token)
+        {
+            mText.push_back(character);
+
+            // A sequence ends at this character, the response ends before it
+            if (mSequences != nullptr)
+            {
+                mNode = mSequences->step(mNode, static_cast<unsigned char>(character));
+                for (auto node = mNode; node != 0; node = mSequences->mNodes[node].mFail)
+                {
+                    auto length = mSequences->mNodes[node].mMatch;
+                    if (length != 0)
+                    {
+                        output = stop(mText.size() - length, EReason::Sequence);
+                        return true;
+                    }
+                }
+            }
+
+            // Scan the JSON value, strings may contain brackets
+            if (mStopOnCompleteJSON)
+            {
+                if (mInString)
+                {
+                    if (mEscaped)
+                        mEscaped = false;
+                    else if (character == '\\')
+                        mEscaped = true;
+                    else if (character == '"')
+                        mInString = false;
+                }
+                else if (character == '"' && mJSONDepth > 0)
+                {
+                    mInString = true;
+                }
+                else if (character == '{' || character == '[')
+                {
+                    mJSONDepth++;
+                }
+                else if ((character == '}' || character == ']') && mJSONDepth > 0 && --mJSONDepth == 0)
+                {
+                    output = stop(mText.size(), EReason::JSON);
+                    return true;
+                }
+            }
+        }
+
+        // Search the patterns at the end of the response, the response ends after the match
+        if (mPatterns != nullptr)
+        {
+            auto window = mText.size() > patternWindow ? mText.size() - patternWindow : 0;
+            auto flags = window > 0 ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+            for (const auto& pattern : *mPatterns)
+            {
+                std::smatch match;
+                if (std::regex_search(mText.cbegin() + window, mText.cend(), match, pattern.mExpression, flags))
+                {
+                    output = stop(window + match.position(0) + match.length(0), EReason::Pattern);
+                    return true;
+                }
+            }
+        }
+
+        // Hold back the text that may be the start of a sequence
+        auto held = mSequences != nullptr ? static_cast<std::size_t>(mSequences->mNodes[mNode].mDepth) : 0;
+        auto deliverable = std::max(mText.size() - held, mDelivered);
+        output = mText.substr(mDelivered, deliverable - mDelivered);
+        mDelivered = deliverable;
+        return false;
+    }
+
+
+    std::string OllamaStopCondition::flush()
+    {
+        if (mReason != EReason::None)
+            return {};
+
+        auto output = mText.substr(mDelivered);
+        mDelivered = mText.size();
+        mNode = 0;
+        return output;
+    }
+
+
+    void OllamaStopCondition::reset()
+    {
+        mText.clear();
+        mDelivered = 0;
+        mNode = 0;
+        mJSONDepth = 0;
+        mInString = false;
+        mEscaped = false;
+        mReason = EReason::None;
+    }
+
+
+    std::string OllamaStopCondition::getKey() const
+    {
+        // Length prefixed, so the key can't be ambiguous
+        std::string key;
+        if (mSequences != nullptr)
+        {
+            for (const auto& sequence : mSequences->mSequences)
+                key += "s" + std::to_string(sequence.size()) + ":" + sequence;
+        }
+        if (mPatterns != nullptr)
+        {
+            for (const auto& pattern : *mPatterns)
+                key += "p" + std::to_string(pattern.mSource.size()) + ":" + pattern.mSource;
+        }
+        if (mStopOnCompleteJSON)
+            key += "j";
+        return key;
+    }
+
+
+    std::shared_ptr<const OllamaStopCondition::Automaton> OllamaStopCondition::build(const std::vector<std::string>& sequences)
+    {
+        auto automaton = std::make_shared<Automaton>();
+        automaton->mSequences = sequences;
+        automaton->mNodes.emplace_back();
+
+        // Build the trie of the sequences
+        for (const auto& sequence : sequences)
+        {
+            int node = 0;
+            for (auto character : sequence)
+            {
+                auto value = static_cast<unsigned char>(character);
+                auto next = automaton->edge(node, value);
+                if (next == -1)
+                {
+                    next = static_cast<int>(automaton->mNodes.size());
+                    Automaton::Node child;
+                    child.mDepth = automaton->mNodes[node].mDepth + 1;
+                    automaton->mNodes.emplace_back(std::move(child));
+
+                    auto& edges = automaton->mNodes[node].mNext;
+                    auto it = std::lower_bound(edges.begin(), edges.end(), value, [](const std::pair<unsigned char, int>& edge, unsigned char v) { return edge.first < v; });
+                    edges.insert(it, { value, next });
+                }
+                node = next;
+            }
+            automaton->mNodes[node].mMatch = static_cast<int>(sequence.size());
+        }
+
+        // Link every node to the node of its longest proper suffix, breadth first so the suffix nodes are linked first
+        std::queue<int> queue;
+        for (const auto& edge : automaton->mNodes[0].mNext)
+            queue.push(edge.second);
+        while (!queue.empty())
+        {
+            auto node = queue.front();
+            queue.pop();
+            for (const auto& edge : automaton->mNodes[node].mNext)
+            {
+                automaton->mNodes[edge.second].mFail = automaton->step(automaton->mNodes[node].mFail, edge.first);
+                queue.push(edge.second);
+            }
+        }
+        return automaton;
+    }
+
+
+    std::string OllamaStopCondition::stop(std::size_t end, EReason reason)
+    {
+        mReason = reason;
+        end = std::max(end, mDelivered);
+        auto output = mText.substr(mDelivered, end - mDelivered);
+        mDelivered = end;
+        return output;
+    }
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <cstdint>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    /**
+     * Client side stop conditions of a response, evaluated incrementally over the tokens as they arrive.
+     * The response is complete as soon as a condition fires, the request is cancelled so the server stops generating.
+     *
+     * Three kinds of conditions are supported:
+     * - Sequences: literal text, the response ends before the sequence. All sequences are matched at once in a single pass over the text,
+     *   text that may be the start of a sequence is held back until it is known not to be.
+     * - Patterns: regular expressions, the response ends after the match. A pattern is searched in the last 'patternWindow' characters of the response.
+     * - Complete JSON: the response ends after the first JSON object or array closes, text before the value is kept.
+     *
+     * A condition holds the state of one response: copy a configured condition for every request, copies share the compiled conditions.
+     */
+    class NAPAPI OllamaStopCondition final
+    {
+    public:
+        /**
+         * The condition that ended a response
+         */
+        enum class EReason : int
+        {
+            None,               ///< No condition fired
+            Sequence,           ///< A stop sequence was generated
+            Pattern,            ///< A stop pattern matched
+            JSON                ///< The JSON value closed
+        };
+
+        // Number of characters at the end of the response a pattern is searched in
+        static constexpr std::size_t patternWindow = 256;
+
+        OllamaStopCondition() = default;
+
+        /**
+         * Adds a literal stop sequence, empty sequences are ignored
+         * @param sequence the text the response ends before
+         */
+        void addSequence(const std::string& sequence);
+
+        /**
+         * Adds a stop pattern in ECMAScript regular expression syntax
+         * @param pattern the expression the response ends after
+         * @param errorState contains the error when the pattern is invalid
+         * @return if the pattern was added
+         */
+        bool addPattern(const std::string& pattern, utility::ErrorState& errorState);
+
+        /**
+         * Sets if the response ends when the first JSON object or array in the response closes
+         * @param stop if the response ends after the JSON value
+         */
+        void setStopOnCompleteJSON(bool stop)                       { mStopOnCompleteJSON = stop; }
+
+        /**
+         * @return if any condition is set
+         */
+        bool isEnabled() const                                      { return mSequences != nullptr || mPatterns != nullptr || mStopOnCompleteJSON; }
+
+        /**
+         * Evaluates the conditions over the next token of the response
+         * @param token the next token
+         * @param output receives the text of the response that can be delivered, excluding text held back and text after the stop
+         * @return true when a condition fired and the response is complete
+         */
+        bool feed(const std::string& token, std::string& output);
+
+        /**
+         * Returns the text held back at the end of a response that completed without a condition firing
+         * @return the held back text
+         */
+        std::string flush();
+
+        /**
+         * Clears the state of the response, keeping the conditions
+         */
+        void reset();
+
+        /**
+         * @return the condition that ended the response
+         */
+        EReason getReason() const                                   { return mReason; }
+
+        /**
+         * @return a description of the conditions, equal for conditions that end every response at the same position
+         */
+        std::string getKey() const;
+
+    private:
+        // Aho-Corasick automaton of the stop sequences
+        struct Automaton
+        {
+            struct Node
+            {
+                std::vector<std::pair<unsigned char, int>> mNext;   ///< Trie edges, sorted by character
+                int mFail = 0;                                      ///< Node of the longest proper suffix that is in the trie
+                int mDepth = 0;                                     ///< Length of the text that leads to the node
+                int mMatch = 0;                                     ///< Length of the sequence that ends at the node, 0 when none
+            };
+
+            /**
+             * @return the node reached from a node over a character, following the failure links
+             */
+            int step(int node, unsigned char character) const;
+
+            /**
+             * @return the trie edge of a node over a character, -1 when there is none
+             */
+            int edge(int node, unsigned char character) const;
+
+            std::vector<std::string> mSequences;
+            std::vector<Node> mNodes;
+        };
+
+        // Compiled stop patterns
+        struct Pattern
+        {
+            std::string mSource;
+            std::regex mExpression;
+        };
+
+        /**
+         * Builds the automaton of a set of sequences
+         */
+        static std::shared_ptr<const Automaton> build(const std::vector<std::string>& sequences);
+
+        /**
+         * Ends the response at a position, returning the text up to it that was not delivered
+         */
+        std::string stop(std::size_t end, EReason reason);
+
+        // Conditions, shared by copies
+        std::shared_ptr<const Automaton> mSequences;
+        std::shared_ptr<const std::vector<Pattern>> mPatterns;
+        bool mStopOnCompleteJSON = false;
+
+        // State of the response
+        std::string mText;                                          ///< Text of the response so far
+        std::size_t mDelivered = 0;                                 ///< Length of the text delivered
+        int mNode = 0;                                              ///< Node of the automaton, its depth is the text held back
+        int mJSONDepth = 0;                                         ///< Nesting depth of the JSON value, 0 before it started
+        bool mInString = false;                                     ///< If the JSON scanner is in a string
+        bool mEscaped = false;                                      ///< If the next character in a JSON string is escaped
+        EReason mReason = EReason::None;
+    };
+}
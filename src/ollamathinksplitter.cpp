@@ -0,0 +1,95 @@
+#include "ollamathinksplitter.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace nap
+{
+    static const std::string openTag = "<think>";
+    static const std::string closeTag = "</think>";
+
+
+    void OllamaThinkSplitter::feed(const std::string& token, std::string& reasoning, std::string& answer)
+    {
+        reasoning.clear();
+        answer.clear();
+
+        auto text = mPending + token;
+        mPending.clear();
+
+        std::string::size_type position = 0;
+        while (position < text.size())
+        {
+            // Outside the reasoning block only the answer remains once it started
+            if (!mReasoning && mAnswerStarted)
+            {
+                emit(text, position, text.size(), reasoning, answer);
+                return;
+            }
+
+            const auto& tag = mReasoning ? closeTag : openTag;
+            auto found = text.find(tag, position);
+            if (found != std::string::npos)
+            {
+                emit(text, position, found, reasoning, answer);
+                position = found;
+
+                // The opening tag is part of the answer when the answer started before it
+                if (!mReasoning && mAnswerStarted)
+                    continue;
+
+                mReasoning = !mReasoning;
+                position += tag.size();
+                continue;
+            }
+
+            // Hold back the longest end of the text that is the start of the tag
+            auto held = std::min(tag.size() - 1, text.size() - position);
+            while (held > 0 && text.compare(text.size() - held, held, tag, 0, held) != 0)
+                held--;
+
+            emit(text, position, text.size() - held, reasoning, answer);
+            mPending = text.substr(text.size() - held);
+            return;
+        }
+    }
+
+
+    void OllamaThinkSplitter::flush(std::string& reasoning, std::string& answer)
+    {
+        reasoning.clear();
+        answer.clear();
+        auto pending = std::move(mPending);
+        mPending.clear();
+        emit(pending, 0, pending.size(), reasoning, answer);
+    }
+
+
+    void OllamaThinkSplitter::reset()
+    {
+        mPending.clear();
+        mReasoning = false;
+        mAnswerStarted = false;
+    }
+
+
+    void OllamaThinkSplitter::emit(const std::string& text, std::string::size_type begin, std::string::size_type end, std::string& reasoning, std::string& answer)
+    {
+        if (mReasoning)
+        {
+            reasoning.append(text, begin, end - begin);
+            return;
+        }
+
+        // Whitespace before the answer is not part of it, the reasoning block may still follow
+        if (!mAnswerStarted)
+        {
+            while (begin < end && std::isspace(static_cast<unsigned char>(text[begin])))
+                begin++;
+            if (begin == end)
+                return;
+            mAnswerStarted = true;
+        }
+        answer.append(text, begin, end - begin);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <utility/dllexport.h>
+
+#include <string>
+
+namespace nap
+{
+    /**
+     * Splits the response of a reasoning model into its reasoning and its answer, incrementally over the tokens as they arrive.
+     *
+     * Reasoning models such as deepseek-r1 start their response with a <think>...</think> block.
+     * Text inside the block is reasoning, text after it is the answer. Tags split over several tokens are recognized:
+     * text that may be the start of a tag is held back until it is known not to be.
+     * The opening tag is only recognized before the answer started, so an answer that mentions the tag is not split.
+     * Whitespace before the answer, such as the newlines after the closing tag, is dropped.
+     */
+    class NAPAPI OllamaThinkSplitter final
+    {
+    public:
+        OllamaThinkSplitter() = default;
+
+        /**
+         * Splits the next token of the response
+         * @param token the next token
+         * @param reasoning receives the reasoning in the token
+         * @param answer receives the answer in the token
+         */
+        void feed(const std::string& token, std::string& reasoning, std::string& answer);
+
+        /**
+         * Returns the text held back at the end of the response
+         * @param reasoning receives the held back reasoning
+         * @param answer receives the held back answer
+         */
+        void flush(std::string& reasoning, std::string& answer);
+
+        /**
+         * @return if the response is in the reasoning block
+         */
+        bool isReasoning() const                                    { return mReasoning; }
+
+        /**
+         * Clears the state of the response
+         */
+        void reset();
+
+    private:
+        /**
+         * Appends text to the channel of the current block
+         */
+        void emit(const std::string& text, std::string::size_type begin, std::string::size_type end, std::string& reasoning, std::string& answer);
+
+        std::string mPending;                                       ///< Text held back that may be the start of a tag
+        bool mReasoning = false;                                    ///< If the response is in the reasoning block
+        bool mAnswerStarted = false;                                ///< If the answer started, after which the opening tag is no longer recognized
+    };
+}
@@ -0,0 +1,160 @@
+#include "ollamatools.h"
+#include "ollamaservice.h"
+
+#include "ollama.hpp"
+
+#include <condition_variable>
+
+namespace nap
+{
+    bool OllamaToolRegistry::addTool(const OllamaTool& tool, utility::ErrorState& errorState)
+    {
+        if (!errorState.check(!tool.mName.empty(), "Tool has no name"))
+            return false;
+        if (!errorState.check(tool.mFunction != nullptr, "Tool '%s' has no function", tool.mName.c_str()))
+            return false;
+        if (!errorState.check(tool.mTimeout.count() > 0, "Timeout of tool '%s' must be positive", tool.mName.c_str()))
+            return false;
+
+        auto parameters = nlohmann::json::parse(tool.mParameters, nullptr, false);
+        if (!errorState.check(parameters.is_object(), "Parameters of tool '%s' are not a JSON object", tool.mName.c_str()))
+            return false;
+
+        std::lock_guard lk(mMutex);
+        auto& metrics = mMetrics[tool.mName];
+        if (metrics == nullptr)
+            metrics = std::make_shared<OllamaToolMetrics>();
+
+        auto entry = std::make_shared<Entry>();
+        entry->mTool = tool;
+        entry->mMetrics = metrics;
+        mTools[tool.mName] = std::move(entry);
+        return true;
+    }
+
+
+    void OllamaToolRegistry::removeTool(const std::string& name)
+    {
+        std::lock_guard lk(mMutex);
+        mTools.erase(name);
+    }
+
+
+    std::size_t OllamaToolRegistry::getToolCount() const
+    {
+        std::lock_guard lk(mMutex);
+        return mTools.size();
+    }
+
+
+    std::string OllamaToolRegistry::getDefinitions() const
+    {
+        auto definitions = nlohmann::json::array();
+        std::lock_guard lk(mMutex);
+        for (const auto& tool : mTools)
+        {
+            nlohmann::json definition;
+            definition["type"] = "function";
+            definition["function"]["name"] = tool.second->mTool.mName;
+            definition["function"]["description"] = tool.second->mTool.mDescription;
+            definition["function"]["parameters"] = nlohmann::json::parse(tool.second->mTool.mParameters);
+            definitions.emplace_back(std::move(definition));
+        }
+        return definitions.dump();
+    }
+
+
+    std::shared_ptr<const OllamaToolMetrics> OllamaToolRegistry::findMetrics(const std::string& name) const
+    {
+        std::lock_guard lk(mMutex);
+        auto it = mMetrics.find(name);
+        return it != mMetrics.end() ? it->second : nullptr;
+    }
+
+
+    std::vector<OllamaToolResult> OllamaToolRegistry::dispatch(const std::vector<OllamaToolCall>& calls, OllamaService& service)
+    {
+        using Clock = std::chrono::steady_clock;
+
+        // State of a call, shared with the tool pool, which may still run the call after it timed out
+        struct Call
+        {
+            std::mutex mMutex;
+            std::condition_variable mReturned;
+            bool mDone = false;
+            OllamaToolResult mResult;
+        };
+
+        // Start all calls before waiting for any
+        auto start = Clock::now();
+        std::vector<std::shared_ptr<Call>> states;
+        std::vector<std::shared_ptr<const Entry>> entries;
+        for (const auto& call : calls)
+        {
+            auto state = std::make_shared<Call>();
+            state->mResult.mName = call.mName;
+            states.emplace_back(state);
+
+            std::shared_ptr<const Entry> entry;
+            {
+                std::lock_guard lk(mMutex);
+                auto it = mTools.find(call.mName);
+                if (it != mTools.end())
+                    entry = it->second;
+            }
+            entries.emplace_back(entry);
+
+            if (entry == nullptr)
+            {
+                state->mResult.mContent = "Error: unknown tool '" + call.mName + "'";
+                state->mDone = true;
+                continue;
+            }
+
+            entry->mMetrics->mCalls.fetch_add(1, std::memory_order_relaxed);
+            service.enqueueToolTask([entry, state, arguments = call.mArguments, start]()
+            {
+                OllamaToolResult result;
+                result.mName = entry->mTool.mName;
+                try
+                {
+                    result.mContent = entry->mTool.mFunction(arguments);
+                    result.mSucceeded = true;
+                }
+                catch (const std::exception& exception)
+                {
+                    result.mContent = std::string("Error: ") + exception.what();
+                    entry->mMetrics->mErrors.fetch_add(1, std::memory_order_relaxed);
+                }
+                entry->mMetrics->mLatency.record(Clock::now() - start);
+
+                {
+                    std::lock_guard lk(state->mMutex);
+                    state->mResult = std::move(result);
+                    state->mDone = true;
+                }
+                state->mReturned.notify_all();
+            });
+        }
+
+        // Wait for every call until the timeout of its tool, measured from the start of the dispatch
+        std::vector<OllamaToolResult> results;
+        results.reserve(calls.size());
+        for (std::size_t i = 0; i < calls.size(); i++)
+        {
+            auto& state = *states[i];
+            std::unique_lock lock(state.mMutex);
+            if (entries[i] != nullptr && !state.mReturned.wait_until(lock, start + entries[i]->mTool.mTimeout, [&state] { return state.mDone; }))
+            {
+                entries[i]->mMetrics->mTimeouts.fetch_add(1, std::memory_order_relaxed);
+                OllamaToolResult timeout;
+                timeout.mName = calls[i].mName;
+                timeout.mContent = "Error: tool '" + calls[i].mName + "' timed out after " + std::to_string(entries[i]->mTool.mTimeout.count()) + " ms";
+                results.emplace_back(std::move(timeout));
+                continue;
+            }
+            results.emplace_back(state.mResult);
+        }
+        return results;
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "ollamametrics.h"
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nap
+{
+    // Forward declarations
+    class OllamaService;
+
+    /**
+     * A C++ function the model can call while it answers a prompt of OllamaChat::chatWithTools()
+     */
+    struct NAPAPI OllamaTool
+    {
+        std::string mName;                                          ///< Name the model calls the tool by
+        std::string mDescription;                                   ///< What the tool does, tells the model when to call it
+        std::string mParameters = "{\"type\":\"object\",\"properties\":{}}";   ///< JSON schema of the arguments of the tool
+        std::function<std::string(const std::string&)> mFunction;   ///< Called with the JSON text of the arguments, returns the result for the model. Throw to report an error to the model
+        std::chrono::milliseconds mTimeout = std::chrono::seconds(10);          ///< Time after which the model is told the call timed out
+    };
+
+
+    /**
+     * A call of a tool requested by the model
+     */
+    struct NAPAPI OllamaToolCall
+    {
+        std::string mName;                  ///< Name of the tool
+        std::string mArguments;             ///< JSON text of the arguments
+    };
+
+
+    /**
+     * The result of a tool call, sent to the model as a tool message
+     */
+    struct NAPAPI OllamaToolResult
+    {
+        std::string mName;                  ///< Name of the tool
+        std::string mContent;               ///< The result, or a description of the error for the model
+        bool mSucceeded = false;            ///< If the tool returned a result, false when it is unknown, threw or timed out
+    };
+
+
+    /**
+     * Latency metrics of the calls of a tool.
+     * Metrics are recorded lock-free from the tool pool and can be queried at any time.
+     */
+    struct NAPAPI OllamaToolMetrics
+    {
+        LatencyHistogram mLatency;                              ///< Time between dispatching a call and the tool returning, also of calls that timed out
+        std::atomic<std::uint64_t> mCalls = { 0 };              ///< Number of calls
+        std::atomic<std::uint64_t> mErrors = { 0 };             ///< Number of calls that threw
+        std::atomic<std::uint64_t> mTimeouts = { 0 };           ///< Number of calls that did not return within the timeout of the tool
+    };
+
+
+    /**
+     * The tools the model can call, together with their metrics.
+     * The tool calls of one turn of the model are executed concurrently on the tool pool of the OllamaService,
+     * which is separate from its worker pool so calls don't wait behind model pulls & loads.
+     * A call that does not return within the timeout of its tool is reported to the model as timed out, its result is discarded when it returns.
+     * A timed out call occupies its thread of the tool pool until it returns.
+     * All calls are thread safe, tools can be added and removed while prompts are in progress.
+     */
+    class NAPAPI OllamaToolRegistry final
+    {
+    public:
+        OllamaToolRegistry() = default;
+
+        // The registry is shared by the requests of a chat and can't be copied
+        OllamaToolRegistry(const OllamaToolRegistry&) = delete;
+        OllamaToolRegistry& operator=(const OllamaToolRegistry&) = delete;
+
+        /**
+         * Adds a tool, replacing the tool with the same name
+         * @param tool the tool to add
+         * @param errorState contains the error when the tool has no name or function, or its parameters are not a valid JSON object
+         * @return if the tool was added
+         */
+        bool addTool(const OllamaTool& tool, utility::ErrorState& errorState);
+
+        /**
+         * Removes a tool, calls in progress complete
+         * @param name the name of the tool
+         */
+        void removeTool(const std::string& name);
+
+        /**
+         * @return the number of tools
+         */
+        std::size_t getToolCount() const;
+
+        /**
+         * @return the tools as the JSON text of the 'tools' field of a chat request
+         */
+        std::string getDefinitions() const;
+
+        /**
+         * Returns the metrics of a tool, kept when the tool is replaced
+         * @param name the name of the tool
+         * @return the metrics of the tool, nullptr when the tool was never added
+         */
+        std::shared_ptr<const OllamaToolMetrics> findMetrics(const std::string& name) const;
+
+        /**
+         * Executes tool calls concurrently on the tool pool of the service and waits for their results or their timeouts.
+         * The timeout of a call includes the time it waits for a thread of the tool pool.
+         * @param calls the calls to execute
+         * @param service the service that executes the calls
+         * @return the results of the calls, in the order of the calls
+         */
+        std::vector<OllamaToolResult> dispatch(const std::vector<OllamaToolCall>& calls, OllamaService& service);
+
+    private:
+        struct Entry
+        {
+            OllamaTool mTool;
+            std::shared_ptr<OllamaToolMetrics> mMetrics;
+        };
+
+        mutable std::mutex mMutex;
+        std::map<std::string, std::shared_ptr<const Entry>> mTools;
+        std::map<std::string, std::shared_ptr<OllamaToolMetrics>> mMetrics;    ///< Metrics of all tools ever added, by name
+    };
+}
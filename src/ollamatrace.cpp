@@ -0,0 +1,302 @@
+#include "ollamatrace.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <intrin.h>
+    #define NAPOLLAMA_HAS_TSC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #include <x86intrin.h>
+    #define NAPOLLAMA_HAS_TSC
+#endif
+
+namespace nap
+{
+    namespace
+    {
+        // Number of events kept per thread, must be a power of two
+        constexpr std::uint64_t sRingCapacity = 1 << 14;
+
+        enum class EPhase : char
+        {
+            Begin       = 'B',
+            End         = 'E',
+            Instant     = 'i',
+            FlowStart   = 's',
+            FlowEnd     = 'f'
+        };
+
+        /**
+         * Reads the CPU time stamp counter, falls back to the steady clock in nanoseconds
+         */
+        inline std::uint64_t readTimestamp()
+        {
+#ifdef NAPOLLAMA_HAS_TSC
+            return __rdtsc();
+#else
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+        }
+
+        /**
+         * A single trace event, fields are atomic because the ring buffer is read while it is being written
+         */
+        struct Event
+        {
+            std::atomic<std::uint64_t> mTimestamp = { 0 };
+            std::atomic<const char*> mName = { nullptr };
+            std::atomic<std::uint64_t> mID = { 0 };
+            std::atomic<char> mPhase = { 0 };
+        };
+
+        /**
+         * Ring buffer of events written by a single thread
+         */
+        struct ThreadBuffer
+        {
+            std::array<Event, sRingCapacity> mEvents;
+            std::atomic<std::uint64_t> mHead = { 0 };           ///< Total number of events written
+            std::atomic<std::uint64_t> mFirstValid = { 0 };     ///< Events before this index were cleared
+            std::atomic<const char*> mThreadName = { nullptr };
+            std::atomic<bool> mInUse = { true };
+            int mThreadIndex = 0;
+        };
+
+        /**
+         * Owns the buffers of all threads, buffers of exited threads are reused by new threads
+         */
+        class Registry
+        {
+        public:
+            static Registry& get()
+            {
+                // Intentionally leaked, thread buffers can be released after static destruction
+                static Registry* registry = new Registry();
+                return *registry;
+            }
+
+            ThreadBuffer* acquire()
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                for (auto& buffer : mBuffers)
+                {
+                    bool in_use = false;
+                    if (buffer->mInUse.compare_exchange_strong(in_use, true))
+                    {
+                        // Drop the events of the previous owner, they would be attributed to the wrong thread
+                        buffer->mFirstValid.store(buffer->mHead.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                        buffer->mThreadName.store(nullptr, std::memory_order_relaxed);
+                        return buffer.get();
+                    }
+                }
+
+                mBuffers.emplace_back(std::make_unique<ThreadBuffer>());
+                mBuffers.back()->mThreadIndex = static_cast<int>(mBuffers.size());
+                return mBuffers.back().get();
+            }
+
+            std::mutex mMutex;
+            std::vector<std::unique_ptr<ThreadBuffer>> mBuffers;
+            std::atomic<std::uint64_t> mFlowCounter = { 1 };
+            const std::uint64_t mStartTimestamp = readTimestamp();
+            const std::chrono::steady_clock::time_point mStartTime = std::chrono::steady_clock::now();
+        };
+
+        /**
+         * Releases the buffer of a thread when the thread exits
+         */
+        struct ThreadBufferHandle
+        {
+            ThreadBuffer* mBuffer = nullptr;
+            ~ThreadBufferHandle()
+            {
+                if (mBuffer != nullptr)
+                    mBuffer->mInUse.store(false);
+            }
+        };
+
+        thread_local ThreadBufferHandle sThreadBuffer;
+
+        ThreadBuffer& getThreadBuffer()
+        {
+            if (sThreadBuffer.mBuffer == nullptr)
+                sThreadBuffer.mBuffer = Registry::get().acquire();
+            return *sThreadBuffer.mBuffer;
+        }
+
+        void record(EPhase phase, const char* name, std::uint64_t id)
+        {
+            auto& buffer = getThreadBuffer();
+            auto head = buffer.mHead.load(std::memory_order_relaxed);
+            auto& event = buffer.mEvents[head & (sRingCapacity - 1)];
+            event.mTimestamp.store(readTimestamp(), std::memory_order_relaxed);
+            event.mName.store(name, std::memory_order_relaxed);
+            event.mID.store(id, std::memory_order_relaxed);
+            event.mPhase.store(static_cast<char>(phase), std::memory_order_relaxed);
+            buffer.mHead.store(head + 1, std::memory_order_release);
+        }
+
+        void writeEscaped(std::ostream& stream, const char* text)
+        {
+            stream << '"';
+            for (const char* c = text; *c != '\0'; ++c)
+            {
+                if (*c == '"' || *c == '\\')
+                    stream << '\\';
+                if (static_cast<unsigned char>(*c) >= 0x20)
+                    stream << *c;
+            }
+            stream << '"';
+        }
+    }
+
+
+    void OllamaTrace::instant(const char* name, std::uint64_t id)
+    {
+        record(EPhase::Instant, name, id);
+    }
+
+
+    void OllamaTrace::begin(const char* name, std::uint64_t id)
+    {
+        record(EPhase::Begin, name, id);
+    }
+
+
+    void OllamaTrace::end(const char* name, std::uint64_t id)
+    {
+        record(EPhase::End, name, id);
+    }
+
+
+    void OllamaTrace::flowStart(const char* name, std::uint64_t flowID)
+    {
+        record(EPhase::FlowStart, name, flowID);
+    }
+
+
+    void OllamaTrace::flowEnd(const char* name, std::uint64_t flowID)
+    {
+        record(EPhase::FlowEnd, name, flowID);
+    }
+
+
+    void OllamaTrace::setThreadName(const char* name)
+    {
+        getThreadBuffer().mThreadName.store(name, std::memory_order_relaxed);
+    }
+
+
+    std::uint64_t OllamaTrace::createFlowID()
+    {
+        return Registry::get().mFlowCounter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+    std::string OllamaTrace::exportChromeTrace()
+    {
+        auto& registry = Registry::get();
+
+        // Calibrate the time stamp counter against the steady clock over the lifetime of the registry
+        if (std::chrono::steady_clock::now() - registry.mStartTime < std::chrono::milliseconds(10))
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto elapsed = std::chrono::steady_clock::now() - registry.mStartTime;
+        auto ticks = static_cast<double>(readTimestamp() - registry.mStartTimestamp);
+        double ticks_per_us = ticks / static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+        std::ostringstream stream;
+        stream.precision(3);
+        stream << std::fixed << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        auto separator = [&]() -> std::ostream& { if (!first) stream << ",\n"; first = false; return stream; };
+
+        std::lock_guard<std::mutex> lock(registry.mMutex);
+        for (auto& buffer : registry.mBuffers)
+        {
+            // Name the thread
+            const char* thread_name = buffer->mThreadName.load(std::memory_order_relaxed);
+            separator() << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->mThreadIndex << ",\"args\":{\"name\":";
+            if (thread_name != nullptr)
+                writeEscaped(stream, thread_name);
+            else
+                stream << "\"Thread " << buffer->mThreadIndex << "\"";
+            stream << "}}";
+
+            // Copy the events that are still in the ring
+            auto head = buffer->mHead.load(std::memory_order_acquire);
+            auto start = std::max(buffer->mFirstValid.load(std::memory_order_relaxed), head > sRingCapacity ? head - sRingCapacity : 0);
+            struct Copy { std::uint64_t mTimestamp; const char* mName; std::uint64_t mID; char mPhase; };
+            std::vector<Copy> events;
+            events.reserve(head - start);
+            for (auto i = start; i < head; i++)
+            {
+                auto& event = buffer->mEvents[i & (sRingCapacity - 1)];
+                events.push_back({ event.mTimestamp.load(std::memory_order_relaxed), event.mName.load(std::memory_order_relaxed),
+                                   event.mID.load(std::memory_order_relaxed), event.mPhase.load(std::memory_order_relaxed) });
+            }
+
+            // Skip events the owning thread overwrote while they were being copied
+            auto new_head = buffer->mHead.load(std::memory_order_acquire);
+            std::uint64_t overwritten = new_head + 1 > sRingCapacity + start ? new_head + 1 - sRingCapacity - start : 0;
+
+            for (std::uint64_t i = overwritten; i < events.size(); i++)
+            {
+                const auto& event = events[i];
+                if (event.mName == nullptr)
+                    continue;
+
+                double ts = static_cast<double>(static_cast<std::int64_t>(event.mTimestamp - registry.mStartTimestamp)) / ticks_per_us;
+                separator() << "{\"ph\":\"" << event.mPhase << "\",\"cat\":\"ollama\",\"name\":";
+                writeEscaped(stream, event.mName);
+                stream << ",\"pid\":1,\"tid\":" << buffer->mThreadIndex << ",\"ts\":" << ts;
+                switch (static_cast<EPhase>(event.mPhase))
+                {
+                case EPhase::FlowStart:
+                    stream << ",\"id\":" << event.mID;
+                    break;
+                case EPhase::FlowEnd:
+                    stream << ",\"id\":" << event.mID << ",\"bp\":\"e\"";
+                    break;
+                case EPhase::Instant:
+                    stream << ",\"s\":\"t\",\"args\":{\"request\":" << event.mID << "}";
+                    break;
+                default:
+                    stream << ",\"args\":{\"request\":" << event.mID << "}";
+                    break;
+                }
+                stream << "}";
+            }
+        }
+        stream << "]}";
+        return stream.str();
+    }
+
+
+    bool OllamaTrace::exportChromeTrace(const std::string& path, utility::ErrorState& errorState)
+    {
+        std::ofstream file(path, std::ios::binary);
+        if (!errorState.check(file.is_open(), "Unable to open %s for writing", path.c_str()))
+            return false;
+
+        file << exportChromeTrace();
+        return errorState.check(file.good(), "Unable to write trace to %s", path.c_str());
+    }
+
+
+    void OllamaTrace::clear()
+    {
+        auto& registry = Registry::get();
+        std::lock_guard<std::mutex> lock(registry.mMutex);
+        for (auto& buffer : registry.mBuffers)
+            buffer->mFirstValid.store(buffer->mHead.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
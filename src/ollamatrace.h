@@ -0,0 +1,127 @@
+#pragma once
+
+#include <utility/dllexport.h>
+#include <utility/errorstate.h>
+
+#include <cstdint>
+#include <string>
+
+namespace nap
+{
+    /**
+     * Low overhead trace recorder for the lifecycle of Ollama requests across threads.
+     * Every thread records into its own fixed size ring buffer, timestamped with the CPU time stamp counter where available.
+     * Recording an event never blocks or allocates once the buffer of a thread exists, the oldest events are overwritten when the buffer is full.
+     * The recorded events can be exported on demand as Chrome trace-event JSON, viewable in chrome://tracing or https://ui.perfetto.dev.
+     *
+     * Use the OLLAMA_TRACE_* macros to record events, they compile to nothing unless NAPOLLAMA_TRACE is defined.
+     * Enable tracing by configuring the module with -DNAPOLLAMA_ENABLE_TRACE=ON.
+     */
+    class NAPAPI OllamaTrace final
+    {
+    public:
+        /**
+         * Records an instant event on the calling thread
+         * @param name static event name, the pointer must remain valid
+         * @param id request id the event belongs to
+         */
+        static void instant(const char* name, std::uint64_t id);
+
+        /**
+         * Records the start of a duration on the calling thread, must be balanced with end() on the same thread
+         * @param name static event name, the pointer must remain valid
+         * @param id request id the event belongs to
+         */
+        static void begin(const char* name, std::uint64_t id);
+
+        /**
+         * Records the end of a duration on the calling thread
+         * @param name static event name, the pointer must remain valid
+         * @param id request id the event belongs to
+         */
+        static void end(const char* name, std::uint64_t id);
+
+        /**
+         * Records the start of a flow, drawn as an arrow to the matching flowEnd() on another thread
+         * @param name static flow name, the pointer must remain valid
+         * @param flowID unique id of the flow
+         */
+        static void flowStart(const char* name, std::uint64_t flowID);
+
+        /**
+         * Records the end of a flow, binds to the duration that encloses it
+         * @param name static flow name, the pointer must remain valid
+         * @param flowID unique id of the flow
+         */
+        static void flowEnd(const char* name, std::uint64_t flowID);
+
+        /**
+         * Names the calling thread in the exported trace
+         * @param name static thread name, the pointer must remain valid
+         */
+        static void setThreadName(const char* name);
+
+        /**
+         * @return a new unique id for a flow
+         */
+        static std::uint64_t createFlowID();
+
+        /**
+         * Exports all recorded events as Chrome trace-event JSON
+         * @return the trace as JSON string
+         */
+        static std::string exportChromeTrace();
+
+        /**
+         * Exports all recorded events as Chrome trace-event JSON to file
+         * @param path the file to write
+         * @param errorState contains the error if the file can't be written
+         * @return if the trace was written
+         */
+        static bool exportChromeTrace(const std::string& path, utility::ErrorState& errorState);
+
+        /**
+         * Discards all recorded events
+         */
+        static void clear();
+
+        /**
+         * Records a duration for the lifetime of the scope
+         */
+        class Scope final
+        {
+        public:
+            Scope(const char* name, std::uint64_t id) : mName(name), mID(id)    { OllamaTrace::begin(mName, mID); }
+            ~Scope()                                                            { OllamaTrace::end(mName, mID); }
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+        private:
+            const char* mName;
+            std::uint64_t mID;
+        };
+    };
+}
+
+#define OLLAMA_TRACE_CONCAT_IMPL(a, b) a##b
+#define OLLAMA_TRACE_CONCAT(a, b) OLLAMA_TRACE_CONCAT_IMPL(a, b)
+
+#ifdef NAPOLLAMA_TRACE
+    #define OLLAMA_TRACE_INSTANT(name, id)          nap::OllamaTrace::instant(name, id)
+    #define OLLAMA_TRACE_BEGIN(name, id)            nap::OllamaTrace::begin(name, id)
+    #define OLLAMA_TRACE_END(name, id)              nap::OllamaTrace::end(name, id)
+    #define OLLAMA_TRACE_SCOPE(name, id)            nap::OllamaTrace::Scope OLLAMA_TRACE_CONCAT(ollama_trace_scope_, __LINE__)(name, id)
+    #define OLLAMA_TRACE_FLOW_START(name, flowID)   nap::OllamaTrace::flowStart(name, flowID)
+    #define OLLAMA_TRACE_FLOW_END(name, flowID)     nap::OllamaTrace::flowEnd(name, flowID)
+    #define OLLAMA_TRACE_FLOW_ID()                  nap::OllamaTrace::createFlowID()
+    #define OLLAMA_TRACE_THREAD_NAME(name)          nap::OllamaTrace::setThreadName(name)
+#else
+    // The ids are still evaluated, so ids that are only passed to the trace don't become unused
+    #define OLLAMA_TRACE_INSTANT(name, id)          ((void)(id))
+    #define OLLAMA_TRACE_BEGIN(name, id)            ((void)(id))
+    #define OLLAMA_TRACE_END(name, id)              ((void)(id))
+    #define OLLAMA_TRACE_SCOPE(name, id)            ((void)(id))
+    #define OLLAMA_TRACE_FLOW_START(name, flowID)   ((void)(flowID))
+    #define OLLAMA_TRACE_FLOW_END(name, flowID)     ((void)(flowID))
+    #define OLLAMA_TRACE_FLOW_ID()                  std::uint64_t(0)
+    #define OLLAMA_TRACE_THREAD_NAME(name)          ((void)0)
+#endif